@@ -4,7 +4,7 @@ _clawsec() {
     COMPREPLY=()
     cur="${COMP_WORDS[COMP_CWORD]}"
     prev="${COMP_WORDS[COMP_CWORD-1]}"
-    opts="-l -p -k -K -L -u -4 -6 -c -v -w -e -z -P -V -n -b -h -R --obfs --pad --jitter --ech --mux --fallback --fingerprint --tofu --pq --tun --tun-udp --masquerade --default-route --scan --socks --send --recv --persistent"
+    opts="-l -p -k -K -L -u -4 -6 -c -v -w -e -z -P -V -n -b -h -R --obfs --no-ktls --tls-bind --cert-cache --session-cache --pad --pad-policy --jitter --ech --mux --mux-prio --mux-conns --target-pool --tunnel-pool --prefork --event --backlog --fallback --fingerprint --tofu --pq --tun --tun-udp --masquerade --default-route --scan --socks --send --recv --persistent"
 
     case "${prev}" in
         -p|-w)
@@ -25,7 +25,11 @@ _clawsec() {
             return 0
             ;;
         --obfs)
-            COMPREPLY=( $(compgen -W "http tls" -- "${cur}") )
+            COMPREPLY=( $(compgen -W "http http-stream tls h2" -- "${cur}") )
+            return 0
+            ;;
+        --pad-policy)
+            COMPREPLY=( $(compgen -W "fixed bucket random" -- "${cur}") )
             return 0
             ;;
         --jitter|--socks|-p)
@@ -15,11 +15,23 @@ complete -c clawsec -s V -d 'SHA-256 end-to-end file verification'
 complete -c clawsec -s n -x -d 'Chat nickname'
 complete -c clawsec -s K -d 'Keep-open: accept multiple clients'
 complete -c clawsec -s L -x -d 'Port forwarding target (host:port)'
-complete -c clawsec -l obfs -x -a 'http tls' -d 'Traffic obfuscation mode'
+complete -c clawsec -l obfs -x -a 'http http-stream tls h2' -d 'Traffic obfuscation mode'
 complete -c clawsec -l pad -d 'Pad all packets to uniform 1400 bytes'
+complete -c clawsec -l no-ktls -d 'Keep TLS record crypto in userspace'
+complete -c clawsec -l tls-bind -d 'Bind session to TLS, skip inner AES-GCM'
+complete -c clawsec -l cert-cache -d 'Keep server TLS cert in ~/.clawsec'
+complete -c clawsec -l session-cache -d 'Keep client TLS ticket in ~/.clawsec'
+complete -c clawsec -l pad-policy -x -a 'fixed bucket random' -d 'Padding size policy'
 complete -c clawsec -l jitter -x -d 'Random delay between packets (ms)'
 complete -c clawsec -l ech -d 'Encrypted Client Hello (hide SNI from DPI)'
 complete -c clawsec -l mux -d 'Multiplex streams over one encrypted tunnel'
+complete -c clawsec -l mux-prio -x -d 'Mux stream class by port (PORT=interactive|normal|bulk)'
+complete -c clawsec -l mux-conns -x -d 'Spread mux streams over n tunnels (server -K)'
+complete -c clawsec -l target-pool -x -d 'Keep n target connections open (-R client, --mux -L server)'
+complete -c clawsec -l tunnel-pool -x -d 'Client: keep n handshaken tunnels for -p connections'
+complete -c clawsec -l prefork -d '-K: workers forked ahead, one listener each (default: CPUs)'
+complete -c clawsec -l event -d '-K -L: n event loops, no fork per client (default: CPUs)'
+complete -c clawsec -l backlog -x -d '-K: listen backlog'
 complete -c clawsec -l fallback -x -d 'Proxy non-ClawSec probes to real site (host:port)'
 complete -c clawsec -l fingerprint -x -a 'chrome firefox safari' -d 'Mimic browser TLS fingerprint'
 complete -c clawsec -l tofu -d 'Trust On First Use (SSH-like server identity)'
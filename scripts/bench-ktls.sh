@@ -0,0 +1,49 @@
+#!/bin/bash
+# Compare CPU time of an --obfs tls transfer with and without kernel TLS,
+# and with --tls-bind (no inner AES-GCM on top of TLS).
+#
+# Usage: scripts/bench-ktls.sh [size_mb] [port]
+# Run from the repo root after `cd src && make linux`.
+# kTLS needs the "tls" kernel module: sudo modprobe tls
+
+SIZE_MB="${1:-256}"
+PORT="${2:-24680}"
+BIN="./src/clawsec"
+PASSWORD="BenchPass123"
+
+if [ ! -x "$BIN" ]; then
+    echo "Build first: cd src && make linux" >&2
+    exit 1
+fi
+
+if ! grep -q '^tls ' /proc/modules 2>/dev/null; then
+    echo "Note: tls module not loaded — every run will use userspace TLS" >&2
+fi
+
+run() {
+    local label="$1"; shift
+    local out="/tmp/clawsec_bench_$$"
+
+    # Server: receive to /dev/null, keep stdin open until the client is done
+    ( sleep 600 | "$BIN" -l -p "$PORT" -k "$PASSWORD" --obfs tls -vv "$@" \
+          > /dev/null 2> "$out.srv" ) &
+    local srv=$!
+    sleep 0.5
+
+    TIMEFORMAT="$label: %R s wall, %U s user, %S s sys (client)"
+    time ( head -c "${SIZE_MB}M" /dev/zero | \
+           "$BIN" -k "$PASSWORD" --obfs tls -vv "$@" 127.0.0.1 "$PORT" \
+           2> "$out.cli" )
+
+    grep -h "kTLS offload" "$out.cli" | sed "s/^/  /"
+    pkill -P "$srv" 2>/dev/null
+    kill "$srv" 2>/dev/null
+    wait "$srv" 2>/dev/null
+    rm -f "$out.srv" "$out.cli"
+    PORT=$((PORT + 1))
+}
+
+echo "Sending ${SIZE_MB} MB over --obfs tls on loopback"
+run "userspace TLS" --no-ktls
+run "kernel TLS   "
+run "kTLS + bind  " --tls-bind
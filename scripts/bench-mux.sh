@@ -0,0 +1,105 @@
+#!/bin/bash
+# Small-frame rate over --mux: 100 chatty streams, each bouncing a 32-byte
+# message off an echo target through the tunnel, one message in flight per
+# stream. Prints messages per second and the CPU both relays used per
+# thousand messages. Point BIN at another build to compare.
+#
+# Usage: scripts/bench-mux.sh [seconds] [streams] [port]
+# Run from the repo root after `cd src && make linux`.
+
+SECS="${1:-10}"
+STREAMS="${2:-100}"
+PORT="${3:-24720}"
+BIN="${BIN:-./src/clawsec}"
+PASSWORD="BenchPass123"
+
+if [ ! -x "$BIN" ]; then
+    echo "Build first: cd src && make linux" >&2
+    exit 1
+fi
+if ! command -v python3 > /dev/null; then
+    echo "python3 is needed for the echo target and the load driver" >&2
+    exit 1
+fi
+
+ECHO_PORT=$PORT
+SRV_PORT=$((PORT + 1))
+LOCAL_PORT=$((PORT + 2))
+
+# Echo target, single-threaded
+python3 - "$ECHO_PORT" <<'EOF' &
+import selectors, socket, sys
+sel = selectors.DefaultSelector()
+ls = socket.socket(); ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+ls.bind(('127.0.0.1', int(sys.argv[1]))); ls.listen(1024); ls.setblocking(False)
+sel.register(ls, selectors.EVENT_READ)
+while True:
+    for key, _ in sel.select():
+        s = key.fileobj
+        if s is ls:
+            c, _ = ls.accept(); c.setblocking(False)
+            sel.register(c, selectors.EVENT_READ)
+            continue
+        try:
+            d = s.recv(65536)
+        except BlockingIOError:
+            continue
+        if not d:
+            sel.unregister(s); s.close()
+        else:
+            s.sendall(d)
+EOF
+ECHO=$!
+
+"$BIN" -l -p "$SRV_PORT" -k "$PASSWORD" -L "127.0.0.1:$ECHO_PORT" --mux \
+    < <(sleep 600) > /dev/null 2>&1 &
+SRV=$!
+sleep 0.5
+"$BIN" -k "$PASSWORD" --mux -p "$LOCAL_PORT" 127.0.0.1 "$SRV_PORT" \
+    < <(sleep 600) > /dev/null 2>&1 &
+CLI=$!
+sleep 1
+
+# Relay CPU in clock ticks: utime + stime of both processes and children
+cpu() {
+    local t=0 p
+    for p in $SRV $CLI $(pgrep -P "$SRV") $(pgrep -P "$CLI"); do
+        [ -r "/proc/$p/stat" ] || continue
+        t=$((t + $(awk '{ print $14 + $15 }' "/proc/$p/stat")))
+    done
+    echo "$t"
+}
+
+before=$(cpu)
+msgs=$(python3 - "$LOCAL_PORT" "$STREAMS" "$SECS" <<'EOF'
+import selectors, socket, sys, time
+port, n, secs = int(sys.argv[1]), int(sys.argv[2]), float(sys.argv[3])
+sel = selectors.DefaultSelector()
+msg = b'x' * 32
+for _ in range(n):
+    c = socket.create_connection(('127.0.0.1', port))
+    c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sel.register(c, selectors.EVENT_READ, [0])
+    c.sendall(msg)
+count, end = 0, time.time() + secs
+while time.time() < end:
+    for key, _ in sel.select(0.1):
+        got = key.data
+        got[0] += len(key.fileobj.recv(4096))
+        while got[0] >= len(msg):
+            got[0] -= len(msg)
+            count += 1
+            key.fileobj.sendall(msg)
+print(count)
+EOF
+)
+after=$(cpu)
+
+hz=$(getconf CLK_TCK)
+awk -v m="$msgs" -v s="$SECS" -v t="$((after - before))" -v hz="$hz" -v n="$STREAMS" \
+    'BEGIN { printf "%d streams: %.0f msgs/s, relay CPU %.1f ms per 1000 msgs\n",
+             n, m / s, m ? t * 1000 / hz / (m / 1000) : 0 }'
+
+kill "$CLI" "$SRV" "$ECHO" 2>/dev/null
+wait 2>/dev/null
+exit 0
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Reconnect latency over --obfs tls, with and without TLS session
+# resumption: connect, TLS, ClawSec handshake, first tunnel byte (the
+# client's EOF) and close. Each client run is a fresh process, so
+# resumption comes from the --session-cache ticket file in a throwaway $HOME.
+#
+# Usage: scripts/bench-resume.sh [connects] [port]
+# Run from the repo root after `cd src && make linux`.
+
+COUNT="${1:-20}"
+PORT="${2:-24700}"
+BIN="$(pwd)/src/clawsec"
+PASSWORD="BenchPass123"
+
+if [ ! -x "$BIN" ]; then
+    echo "Build first: cd src && make linux" >&2
+    exit 1
+fi
+
+export HOME="$(mktemp -d)"
+trap 'rm -rf "$HOME"' EXIT
+
+# -K server: keep stdin open, discard output
+"$BIN" -l -K -p "$PORT" -k "$PASSWORD" --obfs tls < <(sleep 600) > /dev/null 2>&1 &
+SRV=$!
+sleep 0.5
+
+run() {
+    local label="$1"; shift
+    local resumed=0 start end
+    start=$(date +%s%N)
+    for _ in $(seq "$COUNT"); do
+        if timeout 10 "$BIN" -k "$PASSWORD" --obfs tls -vv "$@" 127.0.0.1 "$PORT" \
+               < /dev/null 2>&1 >/dev/null | grep -q "TLS session: resumed"; then
+            resumed=$((resumed + 1))
+        fi
+    done
+    end=$(date +%s%N)
+    awk -v l="$label" -v n="$COUNT" -v r="$resumed" -v ns="$((end - start))" \
+        'BEGIN { printf "%s: %d connects, %d resumed, %.1f ms avg\n", l, n, r, ns / n / 1e6 }'
+}
+
+echo "Reconnecting ${COUNT}x over --obfs tls on loopback"
+run "full handshake"
+run "resumed       " --session-cache
+
+pkill -P "$SRV" 2>/dev/null
+kill "$SRV" 2>/dev/null
+wait "$SRV" 2>/dev/null
+pkill -P $$ sleep 2>/dev/null
+exit 0
@@ -0,0 +1,113 @@
+#!/bin/bash
+# Parallel fetches through --socks: a browser-like driver keeps P SOCKS5
+# connections busy, each CONNECTing, sending a small request and reading
+# a SIZE-byte response that the target sends after DELAY ms. Prints
+# fetches per second and fetch time percentiles. Point BIN at another
+# build to compare.
+#
+# Usage: scripts/bench-socks.sh [fetches] [parallel] [size] [delay_ms] [port]
+# Run from the repo root after `cd src && make linux`.
+
+FETCHES="${1:-600}"
+PARALLEL="${2:-32}"
+SIZE="${3:-16384}"
+DELAY="${4:-20}"
+PORT="${5:-24730}"
+BIN="${BIN:-./src/clawsec}"
+PASSWORD="BenchPass123"
+
+if [ ! -x "$BIN" ]; then
+    echo "Build first: cd src && make linux" >&2
+    exit 1
+fi
+if ! command -v python3 > /dev/null; then
+    echo "python3 is needed for the target and the load driver" >&2
+    exit 1
+fi
+
+TARGET_PORT=$PORT
+SRV_PORT=$((PORT + 1))
+SOCKS_PORT=$((PORT + 2))
+
+# Target: answers each request with SIZE bytes after DELAY ms, then closes
+python3 - "$TARGET_PORT" "$SIZE" "$DELAY" <<'EOF' &
+import socket, sys, threading, time
+port, size, delay = int(sys.argv[1]), int(sys.argv[2]), int(sys.argv[3]) / 1000
+body = b'x' * size
+ls = socket.socket(); ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+ls.bind(('127.0.0.1', port)); ls.listen(1024)
+def serve(c):
+    with c:
+        req = b''
+        while b'\r\n\r\n' not in req:
+            d = c.recv(4096)
+            if not d: return
+            req += d
+        time.sleep(delay)
+        c.sendall(body)
+while True:
+    c, _ = ls.accept()
+    threading.Thread(target=serve, args=(c,), daemon=True).start()
+EOF
+TARGET=$!
+
+"$BIN" -l -p "$SRV_PORT" -k "$PASSWORD" --socks 0 \
+    < <(sleep 600) > /dev/null 2>&1 &
+SRV=$!
+sleep 0.5
+"$BIN" -k "$PASSWORD" --socks "$SOCKS_PORT" 127.0.0.1 "$SRV_PORT" \
+    < <(sleep 600) > /dev/null 2>&1 &
+CLI=$!
+sleep 1
+
+python3 - "$SOCKS_PORT" "$TARGET_PORT" "$FETCHES" "$PARALLEL" "$SIZE" <<'EOF'
+import socket, struct, sys, threading, time
+sport, tport, total, par, size = map(int, sys.argv[1:6])
+lock = threading.Lock()
+left = [total]
+times, failed = [], [0]
+
+def recv_n(c, n):
+    buf = b''
+    while len(buf) < n:
+        d = c.recv(n - len(buf))
+        if not d: raise OSError('closed')
+        buf += d
+    return buf
+
+def fetch():
+    t = time.time()
+    c = socket.create_connection(('127.0.0.1', sport), timeout=30)
+    with c:
+        c.sendall(b'\x05\x01\x00')
+        recv_n(c, 2)
+        c.sendall(b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') + struct.pack('>H', tport))
+        if recv_n(c, 10)[1] != 0: raise OSError('refused')
+        c.sendall(b'GET / HTTP/1.1\r\nHost: bench\r\n\r\n')
+        recv_n(c, size)
+    return time.time() - t
+
+def worker():
+    while True:
+        with lock:
+            if left[0] == 0: return
+            left[0] -= 1
+        try:
+            dt = fetch()
+            with lock: times.append(dt)
+        except OSError:
+            with lock: failed[0] += 1
+
+start = time.time()
+ts = [threading.Thread(target=worker) for _ in range(par)]
+[t.start() for t in ts]; [t.join() for t in ts]
+wall = time.time() - start
+times.sort()
+pct = lambda p: times[min(len(times) - 1, int(len(times) * p))] * 1000 if times else 0
+print('%d fetches, %d parallel: %.0f fetches/s, p50 %.1f ms, p99 %.1f ms, %d failed'
+      % (total, par, len(times) / wall, pct(0.5), pct(0.99), failed[0]))
+EOF
+
+kill "$CLI" "$SRV" "$TARGET" 2>/dev/null
+wait 2>/dev/null
+exit 0
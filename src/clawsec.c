@@ -14,6 +14,7 @@
 #include <time.h>
 
 #include "farm9crypt.h"
+#include "ecdhe.h"
 #include "util.h"
 #include "net.h"
 #include "relay.h"
@@ -30,6 +31,9 @@
 #include "reverse.h"
 #include "persistent.h"
 #include "tun.h"
+#include "tpool.h"
+#include "prefork.h"
+#include "evsrv.h"
 
 /* Global config */
 int g_verbose = 0;
@@ -40,6 +44,10 @@ int g_pq = 0;    /* --pq: post-quantum hybrid */
 
 static volatile sig_atomic_t g_child_exited = 0;
 static const char *s_mux_port = NULL;
+static int s_mux_listen_fd = -1;           /* client: local listener, kept across reconnects */
+static int s_mux_conns = 1;                /* --mux-conns: tunnels to stripe streams over */
+static pid_t s_tunnel_pids[MUX_MAX_CONNS];
+static int s_ntunnels = 0;
 static int g_socks = 0;
 static const char *s_socks_port = NULL;
 static const char *s_send_file = NULL;
@@ -51,6 +59,27 @@ static int g_masquerade = 0;               /* --masquerade (NAT for VPN) */
 static int g_default_route = 0;            /* --default-route (all traffic via VPN) */
 static int g_tun_udp = 0;                  /* --tun-udp (UDP data channel for VPN) */
 static const char *s_bind_port = NULL;     /* -p <port> (also used by --tun-udp server) */
+static int g_tls_bind = 0;                 /* --tls-bind (TLS carries the data, no inner AEAD) */
+static int s_tunnel_pool = 0;              /* --tunnel-pool N (handshaken tunnels kept idle) */
+static int s_prefork = 0;                  /* -K --prefork[=N]: workers forked ahead */
+static int s_backlog = SOMAXCONN;          /* -K --backlog N */
+static int s_event = 0;                    /* -K --event[=N]: event loops, no fork per client */
+
+/* Long-only options without a short-letter alias */
+enum {
+    OPT_PAD_POLICY = 256,
+    OPT_NO_KTLS,
+    OPT_TLS_BIND,
+    OPT_CERT_CACHE,
+    OPT_SESSION_CACHE,
+    OPT_MUX_PRIO,
+    OPT_MUX_CONNS,
+    OPT_TARGET_POOL,
+    OPT_TUNNEL_POOL,
+    OPT_PREFORK,
+    OPT_BACKLOG,
+    OPT_EVENT,
+};
 
 static void sigchld_handler(int sig) {
     (void)sig;
@@ -83,14 +112,19 @@ static void handle_client(int sockfd, const char *password, int is_server,
                           const char *fwd_host, const char *fwd_port,
                           const char *peer_host, const char *peer_port) {
     /* TLS camouflage: wrap socket in TLS before any crypto handshake */
-    if (obfs_get_mode() == OBFS_TLS) {
+    if (obfs_uses_tls()) {
         int tls_rc = is_server ? obfs_tls_accept(sockfd) : obfs_tls_connect(sockfd);
         if (tls_rc < 0) {
             fprintf(stderr, "ERROR: TLS camouflage handshake failed\n");
             close(sockfd);
             return;
         }
-        log_msg(1, "TLS 1.3 camouflage established");
+        log_msg(1, obfs_get_mode() == OBFS_H2 ? "TLS 1.3 + HTTP/2 camouflage established"
+                                              : "TLS 1.3 camouflage established");
+        log_msg(2, "TLS session: %s", obfs_tls_resumed() ? "resumed (PSK)" : "full handshake");
+        log_msg(2, "kTLS offload: send=%s recv=%s",
+                obfs_ktls_send_active() ? "kernel" : "userspace",
+                obfs_ktls_recv_active() ? "kernel" : "userspace");
     }
 
     /* Fallback: knock protocol for active probing resistance */
@@ -148,6 +182,20 @@ static void handle_client(int sockfd, const char *password, int is_server,
         log_msg(1, "PFS session established (X25519 + PBKDF2)");
     }
 
+    /* Channel binding: prove both ends share this TLS session, then let
+     * TLS alone protect the data */
+    if (g_tls_bind && !ecdhe_peer_offers_bind()) {
+        log_msg(1, "peer does not offer --tls-bind, inner AEAD kept");
+    } else if (g_tls_bind) {
+        if (farm9crypt_tls_bind(sockfd, send_first) != 0) {
+            fprintf(stderr, "ERROR: TLS channel binding failed (peer not on this TLS session?)\n");
+            close(sockfd);
+            farm9crypt_cleanup();
+            return;
+        }
+        log_msg(1, "session bound to TLS exporter (inner AEAD off)");
+    }
+
     /* SOCKS5 proxy mode */
     if (g_socks) {
         if (is_server) {
@@ -256,7 +304,7 @@ static void handle_client(int sockfd, const char *password, int is_server,
                 reverse_server(sockfd, rev_port);
             }
         } else {
-            /* Client: wait for ROPEN, connect to local target, relay back */
+            /* Client: connect each incoming stream to the local target */
             char rev_host[256], rev_port[32];
             if (parse_host_port(s_reverse_spec, rev_host, sizeof(rev_host),
                                 rev_port, sizeof(rev_port)) == 0) {
@@ -272,8 +320,21 @@ static void handle_client(int sockfd, const char *password, int is_server,
     if (g_mux) {
         if (is_server && fwd_host && fwd_port) {
             mux_relay_server(sockfd, fwd_host, fwd_port);
-        } else if (!is_server && s_mux_port) {
-            mux_relay_client(sockfd, s_mux_port);
+        } else if (!is_server && s_mux_listen_fd >= 0) {
+            mux_relay_client(sockfd, s_mux_listen_fd);
+        }
+        close(sockfd);
+        farm9crypt_cleanup();
+        return;
+    }
+
+    /* Tunnel pool: handshaken, now wait for a local connection to carry */
+    if (tpool_active()) {
+        int local_fd = tpool_take(sockfd);
+        if (local_fd >= 0) {
+            log_msg(1, "tunnel pool: local connection on a ready tunnel");
+            relay_encrypted_plain(sockfd, local_fd);
+            close(local_fd);
         }
         close(sockfd);
         farm9crypt_cleanup();
@@ -306,6 +367,124 @@ static void handle_client(int sockfd, const char *password, int is_server,
     farm9crypt_cleanup();
 }
 
+/* Client: connect, or with --persistent keep reconnecting */
+static void client_session(const char *host, const char *port, const char *password,
+                           int timeout_sec, const char *fwd_host, const char *fwd_port) {
+    if (g_persistent) {
+        /* Auto-reconnect loop with exponential backoff */
+        int attempt = 0;
+        /* Tunnels of --mux-conns back off independently */
+        srand((unsigned)time(NULL) ^ (unsigned)getpid());
+        log_msg(1, "persistent mode: will auto-reconnect on disconnect");
+        for (;;) {
+            int sockfd = net_try_connect(host, port, timeout_sec > 0 ? timeout_sec : 10);
+            if (sockfd < 0) {
+                int delay = persist_next_delay(attempt++);
+                fprintf(stderr, "persistent: connection failed, retrying in %ds...\n", delay);
+                sleep(delay);
+                continue;
+            }
+            log_msg(1, "connected to %s:%s", host, port);
+            attempt = 0; /* reset on successful connect */
+
+            int send_first = g_udp_mode ? 1 : 0;
+            handle_client(sockfd, password, 0, send_first, NULL,
+                          fwd_host, fwd_port, host, port);
+
+            int delay = persist_next_delay(attempt++);
+            fprintf(stderr, "persistent: disconnected, reconnecting in %ds...\n", delay);
+            sleep(delay);
+        }
+    } else {
+        int sockfd = net_connect(host, port, timeout_sec);
+        log_msg(1, "connected to %s:%s%s", host, port, g_udp_mode ? " (UDP)" : "");
+
+        int send_first = g_udp_mode ? 1 : 0;
+        handle_client(sockfd, password, 0, send_first, NULL,
+                      fwd_host, fwd_port, host, port);
+    }
+}
+
+/* --tunnel-pool: what each pooled tunnel connects to */
+typedef struct {
+    const char *host, *port, *password;
+    int timeout_sec;
+} pool_target_t;
+
+static void pool_session(void *ctx) {
+    pool_target_t *t = ctx;
+    client_session(t->host, t->port, t->password, t->timeout_sec, NULL, NULL);
+}
+
+/* -K --prefork: what every worker serves */
+typedef struct {
+    const char *password, *exec_prog, *fwd_host, *fwd_port;
+} server_conf_t;
+
+static void prefork_prepare(void *ctx) {
+    (void)ctx;
+    /* Rotated here so every worker inherits the same certificate and keys */
+    if (obfs_uses_tls())
+        obfs_tls_server_init();
+}
+
+static void prefork_warm(void *ctx) {
+    (void)ctx;
+    ecdhe_warmup();
+}
+
+static void prefork_serve(int fd, void *ctx) {
+    server_conf_t *c = ctx;
+    handle_client(fd, c->password, 1, 1, c->exec_prog,
+                  c->fwd_host, c->fwd_port, NULL, NULL);
+    /* Also after a failed handshake: a reused worker starts clean */
+    farm9crypt_cleanup();
+}
+
+static void forward_signal(int sig) {
+    for (int i = 0; i < s_ntunnels; i++)
+        kill(s_tunnel_pids[i], sig);
+    _exit(128 + sig);
+}
+
+/*
+ * --mux-conns: one process per tunnel, each with its own handshake and
+ * session key and its own listener of a group on the local port — so
+ * streams spread over several TCP flows and a loss on one stalls only its
+ * share. Runs until every tunnel has ended.
+ */
+static void mux_spawn_tunnels(const char *host, const char *port,
+                              const char *password, int timeout_sec) {
+    int fds[MUX_MAX_CONNS];
+    mux_listen_group(s_mux_port, fds, s_mux_conns);
+    for (int i = 0; i < s_mux_conns; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            for (int j = 0; j < s_mux_conns; j++)
+                if (fds[j] != fds[i]) close(fds[j]);
+            s_mux_listen_fd = fds[i];
+            client_session(host, port, password, timeout_sec, NULL, NULL);
+            _exit(0);
+        }
+        s_tunnel_pids[s_ntunnels++] = pid;
+    }
+    for (int i = 0; i < s_mux_conns; i++)
+        if (i == 0 || fds[i] != fds[0]) close(fds[i]);
+    log_msg(1, "mux: %d tunnels to %s:%s", s_ntunnels, host, port);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = forward_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    while (wait(NULL) > 0 || errno == EINTR);
+}
+
 static void usage(const char *prog) {
     fprintf(stderr,
             "Usage:\n"
@@ -330,8 +509,23 @@ static void usage(const char *prog) {
             "  --default-route   Route ALL traffic through VPN (client-side full tunnel)\n"
             "  --persistent      Auto-reconnect with exponential backoff (client mode)\n"
             "  --obfs http       Obfuscate traffic as HTTP requests (anti-DPI)\n"
-            "  --obfs tls        Wrap connection in real TLS 1.3 (stealth mode)\n"            "  --ech              Encrypted Client Hello (hide SNI from DPI)\n"
-            "  --mux              Multiplex streams over one tunnel (with -L)\n"            "  --fallback <h:p>  Proxy non-ClawSec probes to real site (REALITY-like)\n"
+            "  --obfs http-stream  HTTP with one chunked POST per direction\n"
+            "  --obfs tls        Wrap connection in real TLS 1.3 (stealth mode)\n"
+            "  --obfs h2         TLS 1.3 + HTTP/2 framing (ALPN h2)\n"
+            "  --no-ktls         Keep TLS record crypto in userspace (no kernel TLS)\n"
+            "  --tls-bind        Bind session to TLS exporter, skip inner AES-GCM (if both offer it)\n"
+            "  --cert-cache      Keep the server TLS cert in ~/.clawsec (rotated every 30 days)\n"
+            "  --session-cache   Keep the client TLS ticket in ~/.clawsec (resume across runs)\n"
+            "  --ech              Encrypted Client Hello (hide SNI from DPI)\n"
+            "  --mux              Multiplex streams over one tunnel (with -L)\n"
+            "  --mux-prio <p=c>   Mux class by port: PORT=interactive|normal|bulk,...\n"
+            "  --mux-conns <n>    Client: spread mux streams over n tunnels (server -K)\n"
+            "  --target-pool <n>  Keep n target connections open (-R client, --mux -L server)\n"
+            "  --tunnel-pool <n>  Client: keep n handshaken tunnels for -p connections\n"
+            "  --prefork[=n]     -K: n workers forked ahead, one listener each (default: CPUs)\n"
+            "  --backlog <n>     -K: listen backlog (default: SOMAXCONN)\n"
+            "  --event[=n]       -K -L: n event loops, all clients, no fork (default: CPUs)\n"
+            "  --fallback <h:p>  Proxy non-ClawSec probes to real site (REALITY-like)\n"
             "  --fingerprint <p> Mimic browser TLS (chrome, firefox, safari)\n"
             "  --tofu            Trust On First Use (SSH-like server identity)\n"
             "  --pq              Post-quantum hybrid (X25519 + ML-KEM-768)\n"
@@ -342,6 +536,7 @@ static void usage(const char *prog) {
             "  --send <file>     Send file (encrypted, with SHA-256 verify + resume)\n"
             "  --recv <dir>      Receive file (save to dir, with resume support)\n"
             "  --pad             Pad all packets to uniform 1400 bytes (anti-analysis)\n"
+            "  --pad-policy <p>  Padding sizes: fixed, bucket, random (implies --pad)\n"
             "  --jitter <ms>     Add random 0-N ms delay between packets (anti-timing)\n"
             "  -z                Compress data with zlib before encryption\n"
             "  -P                Show transfer progress bar\n"
@@ -403,9 +598,21 @@ int main(int argc, char **argv) {
     static struct option long_opts[] = {
         {"obfs",        required_argument, NULL, 'O'},
         {"pad",         no_argument,       NULL, 'D'},
+        {"pad-policy",  required_argument, NULL, OPT_PAD_POLICY},
+        {"no-ktls",     no_argument,       NULL, OPT_NO_KTLS},
+        {"tls-bind",    no_argument,       NULL, OPT_TLS_BIND},
+        {"cert-cache",  no_argument,       NULL, OPT_CERT_CACHE},
+        {"session-cache", no_argument,     NULL, OPT_SESSION_CACHE},
         {"jitter",      required_argument, NULL, 'J'},
         {"ech",         no_argument,       NULL, 'E'},
         {"mux",         no_argument,       NULL, 'M'},
+        {"mux-prio",    required_argument, NULL, OPT_MUX_PRIO},
+        {"mux-conns",   required_argument, NULL, OPT_MUX_CONNS},
+        {"target-pool", required_argument, NULL, OPT_TARGET_POOL},
+        {"tunnel-pool", required_argument, NULL, OPT_TUNNEL_POOL},
+        {"prefork",     optional_argument, NULL, OPT_PREFORK},
+        {"backlog",     required_argument, NULL, OPT_BACKLOG},
+        {"event",       optional_argument, NULL, OPT_EVENT},
         {"fallback",    required_argument, NULL, 'F'},
         {"fingerprint", required_argument, NULL, 'T'},
         {"tofu",        no_argument,       NULL, 'U'},
@@ -447,10 +654,14 @@ int main(int argc, char **argv) {
         case 'O':
             if (strcmp(optarg, "http") == 0) {
                 obfs_set_mode(OBFS_HTTP);
+            } else if (strcmp(optarg, "http-stream") == 0) {
+                obfs_set_mode(OBFS_HTTP_STREAM);
             } else if (strcmp(optarg, "tls") == 0) {
                 obfs_set_mode(OBFS_TLS);
+            } else if (strcmp(optarg, "h2") == 0) {
+                obfs_set_mode(OBFS_H2);
             } else {
-                fprintf(stderr, "ERROR: Unknown obfuscation mode '%s' (supported: http, tls)\n", optarg);
+                fprintf(stderr, "ERROR: Unknown obfuscation mode '%s' (supported: http, http-stream, tls, h2)\n", optarg);
                 return 1;
             }
             break;
@@ -464,6 +675,28 @@ int main(int argc, char **argv) {
         case 'V': g_verify = 1; break;
         case 'n': g_nickname = optarg; break;
         case 'D': g_pad = 1; break;
+        case OPT_NO_KTLS: obfs_ktls_set(0); break;
+        case OPT_CERT_CACHE: obfs_tls_cert_cache(1); break;
+        case OPT_SESSION_CACHE: obfs_tls_session_cache(1); break;
+        case OPT_TLS_BIND:
+            g_tls_bind = 1;
+            /* Binding implies TLS mode */
+            if (obfs_get_mode() == OBFS_NONE)
+                obfs_set_mode(OBFS_TLS);
+            break;
+        case OPT_PAD_POLICY:
+            if (strcmp(optarg, "fixed") == 0) {
+                obfs_pad_set_policy(OBFS_PAD_FIXED);
+            } else if (strcmp(optarg, "bucket") == 0) {
+                obfs_pad_set_policy(OBFS_PAD_BUCKET);
+            } else if (strcmp(optarg, "random") == 0) {
+                obfs_pad_set_policy(OBFS_PAD_RANDOM);
+            } else {
+                fprintf(stderr, "ERROR: Unknown padding policy '%s' (supported: fixed, bucket, random)\n", optarg);
+                return 1;
+            }
+            g_pad = 1;
+            break;
         case 'J':
             g_jitter = atoi(optarg);
             if (g_jitter < 0) g_jitter = 0;
@@ -477,6 +710,54 @@ int main(int argc, char **argv) {
         case 'M':
             g_mux = 1;
             break;
+        case OPT_MUX_PRIO:
+            if (mux_prio_parse(optarg) < 0) {
+                fprintf(stderr, "ERROR: Invalid --mux-prio '%s' (use PORT=interactive|normal|bulk,...)\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_MUX_CONNS:
+            s_mux_conns = atoi(optarg);
+            if (s_mux_conns < 1 || s_mux_conns > MUX_MAX_CONNS) {
+                fprintf(stderr, "ERROR: --mux-conns must be 1-%d\n", MUX_MAX_CONNS);
+                return 1;
+            }
+            break;
+        case OPT_TARGET_POOL:
+            g_mux_pool = atoi(optarg);
+            if (g_mux_pool < 1 || g_mux_pool > MUX_POOL_MAX) {
+                fprintf(stderr, "ERROR: --target-pool must be 1-%d\n", MUX_POOL_MAX);
+                return 1;
+            }
+            break;
+        case OPT_TUNNEL_POOL:
+            s_tunnel_pool = atoi(optarg);
+            if (s_tunnel_pool < 1 || s_tunnel_pool > TPOOL_MAX) {
+                fprintf(stderr, "ERROR: --tunnel-pool must be 1-%d\n", TPOOL_MAX);
+                return 1;
+            }
+            break;
+        case OPT_PREFORK:
+            s_prefork = optarg ? atoi(optarg) : prefork_default_workers();
+            if (s_prefork < 1 || s_prefork > PREFORK_MAX) {
+                fprintf(stderr, "ERROR: --prefork must be 1-%d\n", PREFORK_MAX);
+                return 1;
+            }
+            break;
+        case OPT_BACKLOG:
+            s_backlog = atoi(optarg);
+            if (s_backlog < 1) {
+                fprintf(stderr, "ERROR: --backlog must be at least 1\n");
+                return 1;
+            }
+            break;
+        case OPT_EVENT:
+            s_event = optarg ? atoi(optarg) : prefork_default_workers();
+            if (s_event < 1 || s_event > EVSRV_MAX) {
+                fprintf(stderr, "ERROR: --event must be 1-%d\n", EVSRV_MAX);
+                return 1;
+            }
+            break;
         case 'F':
             g_fallback = 1;
             if (parse_host_port(optarg, g_fallback_host, sizeof(g_fallback_host),
@@ -606,6 +887,49 @@ int main(int argc, char **argv) {
         if (!listen_mode)
             s_mux_port = bind_port;
     }
+    if (s_mux_conns > 1 && (!g_mux || listen_mode)) {
+        fprintf(stderr, "ERROR: --mux-conns is for the --mux client\n");
+        return 1;
+    }
+    /* The --socks server has no fixed target to keep connections to */
+    if (g_mux_pool && !(s_reverse_spec && !listen_mode) &&
+        !(g_mux && listen_mode && !g_socks)) {
+        fprintf(stderr, "ERROR: --target-pool is for the -R client or the --mux -L server (not --socks)\n");
+        return 1;
+    }
+    if (s_tunnel_pool) {
+        if (listen_mode || g_mux || g_udp_mode || fwd_spec || s_reverse_spec ||
+            g_socks || s_tun_cidr || s_send_file || s_recv_dir || g_persistent) {
+            fprintf(stderr, "ERROR: --tunnel-pool is for the plain TCP client (without --mux; the server forwards with -K -L)\n");
+            return 1;
+        }
+        if (!bind_port) {
+            fprintf(stderr, "ERROR: --tunnel-pool requires -p <local_port>\n");
+            return 1;
+        }
+    }
+
+    if ((s_prefork || s_event || s_backlog != SOMAXCONN) &&
+        !(listen_mode && keep_open && !g_udp_mode)) {
+        fprintf(stderr, "ERROR: --prefork, --event and --backlog are for the TCP -l -K server\n");
+        return 1;
+    }
+    if (s_event) {
+        /* Sessions keep their keys in the loop; these modes keep theirs
+         * in process-wide state and need a process per client */
+        int per_process = s_prefork || obfs_get_mode() != OBFS_NONE || g_pad || g_jitter ||
+                          g_tofu || g_pq || g_mux || g_socks || s_tun_cidr ||
+                          s_reverse_spec || s_send_file || s_recv_dir;
+#ifdef GAPING_SECURITY_HOLE
+        per_process |= exec_prog != NULL;
+#endif
+        if (!fwd_spec || per_process) {
+            fprintf(stderr, "ERROR: --event forwards plain TCP sessions to -L "
+                            "(not with --prefork, --obfs, --pad, --jitter, --tofu, --pq, "
+                            "--mux, --socks, --tun, -R, --send/--recv or -e)\n");
+            return 1;
+        }
+    }
 
     /* Validate SOCKS5 mode */
     if (g_socks && listen_mode) {
@@ -615,6 +939,20 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* Validate channel binding */
+    if (g_tls_bind) {
+        if (!obfs_uses_tls() || g_udp_mode) {
+            fprintf(stderr, "ERROR: --tls-bind requires TCP with --obfs tls or h2\n");
+            return 1;
+        }
+        if (g_pq) {
+            /* The data would then rest on the TLS key exchange alone */
+            fprintf(stderr, "ERROR: --tls-bind cannot be combined with --pq\n");
+            return 1;
+        }
+        ecdhe_offer_bind(1);
+    }
+
     if (g_udp_mode)
         farm9crypt_set_udp_mode(1);
 
@@ -632,6 +970,44 @@ int main(int argc, char **argv) {
             return 1;
         }
 
+        /* One TLS context + certificate for every connection */
+        if (obfs_uses_tls() && obfs_tls_server_init() < 0) {
+            fprintf(stderr, "ERROR: Failed to set up TLS camouflage certificate\n");
+            return 1;
+        }
+
+        if (s_event) {
+            evsrv_conf_t conf = { password, fwd_host, fwd_port };
+            int fds[EVSRV_MAX];
+            prefork_listen(bind_port, s_backlog, fds, s_event);
+            log_msg(1, "listening on *:%s [keep-open, event] [forwarding]", bind_port);
+            evsrv_run(fds, s_event, &conf);
+            return 0;
+        }
+
+        if (s_prefork) {
+            server_conf_t conf = { password, NULL,
+                                   fwd_spec ? fwd_host : NULL,
+                                   fwd_spec ? fwd_port : NULL };
+#ifdef GAPING_SECURITY_HOLE
+            conf.exec_prog = exec_prog;
+#endif
+            int fds[PREFORK_MAX];
+            prefork_listen(bind_port, s_backlog, fds, s_prefork);
+            log_msg(1, "listening on *:%s [keep-open, prefork]%s",
+                    bind_port, fwd_spec ? " [forwarding]" : "");
+            prefork_ops_t ops = { prefork_prepare, prefork_warm, prefork_serve, &conf, 0 };
+            /* Plain TCP to -L: the session's state is all in farm9crypt,
+             * which prefork_serve resets, so the worker can take another.
+             * TLS/h2, the padding keystream, the jitter queue and the
+             * other modes keep theirs in process globals. */
+            ops.reuse = fwd_spec && obfs_get_mode() == OBFS_NONE && !g_pad && !g_jitter &&
+                        !g_mux && !g_socks && !s_tun_cidr && !s_reverse_spec &&
+                        !s_send_file && !s_recv_dir && !conf.exec_prog;
+            prefork_run(fds, s_prefork, &ops);
+            return 0;
+        }
+
         int listen_fd = net_listen(bind_port);
         log_msg(1, "listening on *:%s%s%s%s",
                 bind_port,
@@ -640,10 +1016,17 @@ int main(int argc, char **argv) {
                 fwd_spec ? " [forwarding]" : "");
 
         if (keep_open && !g_udp_mode) {
-            /* Multi-client mode: fork per connection */
+            /* Multi-client mode: fork per connection. Clients may arrive
+             * together (a --mux-conns client opens all its tunnels at
+             * once); with a backlog of 1 the overflow is lost to SYN
+             * cookies and those clients hang. */
+            listen(listen_fd, s_backlog);
             install_sigchld();
             for (;;) {
                 int client_fd = net_accept(listen_fd);
+                /* Rotates the certificate here, once, rather than per child */
+                if (obfs_uses_tls())
+                    obfs_tls_server_init();
                 pid_t pid = fork();
                 if (pid < 0) {
                     perror("fork");
@@ -703,42 +1086,23 @@ int main(int argc, char **argv) {
         const char *host = argv[optind];
         const char *port = argv[optind + 1];
 
-        if (g_persistent) {
-            /* Auto-reconnect loop with exponential backoff */
-            int attempt = 0;
-            srand(time(NULL));
-            log_msg(1, "persistent mode: will auto-reconnect on disconnect");
-            for (;;) {
-                int sockfd = net_try_connect(host, port, timeout_sec > 0 ? timeout_sec : 10);
-                if (sockfd < 0) {
-                    int delay = persist_next_delay(attempt++);
-                    fprintf(stderr, "persistent: connection failed, retrying in %ds...\n", delay);
-                    sleep(delay);
-                    continue;
-                }
-                log_msg(1, "connected to %s:%s", host, port);
-                attempt = 0; /* reset on successful connect */
-
-                int send_first = g_udp_mode ? 1 : 0;
-                handle_client(sockfd, password, 0, send_first, NULL,
-                              fwd_spec ? fwd_host : NULL,
-                              fwd_spec ? fwd_port : NULL,
-                              host, port);
-
-                int delay = persist_next_delay(attempt++);
-                fprintf(stderr, "persistent: disconnected, reconnecting in %ds...\n", delay);
-                sleep(delay);
-            }
-        } else {
-            int sockfd = net_connect(host, port, timeout_sec);
-            log_msg(1, "connected to %s:%s%s", host, port, g_udp_mode ? " (UDP)" : "");
-
-            int send_first = g_udp_mode ? 1 : 0;
-            handle_client(sockfd, password, 0, send_first, NULL,
-                          fwd_spec ? fwd_host : NULL,
-                          fwd_spec ? fwd_port : NULL,
-                          host, port);
+        if (g_mux && s_mux_conns > 1) {
+            mux_spawn_tunnels(host, port, password, timeout_sec);
+            return 0;
+        }
+        if (s_tunnel_pool) {
+            pool_target_t t = { host, port, password, timeout_sec };
+            int listen_fd = net_listen(bind_port);
+            listen(listen_fd, SOMAXCONN);
+            log_msg(1, "listening on *:%s [tunnel pool to %s:%s]", bind_port, host, port);
+            tpool_run(listen_fd, s_tunnel_pool, pool_session, &t);
+            return 0;
         }
+        /* Bound once, so it outlives --persistent reconnects */
+        if (g_mux)
+            s_mux_listen_fd = mux_listen(s_mux_port);
+        client_session(host, port, password, timeout_sec,
+                       fwd_spec ? fwd_host : NULL, fwd_spec ? fwd_port : NULL);
     }
 
     return 0;
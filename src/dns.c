@@ -0,0 +1,492 @@
+/*
+ * dns.c — Asynchronous name lookups with a TTL cache (see dns.h)
+ *
+ * The cache, its waiters and the answers belong to the calling thread.
+ * Workers only see jobs, which carry their own copy of the name: a worker
+ * takes one off the todo list, runs getaddrinfo(), puts it on the done
+ * list and writes a byte to the pipe. dns_next() then fills the cache
+ * entry and hands every waiter its own copy, with its own port.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "dns.h"
+#include "net.h"
+#include "util.h"
+
+int (*g_dns_getaddrinfo)(const char *, const char *, const struct addrinfo *,
+                         struct addrinfo **) = getaddrinfo;
+
+#define DNS_BUCKETS 256
+#define DNS_NAME_MAX 256
+
+typedef struct {
+    int family, socktype, protocol;
+    socklen_t len;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } u;
+} dns_addr_t;
+
+typedef struct dns_waiter dns_waiter_t;
+
+typedef struct {
+    dns_waiter_t *head, **tail;
+} dns_wlist_t;
+
+/* One lookup in flight or answered, indexed by tag for dns_cancel() */
+struct dns_waiter {
+    dns_waiter_t *tag_next, **tag_pprev;   /* s_tags chain */
+    dns_waiter_t *next, **pprev;           /* on list */
+    dns_wlist_t *list;                     /* its entry's, or s_ready */
+    uint64_t tag;
+    int port;
+    struct addrinfo *res;                  /* on s_ready */
+};
+
+typedef struct dns_entry {
+    struct dns_entry *next;    /* hash chain */
+    char *host;
+    unsigned hash;
+    int pending;               /* on a job */
+    long long expires_ms;
+    int naddr;                 /* 0: did not resolve */
+    dns_addr_t addr[DNS_ADDRS_MAX];
+    dns_wlist_t wait;
+} dns_entry_t;
+
+typedef struct dns_job {
+    struct dns_job *next;
+    dns_entry_t *e;
+    char host[DNS_NAME_MAX];
+    struct addrinfo *res;
+    double ms;
+} dns_job_t;
+
+/* Calling thread only */
+static dns_entry_t *s_buckets[DNS_BUCKETS];
+static size_t s_count;
+static dns_waiter_t *s_tags[DNS_BUCKETS];
+static dns_wlist_t s_ready = { NULL, &s_ready.head };
+static dns_stats_t s_stats;
+static int s_pipe[2] = { -1, -1 };
+static int s_nworkers;
+
+/* Shared with the workers, under s_lock */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static dns_job_t *s_todo, *s_todo_tail, *s_done;
+
+/* A child of a process with workers has none: start over on first use */
+static volatile sig_atomic_t s_forked;
+
+static unsigned name_hash(const char *s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+static unsigned tag_hash(uint64_t tag) {
+    return (unsigned)((tag * 0x9e3779b97f4a7c15ull) >> 56) % DNS_BUCKETS;
+}
+
+static void wlist_push(dns_wlist_t *l, dns_waiter_t *w) {
+    w->list = l;
+    w->next = NULL;
+    w->pprev = l->tail;
+    *l->tail = w;
+    l->tail = &w->next;
+}
+
+/* Off its list and out of the tag index */
+static void waiter_free(dns_waiter_t *w) {
+    dns_wlist_t *l = w->list;
+    *w->pprev = w->next;
+    if (w->next) w->next->pprev = w->pprev;
+    else l->tail = w->pprev;
+    *w->tag_pprev = w->tag_next;
+    if (w->tag_next) w->tag_next->tag_pprev = w->tag_pprev;
+    dns_free(w->res);
+    free(w);
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&s_lock);
+    for (;;) {
+        while (!s_todo)
+            pthread_cond_wait(&s_cond, &s_lock);
+        dns_job_t *j = s_todo;
+        s_todo = j->next;
+        if (!s_todo) s_todo_tail = NULL;
+        pthread_mutex_unlock(&s_lock);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = g_af_family;
+        hints.ai_socktype = SOCK_STREAM;
+        long long t0 = mono_us();
+        if (g_dns_getaddrinfo(j->host, NULL, &hints, &j->res) != 0)
+            j->res = NULL;
+        j->ms = (double)(mono_us() - t0) / 1000.0;
+
+        pthread_mutex_lock(&s_lock);
+        j->next = s_done;
+        s_done = j;
+        /* A full pipe already has a wakeup pending */
+        ssize_t w = write(s_pipe[1], "", 1);
+        (void)w;
+    }
+    return NULL;
+}
+
+static void atfork_prepare(void) { pthread_mutex_lock(&s_lock); }
+static void atfork_parent(void) { pthread_mutex_unlock(&s_lock); }
+static void atfork_child(void) {
+    pthread_mutex_unlock(&s_lock);
+    s_forked = 1;
+}
+
+static void free_jobs(dns_job_t *j) {
+    while (j) {
+        dns_job_t *next = j->next;
+        if (j->res) freeaddrinfo(j->res);
+        free(j);
+        j = next;
+    }
+}
+
+/* In a forked child: the parent's lookups will never finish here */
+static void check_fork(void) {
+    if (!s_forked) return;
+    s_forked = 0;
+    for (int b = 0; b < DNS_BUCKETS; b++) {
+        while (s_buckets[b]) {
+            dns_entry_t *e = s_buckets[b];
+            s_buckets[b] = e->next;
+            while (e->wait.head) waiter_free(e->wait.head);
+            free(e->host);
+            free(e);
+        }
+    }
+    s_count = 0;
+    while (s_ready.head) waiter_free(s_ready.head);
+    free_jobs(s_todo);
+    free_jobs(s_done);
+    s_todo = s_todo_tail = s_done = NULL;
+    pthread_cond_init(&s_cond, NULL);
+    if (s_pipe[0] >= 0) {
+        close(s_pipe[0]);
+        close(s_pipe[1]);
+        s_pipe[0] = s_pipe[1] = -1;
+    }
+    s_nworkers = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+}
+
+int dns_fd(void) {
+    check_fork();
+    if (s_pipe[0] >= 0) return s_pipe[0];
+    if (pipe(s_pipe) < 0) {
+        s_pipe[0] = s_pipe[1] = -1;
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        set_nonblock(s_pipe[i]);
+        fcntl(s_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    return s_pipe[0];
+}
+
+static int start_workers(void) {
+    static int atfork_set = 0;
+    if (s_nworkers == DNS_WORKERS) return 0;
+    if (!atfork_set) {
+        pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+        atfork_set = 1;
+    }
+
+    /* Signals stay with the relay thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (s_nworkers < DNS_WORKERS) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, worker, NULL) != 0) break;
+        pthread_detach(t);
+        s_nworkers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return s_nworkers > 0 ? 0 : -1;
+}
+
+static int port_number(const char *port) {
+    char *end;
+    long v = strtol(port, &end, 10);
+    if (*port && !*end) return (v >= 0 && v <= 65535) ? (int)v : -1;
+    struct servent *se = getservbyname(port, "tcp");
+    return se ? ntohs((unsigned short)se->s_port) : -1;
+}
+
+static void fill_entry(dns_entry_t *e, const struct addrinfo *res) {
+    e->naddr = 0;
+    for (; res && e->naddr < DNS_ADDRS_MAX; res = res->ai_next) {
+        if (res->ai_addrlen > sizeof(e->addr[0].u)) continue;
+        dns_addr_t *a = &e->addr[e->naddr++];
+        a->family = res->ai_family;
+        a->socktype = res->ai_socktype;
+        a->protocol = res->ai_protocol;
+        a->len = res->ai_addrlen;
+        memcpy(&a->u, res->ai_addr, res->ai_addrlen);
+    }
+}
+
+/* The entry's addresses as a fresh addrinfo list with port set */
+static struct addrinfo *answer(const dns_entry_t *e, int port) {
+    struct addrinfo *head = NULL, **tail = &head;
+    for (int i = 0; i < e->naddr; i++) {
+        const dns_addr_t *a = &e->addr[i];
+        struct addrinfo *ai = calloc(1, sizeof(*ai) + sizeof(a->u));
+        if (!ai) break;
+        ai->ai_family = a->family;
+        ai->ai_socktype = a->socktype;
+        ai->ai_protocol = a->protocol;
+        ai->ai_addrlen = a->len;
+        ai->ai_addr = (struct sockaddr *)(ai + 1);
+        memcpy(ai->ai_addr, &a->u, a->len);
+        if (a->family == AF_INET)
+            ((struct sockaddr_in *)ai->ai_addr)->sin_port = htons((unsigned short)port);
+        else if (a->family == AF_INET6)
+            ((struct sockaddr_in6 *)ai->ai_addr)->sin6_port = htons((unsigned short)port);
+        *tail = ai;
+        tail = &ai->ai_next;
+    }
+    return head;
+}
+
+void dns_free(struct addrinfo *res) {
+    while (res) {
+        struct addrinfo *next = res->ai_next;
+        free(res);
+        res = next;
+    }
+}
+
+static dns_entry_t *entry_find(const char *host, unsigned h) {
+    for (dns_entry_t *e = s_buckets[h % DNS_BUCKETS]; e; e = e->next)
+        if (e->hash == h && strcasecmp(e->host, host) == 0) return e;
+    return NULL;
+}
+
+static void entry_unlink(dns_entry_t *e) {
+    dns_entry_t **pp = &s_buckets[e->hash % DNS_BUCKETS];
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    s_count--;
+    free(e->host);
+    free(e);
+}
+
+/* Full cache: drop the idle name that expires first (expired ones do) */
+static void evict_one(void) {
+    dns_entry_t *victim = NULL;
+    for (int b = 0; b < DNS_BUCKETS; b++)
+        for (dns_entry_t *e = s_buckets[b]; e; e = e->next)
+            if (!e->pending && (!victim || e->expires_ms < victim->expires_ms))
+                victim = e;
+    if (victim) entry_unlink(victim);
+}
+
+static dns_entry_t *entry_new(const char *host, unsigned h) {
+    if (s_count >= DNS_CACHE_MAX) evict_one();
+    dns_entry_t *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->host = strdup(host);
+    if (!e->host) {
+        free(e);
+        return NULL;
+    }
+    e->hash = h;
+    e->wait.tail = &e->wait.head;
+    e->next = s_buckets[h % DNS_BUCKETS];
+    s_buckets[h % DNS_BUCKETS] = e;
+    s_count++;
+    return e;
+}
+
+static int start_job(dns_entry_t *e) {
+    if (dns_fd() < 0 || start_workers() < 0) return -1;
+    dns_job_t *j = calloc(1, sizeof(*j));
+    if (!j) return -1;
+    j->e = e;
+    snprintf(j->host, sizeof(j->host), "%s", e->host);
+
+    pthread_mutex_lock(&s_lock);
+    if (s_todo_tail) s_todo_tail->next = j;
+    else s_todo = j;
+    s_todo_tail = j;
+    pthread_cond_signal(&s_cond);
+    pthread_mutex_unlock(&s_lock);
+    e->pending = 1;
+    return 0;
+}
+
+int dns_lookup(const char *host, const char *port, uint64_t tag,
+               struct addrinfo **res) {
+    check_fork();
+    *res = NULL;
+    int pnum = port_number(port);
+    if (pnum < 0 || strlen(host) >= DNS_NAME_MAX) return 1;
+
+    /* Address literals need no lookup (and no cache slot) */
+    struct addrinfo hints, *num;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = g_af_family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(host, NULL, &hints, &num) == 0) {
+        dns_entry_t lit;
+        fill_entry(&lit, num);
+        freeaddrinfo(num);
+        *res = answer(&lit, pnum);
+        return 1;
+    }
+
+    s_stats.lookups++;
+    unsigned h = name_hash(host);
+    dns_entry_t *e = entry_find(host, h);
+    if (e && !e->pending && e->expires_ms > mono_us() / 1000) {
+        s_stats.hits++;
+        *res = answer(e, pnum);
+        return 1;
+    }
+    if (!e && !(e = entry_new(host, h))) return -1;
+
+    dns_waiter_t *w = calloc(1, sizeof(*w));
+    if (!w) return -1;
+    if (e->pending) {
+        s_stats.joined++;
+    } else if (start_job(e) < 0) {
+        free(w);
+        return -1;
+    }
+    w->tag = tag;
+    w->port = pnum;
+    wlist_push(&e->wait, w);
+    dns_waiter_t **chain = &s_tags[tag_hash(tag)];
+    w->tag_next = *chain;
+    w->tag_pprev = chain;
+    if (*chain) (*chain)->tag_pprev = &w->tag_next;
+    *chain = w;
+    return 0;
+}
+
+/* Answers the workers finished: into the cache and out to the waiters */
+static void collect(void) {
+    char drain[64];
+    while (read(s_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&s_lock);
+    dns_job_t *done = s_done;
+    s_done = NULL;
+    pthread_mutex_unlock(&s_lock);
+
+    /* Oldest first */
+    dns_job_t *j = NULL;
+    while (done) {
+        dns_job_t *next = done->next;
+        done->next = j;
+        j = done;
+        done = next;
+    }
+
+    long long now_ms = mono_us() / 1000;
+    while (j) {
+        dns_entry_t *e = j->e;
+        fill_entry(e, j->res);
+        e->pending = 0;
+        e->expires_ms = now_ms + (e->naddr ? DNS_POSITIVE_TTL_MS : DNS_NEGATIVE_TTL_MS);
+        s_stats.resolved++;
+        if (!e->naddr) s_stats.failed++;
+        s_stats.total_ms += j->ms;
+        if (j->ms > s_stats.max_ms) s_stats.max_ms = j->ms;
+
+        /* The waiters move to s_ready as they are, still indexed by tag */
+        for (dns_waiter_t *w = e->wait.head; w; w = w->next) {
+            w->list = &s_ready;
+            w->res = answer(e, w->port);
+        }
+        if (e->wait.head) {
+            e->wait.head->pprev = s_ready.tail;
+            *s_ready.tail = e->wait.head;
+            s_ready.tail = e->wait.tail;
+            e->wait.head = NULL;
+            e->wait.tail = &e->wait.head;
+        }
+
+        dns_job_t *next = j->next;
+        j->next = NULL;
+        free_jobs(j);
+        j = next;
+    }
+}
+
+int dns_next(uint64_t *tag, struct addrinfo **res) {
+    check_fork();
+    if (!s_ready.head) {
+        if (s_pipe[0] < 0) return 0;
+        collect();
+        if (!s_ready.head) return 0;
+    }
+    dns_waiter_t *w = s_ready.head;
+    *tag = w->tag;
+    *res = w->res;
+    w->res = NULL;
+    waiter_free(w);
+    return 1;
+}
+
+void dns_cancel(uint64_t tag) {
+    check_fork();
+    for (dns_waiter_t *w = s_tags[tag_hash(tag)]; w; w = w->tag_next) {
+        if (w->tag == tag) {
+            waiter_free(w);
+            return;
+        }
+    }
+}
+
+void dns_stats(dns_stats_t *st) {
+    check_fork();
+    *st = s_stats;
+}
+
+void dns_log_stats(void) {
+    dns_stats_t st;
+    dns_stats(&st);
+    if (st.lookups == 0) return;
+    log_msg(1, "dns: %lu lookups, %lu%% from cache, %lu resolved (%lu failed), "
+               "%.1f ms avg, %.1f ms max",
+            st.lookups, st.hits * 100 / st.lookups, st.resolved, st.failed,
+            st.resolved ? st.total_ms / (double)st.resolved : 0.0, st.max_ms);
+}
@@ -0,0 +1,67 @@
+#ifndef CLAWSEC_DNS_H
+#define CLAWSEC_DNS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous name lookups with a cache, for relays that must not stall
+ * every stream on one slow name server.
+ *
+ * getaddrinfo() runs on DNS_WORKERS threads; the event loop watches
+ * dns_fd() and collects answers with dns_next(). Answers are cached by
+ * host name — successes for DNS_POSITIVE_TTL_MS, failures for
+ * DNS_NEGATIVE_TTL_MS, since getaddrinfo() does not report record TTLs —
+ * and a lookup of a name already in flight waits for that answer.
+ */
+
+#define DNS_WORKERS          4
+#define DNS_POSITIVE_TTL_MS  (60 * 1000)
+#define DNS_NEGATIVE_TTL_MS  (5 * 1000)
+#define DNS_CACHE_MAX        1024   /* names */
+#define DNS_ADDRS_MAX        8      /* addresses kept per name */
+
+struct addrinfo;
+
+/* Completion pipe to watch for reading, or -1 if it cannot be created */
+int dns_fd(void);
+
+/*
+ * Addresses of host for a TCP connect to port. Returns 1 with a cached
+ * answer in *res (NULL: the name is known not to resolve), 0 when the
+ * answer will come from dns_next() under tag, or -1 on error.
+ */
+int dns_lookup(const char *host, const char *port, uint64_t tag,
+               struct addrinfo **res);
+
+/* Next finished lookup: returns 1 with its tag and answer (NULL on
+ * failure), 0 when none is ready */
+int dns_next(uint64_t *tag, struct addrinfo **res);
+
+/* Forget the lookup waiting under tag */
+void dns_cancel(uint64_t tag);
+
+/* Free an answer from dns_lookup() or dns_next() */
+void dns_free(struct addrinfo *res);
+
+typedef struct {
+    unsigned long lookups;   /* dns_lookup() calls */
+    unsigned long hits;      /* answered from the cache */
+    unsigned long joined;    /* waited for a lookup already in flight */
+    unsigned long resolved;  /* getaddrinfo() calls finished */
+    unsigned long failed;    /* ... that found nothing */
+    double total_ms;         /* getaddrinfo() time, summed */
+    double max_ms;
+} dns_stats_t;
+
+void dns_stats(dns_stats_t *st);
+
+/* One line of dns_stats() at verbosity 1, if anything was looked up */
+void dns_log_stats(void);
+
+/* The lookup the workers run; tests swap in a slow one */
+extern int (*g_dns_getaddrinfo)(const char *host, const char *port,
+                                const struct addrinfo *hints,
+                                struct addrinfo **res);
+
+#endif
@@ -33,6 +33,8 @@ extern "C"
 }
 
 static int debug = false;
+static int bind_offer = false;      /* set bit 255 of our public key */
+static int peer_bind_offer = false; /* the peer's public key had it */
 
 /* Secure memory cleanup */
 static void secure_zero(void *ptr, size_t len) {
@@ -91,7 +93,11 @@ static EVP_PKEY *x25519_keygen(unsigned char pubkey_out[32]) {
 /* Compute X25519 shared secret (32 bytes) */
 static int x25519_derive(EVP_PKEY *my_key, const unsigned char peer_pubkey[32],
                           unsigned char secret_out[32]) {
-    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_pubkey, 32);
+    /* Bit 255 is not part of the coordinate: it carries the bind offer */
+    unsigned char u[32];
+    memcpy(u, peer_pubkey, 32);
+    u[31] &= 0x7f;
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, u, 32);
     if (!peer) return -1;
     EVP_PKEY_CTX *dctx = EVP_PKEY_CTX_new(my_key, NULL);
     if (!dctx || EVP_PKEY_derive_init(dctx) <= 0 ||
@@ -150,6 +156,41 @@ static int derive_session_key(const unsigned char *secret1,
     return 0;
 }
 
+extern "C" void ecdhe_warmup(void) {
+    unsigned char pub[32], secret[32], digest[32];
+    EVP_PKEY *key = x25519_keygen(pub);
+    if (!key) return;
+    if (x25519_derive(key, pub, secret) == 0)
+        EVP_Digest(secret, 32, digest, NULL, EVP_sha256(), NULL);
+    EVP_PKEY_free(key);
+    secure_zero(secret, 32);
+}
+
+extern "C" void *ecdhe_keygen(unsigned char pub_out[32]) {
+    return x25519_keygen(pub_out);
+}
+
+extern "C" int ecdhe_shared(void *key, const unsigned char peer_pub[32],
+                            unsigned char secret_out[32]) {
+    int rc = x25519_derive((EVP_PKEY *)key, peer_pub, secret_out);
+    EVP_PKEY_free((EVP_PKEY *)key);
+    return rc;
+}
+
+extern "C" int ecdhe_session_key(const unsigned char secret[32],
+                                 const unsigned char server_pub[32],
+                                 const unsigned char client_pub[32],
+                                 const char *password, size_t pass_len,
+                                 unsigned char *key_out) {
+    if (!password || pass_len == 0) return -1;
+    return derive_session_key(secret, NULL, server_pub, client_pub,
+                              password, pass_len, key_out);
+}
+
+extern "C" void ecdhe_free_key(void *key) {
+    EVP_PKEY_free((EVP_PKEY *)key);
+}
+
 /* Exchange X25519 pubkeys: server sends first, client receives first */
 static int x25519_exchange_plain(int sockfd, int server_mode,
                                   const unsigned char my_pub[32],
@@ -239,6 +280,26 @@ static int mlkem_exchange(int sockfd, int server_mode,
     return 0;
 }
 
+/*
+ * --tls-bind offer: X25519 ignores the top bit of a public key (RFC 7748,
+ * 5) and honest keys never set it, so a side that will bind sets it on the
+ * key it sends. Peers without --tls-bind clear it and derive as before.
+ * Both sides hash the keys as sent into the salt, so a changed bit fails
+ * the session instead of downgrading it.
+ */
+static void mark_bind_offer(unsigned char pub[32]) {
+    if (bind_offer) pub[31] |= 0x80;
+    peer_bind_offer = false;
+}
+
+extern "C" void ecdhe_offer_bind(int on) {
+    bind_offer = on;
+}
+
+extern "C" int ecdhe_peer_offers_bind(void) {
+    return peer_bind_offer;
+}
+
 /* ---------- Public handshake functions ---------- */
 
 extern "C" int ecdhe_handshake(int sockfd, const char *password, size_t pass_len,
@@ -248,10 +309,12 @@ extern "C" int ecdhe_handshake(int sockfd, const char *password, size_t pass_len
     unsigned char my_pub[32], peer_pub[32];
     EVP_PKEY *my_key = x25519_keygen(my_pub);
     if (!my_key) return -1;
+    mark_bind_offer(my_pub);
 
     if (x25519_exchange_plain(sockfd, server_mode, my_pub, peer_pub) < 0) {
         EVP_PKEY_free(my_key); return -1;
     }
+    peer_bind_offer = (peer_pub[31] & 0x80) != 0;
 
     unsigned char secret[32];
     if (x25519_derive(my_key, peer_pub, secret) < 0) {
@@ -275,11 +338,13 @@ extern "C" int ecdhe_handshake_tofu(int sockfd, const char *password, size_t pas
     unsigned char my_pub[32], peer_pub[32];
     EVP_PKEY *my_key = x25519_keygen(my_pub);
     if (!my_key) return -1;
+    mark_bind_offer(my_pub);
 
     if (x25519_exchange_tofu(sockfd, server_mode, my_pub, peer_pub,
                               peer_host, peer_port) < 0) {
         EVP_PKEY_free(my_key); return -1;
     }
+    peer_bind_offer = (peer_pub[31] & 0x80) != 0;
 
     unsigned char secret[32];
     if (x25519_derive(my_key, peer_pub, secret) < 0) {
@@ -309,6 +374,7 @@ extern "C" int ecdhe_handshake_pq(int sockfd, const char *password, size_t pass_
     unsigned char my_pub[32], peer_pub[32];
     EVP_PKEY *my_key = x25519_keygen(my_pub);
     if (!my_key) return -1;
+    mark_bind_offer(my_pub);
 
     int xrc;
     if (g_tofu)
@@ -317,6 +383,7 @@ extern "C" int ecdhe_handshake_pq(int sockfd, const char *password, size_t pass_
     else
         xrc = x25519_exchange_plain(sockfd, server_mode, my_pub, peer_pub);
     if (xrc < 0) { EVP_PKEY_free(my_key); return -1; }
+    peer_bind_offer = (peer_pub[31] & 0x80) != 0;
 
     unsigned char x_secret[32];
     if (x25519_derive(my_key, peer_pub, x_secret) < 0) {
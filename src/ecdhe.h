@@ -35,6 +35,42 @@ int ecdhe_handshake_pq(int sockfd, const char *password, size_t pass_len,
                        int server_mode, const char *peer_host,
                        const char *peer_port, unsigned char *key_out);
 
+/* --tls-bind negotiation: with on set, the handshakes above tell the peer
+ * that this side will bind to the TLS session. After a handshake,
+ * ecdhe_peer_offers_bind() says whether the peer said the same. */
+void ecdhe_offer_bind(int on);
+int ecdhe_peer_offers_bind(void);
+
+/*
+ * The plain handshake in steps, for a server that carries many sessions in
+ * one process and must not block in any of them (-K --event). The caller
+ * moves the public keys itself: the server's 32 bytes first, then the
+ * client's, as ecdhe_handshake does.
+ */
+
+/* Ephemeral X25519 key, its public half in pub_out. NULL on error. */
+void *ecdhe_keygen(unsigned char pub_out[32]);
+
+/* X25519 secret of key and the peer's public key. Frees key. */
+int ecdhe_shared(void *key, const unsigned char peer_pub[32],
+                 unsigned char secret_out[32]);
+
+/* Session key from the shared secret and the password: the KDF, the slow
+ * step. Touches no shared state, so it may run on another thread. */
+int ecdhe_session_key(const unsigned char secret[32],
+                      const unsigned char server_pub[32],
+                      const unsigned char client_pub[32],
+                      const char *password, size_t pass_len,
+                      unsigned char *key_out);
+
+/* Free a key from ecdhe_keygen that never got to ecdhe_shared */
+void ecdhe_free_key(void *key);
+
+/* Run X25519 and SHA-256 once, so OpenSSL's lazy setup (provider
+ * loading, DRBG seeding) is done before a handshake needs it. For
+ * processes forked to wait for a connection (--prefork). */
+void ecdhe_warmup(void);
+
 /* Low-level obfs-aware send/recv helpers */
 int ecdhe_send(int sockfd, const void *buf, size_t len);
 int ecdhe_recv(int sockfd, void *buf, size_t len);
@@ -0,0 +1,208 @@
+/*
+ * ev.c — Readiness event loop for ClawSec relays
+ *
+ * Linux uses epoll, so a wait costs O(ready fds) however many streams a
+ * tunnel carries. Other systems get a poll() array with an fd -> slot map,
+ * so add/mod/del stay O(1) and only the wait itself scans.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "ev.h"
+
+#ifdef __linux__
+
+struct ev_loop {
+    int epfd;
+    struct epoll_event *buf;
+    int buf_len;
+};
+
+ev_loop_t *ev_new(void) {
+    ev_loop_t *ev = calloc(1, sizeof(*ev));
+    if (!ev) return NULL;
+    ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->epfd < 0) {
+        free(ev);
+        return NULL;
+    }
+    return ev;
+}
+
+void ev_free(ev_loop_t *ev) {
+    if (!ev) return;
+    close(ev->epfd);
+    free(ev->buf);
+    free(ev);
+}
+
+static uint32_t to_epoll(int events) {
+    uint32_t e = 0;
+    if (events & EV_READ)  e |= EPOLLIN | EPOLLRDHUP;
+    if (events & EV_WRITE) e |= EPOLLOUT;
+    return e;
+}
+
+static int ctl(ev_loop_t *ev, int op, int fd, int events, uint64_t tag) {
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = to_epoll(events);
+    ee.data.u64 = tag;
+    return epoll_ctl(ev->epfd, op, fd, &ee);
+}
+
+int ev_add(ev_loop_t *ev, int fd, int events, uint64_t tag) {
+    return ctl(ev, EPOLL_CTL_ADD, fd, events, tag);
+}
+
+int ev_mod(ev_loop_t *ev, int fd, int events, uint64_t tag) {
+    return ctl(ev, EPOLL_CTL_MOD, fd, events, tag);
+}
+
+int ev_del(ev_loop_t *ev, int fd) {
+    return epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int ev_wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout_ms) {
+    if (max > ev->buf_len) {
+        struct epoll_event *nb = realloc(ev->buf, (size_t)max * sizeof(*nb));
+        if (!nb) return -1;
+        ev->buf = nb;
+        ev->buf_len = max;
+    }
+    int n = epoll_wait(ev->epfd, ev->buf, max, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        uint32_t e = ev->buf[i].events;
+        out[i].tag = ev->buf[i].data.u64;
+        out[i].events = 0;
+        if (e & (EPOLLIN | EPOLLRDHUP)) out[i].events |= EV_READ;
+        if (e & EPOLLOUT)               out[i].events |= EV_WRITE;
+        if (e & (EPOLLERR | EPOLLHUP))  out[i].events |= EV_HUP;
+    }
+    return n;
+}
+
+#else /* poll() fallback */
+
+struct ev_loop {
+    struct pollfd *pfd;
+    uint64_t *tags;
+    int n, cap;
+    int *slot;        /* fd -> index in pfd[], -1 if unwatched */
+    int slot_len;
+    int next;         /* round-robin start so no fd starves at max */
+};
+
+ev_loop_t *ev_new(void) {
+    return calloc(1, sizeof(ev_loop_t));
+}
+
+void ev_free(ev_loop_t *ev) {
+    if (!ev) return;
+    free(ev->pfd);
+    free(ev->tags);
+    free(ev->slot);
+    free(ev);
+}
+
+static short to_poll(int events) {
+    short e = 0;
+    if (events & EV_READ)  e |= POLLIN;
+    if (events & EV_WRITE) e |= POLLOUT;
+    return e;
+}
+
+int ev_add(ev_loop_t *ev, int fd, int events, uint64_t tag) {
+    if (fd < 0) { errno = EBADF; return -1; }
+    if (fd >= ev->slot_len) {
+        int len = ev->slot_len ? ev->slot_len : 64;
+        while (len <= fd) len *= 2;
+        int *ns = realloc(ev->slot, (size_t)len * sizeof(*ns));
+        if (!ns) return -1;
+        for (int i = ev->slot_len; i < len; i++) ns[i] = -1;
+        ev->slot = ns;
+        ev->slot_len = len;
+    }
+    if (ev->slot[fd] >= 0) { errno = EEXIST; return -1; }
+    if (ev->n == ev->cap) {
+        int cap = ev->cap ? ev->cap * 2 : 64;
+        struct pollfd *np = realloc(ev->pfd, (size_t)cap * sizeof(*np));
+        if (!np) return -1;
+        ev->pfd = np;
+        uint64_t *nt = realloc(ev->tags, (size_t)cap * sizeof(*nt));
+        if (!nt) return -1;
+        ev->tags = nt;
+        ev->cap = cap;
+    }
+    ev->pfd[ev->n].fd = fd;
+    ev->pfd[ev->n].events = to_poll(events);
+    ev->pfd[ev->n].revents = 0;
+    ev->tags[ev->n] = tag;
+    ev->slot[fd] = ev->n++;
+    return 0;
+}
+
+int ev_mod(ev_loop_t *ev, int fd, int events, uint64_t tag) {
+    if (fd < 0 || fd >= ev->slot_len || ev->slot[fd] < 0) { errno = ENOENT; return -1; }
+    int i = ev->slot[fd];
+    ev->pfd[i].events = to_poll(events);
+    ev->tags[i] = tag;
+    return 0;
+}
+
+int ev_del(ev_loop_t *ev, int fd) {
+    if (fd < 0 || fd >= ev->slot_len || ev->slot[fd] < 0) { errno = ENOENT; return -1; }
+    int i = ev->slot[fd];
+    int last = --ev->n;
+    if (i != last) {
+        ev->pfd[i] = ev->pfd[last];
+        ev->tags[i] = ev->tags[last];
+        ev->slot[ev->pfd[i].fd] = i;
+    }
+    ev->slot[fd] = -1;
+    return 0;
+}
+
+int ev_wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout_ms) {
+    int ret = poll(ev->pfd, (nfds_t)ev->n, timeout_ms);
+    if (ret <= 0) return ret;
+
+    int got = 0;
+    if (ev->next >= ev->n) ev->next = 0;
+    for (int k = 0; k < ev->n && got < max; k++) {
+        int i = (ev->next + k) % ev->n;
+        short r = ev->pfd[i].revents;
+        if (!r) continue;
+        out[got].tag = ev->tags[i];
+        out[got].events = 0;
+        if (r & POLLIN)                        out[got].events |= EV_READ;
+        if (r & POLLOUT)                       out[got].events |= EV_WRITE;
+        if (r & (POLLERR | POLLHUP | POLLNVAL)) out[got].events |= EV_HUP;
+        got++;
+    }
+    ev->next++;
+    return got;
+}
+
+#endif
+
+void ev_raise_nofile(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
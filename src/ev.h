@@ -0,0 +1,46 @@
+#ifndef CLAWSEC_EV_H
+#define CLAWSEC_EV_H
+
+#include <stdint.h>
+
+/*
+ * Readiness event loop. epoll on Linux, poll() elsewhere. Each fd is
+ * registered with a caller-chosen 64-bit tag that comes back with its
+ * events, so a loop finds its object (e.g. a mux stream id) without
+ * scanning everything it watches. Level-triggered.
+ */
+
+#define EV_READ  0x01
+#define EV_WRITE 0x02
+#define EV_HUP   0x04   /* error or hangup — reported even if not asked for */
+
+typedef struct ev_loop ev_loop_t;
+
+typedef struct {
+    uint64_t tag;
+    int events;
+} ev_event_t;
+
+/* Returns a new loop, or NULL on error */
+ev_loop_t *ev_new(void);
+void ev_free(ev_loop_t *ev);
+
+/* Watch fd for events (EV_READ/EV_WRITE, may be 0). Returns 0 or -1. */
+int ev_add(ev_loop_t *ev, int fd, int events, uint64_t tag);
+
+/* Change the events of a watched fd. Returns 0 or -1. */
+int ev_mod(ev_loop_t *ev, int fd, int events, uint64_t tag);
+
+/* Stop watching fd — call before closing it. Returns 0 or -1. */
+int ev_del(ev_loop_t *ev, int fd);
+
+/*
+ * Wait up to timeout_ms (-1 = forever) and fill out[] with at most max
+ * ready fds. Returns the count, 0 on timeout, -1 on error (EINTR included).
+ */
+int ev_wait(ev_loop_t *ev, ev_event_t *out, int max, int timeout_ms);
+
+/* Raise the open-file soft limit to the hard limit (many-stream relays) */
+void ev_raise_nofile(void);
+
+#endif
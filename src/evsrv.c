@@ -0,0 +1,766 @@
+/*
+ * evsrv.c — Event-driven -K server: every session in one loop (--event)
+ *
+ * Sessions sit in a table by slot. A watched fd's tag is the session's
+ * generation, slot and side (client or target), so an event for a session
+ * closed earlier in the same batch finds nothing and is dropped, as does
+ * a KDF answer or a lookup for one that is gone. Sessions with a deadline
+ * (HELLO, CONNECT) are also on a list the loop walks when one is due.
+ *
+ * Backpressure: while a write to one side is short, the rest is kept and
+ * the other side is not read until it has gone out.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+
+#include "evsrv.h"
+#include "ev.h"
+#include "dns.h"
+#include "net.h"
+#include "ecdhe.h"
+#include "farm9crypt.h"
+#include "util.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0   /* main() ignores SIGPIPE anyway */
+#endif
+
+#define EVSRV_EVENTS    256
+#define EVSRV_RBUF      (4 * FARM9_FRAME_MAX)
+#define EVSRV_SLOTS_MAX (1u << 24)
+
+#define TAG_LISTEN  (~0ULL)
+#define TAG_KDF     (~0ULL - 1)
+#define TAG_DNS     (~0ULL - 2)
+#define SIDE_CLIENT 0
+#define SIDE_TARGET 1
+
+enum { S_HELLO, S_KDF, S_RESOLVE, S_CONNECT, S_RELAY };
+
+/* Bytes a short write left over, or a frame not complete yet */
+typedef struct {
+    unsigned char *p;
+    size_t len;
+} evs_buf_t;
+
+typedef struct evs_sess {
+    uint32_t slot, gen;
+    int state;
+    int fd, tfd;                  /* client (frames), target (plain), or -1 */
+    int fd_ev, tfd_ev;            /* events watched on each */
+    int eof;                      /* a side closed: flush the other, then end */
+    void *eph;                    /* HELLO: our ephemeral key */
+    unsigned char pub[32], peer[32];
+    int got;                      /* HELLO: bytes of peer in */
+    struct kdf_job *job;          /* KDF: queued or running for us */
+    farm9_session_t *crypto;
+    struct addrinfo *ai;          /* CONNECT */
+    net_race_t *race;
+    long long due;                /* HELLO: give up; CONNECT: step the race */
+    struct evs_sess *tprev, *tnext;
+    evs_buf_t in;                 /* from the client, not yet opened */
+    evs_buf_t to_fd, to_tfd;      /* not yet written */
+} evs_sess_t;
+
+typedef struct kdf_job {
+    uint64_t tag;
+    unsigned char secret[32], srv_pub[32], cli_pub[32], key[32];
+    int rc;
+    int cancelled;                /* session gone: skip it (under s_kdf_mu) */
+    struct kdf_job *next;
+} kdf_job_t;
+
+static const evsrv_conf_t *s_conf;
+static ev_loop_t *s_ev;
+static long long s_now;
+
+static evs_sess_t **s_tab;        /* by slot */
+static uint32_t *s_free;          /* free slots, a stack */
+static uint32_t s_cap, s_nfree, s_gen;
+static int s_nsess;
+
+static evs_sess_t *s_timed;       /* sessions with a deadline */
+static long long s_next_due = -1;
+
+static unsigned char s_rbuf[EVSRV_RBUF];
+
+static pthread_mutex_t s_kdf_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_kdf_cv = PTHREAD_COND_INITIALIZER;
+static kdf_job_t *s_todo, *s_todo_tail, *s_done;
+static int s_kdf_pipe[2] = { -1, -1 };
+static int s_nkdf;                /* sessions in S_KDF */
+
+static int s_listen_fd = -1, s_listen_ev;
+static long long s_accept_at = -1;    /* accepts paused until */
+
+static void secure_zero(void *ptr, size_t len) {
+    volatile unsigned char *p = (volatile unsigned char *)ptr;
+    while (len--) *p++ = 0;
+}
+
+/* ──────────── Session table ──────────── */
+
+static uint64_t tag_of(const evs_sess_t *s, int side) {
+    return (uint64_t)s->gen << 32 | (uint64_t)s->slot << 1 | (uint64_t)side;
+}
+
+static evs_sess_t *find(uint64_t tag) {
+    uint32_t slot = (uint32_t)tag >> 1;
+    if (slot >= s_cap || !s_tab[slot] || s_tab[slot]->gen != (uint32_t)(tag >> 32))
+        return NULL;
+    return s_tab[slot];
+}
+
+static evs_sess_t *sess_new(void) {
+    if (s_nfree == 0) {
+        uint32_t cap = s_cap ? s_cap * 2 : 1024;
+        if (cap > EVSRV_SLOTS_MAX) return NULL;
+        evs_sess_t **tab = realloc(s_tab, cap * sizeof(*tab));
+        if (!tab) return NULL;
+        s_tab = tab;
+        uint32_t *fr = realloc(s_free, cap * sizeof(*fr));
+        if (!fr) return NULL;
+        s_free = fr;
+        for (uint32_t i = cap; i > s_cap; i--) {
+            s_tab[i - 1] = NULL;
+            s_free[s_nfree++] = i - 1;
+        }
+        s_cap = cap;
+    }
+    evs_sess_t *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->slot = s_free[--s_nfree];
+    s->gen = ++s_gen;
+    s->fd = s->tfd = -1;
+    s_tab[s->slot] = s;
+    s_nsess++;
+    return s;
+}
+
+static void timed_set(evs_sess_t *s, long long due) {
+    if (!s->tprev && s_timed != s) {
+        s->tnext = s_timed;
+        if (s_timed) s_timed->tprev = s;
+        s_timed = s;
+    }
+    s->due = due;
+    if (s_next_due < 0 || due < s_next_due) s_next_due = due;
+}
+
+static void timed_unlink(evs_sess_t *s) {
+    if (!s->tprev && s_timed != s) return;
+    if (s->tprev) s->tprev->tnext = s->tnext;
+    else s_timed = s->tnext;
+    if (s->tnext) s->tnext->tprev = s->tprev;
+    s->tprev = s->tnext = NULL;
+}
+
+static void kdf_cancel(evs_sess_t *s);
+
+static void sess_close(evs_sess_t *s) {
+    timed_unlink(s);
+    if (s->job) kdf_cancel(s);
+    if (s->state == S_RESOLVE) dns_cancel(tag_of(s, SIDE_TARGET));
+    if (s->eph) ecdhe_free_key(s->eph);
+    if (s->race) {
+        net_race_abort(s->race);
+        free(s->race);
+    }
+    dns_free(s->ai);
+    if (s->fd >= 0) {
+        ev_del(s_ev, s->fd);
+        close(s->fd);
+    }
+    if (s->tfd >= 0) {
+        ev_del(s_ev, s->tfd);
+        close(s->tfd);
+    }
+    farm9crypt_session_free(s->crypto);
+    free(s->in.p);
+    free(s->to_fd.p);
+    free(s->to_tfd.p);
+    s_tab[s->slot] = NULL;
+    s_free[s_nfree++] = s->slot;
+    s_nsess--;
+    log_msg(2, "event: session closed, %d open", s_nsess);
+    free(s);
+}
+
+/* ──────────── KDF workers ──────────── */
+
+static void *kdf_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&s_kdf_mu);
+        while (!s_todo)
+            pthread_cond_wait(&s_kdf_cv, &s_kdf_mu);
+        kdf_job_t *j = s_todo;
+        s_todo = j->next;
+        if (!s_todo) s_todo_tail = NULL;
+        int cancelled = j->cancelled;
+        pthread_mutex_unlock(&s_kdf_mu);
+        /* The client left while queued: no KDF for it */
+        if (cancelled) {
+            secure_zero(j, sizeof(*j));
+            free(j);
+            continue;
+        }
+
+        const char *pw = s_conf->password;
+        j->rc = ecdhe_session_key(j->secret, j->srv_pub, j->cli_pub,
+                                  pw, strlen(pw), j->key);
+        secure_zero(j->secret, sizeof(j->secret));
+
+        pthread_mutex_lock(&s_kdf_mu);
+        j->next = s_done;
+        s_done = j;
+        pthread_mutex_unlock(&s_kdf_mu);
+        /* Full pipe: the loop has a wakeup pending already */
+        if (write(s_kdf_pipe[1], "", 1) < 0 && errno != EAGAIN)
+            log_msg(2, "event: kdf wakeup: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+static int kdf_start(void) {
+    if (pipe(s_kdf_pipe) < 0) return -1;
+    set_nonblock(s_kdf_pipe[0]);
+    set_nonblock(s_kdf_pipe[1]);
+
+    /* Signals stay with the loop thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = 0;
+    for (int i = 0; i < EVSRV_KDF_THREADS && rc == 0; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, kdf_worker, NULL) != 0) rc = -1;
+        else pthread_detach(t);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc;
+}
+
+/* Accept while neither out of descriptors nor EVSRV_KDF_QUEUE handshakes
+ * deep in the KDF: a flood of hellos must not queue real clients without
+ * bound behind it */
+static void listen_update(void) {
+    int want = s_accept_at < 0 && s_nkdf < EVSRV_KDF_QUEUE ? EV_READ : 0;
+    if (want == s_listen_ev) return;
+    if (!want && s_accept_at < 0)
+        log_msg(1, "event: %d handshakes waiting for the KDF, pausing accepts", s_nkdf);
+    if (ev_mod(s_ev, s_listen_fd, want, TAG_LISTEN) == 0) s_listen_ev = want;
+}
+
+static void kdf_submit(evs_sess_t *s, kdf_job_t *j) {
+    s->job = j;
+    s_nkdf++;
+    listen_update();
+    j->cancelled = 0;
+    j->next = NULL;
+    pthread_mutex_lock(&s_kdf_mu);
+    if (s_todo_tail) s_todo_tail->next = j;
+    else s_todo = j;
+    s_todo_tail = j;
+    pthread_cond_signal(&s_kdf_cv);
+    pthread_mutex_unlock(&s_kdf_mu);
+}
+
+/* The job stays with the workers (or the done list), which free it */
+static void kdf_cancel(evs_sess_t *s) {
+    pthread_mutex_lock(&s_kdf_mu);
+    s->job->cancelled = 1;
+    pthread_mutex_unlock(&s_kdf_mu);
+    s->job = NULL;
+    s_nkdf--;
+    listen_update();
+}
+
+/* ──────────── Relay ──────────── */
+
+/* Watch for what each side can do now: read only while nothing is held
+ * back for the other, write while something is held back for it */
+static int watch_fds(evs_sess_t *s) {
+    int want = (!s->eof && !s->to_tfd.len ? EV_READ : 0) | (s->to_fd.len ? EV_WRITE : 0);
+    if (want != s->fd_ev) {
+        if (ev_mod(s_ev, s->fd, want, tag_of(s, SIDE_CLIENT)) < 0) return -1;
+        s->fd_ev = want;
+    }
+    if (s->tfd < 0) return 0;
+    want = (!s->eof && !s->to_fd.len ? EV_READ : 0) | (s->to_tfd.len ? EV_WRITE : 0);
+    if (want != s->tfd_ev) {
+        if (ev_mod(s_ev, s->tfd, want, tag_of(s, SIDE_TARGET)) < 0) return -1;
+        s->tfd_ev = want;
+    }
+    return 0;
+}
+
+static int buf_set(evs_buf_t *b, const void *data, size_t len) {
+    b->p = malloc(len);
+    if (!b->p) return -1;
+    memcpy(b->p, data, len);
+    b->len = len;
+    return 0;
+}
+
+static void buf_clear(evs_buf_t *b) {
+    free(b->p);
+    b->p = NULL;
+    b->len = 0;
+}
+
+/* Write what fd takes now and keep the rest in b, which must be empty */
+static int send_some(int fd, evs_buf_t *b, const void *data, size_t len) {
+    ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+    if (w < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+        w = 0;
+    }
+    if ((size_t)w == len) return 0;
+    return buf_set(b, (const unsigned char *)data + w, len - (size_t)w);
+}
+
+static int flush(int fd, evs_buf_t *b) {
+    ssize_t w = send(fd, b->p, b->len, MSG_NOSIGNAL);
+    if (w < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    if ((size_t)w == b->len) {
+        buf_clear(b);
+    } else {
+        memmove(b->p, b->p + w, b->len - (size_t)w);
+        b->len -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Frames from the client, held ones first, then (if do_read) one read's
+ * worth, opened and written to the target until a write is short */
+static int client_input(evs_sess_t *s, int do_read) {
+    /* Only read with every complete frame consumed, so under a frame */
+    size_t len = s->in.len;
+    if (len) memcpy(s_rbuf, s->in.p, len);
+    buf_clear(&s->in);
+    if (do_read) {
+        ssize_t r = recv(s->fd, s_rbuf + len, sizeof(s_rbuf) - len, 0);
+        if (r == 0) {
+            s->eof = 1;
+        } else if (r < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+        } else {
+            len += (size_t)r;
+        }
+    }
+
+    size_t off = 0;
+    while (off < len && !s->to_tfd.len) {
+        char plain[FARM9_MAX_MSG];
+        int plen;
+        int n = farm9crypt_session_open(s->crypto, s_rbuf + off, len - off, plain, &plen);
+        if (n < 0) {
+            log_msg(1, "event: bad frame from client (wrong password?)");
+            return -1;
+        }
+        if (n == 0) break;
+        off += (size_t)n;
+        if (send_some(s->tfd, &s->to_tfd, plain, (size_t)plen) < 0) return -1;
+    }
+    if (off < len && buf_set(&s->in, s_rbuf + off, len - off) < 0) return -1;
+    /* A frame cut off by the client closing will never be completed */
+    if (s->eof && s->in.len && !s->to_tfd.len) return -1;
+    return 0;
+}
+
+/* One read from the target, sealed and written to the client */
+static int target_input(evs_sess_t *s) {
+    char plain[FARM9_MAX_MSG];
+    ssize_t r = recv(s->tfd, plain, sizeof(plain), 0);
+    if (r == 0) {
+        s->eof = 1;
+        return 0;
+    }
+    if (r < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    unsigned char frame[FARM9_FRAME_MAX];
+    int n = farm9crypt_session_seal(s->crypto, plain, (int)r, frame);
+    if (n < 0) return -1;
+    return send_some(s->fd, &s->to_fd, frame, (size_t)n);
+}
+
+static int relay_event(evs_sess_t *s, int side, int events) {
+    int fd = side ? s->tfd : s->fd;
+    evs_buf_t *out = side ? &s->to_tfd : &s->to_fd;
+    int watched = side ? s->tfd_ev : s->fd_ev;
+
+    /* Hung up while not being read: nothing more can move */
+    if ((events & EV_HUP) && !(watched & EV_READ)) return -1;
+    if ((events & (EV_WRITE | EV_HUP)) && out->len) {
+        if (flush(fd, out) < 0) return -1;
+        /* The target took the backlog: frames held for it go next */
+        if (!out->len && side == SIDE_TARGET && s->in.len && client_input(s, 0) < 0)
+            return -1;
+    }
+    if ((events & (EV_READ | EV_HUP)) && (watched & EV_READ)) {
+        if ((side ? target_input(s) : client_input(s, 1)) < 0) return -1;
+    }
+    if (s->eof && !s->to_fd.len && !s->to_tfd.len) return -1;
+    return watch_fds(s);
+}
+
+/* ──────────── Target connect ──────────── */
+
+static int race_watch(void *ctx, int fd) {
+    return ev_add(s_ev, fd, EV_WRITE, tag_of(ctx, SIDE_TARGET));
+}
+
+static void race_unwatch(void *ctx, int fd) {
+    (void)ctx;
+    ev_del(s_ev, fd);
+}
+
+/* An attempt turned writable or a deadline came */
+static void connect_step(evs_sess_t *s) {
+    int wait;
+    int fd = net_race_step(s->race, s_now, &wait);
+    if (fd == -1) {
+        timed_set(s, s_now + (wait < 0 ? EVSRV_CONNECT_MS : wait));
+        return;
+    }
+    timed_unlink(s);
+    free(s->race);
+    s->race = NULL;
+    dns_free(s->ai);
+    s->ai = NULL;
+    if (fd < 0) {
+        log_msg(1, "event: cannot connect to %s:%s", s_conf->fwd_host, s_conf->fwd_port);
+        sess_close(s);
+        return;
+    }
+
+    /* Still watched for writing under the target tag */
+    s->tfd = fd;
+    s->tfd_ev = EV_WRITE;
+    s->state = S_RELAY;
+    log_msg(2, "event: forwarding to %s:%s", s_conf->fwd_host, s_conf->fwd_port);
+    if (watch_fds(s) < 0) sess_close(s);
+}
+
+static void connect_start(evs_sess_t *s, struct addrinfo *res) {
+    s->state = S_CONNECT;
+    s->ai = res;
+    if (!res || !(s->race = malloc(sizeof(*s->race)))) {
+        log_msg(1, "event: cannot resolve %s", s_conf->fwd_host);
+        sess_close(s);
+        return;
+    }
+    net_race_init(s->race, res, EVSRV_CONNECT_MS);
+    s->race->watch = race_watch;
+    s->race->unwatch = race_unwatch;
+    s->race->ctx = s;
+    connect_step(s);
+}
+
+static void resolve_start(evs_sess_t *s) {
+    struct addrinfo *res = NULL;
+    int rc = dns_lookup(s_conf->fwd_host, s_conf->fwd_port, tag_of(s, SIDE_TARGET), &res);
+    if (rc == 0) {
+        s->state = S_RESOLVE;
+        return;
+    }
+    connect_start(s, rc < 0 ? NULL : res);
+}
+
+static void resolve_done(void) {
+    uint64_t tag;
+    struct addrinfo *res;
+    while (dns_next(&tag, &res) == 1) {
+        evs_sess_t *s = find(tag);
+        if (!s || s->state != S_RESOLVE) {
+            dns_free(res);
+            continue;
+        }
+        connect_start(s, res);
+    }
+}
+
+/* ──────────── Handshake ──────────── */
+
+static void kdf_done(void) {
+    char drain[64];
+    while (read(s_kdf_pipe[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&s_kdf_mu);
+    kdf_job_t *j = s_done;
+    s_done = NULL;
+    pthread_mutex_unlock(&s_kdf_mu);
+
+    while (j) {
+        kdf_job_t *next = j->next;
+        evs_sess_t *s = find(j->tag);
+        if (s && s->job == j) {
+            s->job = NULL;
+            s_nkdf--;
+            listen_update();
+            if (j->rc == 0 && (s->crypto = farm9crypt_session_new(j->key))) {
+                log_msg(2, "event: PFS session established (X25519 + PBKDF2)");
+                resolve_start(s);
+            } else {
+                sess_close(s);
+            }
+        }
+        secure_zero(j, sizeof(*j));
+        free(j);
+        j = next;
+    }
+}
+
+/* The client's public key, then the KDF off the loop */
+static void hello_read(evs_sess_t *s) {
+    ssize_t r = recv(s->fd, s->peer + s->got, sizeof(s->peer) - (size_t)s->got, 0);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (r <= 0) {
+        sess_close(s);
+        return;
+    }
+    s->got += (int)r;
+    if (s->got < (int)sizeof(s->peer)) return;
+
+    kdf_job_t *j = malloc(sizeof(*j));
+    int rc = j ? ecdhe_shared(s->eph, s->peer, j->secret) : -1;
+    if (!j) ecdhe_free_key(s->eph);
+    s->eph = NULL;
+    if (rc < 0) {
+        free(j);
+        sess_close(s);
+        return;
+    }
+    j->tag = tag_of(s, SIDE_CLIENT);
+    memcpy(j->srv_pub, s->pub, 32);
+    memcpy(j->cli_pub, s->peer, 32);
+    timed_unlink(s);
+    s->state = S_KDF;
+    /* Still watched for reading, to notice a client that leaves */
+    kdf_submit(s, j);
+}
+
+static void hello_start(int fd) {
+    set_nonblock(fd);
+    evs_sess_t *s = sess_new();
+    if (!s) {
+        close(fd);
+        return;
+    }
+    s->fd = fd;
+    if (g_verbose) log_peer(fd);
+    /* 32 bytes into an empty send buffer are never short */
+    s->eph = ecdhe_keygen(s->pub);
+    if (!s->eph || send(fd, s->pub, sizeof(s->pub), MSG_NOSIGNAL) != (ssize_t)sizeof(s->pub) ||
+        ev_add(s_ev, fd, EV_READ, tag_of(s, SIDE_CLIENT)) < 0) {
+        sess_close(s);
+        return;
+    }
+    s->fd_ev = EV_READ;
+    timed_set(s, s_now + EVSRV_HELLO_MS);
+}
+
+/* ──────────── Loop ──────────── */
+
+static void accept_clients(int lfd) {
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd >= 0) {
+            hello_start(fd);
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            /* Level-triggered: the listener would wake us at once again */
+            log_msg(1, "event: %s at %d sessions, pausing accepts", strerror(errno), s_nsess);
+            s_accept_at = s_now + EVSRV_RETRY_MS;
+            listen_update();
+        }
+        return;
+    }
+}
+
+static void expire(void) {
+    s_next_due = -1;
+    evs_sess_t *next;
+    for (evs_sess_t *s = s_timed; s; s = next) {
+        next = s->tnext;
+        if (s->due > s_now) {
+            if (s_next_due < 0 || s->due < s_next_due) s_next_due = s->due;
+            continue;
+        }
+        if (s->state == S_HELLO) {
+            log_msg(1, "event: no handshake from client in time");
+            sess_close(s);
+        } else {
+            connect_step(s);
+        }
+    }
+}
+
+/* The client socket before the relay: only a client that leaves matters
+ * (its queued KDF is then skipped); early data waits in the socket */
+static void wait_event(evs_sess_t *s, int events) {
+    char c;
+    ssize_t r = (events & EV_HUP) ? 0 : recv(s->fd, &c, 1, MSG_PEEK);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (r <= 0) {
+        log_msg(2, "event: client left during the handshake");
+        sess_close(s);
+        return;
+    }
+    if (ev_mod(s_ev, s->fd, 0, tag_of(s, SIDE_CLIENT)) < 0) sess_close(s);
+    else s->fd_ev = 0;
+}
+
+static void on_event(uint64_t tag, int events) {
+    evs_sess_t *s = find(tag);
+    if (!s) return;
+    int side = (int)(tag & 1);
+    switch (s->state) {
+    case S_HELLO:
+        hello_read(s);
+        return;
+    case S_CONNECT:
+        if (side == SIDE_TARGET) {
+            connect_step(s);
+            return;
+        }
+        /* fall through */
+    case S_KDF:
+    case S_RESOLVE:
+        wait_event(s, events);
+        return;
+    }
+    if (relay_event(s, side, events) < 0) sess_close(s);
+}
+
+int evsrv_loop(int listen_fd, const evsrv_conf_t *conf) {
+    s_conf = conf;
+    s_listen_fd = listen_fd;
+    s_listen_ev = EV_READ;
+    ev_raise_nofile();
+    set_nonblock(listen_fd);
+    s_ev = ev_new();
+    if (!s_ev || kdf_start() < 0 ||
+        ev_add(s_ev, listen_fd, EV_READ, TAG_LISTEN) < 0 ||
+        ev_add(s_ev, s_kdf_pipe[0], EV_READ, TAG_KDF) < 0 ||
+        dns_fd() < 0 || ev_add(s_ev, dns_fd(), EV_READ, TAG_DNS) < 0)
+        return -1;
+
+    ev_event_t evs[EVSRV_EVENTS];
+    for (;;) {
+        s_now = mono_ms();
+        int timeout = -1;
+        if (s_next_due >= 0)
+            timeout = s_next_due > s_now ? (int)(s_next_due - s_now) : 0;
+        if (s_accept_at >= 0) {
+            int left = s_accept_at > s_now ? (int)(s_accept_at - s_now) : 0;
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+
+        int n = ev_wait(s_ev, evs, EVSRV_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s_now = mono_ms();
+        if (s_accept_at >= 0 && s_now >= s_accept_at) {
+            s_accept_at = -1;
+            listen_update();
+        }
+        if (s_next_due >= 0 && s_now >= s_next_due) expire();
+
+        for (int i = 0; i < n; i++) {
+            if (evs[i].tag == TAG_LISTEN) accept_clients(listen_fd);
+            else if (evs[i].tag == TAG_KDF) kdf_done();
+            else if (evs[i].tag == TAG_DNS) resolve_done();
+            else on_event(evs[i].tag, evs[i].events);
+        }
+    }
+}
+
+/* ──────────── One loop per process ──────────── */
+
+static pid_t s_pids[EVSRV_MAX];
+static int s_nloops = 0;
+
+typedef struct {
+    const int *fds;
+    int n;
+    const evsrv_conf_t *conf;
+} evsrv_run_t;
+
+static int loop_want(int slot, void *arg) {
+    (void)arg;
+    return s_pids[slot] == 0;
+}
+
+static void loop_child(int slot, void *arg) {
+    evsrv_run_t *r = arg;
+    for (int k = 0; k < r->n; k++)
+        if (r->fds[k] != r->fds[slot]) close(r->fds[k]);
+    evsrv_loop(r->fds[slot], r->conf);
+    perror("event loop");
+    _exit(1);
+}
+
+static void loop_forked(int slot, pid_t pid, void *arg) {
+    (void)arg;
+    if (pid < 0) return;
+    s_pids[slot] = pid;
+    log_msg(2, "event: loop pid=%d on listener %d", (int)pid, slot);
+}
+
+static int loop_reaped(pid_t pid, int status, void *arg) {
+    (void)status;
+    (void)arg;
+    for (int i = 0; i < s_nloops; i++) {
+        if (s_pids[i] != pid) continue;
+        /* Its sessions are gone with it; the listener is not */
+        log_msg(1, "event: loop pid=%d died, restarting", (int)pid);
+        s_pids[i] = 0;
+        return i;
+    }
+    return -1;
+}
+
+static void kill_loops(void *arg) {
+    (void)arg;
+    for (int i = 0; i < s_nloops; i++)
+        if (s_pids[i] > 0) kill(s_pids[i], SIGTERM);
+}
+
+void evsrv_run(const int *fds, int n, const evsrv_conf_t *conf) {
+    if (n == 1) {
+        log_msg(1, "event: one loop, no fork per client");
+        if (evsrv_loop(fds[0], conf) < 0)
+            fatal("event loop: %s", strerror(errno));
+        return;
+    }
+
+    s_nloops = n;
+    evsrv_run_t run = { fds, n, conf };
+    log_msg(1, "event: %d loops, no fork per client", n);
+    respawn_ops_t ops = {
+        .nslots = n, .retry_ms = EVSRV_RETRY_MS, .event_fd = -1,
+        .want = loop_want, .child = loop_child, .forked = loop_forked,
+        .reaped = loop_reaped, .stop = kill_loops, .ctx = &run,
+    };
+    respawn_loop(&ops);
+}
@@ -0,0 +1,52 @@
+#ifndef CLAWSEC_EVSRV_H
+#define CLAWSEC_EVSRV_H
+
+/*
+ * Event-driven -K server (--event): one process carries every session on
+ * its listener, with no fork per client. Each session is a small state
+ * machine driven by one event loop (ev.c):
+ *
+ *   HELLO    server public key sent, waiting for the client's
+ *   KDF      password KDF running on a worker thread
+ *   RESOLVE  looking up the -L target (dns.c)
+ *   CONNECT  racing its addresses (net.h)
+ *   RELAY    frames <-> target bytes, both sockets non-blocking
+ *
+ * The KDF (Argon2id, or PBKDF2) is the only step slow enough to stall the
+ * loop, so it runs on EVSRV_KDF_THREADS threads per loop. A client that
+ * leaves while its KDF is queued costs none, and with EVSRV_KDF_QUEUE
+ * sessions waiting for it the loop stops accepting until one is done, as
+ * it does when out of descriptors.
+ *
+ * Keys and frame counters live in the session (farm9crypt_session_*), not
+ * in the process-wide state the fork-per-client server uses, which is why
+ * only plain TCP sessions forwarding to -L are carried here: TLS
+ * camouflage, TOFU, --pq, the mux (--socks, -R) and --tun keep their
+ * per-process state.
+ *
+ * An idle session costs its descriptors and kernel socket buffers plus
+ * one evsrv session and two AES-GCM keys; buffers are only allocated
+ * while a write is short. With n > 1 each loop runs in its own process
+ * on its own SO_REUSEPORT listener, one per CPU by default.
+ */
+
+#define EVSRV_MAX           64      /* loops */
+#define EVSRV_KDF_THREADS   2       /* per loop */
+#define EVSRV_KDF_QUEUE     64      /* sessions at the KDF before accepts pause */
+#define EVSRV_HELLO_MS      10000   /* client key must come in this long */
+#define EVSRV_CONNECT_MS    5000    /* per target address, as net_connect */
+#define EVSRV_RETRY_MS      1000    /* accept after running out of fds; respawn */
+
+typedef struct {
+    const char *password;
+    const char *fwd_host, *fwd_port;
+} evsrv_conf_t;
+
+/* Serve on listen_fd in this process. Returns only on a fatal error. */
+int evsrv_loop(int listen_fd, const evsrv_conf_t *conf);
+
+/* Serve forever with a loop on each of fds[0..n-1]: in this process if
+ * n is 1, else one process per loop, respawned if it dies */
+void evsrv_run(const int *fds, int n, const evsrv_conf_t *conf);
+
+#endif
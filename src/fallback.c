@@ -9,17 +9,26 @@
  *
  * The fallback server is a real website (nginx, apache, etc.) that
  * serves legitimate content. DPI sees a real HTTPS site on the port.
+ *
+ * With kernel TLS offload the proxy never touches the payload: when the
+ * kernel handles both record directions the pair is relayed by fwd_pair()
+ * with splice(2); with send offload only, site → client is still spliced
+ * straight into the TLS socket and encrypted by the kernel.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <poll.h>
 
 #include "fallback.h"
+#include "fwd.h"
 #include "obfs.h"
 #include "net.h"
 #include "util.h"
@@ -43,6 +52,16 @@ int fallback_check_knock(int fd) {
     return 0;  /* foreign probe */
 }
 
+/* Hand plaintext already buffered inside OpenSSL to the site */
+static int drain_tls_pending(int client_fd, int target_fd, char *buf, size_t buflen) {
+    while (obfs_tls_pending() > 0) {
+        int n = obfs_recv(client_fd, buf, buflen);
+        if (n <= 0) return -1;
+        if (write_all(target_fd, buf, (size_t)n) < 0) return -1;
+    }
+    return 0;
+}
+
 int fallback_proxy(int client_fd, const char *fallback_host,
                    const char *fallback_port,
                    const void *peeked, size_t peeked_len) {
@@ -62,39 +81,60 @@ int fallback_proxy(int client_fd, const char *fallback_host,
         }
     }
 
-    /* Bidirectional relay: client_fd (TLS) <-> target_fd (plain) */
     char buf[8192];
-    for (;;) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(client_fd, &rfds);
-        FD_SET(target_fd, &rfds);
-        int nfds = client_fd > target_fd ? client_fd : target_fd;
+    if (drain_tls_pending(client_fd, target_fd, buf, sizeof(buf)) < 0) {
+        close(target_fd);
+        return -1;
+    }
+
+    /* Kernel owns both TLS directions: the socket pair is plain to us */
+    int tls = obfs_get_mode() == OBFS_TLS;
+    if (tls && obfs_ktls_send_active() && obfs_ktls_recv_active()) {
+        log_msg(2, "fallback: zero-copy relay (kTLS both ways)");
+        fwd_pair(client_fd, target_fd, FALLBACK_IDLE_SECS);
+        close(target_fd);
+        return 0;
+    }
+
+    /* Client -> site still decrypts in OpenSSL; site -> client can splice */
+    int pipefd[2] = { -1, -1 };
+    if (tls && obfs_ktls_send_active())
+        fwd_pipe_open(pipefd);
 
-        struct timeval tv;
-        tv.tv_sec = 30;  /* timeout idle probes */
-        tv.tv_usec = 0;
+    for (;;) {
+        struct pollfd pfd[2];
+        pfd[0].fd = client_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = target_fd;
+        pfd[1].events = POLLIN;
 
-        int ret = select(nfds + 1, &rfds, NULL, NULL, &tv);
+        int ret = poll(pfd, 2, FALLBACK_IDLE_SECS * 1000);
         if (ret < 0) {
             if (errno == EINTR) continue;
             break;
         }
         if (ret == 0) break; /* idle timeout */
 
-        if (FD_ISSET(client_fd, &rfds)) {
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
             int n = obfs_recv(client_fd, buf, sizeof(buf));
             if (n <= 0) break;
             if (write_all(target_fd, buf, (size_t)n) < 0) break;
+            if (drain_tls_pending(client_fd, target_fd, buf, sizeof(buf)) < 0) break;
         }
 
-        if (FD_ISSET(target_fd, &rfds)) {
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (pipefd[0] >= 0) {
+                if (fwd_move(target_fd, client_fd, pipefd, buf, sizeof(buf)) <= 0)
+                    break;
+                continue;
+            }
             ssize_t n = read(target_fd, buf, sizeof(buf));
             if (n <= 0) break;
             if (obfs_send(client_fd, buf, (size_t)n) < 0) break;
         }
     }
 
+    fwd_pipe_close(pipefd);
     close(target_fd);
     return 0;
 }
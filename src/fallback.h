@@ -13,6 +13,9 @@
 #define FALLBACK_KNOCK_MAGIC "CLAW"
 #define FALLBACK_KNOCK_SIZE  4
 
+/* Proxied probes are dropped after this long without traffic */
+#define FALLBACK_IDLE_SECS   30
+
 /* Send knock from client side (through TLS/obfs layer) */
 int fallback_send_knock(int fd);
 
@@ -12,7 +12,10 @@
  *  - Comprehensive error handling
  *
  *  Protocol format:
- *  [MAGIC:4][VERSION:2][FLAGS:2][LENGTH:4][IV:12][TAG:16][CIPHERTEXT:variable]
+ *  [MAGIC:4][VERSION:2][FLAGS:2][SEQ:4][LENGTH:4][IV:12][TAG:16][CIPHERTEXT:variable]
+ *
+ *  After farm9crypt_tls_bind() (--tls-bind) the session runs inside TLS:
+ *  [MAGIC:4][VERSION:2][FLAGS=PLAIN:2][SEQ:4][LENGTH:4][PAYLOAD:variable]
  */
 
 #ifndef WIN32
@@ -26,6 +29,9 @@
 #include <openssl/rand.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/crypto.h>
 #include <arpa/inet.h>
 #else
 #include <fcntl.h>
@@ -48,10 +54,11 @@ extern "C"
 struct __attribute__((packed)) farm9_header {
     uint32_t magic;      /* FARM9_MAGIC */
     uint16_t version;    /* FARM9_VERSION */
-    uint16_t flags;      /* Reserved for future use */
+    uint16_t flags;      /* FARM9_FLAG_* (0 for ordinary AEAD frames) */
     uint32_t seq_num;    /* Message sequence number (replay protection) */
     uint32_t length;     /* Ciphertext length */
 };
+static_assert(sizeof(struct farm9_header) == FARM9_HDR_LEN, "FARM9_HDR_LEN");
 
 static int debug = false;
 static int initialized = false;
@@ -61,6 +68,7 @@ static AESGCM* encryptor = NULL;
 static unsigned char derived_key[32];
 static uint64_t send_seq = 0;    /* Outgoing message sequence counter */
 static uint64_t recv_seq = 0;    /* Expected incoming sequence counter */
+static int bound = false;        /* TLS-bound: frames carry no inner AEAD */
 
 /* Secure memory cleanup */
 static void secure_zero(void* ptr, size_t len) {
@@ -161,6 +169,7 @@ static int ecdhe_finalize(unsigned char key[32], const char *label) {
         return -1;
     }
     initialized = true;
+    bound = false;
     send_seq = 0;
     recv_seq = 0;
     if (debug) fprintf(stderr, "[%s] PFS session established\n", label);
@@ -222,6 +231,7 @@ extern "C" void farm9crypt_cleanup() {
     send_seq = 0;
     recv_seq = 0;
     initialized = false;
+    bound = false;
     if (debug) fprintf(stderr, "[CRYPT] Cleanup complete\n");
 }
 
@@ -269,7 +279,8 @@ static int recv_exact(int sockfd, void* buf, size_t len) {
     return total;
 }
 
-extern "C" int farm9crypt_read(int sockfd, char* buf, int size) {
+/* Read and decrypt one AEAD frame; *flags receives the header flags */
+static int read_frame(int sockfd, char* buf, int size, uint16_t* flags) {
     if (!initialized) {
         if (debug) fprintf(stderr, "[CRYPT] Error: Not initialized\n");
         errno = EINVAL;
@@ -356,6 +367,7 @@ extern "C" int farm9crypt_read(int sockfd, char* buf, int size) {
         errno = EPROTONOSUPPORT;
         return -1;
     }
+    *flags = ntohs(header.flags);
 
     /* Validate sequence number (replay protection) */
     uint32_t msg_seq = ntohl(header.seq_num);
@@ -391,6 +403,53 @@ extern "C" int farm9crypt_read(int sockfd, char* buf, int size) {
     return plaintext_len;
 }
 
+/* Bound session: one TLS-protected frame, payload in the clear */
+static int read_bound(int sockfd, char* buf, int size) {
+    unsigned char frame[sizeof(struct farm9_header) + FARM9_MAX_MSG];
+    struct farm9_header header;
+    int flen = obfs_recv(sockfd, frame, sizeof(frame));
+    if (flen <= 0) return flen;
+    if ((size_t)flen < sizeof(header)) { errno = EPROTO; return -1; }
+    memcpy(&header, frame, sizeof(header));
+
+    uint32_t len = ntohl(header.length);
+    if (ntohl(header.magic) != FARM9_MAGIC || ntohs(header.version) != FARM9_VERSION ||
+        ntohs(header.flags) != FARM9_FLAG_PLAIN) {
+        if (debug) fprintf(stderr, "[CRYPT] Error: Unexpected frame in bound session\n");
+        errno = EPROTO;
+        return -1;
+    }
+    if (len == 0 || len != (size_t)flen - sizeof(header) || len > (uint32_t)size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (ntohl(header.seq_num) != (uint32_t)recv_seq) {
+        if (debug) fprintf(stderr, "[CRYPT] Error: Sequence mismatch in bound session\n");
+        errno = EPROTO;
+        return -1;
+    }
+    recv_seq++;
+    memcpy(buf, frame + sizeof(header), len);
+    return (int)len;
+}
+
+extern "C" int farm9crypt_read(int sockfd, char* buf, int size) {
+    if (bound) {
+        if (!buf || size <= 0) { errno = EINVAL; return -1; }
+        return read_bound(sockfd, buf, size);
+    }
+
+    uint16_t flags = 0;
+    int n = read_frame(sockfd, buf, size, &flags);
+    if (n > 0 && flags != 0) {
+        /* Bind confirmations and plain frames are only valid where expected */
+        if (debug) fprintf(stderr, "[CRYPT] Error: Unexpected frame flags 0x%04x\n", flags);
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
 /* Secure send - ensures all data is sent or returns error */
 static int send_exact(int sockfd, const void* buf, size_t len) {
     size_t total = 0;
@@ -408,7 +467,8 @@ static int send_exact(int sockfd, const void* buf, size_t len) {
     return total;
 }
 
-extern "C" int farm9crypt_write(int sockfd, char* buf, int size) {
+/* Encrypt and send one AEAD frame with the given header flags */
+static int write_frame(int sockfd, const char* buf, int size, uint16_t flags) {
     if (!initialized) {
         if (debug) fprintf(stderr, "[CRYPT] Error: Not initialized\n");
         errno = EINVAL;
@@ -435,7 +495,7 @@ extern "C" int farm9crypt_write(int sockfd, char* buf, int size) {
     int ciphertext_len;
 
     bool ok = encryptor->encrypt(
-        reinterpret_cast<unsigned char*>(buf), size,
+        reinterpret_cast<const unsigned char*>(buf), size,
         ciphertext,
         iv, FARM9_IV_LEN,
         tag, FARM9_TAG_LEN,
@@ -452,7 +512,7 @@ extern "C" int farm9crypt_write(int sockfd, char* buf, int size) {
     struct farm9_header header;
     header.magic = htonl(FARM9_MAGIC);
     header.version = htons(FARM9_VERSION);
-    header.flags = htons(0);
+    header.flags = htons(flags);
     header.seq_num = htonl((uint32_t)send_seq);
     header.length = htonl(ciphertext_len);
     send_seq++;
@@ -496,3 +556,200 @@ extern "C" int farm9crypt_write(int sockfd, char* buf, int size) {
 
     return size;  /* Return original plaintext size */
 }
+
+/* Bound session: header + payload as one TLS record, no inner AEAD */
+static int write_bound(int sockfd, const char* buf, int size) {
+    unsigned char frame[sizeof(struct farm9_header) + FARM9_MAX_MSG];
+    struct farm9_header header;
+    header.magic = htonl(FARM9_MAGIC);
+    header.version = htons(FARM9_VERSION);
+    header.flags = htons(FARM9_FLAG_PLAIN);
+    header.seq_num = htonl((uint32_t)send_seq);
+    header.length = htonl((uint32_t)size);
+    send_seq++;
+
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), buf, (size_t)size);
+    if (obfs_send(sockfd, frame, sizeof(header) + (size_t)size) < 0) return -1;
+    return size;
+}
+
+extern "C" int farm9crypt_write(int sockfd, char* buf, int size) {
+    if (bound) {
+        if (!buf || size <= 0 || size > FARM9_MAX_MSG) { errno = EINVAL; return -1; }
+        return write_bound(sockfd, buf, size);
+    }
+    return write_frame(sockfd, buf, size, 0);
+}
+
+/*
+ * TLS channel binding (--tls-bind).
+ *
+ * Each side computes confirm = HMAC-SHA256(session_key, role || exporter)
+ * over the TLS exporter secret and sends it in an AEAD frame flagged
+ * FARM9_FLAG_BIND, server first. A matching confirm proves the peer knows
+ * the password-derived ECDHE key AND terminates the same TLS session —
+ * a proxy running separate TLS sessions towards each side sees two
+ * different exporters and cannot forge either confirm. Only then do both
+ * sides rekey to HKDF(session_key, exporter) and drop the inner AEAD,
+ * leaving confidentiality and integrity to the TLS record layer.
+ */
+static const char bind_label[] = "EXPORTER-clawsec-tls-bind";
+
+static int bind_confirm(const unsigned char ekm[32], int server_role,
+                        unsigned char out[32]) {
+    unsigned char msg[1 + 32];
+    msg[0] = server_role ? 'S' : 'C';
+    memcpy(msg + 1, ekm, 32);
+    unsigned int len = 32;
+    return HMAC(EVP_sha256(), derived_key, sizeof(derived_key),
+                msg, sizeof(msg), out, &len) ? 0 : -1;
+}
+
+static int bind_rekey(const unsigned char ekm[32], unsigned char key_out[32]) {
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (!pctx) return -1;
+    size_t len = 32;
+    int ok = EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_salt(pctx, ekm, 32) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_key(pctx, derived_key, sizeof(derived_key)) > 0 &&
+             EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)bind_label,
+                                         sizeof(bind_label) - 1) > 0 &&
+             EVP_PKEY_derive(pctx, key_out, &len) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+}
+
+extern "C" int farm9crypt_tls_bind(int sockfd, int server_mode) {
+    if (!initialized || bound || udp_mode || !obfs_uses_tls()) {
+        if (debug) fprintf(stderr, "[TLS-BIND] Error: needs an ECDHE session inside TLS\n");
+        return -1;
+    }
+
+    unsigned char ekm[32], mine[32], expect[32], got[64];
+    if (obfs_tls_exporter(bind_label, ekm, sizeof(ekm)) < 0 ||
+        bind_confirm(ekm, server_mode, mine) < 0 ||
+        bind_confirm(ekm, !server_mode, expect) < 0) {
+        secure_zero(ekm, sizeof(ekm));
+        return -1;
+    }
+
+    int n = 0;
+    uint16_t flags = 0;
+    if (server_mode) {
+        if (write_frame(sockfd, (const char *)mine, 32, FARM9_FLAG_BIND) != 32 ||
+            (n = read_frame(sockfd, (char *)got, sizeof(got), &flags)) != 32)
+            n = -1;
+    } else {
+        if ((n = read_frame(sockfd, (char *)got, sizeof(got), &flags)) != 32)
+            n = -1;
+    }
+
+    int rc = -1;
+    if (n == 32 && flags == FARM9_FLAG_BIND && CRYPTO_memcmp(got, expect, 32) == 0) {
+        if (server_mode || write_frame(sockfd, (const char *)mine, 32, FARM9_FLAG_BIND) == 32)
+            rc = 0;
+    } else if (debug) {
+        fprintf(stderr, "[TLS-BIND] Error: peer is not bound to this TLS session\n");
+    }
+
+    unsigned char key[32];
+    if (rc == 0 && bind_rekey(ekm, key) == 0 && ecdhe_finalize(key, "TLS-BIND") == 0)
+        bound = true;
+    else
+        rc = -1;
+
+    secure_zero(ekm, sizeof(ekm));
+    secure_zero(mine, sizeof(mine));
+    secure_zero(expect, sizeof(expect));
+    return rc;
+}
+
+extern "C" int farm9crypt_tls_bound() {
+    return bound;
+}
+
+/*
+ * Per-session state (-K --event): the same AEAD frames, with the keys and
+ * counters in the session instead of the globals above.
+ */
+struct farm9_session {
+    AESGCM *enc;
+    AESGCM *dec;
+    uint32_t send_seq;
+    uint32_t recv_seq;
+};
+
+extern "C" farm9_session_t *farm9crypt_session_new(const unsigned char *key) {
+    farm9_session_t *s = new farm9_session_t;
+    s->enc = new AESGCM(key, 32);
+    s->dec = new AESGCM(key, 32);
+    s->send_seq = 0;
+    s->recv_seq = 0;
+    return s;
+}
+
+extern "C" void farm9crypt_session_free(farm9_session_t *s) {
+    if (!s) return;
+    delete s->enc;
+    delete s->dec;
+    delete s;
+}
+
+extern "C" int farm9crypt_session_seal(farm9_session_t *s, const char *buf, int size,
+                                       unsigned char *out) {
+    if (!buf || size <= 0 || size > FARM9_MAX_MSG) { errno = EINVAL; return -1; }
+
+    unsigned char *iv = out + sizeof(struct farm9_header);
+    unsigned char *tag = iv + FARM9_IV_LEN;
+    unsigned char *ct = tag + FARM9_TAG_LEN;
+    int ct_len;
+    if (RAND_bytes(iv, FARM9_IV_LEN) != 1 ||
+        !s->enc->encrypt(reinterpret_cast<const unsigned char*>(buf), size, ct,
+                         iv, FARM9_IV_LEN, tag, FARM9_TAG_LEN, ct_len)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct farm9_header header;
+    header.magic = htonl(FARM9_MAGIC);
+    header.version = htons(FARM9_VERSION);
+    header.flags = 0;
+    header.seq_num = htonl(s->send_seq++);
+    header.length = htonl((uint32_t)ct_len);
+    memcpy(out, &header, sizeof(header));
+    return (int)(sizeof(header) + FARM9_IV_LEN + FARM9_TAG_LEN) + ct_len;
+}
+
+extern "C" int farm9crypt_session_open(farm9_session_t *s, const unsigned char *in,
+                                       size_t len, char *out, int *out_len) {
+    const size_t pre = sizeof(struct farm9_header) + FARM9_IV_LEN + FARM9_TAG_LEN;
+    struct farm9_header header;
+    if (len < sizeof(header)) return 0;
+    memcpy(&header, in, sizeof(header));
+
+    /* Checked before waiting for the rest, so garbage is dropped at once */
+    uint32_t ct_len = ntohl(header.length);
+    if (ntohl(header.magic) != FARM9_MAGIC || ntohs(header.version) != FARM9_VERSION ||
+        header.flags != 0 || ct_len == 0 || ct_len > FARM9_MAX_MSG) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (len < pre + ct_len) return 0;
+
+    if (ntohl(header.seq_num) != s->recv_seq) {
+        errno = EPROTO;
+        return -1;
+    }
+    const unsigned char *iv = in + sizeof(header);
+    const unsigned char *tag = iv + FARM9_IV_LEN;
+    if (!s->dec->decrypt(tag + FARM9_TAG_LEN, (int)ct_len, iv, FARM9_IV_LEN,
+                         tag, FARM9_TAG_LEN, reinterpret_cast<unsigned char*>(out),
+                         *out_len)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    s->recv_seq++;
+    return (int)(pre + ct_len);
+}
@@ -39,6 +39,17 @@ int farm9crypt_init_ecdhe_tofu(int sockfd, const char* password, size_t pass_len
 int farm9crypt_init_ecdhe_pq(int sockfd, const char* password, size_t pass_len,
                               int server_mode, const char *peer_host, const char *peer_port);
 
+/* TLS channel binding (--tls-bind), called right after an ECDHE init on
+ * both ends while --obfs tls/h2 is active. Exchanges HMAC confirmations
+ * over the TLS exporter secret; on success the session is rekeyed with it
+ * and frames carry only [header][payload] — TLS provides confidentiality
+ * and integrity, the inner AES-GCM pass is skipped.
+ * Returns 0 on success, -1 if not in TLS or the peer is on another session. */
+int farm9crypt_tls_bind(int sockfd, int server_mode);
+
+/* True once farm9crypt_tls_bind() succeeded for the current session */
+int farm9crypt_tls_bound();
+
 /* Set UDP datagram mode (must be called before read/write) */
 void farm9crypt_set_udp_mode(int enabled);
 
@@ -72,6 +83,29 @@ int farm9crypt_export_key(unsigned char *out, size_t len);
 /* Returns bytes written, or -1 on error */
 int farm9crypt_get_fingerprint(unsigned char *out, size_t len);
 
+/*
+ * Per-session state, for a process that carries many sessions at once
+ * (-K --event). Frames are those farm9crypt_read/write use on a plain
+ * TCP ECDHE session; the caller does the socket I/O, so nothing here
+ * blocks.
+ */
+typedef struct farm9_session farm9_session_t;
+
+/* Session keyed with a 32-byte ECDHE session key. NULL on error. */
+farm9_session_t *farm9crypt_session_new(const unsigned char *key);
+void farm9crypt_session_free(farm9_session_t *s);
+
+/* Seal size (1..FARM9_MAX_MSG) bytes as the next frame in out, which holds
+ * FARM9_FRAME_MAX. Returns the frame length, or -1. */
+int farm9crypt_session_seal(farm9_session_t *s, const char *buf, int size,
+                            unsigned char *out);
+
+/* Open the frame at the start of in[0..len) into out (FARM9_MAX_MSG).
+ * Returns the bytes of in it took, with its length in *out_len; 0 while
+ * the frame is incomplete; -1 if it is malformed, replayed or forged. */
+int farm9crypt_session_open(farm9_session_t *s, const unsigned char *in,
+                            size_t len, char *out, int *out_len);
+
 /* Protocol constants */
 #define FARM9_MAGIC 0x434C4157     /* "CLAW" */
 #define FARM9_VERSION 0x0001       /* Protocol version 1 */
@@ -79,4 +113,10 @@ int farm9crypt_get_fingerprint(unsigned char *out, size_t len);
 #define FARM9_TAG_LEN 16           /* AES-GCM auth tag length */
 #define FARM9_SALT_LEN 16          /* PBKDF2 salt length */
 #define FARM9_MAX_MSG 8192         /* Maximum message size */
+#define FARM9_HDR_LEN 16           /* magic, version, flags, seq, length */
+#define FARM9_FRAME_MAX (FARM9_HDR_LEN + FARM9_IV_LEN + FARM9_TAG_LEN + FARM9_MAX_MSG)
+
+/* Header flags */
+#define FARM9_FLAG_BIND  0x0001    /* AEAD frame carrying a TLS-bind confirm */
+#define FARM9_FLAG_PLAIN 0x0002    /* Bound session: payload in clear inside TLS */
 
@@ -0,0 +1,127 @@
+/*
+ * fwd.c — Zero-copy fd-pair forwarding for ClawSec
+ *
+ * Used where the bytes need no userspace processing: the fallback proxy
+ * (browser/probe <-> real website), with kTLS doing the TLS records.
+ *
+ * Each direction owns a pipe. splice(2) moves up to FWD_CHUNK bytes from
+ * the source socket into the pipe and from the pipe into the destination,
+ * as page references — the payload is never copied into our buffers.
+ * One poll() loop drives both directions and the idle timeout.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "fwd.h"
+#include "util.h"
+
+void fwd_pipe_open(int pipefd[2]) {
+#ifdef __linux__
+    if (pipe2(pipefd, O_CLOEXEC) == 0) return;
+#endif
+    pipefd[0] = pipefd[1] = -1;
+}
+
+void fwd_pipe_close(int pipefd[2]) {
+    if (pipefd[0] >= 0) close(pipefd[0]);
+    if (pipefd[1] >= 0) close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+}
+
+ssize_t fwd_move(int from_fd, int to_fd, int pipefd[2], void *buf, size_t buflen) {
+#ifdef __linux__
+    if (pipefd[0] >= 0) {
+        ssize_t n;
+        do {
+            n = splice(from_fd, NULL, pipefd[1], NULL, FWD_CHUNK, SPLICE_F_MOVE);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return n;
+
+        /* The pipe starts empty, so all n bytes are ours to push out */
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t w = splice(pipefd[0], NULL, to_fd, NULL, (size_t)left,
+                               SPLICE_F_MOVE);
+            if (w <= 0) {
+                if (w < 0 && errno == EINTR) continue;
+                return -1;
+            }
+            left -= w;
+        }
+        return n;
+    }
+#else
+    (void)pipefd;
+#endif
+    ssize_t n;
+    do {
+        n = read(from_fd, buf, buflen);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+    if (write_all(to_fd, buf, (size_t)n) < 0) return -1;
+    return n;
+}
+
+int fwd_pair(int a, int b, int idle_sec) {
+    int pipes[2][2];
+    int open_dir[2] = { 1, 1 };      /* [0]: a -> b, [1]: b -> a */
+    int from[2] = { a, b }, to[2] = { b, a };
+    char buf[8192];                  /* copy fallback only */
+    int rc = 0;
+
+    fwd_pipe_open(pipes[0]);
+    fwd_pipe_open(pipes[1]);
+
+    while (open_dir[0] || open_dir[1]) {
+        struct pollfd pfd[2];
+        int map[2], nfds = 0;
+        for (int d = 0; d < 2; d++) {
+            if (!open_dir[d]) continue;
+            pfd[nfds].fd = from[d];
+            pfd[nfds].events = POLLIN;
+            pfd[nfds].revents = 0;
+            map[nfds++] = d;
+        }
+
+        int ret = poll(pfd, (nfds_t)nfds, idle_sec > 0 ? idle_sec * 1000 : -1);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (ret == 0) {
+            rc = 1;   /* idle timeout */
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            int d = map[i];
+            ssize_t n = fwd_move(from[d], to[d], pipes[d], buf, sizeof(buf));
+            if (n < 0) {
+                rc = -1;
+                goto done;
+            }
+            if (n == 0) {
+                /* Half-close: the peer still gets to answer */
+                shutdown(to[d], SHUT_WR);
+                open_dir[d] = 0;
+            }
+        }
+    }
+
+done:
+    fwd_pipe_close(pipes[0]);
+    fwd_pipe_close(pipes[1]);
+    return rc;
+}
@@ -0,0 +1,40 @@
+#ifndef CLAWSEC_FWD_H
+#define CLAWSEC_FWD_H
+
+#include <sys/types.h>
+
+/*
+ * Zero-copy forwarding between file descriptors that need no userspace
+ * crypto: plain sockets, or a TLS socket whose records the kernel handles
+ * (kTLS). On Linux each direction moves data socket -> pipe -> socket with
+ * splice(2), so payload never crosses into userspace; elsewhere, or when
+ * no pipe can be made, a read/write copy is used instead.
+ */
+
+#define FWD_CHUNK 65536   /* bytes moved per step and direction */
+
+/*
+ * Open the splice pipe for one direction. On failure or without splice
+ * support both ends are set to -1 and fwd_move() copies through its buffer.
+ */
+void fwd_pipe_open(int pipefd[2]);
+void fwd_pipe_close(int pipefd[2]);
+
+/*
+ * Move one chunk from from_fd to to_fd — spliced through pipefd when it is
+ * open, otherwise read into buf and written out. Call when from_fd polls
+ * readable; blocks until the chunk is fully written.
+ * Returns bytes moved, 0 on EOF, -1 on error.
+ */
+ssize_t fwd_move(int from_fd, int to_fd, int pipefd[2], void *buf, size_t buflen);
+
+/*
+ * Relay a <-> b until both directions reach EOF. EOF on one side is passed
+ * on as shutdown(SHUT_WR) of the other, so half-closed protocols still
+ * finish. idle_sec > 0 ends the relay after that long with no traffic.
+ * Neither fd is closed.
+ * Returns 0 when both sides finished, 1 on idle timeout, -1 on error.
+ */
+int fwd_pair(int a, int b, int idle_sec);
+
+#endif
@@ -4,7 +4,22 @@
  * Multiplexes multiple logical streams over a single encrypted tunnel.
  * Used with -L port forwarding: multiple clients share one tunnel.
  *
- * Frame format: [stream_id(1)][type(1)][length(2 BE)][payload(N)]
+ * Frame format (v2): [version(1)][type(1)][length(2 BE)][stream_id(4 BE)][payload(N)]
+ *
+ * Streams live in a hash table keyed by id and every socket is watched by
+ * one event loop (ev.c), so a pass costs O(ready streams), not O(all).
+ * Closing is a CLOSE from each side; the opener recycles the id once it
+ * has both, so a long-lived tunnel never runs out of stream ids.
+ *
+ * The server connects to the target without blocking: the client may send
+ * DATA right after OPEN, the server holds it until the connect finishes
+ * and answers OPEN_OK, or CLOSE when no address could be reached.
+ *
+ * The same loop carries SOCKS5 (socks5.c): the client negotiates with each
+ * application itself and its OPEN names the target, which the server
+ * connects to per stream instead of a fixed -L target. A UDP ASSOCIATE
+ * stream carries datagrams instead, as MUX_DGRAM frames outside the
+ * stream windows.
  */
 
 #define _POSIX_C_SOURCE 200809L
@@ -13,267 +28,1742 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 
 #include "mux.h"
+#include "ev.h"
 #include "farm9crypt.h"
 #include "util.h"
 #include "net.h"
 #include "obfs.h"
 #include "relay.h"
+#include "socks5.h"
+#include "dns.h"
 
 int g_mux = 0;
+int g_mux_pool = 0;
+int g_mux_udp_idle_ms = MUX_UDP_IDLE_MS;
 
-int mux_encode_header(unsigned char *buf, unsigned char stream_id,
+int mux_encode_header(unsigned char *buf, uint32_t stream_id,
                       unsigned char type, unsigned short length) {
-    buf[0] = stream_id;
+    buf[0] = MUX_VERSION;
     buf[1] = type;
     buf[2] = (length >> 8) & 0xFF;
     buf[3] = length & 0xFF;
+    buf[4] = (stream_id >> 24) & 0xFF;
+    buf[5] = (stream_id >> 16) & 0xFF;
+    buf[6] = (stream_id >> 8) & 0xFF;
+    buf[7] = stream_id & 0xFF;
     return MUX_HDR_SIZE;
 }
 
 int mux_decode_header(const unsigned char *buf, mux_header_t *hdr) {
-    hdr->stream_id = buf[0];
+    if (buf[0] != MUX_VERSION) return -1;
     hdr->type = buf[1];
     hdr->length = ((unsigned short)buf[2] << 8) | buf[3];
+    hdr->stream_id = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) |
+                     ((uint32_t)buf[6] << 8) | buf[7];
     if (hdr->length > MUX_MAX_PAYLOAD) return -1;
     return 0;
 }
 
-int mux_write_frame(int sockfd, unsigned char stream_id,
+/* Record out: through the jitter queue when --jitter is on */
+static int send_record(int sockfd, const unsigned char *rec, size_t len) {
+    if (g_jitter > 0)
+        return obfs_jq_push(sockfd, rec, len, g_jitter) == (int)len ? 0 : -1;
+    return farm9crypt_write(sockfd, (char *)rec, (int)len) == (int)len ? 0 : -1;
+}
+
+int mux_write_frame(int sockfd, uint32_t stream_id,
                     unsigned char type, const void *data, size_t len) {
     if (len > MUX_MAX_PAYLOAD) return -1;
 
-    char frame[MUX_HDR_SIZE + MUX_MAX_PAYLOAD];
-    mux_encode_header((unsigned char *)frame, stream_id, type, (unsigned short)len);
+    unsigned char frame[MUX_FRAME_MAX];
+    mux_encode_header(frame, stream_id, type, (unsigned short)len);
     if (len > 0)
         memcpy(frame + MUX_HDR_SIZE, data, len);
 
-    int total = MUX_HDR_SIZE + (int)len;
+    return send_record(sockfd, frame, MUX_HDR_SIZE + len) < 0 ? -1 : (int)len;
+}
+
+/* Parse the frame at raw[0..avail). Returns its payload length, or -1. */
+static int parse_frame(const unsigned char *raw, size_t avail, mux_header_t *hdr,
+                       void *buf, size_t buflen) {
+    if (avail < MUX_HDR_SIZE) return -1;
+    if (mux_decode_header(raw, hdr) < 0) return -1;
+    if (hdr->length > avail - MUX_HDR_SIZE) return -1;
+    if (hdr->length > buflen) return -1;
 
-    if (g_jitter > 0) obfs_jitter(g_jitter);
+    if (hdr->length > 0)
+        memcpy(buf, raw + MUX_HDR_SIZE, hdr->length);
 
-    return farm9crypt_write(sockfd, frame, total) == total ? (int)len : -1;
+    return (int)hdr->length;
 }
 
 int mux_read_frame(int sockfd, mux_header_t *hdr, void *buf, size_t buflen) {
     memset(hdr, 0, sizeof(*hdr));
 
-    char raw[MUX_HDR_SIZE + MUX_MAX_PAYLOAD];
+    char raw[MUX_FRAME_MAX];
     int got = farm9crypt_read(sockfd, raw, sizeof(raw));
     if (got <= 0) return got;
 
-    if (got < MUX_HDR_SIZE) return -1;
+    return parse_frame((unsigned char *)raw, (size_t)got, hdr, buf, buflen);
+}
 
-    if (mux_decode_header((unsigned char *)raw, hdr) < 0) return -1;
-    if ((int)hdr->length > got - MUX_HDR_SIZE) return -1;
-    if (hdr->length > buflen) return -1;
+int mux_pack_frame(int sockfd, mux_rec_t *rec, uint32_t stream_id,
+                   unsigned char type, const void *data, size_t len) {
+    if (len > MUX_MAX_PAYLOAD) return -1;
+    if (rec->len + MUX_HDR_SIZE + len > MUX_FRAME_MAX &&
+        mux_pack_flush(sockfd, rec) < 0)
+        return -1;
 
-    if (hdr->length > 0)
-        memcpy(buf, raw + MUX_HDR_SIZE, hdr->length);
+    mux_encode_header(rec->buf + rec->len, stream_id, type, (unsigned short)len);
+    if (len > 0)
+        memcpy(rec->buf + rec->len + MUX_HDR_SIZE, data, len);
+    rec->len += MUX_HDR_SIZE + len;
+    return (int)len;
+}
 
-    return (int)hdr->length;
+int mux_pack_flush(int sockfd, mux_rec_t *rec) {
+    if (rec->len == 0) return 0;
+    int rc = send_record(sockfd, rec->buf, rec->len);
+    rec->len = 0;
+    return rc;
 }
 
-/* ──────────── Server-side mux relay ──────────── */
+int mux_unpack_frame(int sockfd, mux_rec_t *rec, mux_header_t *hdr,
+                     void *buf, size_t buflen) {
+    memset(hdr, 0, sizeof(*hdr));
 
-int mux_relay_server(int enc_fd, const char *fwd_host, const char *fwd_port) {
-    int streams[MUX_MAX_STREAMS];
-    memset(streams, -1, sizeof(streams));
+    if (rec->off >= rec->len) {
+        rec->off = rec->len = 0;
+        int got = farm9crypt_read(sockfd, (char *)rec->buf, sizeof(rec->buf));
+        if (got <= 0) return got;
+        rec->len = (size_t)got;
+    }
 
-    char buf[MUX_MAX_PAYLOAD];
+    int n = parse_frame(rec->buf + rec->off, rec->len - rec->off, hdr, buf, buflen);
+    if (n < 0) {
+        rec->off = rec->len;   /* the rest of the record cannot be framed */
+        return -1;
+    }
+    rec->off += MUX_HDR_SIZE + (size_t)n;
+    return n;
+}
 
-    log_msg(1, "mux: server relay -> %s:%s", fwd_host, fwd_port);
+/* ──────────── Stream table ──────────── */
 
-    for (;;) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(enc_fd, &rfds);
-        int nfds = enc_fd;
-
-        for (int i = 0; i < MUX_MAX_STREAMS; i++) {
-            if (streams[i] >= 0) {
-                FD_SET(streams[i], &rfds);
-                if (streams[i] > nfds) nfds = streams[i];
+#define MUX_TABLE_MIN  64
+#define MUX_ID_LIMIT   0xFFFFFFFEu   /* fresh ids stop below this */
+
+static uint32_t id_hash(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+int mux_table_init(mux_table_t *t, int odd) {
+    memset(t, 0, sizeof(*t));
+    t->slots = calloc(MUX_TABLE_MIN, sizeof(*t->slots));
+    if (!t->slots) return -1;
+    t->cap = MUX_TABLE_MIN;
+    t->next_id = odd ? 1 : 2;
+    return 0;
+}
+
+void mux_table_free(mux_table_t *t) {
+    for (uint32_t i = 0; i < t->cap; i++) {
+        if (!t->slots[i]) continue;
+        dns_free(t->slots[i]->ai);
+        free(t->slots[i]->race);
+        free(t->slots[i]->udp);
+        free(t->slots[i]->out);
+        free(t->slots[i]);
+    }
+    free(t->slots);
+    free(t->free_ids);
+    memset(t, 0, sizeof(*t));
+}
+
+static void table_place(mux_stream_t **slots, uint32_t cap, mux_stream_t *s) {
+    uint32_t i = id_hash(s->id) & (cap - 1);
+    while (slots[i])
+        i = (i + 1) & (cap - 1);
+    slots[i] = s;
+}
+
+static int table_grow(mux_table_t *t) {
+    uint32_t cap = t->cap * 2;
+    mux_stream_t **slots = calloc(cap, sizeof(*slots));
+    if (!slots) return -1;
+    for (uint32_t i = 0; i < t->cap; i++)
+        if (t->slots[i]) table_place(slots, cap, t->slots[i]);
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return 0;
+}
+
+static mux_stream_t *table_insert(mux_table_t *t, uint32_t id, int fd) {
+    /* Keep the load under 70% so probe runs stay short */
+    if ((uint64_t)(t->count + 1) * 10 > (uint64_t)t->cap * 7 && table_grow(t) < 0)
+        return NULL;
+    mux_stream_t *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->id = id;
+    s->fd = fd;
+    s->send_window = MUX_STREAM_WINDOW;
+    s->prio = MUX_PRIO_NORMAL;
+    table_place(t->slots, t->cap, s);
+    t->count++;
+    return s;
+}
+
+mux_stream_t *mux_table_find(const mux_table_t *t, uint32_t id) {
+    uint32_t i = id_hash(id) & (t->cap - 1);
+    while (t->slots[i]) {
+        if (t->slots[i]->id == id) return t->slots[i];
+        i = (i + 1) & (t->cap - 1);
+    }
+    return NULL;
+}
+
+mux_stream_t *mux_table_open(mux_table_t *t, int fd) {
+    if (t->nfree > 0) {
+        mux_stream_t *s = table_insert(t, t->free_ids[t->nfree - 1], fd);
+        if (s) t->nfree--;
+        return s;
+    }
+    if (t->next_id >= MUX_ID_LIMIT) return NULL;
+    mux_stream_t *s = table_insert(t, t->next_id, fd);
+    if (s) t->next_id += 2;
+    return s;
+}
+
+mux_stream_t *mux_table_add(mux_table_t *t, uint32_t id, int fd) {
+    if (id == 0 || (id & 1) == (t->next_id & 1)) return NULL;   /* not peer's */
+    if (mux_table_find(t, id)) return NULL;
+    return table_insert(t, id, fd);
+}
+
+void mux_table_remove(mux_table_t *t, mux_stream_t *s) {
+    uint32_t mask = t->cap - 1;
+    uint32_t i = id_hash(s->id) & mask;
+    while (t->slots[i] != s) {
+        if (!t->slots[i]) return;
+        i = (i + 1) & mask;
+    }
+
+    /* Backward-shift deletion: no tombstones to slow later probes */
+    t->slots[i] = NULL;
+    for (uint32_t j = (i + 1) & mask; t->slots[j]; j = (j + 1) & mask) {
+        uint32_t k = id_hash(t->slots[j]->id) & mask;
+        int stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (stays) continue;
+        t->slots[i] = t->slots[j];
+        t->slots[j] = NULL;
+        i = j;
+    }
+    t->count--;
+
+    if ((s->id & 1) == (t->next_id & 1)) {
+        if (t->nfree == t->free_cap) {
+            uint32_t cap = t->free_cap ? t->free_cap * 2 : 64;
+            uint32_t *ids = realloc(t->free_ids, cap * sizeof(*ids));
+            if (ids) {
+                t->free_ids = ids;
+                t->free_cap = cap;
             }
         }
+        if (t->nfree < t->free_cap)
+            t->free_ids[t->nfree++] = s->id;
+    }
+    dns_free(s->ai);
+    free(s->race);
+    free(s->udp);
+    free(s->out);
+    free(s);
+}
+
+/* ──────────── Stream classes by port ──────────── */
+
+#define MUX_PRIO_PORTS 32
+
+static struct { int port; int prio; } s_prio_ports[MUX_PRIO_PORTS];
+static int s_nprio_ports = 0;
+
+int mux_prio_parse(const char *spec) {
+    static const char *names[MUX_PRIO_CLASSES] = { "interactive", "normal", "bulk" };
+    char copy[512];
+    if (!spec || strlen(spec) >= sizeof(copy)) return -1;
+    strcpy(copy, spec);
+
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        char *end;
+        long port = strtol(item, &end, 10);
+        if (*item == '\0' || *end != '\0' || port < 1 || port > 65535) return -1;
+
+        int prio = -1;
+        for (int c = 0; c < MUX_PRIO_CLASSES; c++)
+            if (strcmp(eq + 1, names[c]) == 0) prio = c;
+        if (prio < 0 || s_nprio_ports == MUX_PRIO_PORTS) return -1;
+
+        s_prio_ports[s_nprio_ports].port = (int)port;
+        s_prio_ports[s_nprio_ports].prio = prio;
+        s_nprio_ports++;
+    }
+    return 0;
+}
+
+int mux_prio_for_port(int port) {
+    for (int i = 0; i < s_nprio_ports; i++)
+        if (s_prio_ports[i].port == port) return s_prio_ports[i].prio;
+    return -1;
+}
+
+/* ──────────── Relay event loop ──────────── */
+
+/* Event tags: stream ids go in as-is, the fixed fds above 32 bits */
+#define TAG_ENC     (1ULL << 32)
+#define TAG_LISTEN  (2ULL << 32)
+#define TAG_DNS     (3ULL << 32)
+#define TAG_RACE    (1ULL << 62)   /* | stream id: a connect attempt */
+#define TAG_UDP     (1ULL << 61)   /* | socket index << 32 | stream id */
+#define TAG_POOL    (1ULL << 60)   /* | pool slot: a warm target connection */
+#define MUX_EVENTS  256
+
+/* Unsent tunnel bytes the kernel may hold before we stop packing more: a
+ * deep socket buffer of bulk data would sit in front of every keystroke */
+#define MUX_NOTSENT_LOWAT (128 * 1024)
+
+/* Datagrams one readiness event may forward before others get a turn */
+#define MUX_UDP_BURST 64
+
+/* Per target address, as net_try_connect's timeout was */
+#define MUX_CONNECT_TIMEOUT_MS 5000
+
+#define MUX_S_SOCKS_NEGOTIATING (MUX_S_SOCKS_HELLO | MUX_S_SOCKS_REQUEST)
+
+/* Server: a target connect, raced over its addresses. Attempts carry their
+ * own tag (TAG_RACE for a stream's), so events of losers the race already
+ * closed are not taken for the winner's. */
+typedef struct mux_race {
+    net_race_t r;
+    ev_loop_t *ev;
+    uint64_t tag;
+} mux_race_t;
+
+/* Warm target connection: connecting (race), ready (fd), or neither */
+typedef struct {
+    int fd;
+    mux_race_t *race;
+    struct addrinfo *ai;     /* the race's addresses */
+    long long due_ms;        /* the race's next step, or end of life */
+} mux_pooled_t;
+
+/* OPEN/CLOSE/WINDOW frame waiting for room in the tunnel */
+typedef struct {
+    uint32_t id;
+    unsigned char type;
+    unsigned char len;
+    unsigned char data[4];
+} mux_ctl_t;
+
+typedef struct {
+    int enc_fd;
+    int server;                /* accepts OPEN (tunnel server side) */
+    int socks;                 /* SOCKS5: each OPEN names its target */
+    int listen_fd;             /* client: local listener, server: -1 */
+    const char *fwd_host;      /* server: forward target */
+    const char *fwd_port;
+    mux_table_t tab;
+    ev_loop_t *ev;
+    int tx_blocked;            /* tunnel full: only read it until it drains */
+    int tx_ok;                 /* tunnel took-a-record check still valid */
+    mux_ctl_t *ctl;
+    size_t nctl, ctl_cap;
+    mux_rec_t txc;             /* OPEN/WINDOW frames of this pass, sent first */
+    mux_rec_t tx;              /* DATA/CLOSE frames of this pass */
+    mux_rec_t rx;              /* record being unpacked */
+    mux_stream_t *rq_head[MUX_PRIO_CLASSES], *rq_tail[MUX_PRIO_CLASSES];
+    mux_stream_t *wq_head, *wq_tail;   /* on a deadline, earliest first */
+    long long now_ms;          /* monotonic, taken once per loop pass */
+    int prio;                  /* class for this side's streams, -1: by traffic */
+    mux_pooled_t *pool;        /* server: warm target connections */
+    int npool;
+    long long pool_due;        /* pool_tick is due, -1: nothing pending */
+    long long pool_retry;      /* no refill before, after a failed connect */
+} mux_sess_t;
+
+/*
+ * Neither relay may sit in a blocking tunnel write: if both did, each
+ * waiting for the other to read, the tunnel would wedge. DATA is only read
+ * from local sockets while the tunnel has room, and control frames queue
+ * here instead of blocking, so the tunnel is always being read.
+ */
+static int tunnel_ready(mux_sess_t *m) {
+    if (m->tx_blocked) return 0;
+    /* --jitter: the queue in front of the tunnel fills first */
+    if (obfs_jq_full()) {
+        m->tx_blocked = 1;
+        return 0;
+    }
+    if (m->tx_ok) return 1;
+    struct pollfd p;
+    p.fd = m->enc_fd;
+    p.events = POLLOUT;
+    p.revents = 0;
+    if (poll(&p, 1, 0) == 1 && (p.revents & POLLOUT)) {
+        m->tx_ok = 1;   /* room for at least the record being packed */
+        return 1;
+    }
+    m->tx_blocked = 1;
+    return 0;
+}
+
+/* Send the frames packed so far, control frames ahead of data and in the
+ * same record when both fit; the next frame needs a fresh check */
+static int tunnel_flush(mux_sess_t *m) {
+    m->tx_ok = 0;
+    if (m->txc.len && m->txc.len + m->tx.len <= MUX_FRAME_MAX) {
+        memcpy(m->txc.buf + m->txc.len, m->tx.buf, m->tx.len);
+        m->txc.len += m->tx.len;
+        m->tx.len = 0;
+    }
+    if (mux_pack_flush(m->enc_fd, &m->txc) < 0) return -1;
+    return mux_pack_flush(m->enc_fd, &m->tx);
+}
+
+/*
+ * Pack a frame into this pass's record. Callers check tunnel_ready()
+ * first; a full record goes out right away, the rest when the loop is
+ * about to wait again — so frames that became ready together share one
+ * AEAD seal and write, and a lone frame is not held back.
+ */
+static int tunnel_send(mux_sess_t *m, uint32_t id, unsigned char type,
+                       const void *data, size_t len) {
+    /* CLOSE stays behind the stream's DATA; OPEN and credit may overtake */
+    mux_rec_t *rec = (type == MUX_OPEN || type == MUX_WINDOW) ? &m->txc : &m->tx;
+    if (rec->len + MUX_HDR_SIZE + len > MUX_FRAME_MAX && tunnel_flush(m) < 0)
+        return -1;
+    return mux_pack_frame(m->enc_fd, rec, id, type, data, len) < 0 ? -1 : 0;
+}
 
-        int ret = select(nfds + 1, &rfds, NULL, NULL, NULL);
-        if (ret < 0) {
+static int send_ctl(mux_sess_t *m, uint32_t id, unsigned char type,
+                    const unsigned char *data, size_t len) {
+    if (m->nctl == 0 && tunnel_ready(m))
+        return tunnel_send(m, id, type, data, len);
+
+    if (m->nctl == m->ctl_cap) {
+        size_t cap = m->ctl_cap ? m->ctl_cap * 2 : 64;
+        mux_ctl_t *nc = realloc(m->ctl, cap * sizeof(*nc));
+        if (!nc) return -1;
+        m->ctl = nc;
+        m->ctl_cap = cap;
+    }
+    if (len > sizeof(m->ctl->data)) return -1;
+    mux_ctl_t *c = &m->ctl[m->nctl++];
+    c->id = id;
+    c->type = type;
+    c->len = (unsigned char)len;
+    if (len) memcpy(c->data, data, len);
+    m->tx_blocked = 1;
+    return 0;
+}
+
+/* Tunnel writable again: send queued control frames, in order */
+static int flush_ctl(mux_sess_t *m) {
+    size_t i = 0;
+    m->tx_blocked = 0;
+    while (i < m->nctl && tunnel_ready(m)) {
+        mux_ctl_t *c = &m->ctl[i++];
+        if (tunnel_send(m, c->id, c->type, c->data, c->len) < 0)
+            return -1;
+    }
+    memmove(m->ctl, m->ctl + i, (m->nctl - i) * sizeof(*m->ctl));
+    m->nctl -= i;
+    if (m->nctl) m->tx_blocked = 1;
+    return 0;
+}
+
+/* Bytes the stream may send now: the peer's credit, and for BULK streams
+ * no more than MUX_BULK_INFLIGHT outstanding */
+static uint32_t send_room(const mux_stream_t *s) {
+    if (s->prio != MUX_PRIO_BULK) return s->send_window;
+    uint32_t out = MUX_STREAM_WINDOW - s->send_window;
+    return out >= MUX_BULK_INFLIGHT ? 0 : MUX_BULK_INFLIGHT - out;
+}
+
+/* Watch the stream's fd for what it can do now: read while it has room to
+ * send, write while peer data is queued */
+static void stream_rearm(mux_sess_t *m, mux_stream_t *s) {
+    if (s->fd < 0 || (s->flags & (MUX_S_CONNECTING | MUX_S_SOCKS_NEGOTIATING))) return;
+    int want = 0;
+    if (!(s->flags & MUX_S_REMOTE_CLOSED) && send_room(s) > 0) want |= EV_READ;
+    if (s->out_len > s->out_off) want |= EV_WRITE;
+    if (want != s->events && ev_mod(m->ev, s->fd, want, s->id) == 0)
+        s->events = want;
+}
+
+/* Run queues: streams with data to send, one FIFO per class */
+static void rq_push(mux_sess_t *m, mux_stream_t *s) {
+    if (s->queued) return;
+    int c = s->prio;
+    s->rq_next = NULL;
+    s->rq_prev = m->rq_tail[c];
+    if (m->rq_tail[c]) m->rq_tail[c]->rq_next = s;
+    else m->rq_head[c] = s;
+    m->rq_tail[c] = s;
+    s->queued = 1;
+}
+
+static void rq_unlink(mux_sess_t *m, mux_stream_t *s) {
+    if (!s->queued) return;
+    int c = s->prio;
+    if (s->rq_prev) s->rq_prev->rq_next = s->rq_next;
+    else m->rq_head[c] = s->rq_next;
+    if (s->rq_next) s->rq_next->rq_prev = s->rq_prev;
+    else m->rq_tail[c] = s->rq_prev;
+    s->rq_prev = s->rq_next = NULL;
+    s->queued = 0;
+}
+
+static int rq_empty(const mux_sess_t *m) {
+    for (int c = 0; c < MUX_PRIO_CLASSES; c++)
+        if (m->rq_head[c]) return 0;
+    return 1;
+}
+
+static int race_watch(void *ctx, int fd) {
+    mux_race_t *mr = ctx;
+    return ev_add(mr->ev, fd, EV_WRITE, mr->tag);
+}
+
+static void race_unwatch(void *ctx, int fd) {
+    mux_race_t *mr = ctx;
+    ev_del(mr->ev, fd);
+}
+
+/* Close the attempts still in flight */
+static void race_end(mux_stream_t *s) {
+    if (!s->race) return;
+    net_race_abort(&s->race->r);
+    free(s->race);
+    s->race = NULL;
+}
+
+/*
+ * SOCKS5 UDP association. Client: fd[0] takes the application's datagrams,
+ * accepted only from the host of its SOCKS connection (peer) and, once
+ * the first has come, from that port. Server: fd[0] and fd[1] send to IPv4
+ * and IPv6 destinations, opened on first use — the association's NAT
+ * mapping, which lasts as long as it does.
+ */
+typedef struct mux_udp {
+    int fd[2];
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    int peer_port_set;
+    long long last_ms;           /* server: last datagram either way */
+} mux_udp_t;
+
+static mux_udp_t *udp_new(void) {
+    mux_udp_t *u = calloc(1, sizeof(*u));
+    if (u) u->fd[0] = u->fd[1] = -1;
+    return u;
+}
+
+/* Watch a new socket of the association, index i. Closes it on failure. */
+static int udp_watch(mux_sess_t *m, mux_stream_t *s, int i, int fd) {
+    set_nonblock(fd);
+    if (ev_add(m->ev, fd, EV_READ, TAG_UDP | (uint64_t)i << 32 | s->id) < 0) {
+        close(fd);
+        return -1;
+    }
+    s->udp->fd[i] = fd;
+    return 0;
+}
+
+static void udp_end(mux_sess_t *m, mux_stream_t *s) {
+    if (!s->udp) return;
+    for (int i = 0; i < 2; i++) {
+        if (s->udp->fd[i] < 0) continue;
+        ev_del(m->ev, s->udp->fd[i]);
+        close(s->udp->fd[i]);
+        s->udp->fd[i] = -1;
+    }
+}
+
+/* Streams on a deadline: connect races and UDP associations on the
+ * server, held OPENs on the client. Most deadlines are the latest yet, so the sorted insert starts
+ * from the tail. */
+static void wq_push(mux_sess_t *m, mux_stream_t *s, int ms) {
+    s->deadline = m->now_ms + ms;
+    mux_stream_t *prev = m->wq_tail;
+    while (prev && prev->deadline > s->deadline) prev = prev->wq_prev;
+    s->wq_prev = prev;
+    s->wq_next = prev ? prev->wq_next : m->wq_head;
+    if (s->wq_next) s->wq_next->wq_prev = s;
+    else m->wq_tail = s;
+    if (prev) prev->wq_next = s;
+    else m->wq_head = s;
+}
+
+static void wq_unlink(mux_sess_t *m, mux_stream_t *s) {
+    s->flags &= ~(MUX_S_CONNECTING | MUX_S_OPEN_HELD);
+    if (!s->wq_prev && m->wq_head != s) return;
+    if (s->wq_prev) s->wq_prev->wq_next = s->wq_next;
+    else m->wq_head = s->wq_next;
+    if (s->wq_next) s->wq_next->wq_prev = s->wq_prev;
+    else m->wq_tail = s->wq_prev;
+    s->wq_prev = s->wq_next = NULL;
+}
+
+/* Close our end of a stream; forget it once both sides sent CLOSE */
+static int stream_close(mux_sess_t *m, mux_stream_t *s) {
+    int rc = 0;
+    rq_unlink(m, s);
+    wq_unlink(m, s);
+    if (s->flags & MUX_S_RESOLVING) {
+        dns_cancel(s->id);
+        s->flags &= ~MUX_S_RESOLVING;
+    }
+    race_end(s);
+    udp_end(m, s);
+    if (s->fd >= 0) {
+        ev_del(m->ev, s->fd);
+        close(s->fd);
+        s->fd = -1;
+    }
+    free(s->out);
+    s->out = NULL;
+    s->out_off = s->out_len = 0;
+    if (!(s->flags & MUX_S_LOCAL_CLOSED)) {
+        s->flags |= MUX_S_LOCAL_CLOSED;
+        if (send_ctl(m, s->id, MUX_CLOSE, NULL, 0) < 0) rc = -1;
+    }
+    if (s->flags & MUX_S_REMOTE_CLOSED)
+        mux_table_remove(&m->tab, s);
+    return rc;
+}
+
+/* Client: a stream the peer never heard of goes away without a CLOSE */
+static int stream_drop(mux_sess_t *m, mux_stream_t *s) {
+    s->flags |= MUX_S_LOCAL_CLOSED | MUX_S_REMOTE_CLOSED;
+    return stream_close(m, s);
+}
+
+/* Explicit class (MUX_PRIO_*), or -1 to leave the stream to the traffic rule */
+static void stream_set_prio(mux_stream_t *s, int prio) {
+    if (prio < 0 || prio >= MUX_PRIO_CLASSES) return;
+    s->prio = (unsigned char)prio;
+    s->pinned = 1;
+}
+
+static int stream_watch(mux_sess_t *m, mux_stream_t *s) {
+    set_nonblock(s->fd);
+    s->events = EV_READ;
+    if (ev_add(m->ev, s->fd, EV_READ, s->id) == 0) return 0;
+    close(s->fd);
+    s->fd = -1;
+    return stream_close(m, s);
+}
+
+/* n more bytes reached the local socket: hand credit back in batches */
+static int stream_credit(mux_sess_t *m, mux_stream_t *s, size_t n) {
+    s->recv_consumed += (uint32_t)n;
+    if (s->recv_consumed < MUX_STREAM_WINDOW / 4) return 0;
+    unsigned char inc[4];
+    inc[0] = (s->recv_consumed >> 24) & 0xFF;
+    inc[1] = (s->recv_consumed >> 16) & 0xFF;
+    inc[2] = (s->recv_consumed >> 8) & 0xFF;
+    inc[3] = s->recv_consumed & 0xFF;
+    s->recv_consumed = 0;
+    return send_ctl(m, s->id, MUX_WINDOW, inc, sizeof(inc));
+}
+
+/* Push queued peer data into the local socket. Returns -1 on tunnel error. */
+static int stream_flush(mux_sess_t *m, mux_stream_t *s) {
+    while (s->out_len > s->out_off) {
+        ssize_t w = write(s->fd, s->out + s->out_off, s->out_len - s->out_off);
+        if (w < 0) {
             if (errno == EINTR) continue;
-            break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return stream_close(m, s);
         }
+        s->out_off += (size_t)w;
+        if (stream_credit(m, s, (size_t)w) < 0) return -1;
+    }
+    if (s->out_off == s->out_len) {
+        /* Idle streams hold no buffer */
+        free(s->out);
+        s->out = NULL;
+        s->out_off = s->out_len = 0;
+        if (s->flags & MUX_S_REMOTE_CLOSED)
+            return stream_close(m, s);
+    }
+    stream_rearm(m, s);
+    return 0;
+}
 
-        /* Encrypted side → demux */
-        if (FD_ISSET(enc_fd, &rfds)) {
-            mux_header_t hdr;
-            int n = mux_read_frame(enc_fd, &hdr, buf, sizeof(buf));
-
-            if (n < 0 || (n == 0 && hdr.type == 0)) break;
-
-            switch (hdr.type) {
-            case MUX_OPEN: {
-                if (hdr.stream_id >= MUX_MAX_STREAMS) break;
-                if (streams[hdr.stream_id] >= 0)
-                    close(streams[hdr.stream_id]);
-                int tfd = net_try_connect(fwd_host, fwd_port, 5);
-                if (tfd < 0) {
-                    mux_write_frame(enc_fd, hdr.stream_id, MUX_CLOSE, NULL, 0);
-                    log_msg(1, "mux: stream %d connect failed", hdr.stream_id);
-                } else {
-                    streams[hdr.stream_id] = tfd;
-                    log_msg(1, "mux: stream %d -> %s:%s",
-                            hdr.stream_id, fwd_host, fwd_port);
-                }
-                break;
-            }
-            case MUX_DATA:
-                if (hdr.stream_id >= MUX_MAX_STREAMS ||
-                    streams[hdr.stream_id] < 0) break;
-                if (write_all(streams[hdr.stream_id], buf, (size_t)n) < 0) {
-                    close(streams[hdr.stream_id]);
-                    streams[hdr.stream_id] = -1;
-                    mux_write_frame(enc_fd, hdr.stream_id, MUX_CLOSE, NULL, 0);
-                }
-                break;
-
-            case MUX_CLOSE:
-                if (hdr.stream_id >= MUX_MAX_STREAMS) break;
-                if (streams[hdr.stream_id] >= 0) {
-                    close(streams[hdr.stream_id]);
-                    streams[hdr.stream_id] = -1;
-                    log_msg(1, "mux: stream %d closed", hdr.stream_id);
-                }
-                break;
-            }
+/* DATA from the peer: write through if the socket keeps up, else queue */
+static int stream_deliver(mux_sess_t *m, mux_stream_t *s, const char *data, size_t n) {
+    size_t queued = s->out_len - s->out_off;
+    if (queued + s->recv_consumed + n > MUX_STREAM_WINDOW) {
+        log_msg(1, "mux: stream %u overran its window", s->id);
+        return stream_close(m, s);
+    }
+
+    if (queued == 0 && !(s->flags & (MUX_S_CONNECTING | MUX_S_RESOLVING))) {
+        ssize_t w;
+        do {
+            w = write(s->fd, data, n);
+        } while (w < 0 && errno == EINTR);
+        if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return stream_close(m, s);
+        if (w > 0) {
+            data += w;
+            n -= (size_t)w;
+            if (stream_credit(m, s, (size_t)w) < 0) return -1;
         }
+        if (n == 0) return 0;
+    }
 
-        /* Target connections → mux frames */
-        for (int i = 0; i < MUX_MAX_STREAMS; i++) {
-            if (streams[i] >= 0 && FD_ISSET(streams[i], &rfds)) {
-                ssize_t n = read(streams[i], buf, sizeof(buf));
-                if (n <= 0) {
-                    close(streams[i]);
-                    streams[i] = -1;
-                    mux_write_frame(enc_fd, (unsigned char)i, MUX_CLOSE, NULL, 0);
-                    log_msg(1, "mux: stream %d target EOF", i);
-                } else {
-                    if (mux_write_frame(enc_fd, (unsigned char)i,
-                                        MUX_DATA, buf, (size_t)n) < 0)
-                        goto done;
-                }
-            }
+    /* Slow consumer, or the target is not reached yet: keep it in the
+     * stream's own buffer, bounded by the window */
+    if (s->out_off > 0) {
+        memmove(s->out, s->out + s->out_off, s->out_len - s->out_off);
+        s->out_len -= s->out_off;
+        s->out_off = 0;
+    }
+    char *nb = realloc(s->out, s->out_len + n);
+    if (!nb) return stream_close(m, s);
+    memcpy(nb + s->out_len, data, n);
+    s->out = nb;
+    s->out_len += n;
+    stream_rearm(m, s);
+    return 0;
+}
+
+/* Client: new local connections become streams */
+static int accept_local(mux_sess_t *m) {
+    for (;;) {
+        int fd = accept(m->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            return 0;   /* EAGAIN, or out of fds — retry on next wakeup */
+        }
+        mux_stream_t *s = mux_table_open(&m->tab, fd);
+        if (!s) {
+            close(fd);
+            fprintf(stderr, "mux: out of stream ids\n");
+            continue;
+        }
+        stream_set_prio(s, m->prio);
+        log_msg(1, "mux: stream %u opened (local)", s->id);
+        if (stream_watch(m, s) < 0) return -1;
+        if (s->fd < 0) continue;
+        if (m->socks) {
+            /* No OPEN until the application has named its target */
+            s->flags |= MUX_S_SOCKS_HELLO;
+        } else {
+            /* OPEN waits briefly for the first bytes so they can ride in it */
+            s->flags |= MUX_S_OPEN_HELD;
+            wq_push(m, s, MUX_OPEN_HOLD_MS);
         }
     }
+}
 
-done:
-    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
-        if (streams[i] >= 0) close(streams[i]);
+/* Client: OPEN without data — the local side has not written yet */
+static int open_bare(mux_sess_t *m, mux_stream_t *s) {
+    unsigned char hint = s->prio;
+    wq_unlink(m, s);
+    return send_ctl(m, s->id, MUX_OPEN, &hint, s->pinned ? 1 : 0);
+}
+
+/* Client: a held stream turned readable, its first read goes out in OPEN */
+static int open_first(mux_sess_t *m, mux_stream_t *s, char *buf, size_t buflen) {
+    if (!tunnel_ready(m)) return 0;   /* still readable once it drains */
+    size_t want = buflen - 1;
+    if (want > s->send_window) want = s->send_window;
+    ssize_t r = read(s->fd, buf + 1, want);
+    if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r <= 0) {
+        /* Closed without a byte: the target still sees the connection */
+        if (open_bare(m, s) < 0) return -1;
+        log_msg(1, "mux: stream %u local EOF", s->id);
+        return stream_close(m, s);
     }
+
+    wq_unlink(m, s);
+    buf[0] = (char)(s->pinned ? s->prio : MUX_OPEN_NOPRIO);
+    if (tunnel_send(m, s->id, MUX_OPEN, buf, (size_t)r + 1) < 0) return -1;
+    s->send_window -= (uint32_t)r;
+    s->burst = (size_t)r;
+    s->last_send_ms = m->now_ms;
     return 0;
 }
 
-/* ──────────── Client-side mux relay ──────────── */
+/*
+ * SOCKS client: UDP ASSOCIATE. The application's datagrams go to a socket
+ * on the address it reached us at, and the OPEN names no target; the
+ * reply, with that socket's address, waits for the server's OPEN_OK.
+ */
+static int udp_associate(mux_sess_t *m, mux_stream_t *s, char *buf) {
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    int fd = -1;
+    s->udp = udp_new();
+    if (s->udp && getsockname(s->fd, (struct sockaddr *)&ss, &slen) == 0) {
+        s->udp->peer_len = sizeof(s->udp->peer);
+        if (getpeername(s->fd, (struct sockaddr *)&s->udp->peer, &s->udp->peer_len) == 0)
+            fd = socket(ss.ss_family, SOCK_DGRAM, 0);
+        if (ss.ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&ss)->sin6_port = 0;
+        else
+            ((struct sockaddr_in *)&ss)->sin_port = 0;
+        if (fd >= 0 && bind(fd, (struct sockaddr *)&ss, slen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0 || udp_watch(m, s, 0, fd) < 0) {
+        unsigned char rep[SOCKS5_REPLY_LEN];
+        socks5_reply(rep, SOCKS5_REP_FAIL);
+        (void)write(s->fd, rep, sizeof(rep));
+        return stream_drop(m, s);
+    }
 
-int mux_relay_client(int enc_fd, const char *local_port) {
-    int listen_fd = net_listen(local_port);
+    buf[0] = (char)(s->pinned ? s->prio : MUX_OPEN_NOPRIO);
+    buf[1] = 0;   /* empty target */
+    if (tunnel_send(m, s->id, MUX_OPEN, buf, 2) < 0) return -1;
+    s->flags = (s->flags & ~MUX_S_SOCKS_REQUEST) | MUX_S_SOCKS_WAIT;
+    free(s->out);
+    s->out = NULL;
+    s->out_off = s->out_len = 0;
+    stream_rearm(m, s);
+    return 0;
+}
 
-    int streams[MUX_MAX_STREAMS];
-    memset(streams, -1, sizeof(streams));
-    int next_id = 1;
+/*
+ * SOCKS client: the application's greeting and CONNECT, as far as they
+ * have arrived; a partial one waits in s->out. The greeting is answered
+ * here, the CONNECT becomes the stream's OPEN (with any bytes sent after
+ * it), and its reply waits for the server's OPEN_OK or CLOSE.
+ */
+static int socks_negotiate(mux_sess_t *m, mux_stream_t *s, char *buf) {
+    unsigned char in[SOCKS5_HELLO_MAX + SOCKS5_REQUEST_MAX];
+    unsigned char rep[SOCKS5_REPLY_LEN];
+    if (!tunnel_ready(m)) return 0;   /* still readable once it drains */
 
-    char buf[MUX_MAX_PAYLOAD];
+    size_t have = s->out_len;
+    if (have) memcpy(in, s->out, have);
+    ssize_t r = read(s->fd, in + have, sizeof(in) - have);
+    if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r <= 0) return stream_drop(m, s);
+    have += (size_t)r;
 
-    log_msg(1, "mux: client relay on *:%s", local_port);
+    size_t off = 0;
+    if (s->flags & MUX_S_SOCKS_HELLO) {
+        int n = socks5_parse_greeting(in, have);
+        if (n == 0) goto partial;
+        rep[0] = 0x05;
+        rep[1] = n < 0 ? 0xFF : 0x00;   /* no acceptable method / no auth */
+        if (write(s->fd, rep, 2) != 2 || n < 0) return stream_drop(m, s);
+        s->flags = (s->flags & ~MUX_S_SOCKS_HELLO) | MUX_S_SOCKS_REQUEST;
+        off = (size_t)n;
+    }
+
+    size_t tlen;
+    unsigned char cmd, code;
+    int n = socks5_parse_request(in + off, have - off, &cmd, (unsigned char *)buf + 1,
+                                 &tlen, &code);
+    if (n == 0) goto partial;
+    if (n < 0) {
+        socks5_reply(rep, code);
+        (void)write(s->fd, rep, sizeof(rep));
+        return stream_drop(m, s);
+    }
+    if (cmd == SOCKS5_CMD_UDP) return udp_associate(m, s, buf);
+    off += (size_t)n;
+    int prio = mux_prio_for_port((unsigned char)buf[tlen - 1] << 8 | (unsigned char)buf[tlen]);
+    if (prio >= 0) stream_set_prio(s, prio);
+
+    /* OPEN: class, target, and whatever the application sent after it */
+    size_t early = have - off;
+    if (early > s->send_window) early = s->send_window;
+    buf[0] = (char)(s->pinned ? s->prio : MUX_OPEN_NOPRIO);
+    memcpy(buf + 1 + tlen, in + off, early);
+    if (tunnel_send(m, s->id, MUX_OPEN, buf, 1 + tlen + early) < 0) return -1;
+    s->send_window -= (uint32_t)early;
+    s->flags = (s->flags & ~MUX_S_SOCKS_REQUEST) | MUX_S_SOCKS_WAIT;
+    free(s->out);
+    s->out = NULL;
+    s->out_off = s->out_len = 0;
+    stream_rearm(m, s);
+    return 0;
+
+partial:
+    if (have == sizeof(in)) return stream_drop(m, s);
+    if (off) {
+        memmove(in, in + off, have - off);
+        have -= off;
+    }
+    char *nb = realloc(s->out, have);
+    if (!nb) return stream_drop(m, s);
+    memcpy(nb, in, have);
+    s->out = nb;
+    s->out_len = have;
+    return 0;
+}
+
+/* SOCKS client: the server connected the stream (or gave up) — tell the
+ * application */
+static int socks_answer(mux_sess_t *m, mux_stream_t *s, unsigned char code) {
+    unsigned char rep[SOCKS5_REPLY_MAX];
+    size_t len = SOCKS5_REPLY_LEN;
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    s->flags &= ~MUX_S_SOCKS_WAIT;
+    /* A UDP association replies with where to send its datagrams */
+    if (code == SOCKS5_REP_OK && s->udp &&
+        getsockname(s->udp->fd[0], (struct sockaddr *)&ss, &slen) == 0)
+        len = socks5_reply_addr(rep, code, (struct sockaddr *)&ss);
+    else
+        socks5_reply(rep, code);
+    /* Only the 2-byte method reply went before it: the socket has room */
+    if (write(s->fd, rep, len) != (ssize_t)len || code != SOCKS5_REP_OK)
+        return stream_close(m, s);
+    log_msg(1, "mux: stream %u %s", s->id, s->udp ? "UDP associated" : "connected");
+    return 0;
+}
+
+/* Client: the SOCKS connection only holds the association open. What the
+ * application writes on it is discarded; its EOF ends the association. */
+static int udp_hold(mux_sess_t *m, mux_stream_t *s, char *buf, size_t buflen) {
+    ssize_t r = read(s->fd, buf, buflen);
+    if (r > 0 || (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)))
+        return 0;
+    log_msg(1, "mux: stream %u UDP association ended", s->id);
+    return stream_close(m, s);
+}
+
+/* Client: only the application's host may send, from one port */
+static int udp_from_app(mux_udp_t *u, struct sockaddr_storage *from) {
+    if (from->ss_family != u->peer.ss_family) return 0;
+    in_port_t *port, *want;
+    if (from->ss_family == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6 *)from;
+        struct sockaddr_in6 *b = (struct sockaddr_in6 *)&u->peer;
+        if (memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) != 0) return 0;
+        port = &a->sin6_port;
+        want = &b->sin6_port;
+    } else {
+        struct sockaddr_in *a = (struct sockaddr_in *)from;
+        struct sockaddr_in *b = (struct sockaddr_in *)&u->peer;
+        if (a->sin_addr.s_addr != b->sin_addr.s_addr) return 0;
+        port = &a->sin_port;
+        want = &b->sin_port;
+    }
+    if (!u->peer_port_set) {
+        *want = *port;
+        u->peer_port_set = 1;
+    }
+    return *port == *want;
+}
+
+/*
+ * Datagrams waiting on socket i of the association go out as MUX_DGRAM,
+ * [target][data]: the client names the destination from the SOCKS5 UDP
+ * header, the server the source it came from. While the tunnel is full
+ * they wait in the socket buffer, and overflow there.
+ */
+static int udp_read(mux_sess_t *m, mux_stream_t *s, int i, char *buf) {
+    static unsigned char dg[65536];
+    mux_udp_t *u = s->udp;
+    for (int k = 0; k < MUX_UDP_BURST && u->fd[i] >= 0 && tunnel_ready(m); k++) {
+        struct sockaddr_storage from;
+        socklen_t flen = sizeof(from);
+        ssize_t r = recvfrom(u->fd[i], dg, sizeof(dg), 0, (struct sockaddr *)&from, &flen);
+        if (r < 0) return 0;
+
+        size_t tlen, hlen = 0;
+        if (m->server) {
+            tlen = socks5_target_addr((unsigned char *)buf, (struct sockaddr *)&from);
+        } else {
+            int h;
+            if (!udp_from_app(u, &from) ||
+                (h = socks5_parse_udp(dg, (size_t)r, (unsigned char *)buf, &tlen)) < 0)
+                continue;
+            hlen = (size_t)h;
+        }
+        size_t n = (size_t)r - hlen;
+        if (tlen + n > MUX_MAX_PAYLOAD) continue;   /* does not fit a frame */
+        memcpy(buf + tlen, dg + hlen, n);
+        if (tunnel_send(m, s->id, MUX_DGRAM, buf, tlen + n) < 0) return -1;
+        u->last_ms = m->now_ms;
+    }
+    return 0;
+}
+
+/* Client: a datagram from the tunnel, to the application with its source */
+static void udp_to_app(mux_stream_t *s, const char *buf, size_t n) {
+    static unsigned char dg[SOCKS5_UDP_HDR_MAX + MUX_MAX_PAYLOAD];
+    char host[256], port[6];
+    mux_udp_t *u = s->udp;
+    int tlen = socks5_parse_target((const unsigned char *)buf, n, host, port);
+    if (tlen < 0 || !u->peer_port_set || u->fd[0] < 0) return;
+    size_t h = socks5_udp_header(dg, host, port);
+    memcpy(dg + h, buf + tlen, n - (size_t)tlen);
+    (void)sendto(u->fd[0], dg, h + n - (size_t)tlen, 0,
+                 (struct sockaddr *)&u->peer, u->peer_len);
+}
+
+/* Target socket connected: tell the client, hand over what it sent
+ * meanwhile, then read as usual */
+static int stream_connected(mux_sess_t *m, mux_stream_t *s, int fd) {
+    s->fd = fd;
+    s->events = EV_WRITE;
+    if (ev_mod(m->ev, fd, EV_WRITE, s->id) < 0) return stream_close(m, s);
+    if (m->socks)
+        log_msg(1, "mux: stream %u connected", s->id);
+    else
+        log_msg(1, "mux: stream %u -> %s:%s", s->id, m->fwd_host, m->fwd_port);
+    if (send_ctl(m, s->id, MUX_OPEN_OK, NULL, 0) < 0) return -1;
+    return stream_flush(m, s);
+}
+
+/* Server: move the stream's connect race on — an attempt turned writable
+ * or its deadline came */
+static int connect_step(mux_sess_t *m, mux_stream_t *s) {
+    int wait;
+    wq_unlink(m, s);
+    int fd = net_race_step(&s->race->r, m->now_ms, &wait);
+    if (fd == -1) {
+        s->flags |= MUX_S_CONNECTING;
+        wq_push(m, s, wait < 0 ? MUX_CONNECT_TIMEOUT_MS : wait);
+        return 0;
+    }
+    race_end(s);
+    if (fd >= 0) return stream_connected(m, s, fd);
+    log_msg(1, "mux: stream %u connect failed", s->id);
+    return stream_close(m, s);
+}
+
+/* Server: connect the stream to res, all its addresses raced (net.h) */
+static int connect_start(mux_sess_t *m, mux_stream_t *s, struct addrinfo *res) {
+    s->ai = res;
+    s->race = malloc(sizeof(*s->race));
+    if (!s->race) return stream_close(m, s);
+    net_race_init(&s->race->r, res, MUX_CONNECT_TIMEOUT_MS);
+    s->race->r.watch = race_watch;
+    s->race->r.unwatch = race_unwatch;
+    s->race->r.ctx = s->race;
+    s->race->ev = m->ev;
+    s->race->tag = TAG_RACE | s->id;
+    return connect_step(m, s);
+}
+
+/* ──────────── Warm target connections ──────────── */
+
+static void pool_drop(mux_sess_t *m, mux_pooled_t *p) {
+    if (p->race) {
+        net_race_abort(&p->race->r);
+        free(p->race);
+        p->race = NULL;
+    }
+    dns_free(p->ai);
+    p->ai = NULL;
+    if (p->fd >= 0) {
+        ev_del(m->ev, p->fd);
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+/* Move slot i's connect race on; the winner is watched for the target
+ * closing it */
+static void pool_step(mux_sess_t *m, int i) {
+    mux_pooled_t *p = &m->pool[i];
+    int wait;
+    int fd = net_race_step(&p->race->r, m->now_ms, &wait);
+    if (fd == -1) {
+        p->due_ms = m->now_ms + (wait < 0 ? MUX_CONNECT_TIMEOUT_MS : wait);
+        return;
+    }
+    pool_drop(m, p);
+    if (fd < 0) {
+        log_msg(2, "mux: pool cannot connect to %s:%s", m->fwd_host, m->fwd_port);
+        m->pool_retry = m->now_ms + MUX_POOL_RETRY_MS;
+        return;
+    }
+    p->fd = fd;
+    p->due_ms = m->now_ms + MUX_POOL_MAX_AGE_MS;
+    if (ev_mod(m->ev, fd, EV_READ, TAG_POOL | (uint64_t)i) < 0) pool_drop(m, p);
+}
+
+/* Start a connection in empty slot i, if the target's addresses are cached */
+static void pool_start(mux_sess_t *m, int i) {
+    mux_pooled_t *p = &m->pool[i];
+    if (dns_lookup(m->fwd_host, m->fwd_port, 0, &p->ai) != 1 || !p->ai ||
+        !(p->race = malloc(sizeof(*p->race)))) {
+        /* Being looked up (resolve_done restarts us), or not at all */
+        dns_free(p->ai);
+        p->ai = NULL;
+        m->pool_retry = m->now_ms + MUX_POOL_RETRY_MS;
+        return;
+    }
+    net_race_init(&p->race->r, p->ai, MUX_CONNECT_TIMEOUT_MS);
+    p->race->r.watch = race_watch;
+    p->race->r.unwatch = race_unwatch;
+    p->race->r.ctx = p->race;
+    p->race->ev = m->ev;
+    p->race->tag = TAG_POOL | (uint64_t)i;
+    pool_step(m, i);
+}
+
+/*
+ * Event on slot i: a racing attempt turned writable, or a ready connection
+ * readable. The target has nothing to say before a client does, unless it
+ * greets first (SSH, SMTP): that greeting waits in the socket for the
+ * stream and the connection is no longer watched, but EOF or an error
+ * means it is gone.
+ */
+static void pool_event(mux_sess_t *m, int i, int events) {
+    mux_pooled_t *p = &m->pool[i];
+    if (p->race) {
+        pool_step(m, i);
+    } else if (p->fd >= 0) {
+        char c;
+        ssize_t r = recv(p->fd, &c, 1, MSG_PEEK);
+        if (r > 0 && !(events & EV_HUP)) {
+            ev_mod(m->ev, p->fd, 0, TAG_POOL | (uint64_t)i);
+            return;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+            !(events & EV_HUP))
+            return;
+        log_msg(2, "mux: pooled connection closed by the target");
+        pool_drop(m, p);
+    }
+    m->pool_due = 0;
+}
+
+/* Step due races, retire connections past their age, and fill empty slots.
+ * Runs at the start of a pass, so events of this pass still match their
+ * slot's state. */
+static void pool_tick(mux_sess_t *m) {
+    long long due = -1;
+    for (int i = 0; i < m->npool; i++) {
+        mux_pooled_t *p = &m->pool[i];
+        if (p->race && p->due_ms <= m->now_ms)
+            pool_step(m, i);
+        else if (p->fd >= 0 && p->due_ms <= m->now_ms)
+            pool_drop(m, p);   /* before the target times it out */
+        if (p->fd < 0 && !p->race && m->now_ms >= m->pool_retry)
+            pool_start(m, i);
+        long long next = (p->fd >= 0 || p->race) ? p->due_ms : m->pool_retry;
+        if (due < 0 || next < due) due = next;
+    }
+    m->pool_due = due;
+}
+
+/* A ready connection to the target, still watched under its slot's tag
+ * (stream_connected retags it), or -1. Its slot refills next pass. */
+static int pool_take(mux_sess_t *m) {
+    for (int i = 0; i < m->npool; i++) {
+        mux_pooled_t *p = &m->pool[i];
+        if (p->fd < 0) continue;
+        int fd = p->fd;
+        p->fd = -1;
+        m->pool_due = 0;
+        return fd;
+    }
+    return -1;
+}
+
+/*
+ * SOCKS server: a datagram from the tunnel, to its destination. A name not
+ * in the DNS cache yet costs the datagram (the lookup starts, and the
+ * application's retry finds it), as does one that does not resolve.
+ */
+static void udp_to_target(mux_sess_t *m, mux_stream_t *s, const char *buf, size_t n) {
+    char host[256], port[6];
+    struct addrinfo *res;
+    mux_udp_t *u = s->udp;
+    int tlen = socks5_parse_target((const unsigned char *)buf, n, host, port);
+    if (tlen < 0 || dns_lookup(host, port, 0, &res) != 1 || !res) return;
+    int i = res->ai_family == AF_INET6;
+    if (u->fd[i] < 0) {
+        int fd = socket(res->ai_family, SOCK_DGRAM, 0);
+        if (fd < 0 || udp_watch(m, s, i, fd) < 0) {
+            dns_free(res);
+            return;
+        }
+    }
+    (void)sendto(u->fd[i], buf + tlen, n - (size_t)tlen, 0, res->ai_addr, res->ai_addrlen);
+    dns_free(res);
+    u->last_ms = m->now_ms;
+}
+
+/* SOCKS server: a UDP association. Its sockets open as destinations come
+ * up; it ends after g_mux_udp_idle_ms without a datagram either way. */
+static int udp_open(mux_sess_t *m, mux_stream_t *s) {
+    s->udp = udp_new();
+    if (!s->udp) return stream_close(m, s);
+    s->udp->last_ms = m->now_ms;
+    log_msg(1, "mux: stream %u UDP ASSOCIATE", s->id);
+    wq_push(m, s, g_mux_udp_idle_ms);
+    return send_ctl(m, s->id, MUX_OPEN_OK, NULL, 0);
+}
+
+/* Server: an association's idle deadline came, perhaps moved since */
+static int udp_expire(mux_sess_t *m, mux_stream_t *s) {
+    wq_unlink(m, s);
+    long long idle = m->now_ms - s->udp->last_ms;
+    if (idle < g_mux_udp_idle_ms) {
+        wq_push(m, s, (int)(g_mux_udp_idle_ms - idle));
+        return 0;
+    }
+    log_msg(1, "mux: stream %u UDP association idle", s->id);
+    return stream_close(m, s);
+}
+
+/* Deadlines that passed: connect races start their next attempt or give up
+ * on one, held OPENs go out without data, idle associations end */
+static int expire_waits(mux_sess_t *m) {
+    while (m->wq_head && m->wq_head->deadline <= m->now_ms) {
+        mux_stream_t *s = m->wq_head;
+        if (s->udp) {
+            if (udp_expire(m, s) < 0) return -1;
+            continue;
+        }
+        if (s->flags & MUX_S_OPEN_HELD) {
+            if (open_bare(m, s) < 0) return -1;
+            continue;
+        }
+        if (connect_step(m, s) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Server: look the stream's target up and connect to it. Cached names go
+ * straight to the connect; the rest wait in RESOLVING, peer data queued,
+ * while the relay serves every other stream.
+ */
+static int stream_resolve(mux_sess_t *m, mux_stream_t *s, const char *host,
+                          const char *port) {
+    struct addrinfo *res;
+    int rc = dns_lookup(host, port, s->id, &res);
+    if (rc == 0) {
+        s->flags |= MUX_S_RESOLVING;
+        return 0;
+    }
+    if (rc < 0 || !res) {
+        log_msg(1, "mux: stream %u cannot resolve %s", s->id, host);
+        return stream_close(m, s);
+    }
+    return connect_start(m, s, res);
+}
+
+/* Lookups that finished: their streams start connecting */
+static int resolve_done(mux_sess_t *m) {
+    uint64_t tag;
+    struct addrinfo *res;
+    while (dns_next(&tag, &res)) {
+        mux_stream_t *s = mux_table_find(&m->tab, (uint32_t)tag);
+        if (tag == 0 || !s || !(s->flags & MUX_S_RESOLVING)) {
+            dns_free(res);   /* the prefetch, or a stream gone meanwhile */
+            if (tag == 0 && m->pool) m->pool_retry = m->pool_due = 0;
+            continue;
+        }
+        s->flags &= ~MUX_S_RESOLVING;
+        if (!res) {
+            log_msg(1, "mux: stream %u target does not resolve", s->id);
+            if (stream_close(m, s) < 0) return -1;
+            continue;
+        }
+        if (connect_start(m, s, res) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Stream still has a target to reach, or reached it */
+static int stream_live(const mux_stream_t *s) {
+    return s->fd >= 0 || (s->flags & (MUX_S_RESOLVING | MUX_S_CONNECTING));
+}
+
+/* SOCKS server: the target named in the OPEN, into host and port.
+ * Returns the bytes it took, or -1. */
+static int open_target(mux_stream_t *s, const char *payload, size_t n,
+                       char *host, char *port) {
+    int tlen = socks5_parse_target((const unsigned char *)payload, n, host, port);
+    if (tlen < 0) return -1;
+    log_msg(1, "mux: stream %u CONNECT %s:%s", s->id, host, port);
+    int prio = mux_prio_for_port(atoi(port));
+    if (prio >= 0) stream_set_prio(s, prio);
+    return tlen;
+}
+
+/* Server: OPEN from the peer. Its payload is the opener's class for the
+ * stream and the stream's first bytes, both optional — with the target
+ * between them under SOCKS5. */
+static int open_remote(mux_sess_t *m, uint32_t id, const char *payload, size_t n) {
+    mux_stream_t *s = mux_table_add(&m->tab, id, -1);
+    if (!s) {
+        log_msg(1, "mux: bad OPEN for stream %u", id);
+        return -1;
+    }
+    stream_set_prio(s, m->prio >= 0 ? m->prio : (n ? (unsigned char)payload[0] : -1));
+
+    if (m->socks) {
+        if (n >= 2 && payload[1] == 0) return udp_open(m, s);
+        char host[256], port[6];
+        int tlen = n ? open_target(s, payload + 1, n - 1, host, port) : -1;
+        if (tlen < 0) {
+            log_msg(1, "mux: stream %u has no target", id);
+            return stream_close(m, s);
+        }
+        n -= (size_t)tlen;
+        payload += tlen;
+        if (stream_resolve(m, s, host, port) < 0) return -1;
+    } else {
+        int fd = pool_take(m);
+        if (fd >= 0) {
+            if (stream_connected(m, s, fd) < 0) return -1;
+        } else if (stream_resolve(m, s, m->fwd_host, m->fwd_port) < 0) {
+            return -1;
+        }
+    }
+
+    /* 0-RTT data waits in the stream buffer until the connect is done */
+    if (n > 1 && stream_live(s))
+        return stream_deliver(m, s, payload + 1, n - 1);
+    return 0;
+}
+
+/* One frame from the tunnel. Returns 0, or -1 when the tunnel is done. */
+static int handle_frame(mux_sess_t *m, char *buf, size_t buflen) {
+    mux_header_t hdr;
+    int n = mux_unpack_frame(m->enc_fd, &m->rx, &hdr, buf, buflen);
+    if (n < 0 || (n == 0 && hdr.type == 0)) return -1;
+
+    mux_stream_t *s = mux_table_find(&m->tab, hdr.stream_id);
+    switch (hdr.type) {
+    case MUX_OPEN:
+        if (!m->server) return -1;   /* only the server accepts OPEN */
+        return open_remote(m, hdr.stream_id, buf, (size_t)n);
+
+    case MUX_OPEN_OK:
+        if (!s || s->fd < 0 || m->server) return 0;
+        if (s->flags & MUX_S_SOCKS_WAIT)
+            return socks_answer(m, s, SOCKS5_REP_OK);
+        log_msg(1, "mux: stream %u connected", s->id);
+        return 0;
+
+    case MUX_DATA:
+        /* Frames for a stream we already closed are still in flight */
+        if (!s || !stream_live(s) || n == 0) return 0;
+        return stream_deliver(m, s, buf, (size_t)n);
+
+    case MUX_DGRAM:
+        /* Dropped once the association is closed on our side */
+        if (!s || !s->udp || (s->flags & MUX_S_LOCAL_CLOSED) || n == 0) return 0;
+        if (m->server)
+            udp_to_target(m, s, buf, (size_t)n);
+        else
+            udp_to_app(s, buf, (size_t)n);
+        return 0;
+
+    case MUX_WINDOW: {
+        if (!s || !stream_live(s) || n != 4) return 0;
+        uint32_t inc = ((uint32_t)(unsigned char)buf[0] << 24) |
+                       ((uint32_t)(unsigned char)buf[1] << 16) |
+                       ((uint32_t)(unsigned char)buf[2] << 8) |
+                       (unsigned char)buf[3];
+        if (inc > MUX_STREAM_WINDOW - s->send_window) {
+            log_msg(1, "mux: stream %u credited past its window", s->id);
+            return stream_close(m, s);
+        }
+        s->send_window += inc;
+        stream_rearm(m, s);
+        return 0;
+    }
+
+    case MUX_CLOSE:
+        if (!s) return 0;
+        s->flags |= MUX_S_REMOTE_CLOSED;
+        if (s->fd >= 0)
+            log_msg(1, "mux: stream %u closed by remote", s->id);
+        /* The server could not reach the target */
+        if (s->fd >= 0 && (s->flags & MUX_S_SOCKS_WAIT))
+            return socks_answer(m, s, SOCKS5_REP_HOSTUNREACH);
+        /* Let the local socket take what the peer sent before closing */
+        if (stream_live(s) && s->out_len > s->out_off) {
+            stream_rearm(m, s);
+            return 0;
+        }
+        return stream_close(m, s);
+    }
+    return 0;
+}
+
+/*
+ * One DRR turn for a stream with data waiting: send up to its deficit (as
+ * its room allows) and requeue it if there may be more. A stream that was
+ * quiet for MUX_QUIET_MS starts a new burst, back in NORMAL.
+ */
+static int stream_serve(mux_sess_t *m, mux_stream_t *s, char *buf, size_t buflen) {
+    s->deficit += MUX_QUANTUM;
+    size_t want = s->deficit;
+    if (want > buflen) want = buflen;
+    if (want > send_room(s)) want = send_room(s);
+    if (want == 0) {
+        s->deficit = 0;   /* parked until the peer returns credit */
+        return 0;
+    }
+
+    ssize_t r = read(s->fd, buf, want);
+    if (r < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            s->deficit = 0;
+            return 0;
+        }
+        r = 0;
+    }
+    if (r == 0) {
+        log_msg(1, "mux: stream %u %s EOF", s->id, m->server ? "target" : "local");
+        return stream_close(m, s);
+    }
+
+    if (tunnel_send(m, s->id, MUX_DATA, buf, (size_t)r) < 0) return -1;
+    s->send_window -= (uint32_t)r;
+    s->deficit -= (size_t)r;
+
+    if (m->now_ms - s->last_send_ms > MUX_QUIET_MS) {
+        s->burst = 0;
+        if (!s->pinned) s->prio = MUX_PRIO_NORMAL;
+    }
+    s->last_send_ms = m->now_ms;
+    s->burst += (size_t)r;
+    if (!s->pinned && s->burst >= MUX_BULK_BURST)
+        s->prio = MUX_PRIO_BULK;
+
+    if ((size_t)r < want) {
+        s->deficit = 0;   /* ran dry: the next turn starts fresh */
+        stream_rearm(m, s);
+    } else if (send_room(s) > 0) {
+        rq_push(m, s);    /* maybe more */
+    } else {
+        stream_rearm(m, s);   /* until credit is back */
+    }
+    return 0;
+}
+
+/* One pass over the run queues while the tunnel has room: every stream
+ * queued at the start of its class's turn gets one turn, higher classes first */
+static int schedule(mux_sess_t *m, char *buf, size_t buflen) {
+    for (int c = 0; c < MUX_PRIO_CLASSES; c++) {
+        mux_stream_t *last = m->rq_tail[c];
+        while (m->rq_head[c] && tunnel_ready(m)) {
+            mux_stream_t *s = m->rq_head[c];
+            int end = (s == last);
+            rq_unlink(m, s);
+            if (stream_serve(m, s, buf, buflen) < 0) return -1;
+            if (end) break;
+        }
+    }
+    return 0;
+}
+
+/* Handle every frame the tunnel has ready. Returns -1 when it is done. */
+static int read_tunnel(mux_sess_t *m, char *buf, size_t buflen) {
+    /* Drain the packed record and whatever TLS already decrypted: epoll
+     * cannot see either */
+    do {
+        if (handle_frame(m, buf, buflen) < 0) return -1;
+    } while (m->rx.off < m->rx.len || obfs_tls_pending() > 0);
+    return 0;
+}
+
+/* Tunnel full: service only it until our queued frames are out */
+static int wait_tunnel(mux_sess_t *m, char *buf, size_t buflen, int timeout) {
+    /* Blocked on a full jitter queue: wait for its next release, or for
+     * room when a frame is already due */
+    int jq_full = obfs_jq_full();
+    struct pollfd p;
+    p.fd = m->enc_fd;
+    p.events = jq_full && obfs_jq_wait_fd() < 0 ? POLLIN : POLLIN | POLLOUT;
+    p.revents = 0;
+    if (m->rx.off < m->rx.len || obfs_tls_pending() > 0)
+        p.revents = POLLIN;
+    else if (poll(&p, 1, timeout) < 0)
+        return errno == EINTR ? 0 : -1;
+    if (obfs_jq_flush() < 0) return -1;
+    m->now_ms = mono_ms();
+    if (((p.revents & POLLOUT) || (jq_full && !obfs_jq_full())) && flush_ctl(m) < 0)
+        return -1;
+    if ((p.revents & (POLLIN | POLLHUP | POLLERR)) && read_tunnel(m, buf, buflen) < 0)
+        return 1;
+    return 0;
+}
+
+static int mux_loop(mux_sess_t *m) {
+    char buf[MUX_MAX_PAYLOAD];
+    ev_event_t evs[MUX_EVENTS];
 
     for (;;) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(enc_fd, &rfds);
-        FD_SET(listen_fd, &rfds);
+        /* End of a pass: what it produced goes out as one record — into
+         * the jitter queue, whose next release the timeout must cover */
+        if (tunnel_flush(m) < 0) return -1;
+        if (obfs_jq_wait_fd() >= 0) m->tx_blocked = 1;
 
-        int nfds = enc_fd > listen_fd ? enc_fd : listen_fd;
+        struct timeval tv;
+        struct timeval *tvp = obfs_jq_timeout(&tv);
+        int timeout = tvp ? (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000) : -1;
+        if (m->wq_head) {
+            long long left = m->wq_head->deadline - mono_ms();
+            if (left < 0) left = 0;
+            if (timeout < 0 || left < timeout) timeout = (int)left;
+        }
+        if (m->pool && m->pool_due >= 0) {
+            long long left = m->pool_due - mono_ms();
+            if (left < 0) left = 0;
+            if (timeout < 0 || left < timeout) timeout = (int)left;
+        }
 
-        for (int i = 0; i < MUX_MAX_STREAMS; i++) {
-            if (streams[i] >= 0) {
-                FD_SET(streams[i], &rfds);
-                if (streams[i] > nfds) nfds = streams[i];
-            }
+        if (m->tx_blocked) {
+            int rc = wait_tunnel(m, buf, sizeof(buf), timeout);
+            if (rc != 0) return rc < 0 ? -1 : 0;
+            continue;
         }
 
-        int ret = select(nfds + 1, &rfds, NULL, NULL, NULL);
-        if (ret < 0) {
+        int n = ev_wait(m->ev, evs, MUX_EVENTS, rq_empty(m) ? timeout : 0);
+        if (n < 0) {
             if (errno == EINTR) continue;
-            break;
+            return -1;
         }
+        if (obfs_jq_flush() < 0) return -1;
+        m->now_ms = mono_ms();
+        if (expire_waits(m) < 0) return -1;
+        if (m->pool && m->pool_due >= 0 && m->pool_due <= m->now_ms) pool_tick(m);
 
-        /* New local connection */
-        if (FD_ISSET(listen_fd, &rfds)) {
-            int client_fd = net_accept(listen_fd);
-            if (client_fd >= 0 && next_id < MUX_MAX_STREAMS) {
-                int sid = next_id++;
-                streams[sid] = client_fd;
-                mux_write_frame(enc_fd, (unsigned char)sid, MUX_OPEN, NULL, 0);
-                log_msg(1, "mux: stream %d opened (local)", sid);
-            } else if (client_fd >= 0) {
-                close(client_fd);
-                fprintf(stderr, "mux: max streams reached\n");
+        for (int i = 0; i < n; i++) {
+            if (evs[i].tag == TAG_ENC) {
+                if (read_tunnel(m, buf, sizeof(buf)) < 0) return 0;
+                continue;
+            }
+            if (evs[i].tag == TAG_LISTEN) {
+                if (accept_local(m) < 0) return -1;
+                continue;
+            }
+            if (evs[i].tag == TAG_DNS) {
+                if (resolve_done(m) < 0) return -1;
+                continue;
             }
-        }
 
-        /* Encrypted side → demux */
-        if (FD_ISSET(enc_fd, &rfds)) {
-            mux_header_t hdr;
-            int n = mux_read_frame(enc_fd, &hdr, buf, sizeof(buf));
-
-            if (n < 0 || (n == 0 && hdr.type == 0)) break;
-
-            switch (hdr.type) {
-            case MUX_DATA:
-                if (hdr.stream_id < MUX_MAX_STREAMS &&
-                    streams[hdr.stream_id] >= 0) {
-                    if (write_all(streams[hdr.stream_id], buf, (size_t)n) < 0) {
-                        close(streams[hdr.stream_id]);
-                        streams[hdr.stream_id] = -1;
-                        mux_write_frame(enc_fd, hdr.stream_id, MUX_CLOSE, NULL, 0);
-                    }
-                }
-                break;
-
-            case MUX_CLOSE:
-                if (hdr.stream_id < MUX_MAX_STREAMS &&
-                    streams[hdr.stream_id] >= 0) {
-                    close(streams[hdr.stream_id]);
-                    streams[hdr.stream_id] = -1;
-                    log_msg(1, "mux: stream %d closed by remote", hdr.stream_id);
-                }
-                break;
+            /* The stream may have closed earlier in this batch */
+            uint32_t id = (uint32_t)evs[i].tag;
+            mux_stream_t *s = mux_table_find(&m->tab, id);
+            if (evs[i].tag & TAG_RACE) {
+                if (s && (s->flags & MUX_S_CONNECTING) && connect_step(m, s) < 0)
+                    return -1;
+                continue;
             }
-        }
+            if (evs[i].tag & TAG_POOL) {
+                pool_event(m, (int)(uint32_t)evs[i].tag, evs[i].events);
+                continue;
+            }
+            if (evs[i].tag & TAG_UDP) {
+                if (s && s->udp && udp_read(m, s, (int)(evs[i].tag >> 32) & 1, buf) < 0)
+                    return -1;
+                continue;
+            }
+            if (!s || s->fd < 0) continue;
 
-        /* Local connections → mux frames */
-        for (int i = 0; i < MUX_MAX_STREAMS; i++) {
-            if (streams[i] >= 0 && FD_ISSET(streams[i], &rfds)) {
-                ssize_t n = read(streams[i], buf, sizeof(buf));
-                if (n <= 0) {
-                    close(streams[i]);
-                    streams[i] = -1;
-                    mux_write_frame(enc_fd, (unsigned char)i, MUX_CLOSE, NULL, 0);
-                    log_msg(1, "mux: stream %d local EOF", i);
-                } else {
-                    if (mux_write_frame(enc_fd, (unsigned char)i,
-                                        MUX_DATA, buf, (size_t)n) < 0)
-                        goto done;
-                }
+            if (s->flags & MUX_S_OPEN_HELD) {
+                if (open_first(m, s, buf, sizeof(buf)) < 0) return -1;
+                continue;
+            }
+            if (s->flags & MUX_S_SOCKS_NEGOTIATING) {
+                if (socks_negotiate(m, s, buf) < 0) return -1;
+                continue;
+            }
+            if (s->udp) {
+                if (udp_hold(m, s, buf, sizeof(buf)) < 0) return -1;
+                continue;
+            }
+            if (evs[i].events & EV_WRITE) {
+                if (stream_flush(m, s) < 0) return -1;
+                if (!(s = mux_table_find(&m->tab, id)) || s->fd < 0) continue;
+            }
+            if (evs[i].events & EV_READ) {
+                rq_push(m, s);
+            } else if ((evs[i].events & EV_HUP) && !(evs[i].events & EV_WRITE)) {
+                /* Socket died while we were not reading from it */
+                if (stream_close(m, s) < 0) return -1;
             }
         }
+        if (schedule(m, buf, sizeof(buf)) < 0) return -1;
     }
+}
+
+static int mux_run(mux_sess_t *m) {
+    ev_raise_nofile();
+
+    /* OPEN/CLOSE and short replies are tiny records: without this, Nagle
+     * holds each one back until the previous is ACKed (delayed ACK, ~40ms) */
+    int one = 1;
+    setsockopt(m->enc_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = MUX_NOTSENT_LOWAT;
+    setsockopt(m->enc_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+
+    int rc = -1;
+    m->ev = ev_new();
+    if (!m->ev || mux_table_init(&m->tab, !m->server) < 0) {
+        ev_free(m->ev);
+        return -1;
+    }
+    if (m->npool) {
+        m->pool = calloc((size_t)m->npool, sizeof(*m->pool));
+        if (!m->pool) m->npool = 0;
+        for (int i = 0; i < m->npool; i++) m->pool[i].fd = -1;
+        m->pool_due = 0;   /* fill on the first pass */
+    }
+    if (ev_add(m->ev, m->enc_fd, EV_READ, TAG_ENC) == 0 &&
+        (m->listen_fd < 0 || ev_add(m->ev, m->listen_fd, EV_READ, TAG_LISTEN) == 0) &&
+        (!m->server || ev_add(m->ev, dns_fd(), EV_READ, TAG_DNS) == 0))
+        rc = mux_loop(m);
+
+    tunnel_flush(m);
+    obfs_jq_drain();
+    for (uint32_t i = 0; i < m->tab.cap; i++) {
+        mux_stream_t *s = m->tab.slots[i];
+        if (s && s->fd >= 0) close(s->fd);
+    }
+    for (uint32_t i = 0; i < m->tab.cap; i++) {
+        mux_stream_t *s = m->tab.slots[i];
+        if (s && (s->flags & MUX_S_RESOLVING)) dns_cancel(s->id);
+        if (s) race_end(s);
+        if (s) udp_end(m, s);
+    }
+    for (int i = 0; i < m->npool; i++) pool_drop(m, &m->pool[i]);
+    free(m->pool);
+    mux_table_free(&m->tab);
+    ev_free(m->ev);
+    free(m->ctl);
+    if (m->server) dns_log_stats();
+    return rc < 0 ? rc : 0;
+}
+
+/* ──────────── Server-side mux relay ──────────── */
+
+int mux_relay_server(int enc_fd, const char *fwd_host, const char *fwd_port) {
+    mux_sess_t m;
+    memset(&m, 0, sizeof(m));
+    m.enc_fd = enc_fd;
+    m.server = 1;
+    m.listen_fd = -1;
+    m.fwd_host = fwd_host;
+    m.fwd_port = fwd_port;
+    m.prio = mux_prio_for_port(atoi(fwd_port));
+    m.npool = g_mux_pool < MUX_POOL_MAX ? g_mux_pool : MUX_POOL_MAX;
 
-done:
-    close(listen_fd);
-    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
-        if (streams[i] >= 0) close(streams[i]);
+    /* Start the lookup now, so the first OPEN finds it cached or in flight */
+    struct addrinfo *res;
+    if (dns_lookup(fwd_host, fwd_port, 0, &res) == 1) {
+        if (!res) log_msg(1, "mux: cannot resolve %s:%s", fwd_host, fwd_port);
+        dns_free(res);
     }
+
+    log_msg(1, "mux: server relay -> %s:%s", fwd_host, fwd_port);
+    mux_run(&m);
+    return 0;
+}
+
+int mux_relay_socks_server(int enc_fd) {
+    mux_sess_t m;
+    memset(&m, 0, sizeof(m));
+    m.enc_fd = enc_fd;
+    m.server = 1;
+    m.socks = 1;
+    m.listen_fd = -1;
+    m.prio = -1;   /* by target port, per stream */
+
+    log_msg(1, "mux: SOCKS5 server relay");
+    mux_run(&m);
     return 0;
 }
+
+/* ──────────── Client-side mux relay ──────────── */
+
+static int listen_ready(int fd) {
+    /* Bursts of local connects should queue, not be refused */
+    listen(fd, SOMAXCONN);
+    set_nonblock(fd);
+    return fd;
+}
+
+int mux_listen(const char *local_port) {
+    return listen_ready(net_listen(local_port));
+}
+
+void mux_listen_group(const char *local_port, int *fds, int n) {
+#ifdef __linux__
+    for (int i = 0; i < n; i++)
+        fds[i] = listen_ready(net_listen_reuseport(local_port));
+#else
+    /* No balancing group: the relays take turns on one listener */
+    fds[0] = mux_listen(local_port);
+    for (int i = 1; i < n; i++)
+        fds[i] = fds[0];
+#endif
+}
+
+static int relay_client(int enc_fd, int listen_fd, int socks) {
+    mux_sess_t m;
+    memset(&m, 0, sizeof(m));
+    m.enc_fd = enc_fd;
+    m.socks = socks;
+    m.listen_fd = listen_fd;
+
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    int port = 0;
+    if (getsockname(listen_fd, (struct sockaddr *)&ss, &slen) == 0)
+        port = ntohs(ss.ss_family == AF_INET6 ?
+                     ((struct sockaddr_in6 *)&ss)->sin6_port :
+                     ((struct sockaddr_in *)&ss)->sin_port);
+    m.prio = mux_prio_for_port(port);
+
+    log_msg(1, "mux: %sclient relay on *:%d", socks ? "SOCKS5 " : "", port);
+    mux_run(&m);
+    return 0;
+}
+
+int mux_relay_client(int enc_fd, int listen_fd) {
+    return relay_client(enc_fd, listen_fd, 0);
+}
+
+int mux_relay_socks_client(int enc_fd, int listen_fd) {
+    return relay_client(enc_fd, listen_fd, 1);
+}
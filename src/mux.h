@@ -2,52 +2,247 @@
 #define CLAWSEC_MUX_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* Mux frame types */
 #define MUX_DATA   0x01
 #define MUX_OPEN   0x02
 #define MUX_CLOSE  0x03
+#define MUX_WINDOW 0x04   /* payload: 4-byte BE credit increment */
+#define MUX_OPEN_OK 0x05  /* server reached the target; failure is a CLOSE */
+#define MUX_DGRAM  0x06   /* one datagram of a UDP association (socks5.h) */
 
-/* Max concurrent streams */
-#define MUX_MAX_STREAMS 64
+/*
+ * Datagrams are not flow-controlled and may be dropped: when the tunnel is
+ * full, the target name is still being looked up, or the association is
+ * gone. Peers that predate them ignore the frame. An association that
+ * carried nothing for MUX_UDP_IDLE_MS is closed by the server.
+ */
+#define MUX_UDP_IDLE_MS (120 * 1000)
 
-/* Frame header: stream_id(1) + type(1) + len(2) = 4 bytes */
-#define MUX_HDR_SIZE 4
+/*
+ * OPEN payload (optional): the opener's class for the stream (MUX_PRIO_*,
+ * or MUX_OPEN_NOPRIO), then the first bytes of the stream — 0-RTT data the
+ * server writes to the target as soon as it is connected. Under SOCKS5
+ * the stream's target (socks5.h) sits between the two and is required.
+ */
+#define MUX_OPEN_NOPRIO 0xFF
+#define MUX_OPEN_HOLD_MS 2   /* client waits this long for those bytes */
 
-/* Max payload per frame */
-#define MUX_MAX_PAYLOAD 8192
+/* Wire format version, first byte of every frame */
+#define MUX_VERSION 2
+
+/*
+ * Frame header (v2): version(1) + type(1) + len(2 BE) + stream_id(4 BE).
+ * The tunnel client opens odd stream ids, the server even ones; 0 is
+ * reserved for frames about the whole tunnel.
+ */
+#define MUX_HDR_SIZE 8
+
+/*
+ * Per-stream flow control: each side may have at most this many bytes in
+ * flight on a stream that the other end has not yet handed to its local
+ * socket. Receivers return credit with MUX_WINDOW once a quarter of it has
+ * been delivered, so a slow consumer only ever stalls its own stream.
+ */
+#define MUX_STREAM_WINDOW (256 * 1024)
+
+/*
+ * Sender scheduling: ready streams are served by deficit round robin, one
+ * quantum per stream per pass, highest class first. A stream without an
+ * explicit class starts NORMAL and drops to BULK, with at most
+ * MUX_BULK_INFLIGHT bytes outstanding, once it has sent MUX_BULK_BURST
+ * bytes without a MUX_QUIET_MS pause — so a download cannot delay
+ * keystrokes on the same tunnel. OPEN and WINDOW frames go ahead of DATA.
+ */
+#define MUX_PRIO_INTERACTIVE 0
+#define MUX_PRIO_NORMAL      1
+#define MUX_PRIO_BULK        2
+#define MUX_PRIO_CLASSES     3
+
+#define MUX_QUANTUM    MUX_MAX_PAYLOAD
+#define MUX_BULK_BURST (512 * 1024)
+#define MUX_BULK_INFLIGHT (MUX_STREAM_WINDOW / 2)
+#define MUX_QUIET_MS   50
+
+/* A whole frame must fit one farm9crypt record (FARM9_MAX_MSG) */
+#define MUX_FRAME_MAX   8192
+#define MUX_MAX_PAYLOAD (MUX_FRAME_MAX - MUX_HDR_SIZE)
 
 /* Frame header structure */
 typedef struct {
-    unsigned char stream_id;
+    uint32_t stream_id;
     unsigned char type;
     unsigned short length;
 } mux_header_t;
 
-/* Encode frame header into 4-byte buffer. Returns MUX_HDR_SIZE. */
-int mux_encode_header(unsigned char *buf, unsigned char stream_id,
+/* Encode frame header into MUX_HDR_SIZE bytes. Returns MUX_HDR_SIZE. */
+int mux_encode_header(unsigned char *buf, uint32_t stream_id,
                       unsigned char type, unsigned short length);
 
-/* Decode frame header from 4-byte buffer. Returns 0 or -1. */
+/* Decode frame header. Returns 0, or -1 on a bad version or length. */
 int mux_decode_header(const unsigned char *buf, mux_header_t *hdr);
 
 /* Write a mux frame through encrypted channel. Returns payload len or -1. */
-int mux_write_frame(int sockfd, unsigned char stream_id,
+int mux_write_frame(int sockfd, uint32_t stream_id,
                     unsigned char type, const void *data, size_t len);
 
 /*
- * Read a mux frame from encrypted channel.
+ * Read a mux frame from encrypted channel (first frame of the record).
  * Returns: >0 payload len, 0 with hdr.type>0 = valid empty frame,
  *          0 with hdr.type==0 = EOF, <0 = error.
  */
 int mux_read_frame(int sockfd, mux_header_t *hdr, void *buf, size_t buflen);
 
+/*
+ * Frame packing: one farm9crypt record may carry several frames back to
+ * back, so a burst of small frames from different streams costs one AEAD
+ * seal and one write instead of one each.
+ */
+typedef struct {
+    unsigned char buf[MUX_FRAME_MAX];
+    size_t len;          /* bytes queued (tx) or in the record (rx) */
+    size_t off;          /* rx: next unread frame */
+} mux_rec_t;
+
+/* Queue a frame in rec, sending rec first if the frame does not fit.
+ * Returns payload len or -1. */
+int mux_pack_frame(int sockfd, mux_rec_t *rec, uint32_t stream_id,
+                   unsigned char type, const void *data, size_t len);
+
+/* Send the queued frames as one record (no-op when empty). Returns 0 or -1. */
+int mux_pack_flush(int sockfd, mux_rec_t *rec);
+
+/* Next frame of rec, reading a new record once it is used up. Returns as
+ * mux_read_frame. */
+int mux_unpack_frame(int sockfd, mux_rec_t *rec, mux_header_t *hdr,
+                     void *buf, size_t buflen);
+
+/*
+ * Stream table: open addressing (linear probing) on the stream id, so
+ * lookups stay O(1) with tens of thousands of streams. Ids this side
+ * allocates are recycled once both ends have sent CLOSE for them — after
+ * that no frame for the old stream can still be in flight.
+ */
+#define MUX_S_LOCAL_CLOSED  0x01   /* we sent CLOSE */
+#define MUX_S_REMOTE_CLOSED 0x02   /* peer sent CLOSE */
+#define MUX_S_CONNECTING    0x04   /* server: target connect race running */
+#define MUX_S_OPEN_HELD     0x08   /* client: OPEN waits for the first bytes */
+#define MUX_S_SOCKS_HELLO   0x10   /* SOCKS client: awaiting the greeting */
+#define MUX_S_SOCKS_REQUEST 0x20   /* SOCKS client: awaiting the CONNECT */
+#define MUX_S_SOCKS_WAIT    0x40   /* SOCKS client: OPEN sent, reply pending */
+#define MUX_S_RESOLVING     0x80   /* server: target name lookup in progress */
+
+struct addrinfo;
+
+typedef struct mux_stream {
+    uint32_t id;
+    int fd;              /* local socket (non-blocking), -1 once closed */
+    unsigned flags;      /* MUX_S_* */
+    int events;          /* EV_* currently watched on fd */
+    uint32_t send_window;    /* bytes the peer still accepts from us */
+    uint32_t recv_consumed;  /* delivered locally, not yet credited back */
+    char *out;               /* peer data the local socket has not taken
+                                (SOCKS client: the request read so far) */
+    size_t out_off, out_len; /* pending bytes are out[out_off..out_len) */
+    unsigned char prio;      /* MUX_PRIO_* */
+    unsigned char pinned;    /* class set explicitly, never demoted */
+    unsigned char queued;    /* on a run queue */
+    size_t deficit;          /* DRR bytes this stream may still send */
+    size_t burst;            /* sent since it was last quiet */
+    long long last_send_ms;
+    struct mux_stream *rq_prev, *rq_next;
+    struct mux_race *race;   /* server: connect attempts in flight */
+    struct addrinfo *ai;     /* server: target addresses (dns.h) */
+    long long deadline;      /* connect race's next step, or held OPEN goes
+                                out bare */
+    struct mux_stream *wq_prev, *wq_next;
+    struct mux_udp *udp;     /* SOCKS5 UDP ASSOCIATE: its sockets */
+} mux_stream_t;
+
+typedef struct {
+    mux_stream_t **slots;
+    uint32_t cap;        /* power of two */
+    uint32_t count;
+    uint32_t next_id;    /* next never-used id of our parity */
+    uint32_t *free_ids;  /* recycled ids, reused first */
+    uint32_t nfree, free_cap;
+} mux_table_t;
+
+/* odd: this side allocates odd ids (tunnel client). Returns 0 or -1. */
+int mux_table_init(mux_table_t *t, int odd);
+
+/* Free every stream entry (their fds are not closed) */
+void mux_table_free(mux_table_t *t);
+
+/* New stream with an id of our parity. Returns NULL when out of ids/memory. */
+mux_stream_t *mux_table_open(mux_table_t *t, int fd);
+
+/* Stream opened by the peer under its id. NULL if taken or out of memory. */
+mux_stream_t *mux_table_add(mux_table_t *t, uint32_t id, int fd);
+
+mux_stream_t *mux_table_find(const mux_table_t *t, uint32_t id);
+
+/* Drop and free a stream (and its buffer, addresses and association
+ * state); its id returns to the pool if we allocated it. A pending lookup
+ * and the association's sockets are the caller's to end. */
+void mux_table_remove(mux_table_t *t, mux_stream_t *s);
+
+/*
+ * Classes by port, "PORT=CLASS[,PORT=CLASS...]" with CLASS interactive,
+ * normal or bulk. Matched against the forward target's port on the server
+ * and the local listening port on the client (under SOCKS5, the stream's
+ * target port on both). Returns 0 or -1.
+ */
+int mux_prio_parse(const char *spec);
+
+/* Class configured for port, or -1 */
+int mux_prio_for_port(int port);
+
 /* Server-side mux: demux encrypted frames to target connections */
 int mux_relay_server(int enc_fd, const char *fwd_host, const char *fwd_port);
 
-/* Client-side mux: accept local connections, mux through encrypted tunnel */
-int mux_relay_client(int enc_fd, const char *local_port);
+/* Non-blocking local listener for mux_relay_client (exits on error) */
+int mux_listen(const char *local_port);
+
+/*
+ * n listeners on one port for n client relays (--mux-conns), each with its
+ * own tunnel. On Linux they form a SO_REUSEPORT group, so the kernel
+ * spreads local connections evenly over the tunnels; elsewhere all n are
+ * the same socket.
+ */
+void mux_listen_group(const char *local_port, int *fds, int n);
+
+/* Client-side mux: accept local connections from listen_fd, mux through
+ * the encrypted tunnel. listen_fd is left open. */
+int mux_relay_client(int enc_fd, int listen_fd);
+
+/*
+ * SOCKS5 over mux (socks5.c): the client answers each local application's
+ * greeting and CONNECT, and names the target in the stream's OPEN; the
+ * server connects every stream to its own target.
+ */
+int mux_relay_socks_server(int enc_fd);
+int mux_relay_socks_client(int enc_fd, int listen_fd);
+
+/* Most tunnels one client may stripe streams over */
+#define MUX_MAX_CONNS 16
+
+/*
+ * Warm target connections (--target-pool N): a relay server with a fixed
+ * target (-R client, --mux -L server) keeps N connections to it open
+ * ahead of time, so an OPEN is answered without waiting for a connect.
+ * Each one taken is replaced at once. One the target closes is replaced
+ * too, and none is kept past MUX_POOL_MAX_AGE_MS, before targets time out
+ * idle connections themselves. Refills wait MUX_POOL_RETRY_MS after a
+ * failed connect.
+ */
+#define MUX_POOL_MAX         64
+#define MUX_POOL_MAX_AGE_MS  (15 * 1000)
+#define MUX_POOL_RETRY_MS    1000
 
 extern int g_mux;
+extern int g_mux_pool;          /* --target-pool size, 0: none */
+extern int g_mux_udp_idle_ms;   /* MUX_UDP_IDLE_MS; tests shorten it */
 
 #endif
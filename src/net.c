@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE   /* SO_REUSEPORT */
+#endif
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,142 +10,199 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <time.h>
 
 #include "net.h"
 #include "util.h"
 
-int net_connect(const char *host, const char *port, int timeout_sec) {
-    struct addrinfo hints, *res = NULL, *rp;
-    int sock = -1, ret;
-
+static struct addrinfo *lookup(const char *host, const char *port, int *err) {
+    struct addrinfo hints, *res = NULL;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family   = g_af_family;
     hints.ai_socktype = g_udp_mode ? SOCK_DGRAM : SOCK_STREAM;
+    *err = getaddrinfo(host, port, &hints, &res);
+    return *err == 0 ? res : NULL;
+}
 
-    ret = getaddrinfo(host, port, &hints, &res);
-    if (ret != 0) fatal("getaddrinfo(%s,%s): %s", host, port, gai_strerror(ret));
-
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sock < 0) continue;
-
-        int yes = 1;
-        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-
-        if (!g_udp_mode && timeout_sec > 0) {
-            int flags = fcntl(sock, F_GETFL, 0);
-            if (flags < 0) flags = 0;
-            fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-        }
-
-        ret = connect(sock, rp->ai_addr, rp->ai_addrlen);
-        if (ret == 0) {
-            if (!g_udp_mode && timeout_sec > 0) {
-                int flags = fcntl(sock, F_GETFL, 0);
-                fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
-            }
-            break;
-        }
-
-        if (!g_udp_mode && timeout_sec > 0 && errno == EINPROGRESS) {
-            fd_set wfds;
-            struct timeval tv;
-            FD_ZERO(&wfds);
-            FD_SET(sock, &wfds);
-            tv.tv_sec = timeout_sec;
-            tv.tv_usec = 0;
-            ret = select(sock + 1, NULL, &wfds, NULL, &tv);
-            if (ret > 0 && FD_ISSET(sock, &wfds)) {
-                int err = 0;
-                socklen_t slen = sizeof(err);
-                if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &slen) == 0 && err == 0) {
-                    int flags = fcntl(sock, F_GETFL, 0);
-                    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
-                    break;
-                }
-                errno = err;
-            } else if (ret == 0) {
-                errno = ETIMEDOUT;
-            }
-        }
-
-        close(sock);
-        sock = -1;
-    }
-
+int net_connect(const char *host, const char *port, int timeout_sec) {
+    int ret;
+    struct addrinfo *res = lookup(host, port, &ret);
+    if (!res) fatal("getaddrinfo(%s,%s): %s", host, port, gai_strerror(ret));
+    int sock = net_connect_addrs(res, timeout_sec);
     freeaddrinfo(res);
     if (sock < 0) fatal("connect to %s:%s failed", host, port);
     return sock;
 }
 
 int net_try_connect(const char *host, const char *port, int timeout_sec) {
-    struct addrinfo hints, *res = NULL, *rp;
-    int sock = -1, ret;
+    int ret;
+    struct addrinfo *res = lookup(host, port, &ret);
+    if (!res) return -1;
+    int sock = net_connect_addrs(res, timeout_sec);
+    freeaddrinfo(res);
+    return sock;
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = g_af_family;
-    hints.ai_socktype = g_udp_mode ? SOCK_DGRAM : SOCK_STREAM;
+int net_connect_start(const struct addrinfo *ai) {
+    int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock < 0) return -1;
+    set_nonblock(sock);
+    if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+        return sock;
+    close(sock);
+    return -1;
+}
 
-    ret = getaddrinfo(host, port, &hints, &res);
-    if (ret != 0) return -1;
+int net_connect_finish(int fd) {
+    int err = 0;
+    socklen_t slen = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &slen) < 0) return errno;
+    return err;
+}
 
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sock < 0) continue;
+/* ──────────── Happy Eyeballs (RFC 8305) ──────────── */
+
+/* Alternate address families, starting with the resolver's first choice
+ * (RFC 8305 section 4, First Address Family Count 1) */
+static void race_order(net_race_t *r, const struct addrinfo *res) {
+    const struct addrinfo *first[NET_RACE_ADDRS], *other[NET_RACE_ADDRS];
+    int nfirst = 0, nother = 0;
+    int family = res ? res->ai_family : AF_UNSPEC;
+    for (; res; res = res->ai_next) {
+        if (res->ai_family == family) {
+            if (nfirst < NET_RACE_ADDRS) first[nfirst++] = res;
+        } else if (nother < NET_RACE_ADDRS) {
+            other[nother++] = res;
+        }
+    }
+    for (int i = 0; (i < nfirst || i < nother) && r->naddr < NET_RACE_ADDRS; i++) {
+        if (i < nfirst) r->addr[r->naddr++] = first[i];
+        if (i < nother && r->naddr < NET_RACE_ADDRS) r->addr[r->naddr++] = other[i];
+    }
+}
 
-        int yes = 1;
-        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+void net_race_init(net_race_t *r, const struct addrinfo *res, int timeout_ms) {
+    memset(r, 0, sizeof(*r));
+    race_order(r, res);
+    r->timeout_ms = timeout_ms;
+    r->err = EHOSTUNREACH;
+}
 
-        if (!g_udp_mode && timeout_sec > 0) {
-            int flags = fcntl(sock, F_GETFL, 0);
-            if (flags < 0) flags = 0;
-            fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-        }
+/* Give up on attempt i */
+static void race_drop(net_race_t *r, int i) {
+    if (r->unwatch) r->unwatch(r->ctx, r->fd[i]);
+    close(r->fd[i]);
+    r->nfd--;
+    r->fd[i] = r->fd[r->nfd];
+    r->deadline[i] = r->deadline[r->nfd];
+}
 
-        ret = connect(sock, rp->ai_addr, rp->ai_addrlen);
-        if (ret == 0) {
-            if (!g_udp_mode && timeout_sec > 0) {
-                int flags = fcntl(sock, F_GETFL, 0);
-                fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
-            }
-            break;
-        }
+void net_race_abort(net_race_t *r) {
+    while (r->nfd > 0) race_drop(r, r->nfd - 1);
+    r->next = r->naddr;
+}
 
-        if (!g_udp_mode && timeout_sec > 0 && errno == EINPROGRESS) {
-            fd_set wfds;
-            struct timeval tv;
-            FD_ZERO(&wfds);
-            FD_SET(sock, &wfds);
-            tv.tv_sec = timeout_sec;
-            tv.tv_usec = 0;
-            ret = select(sock + 1, NULL, &wfds, NULL, &tv);
-            if (ret > 0 && FD_ISSET(sock, &wfds)) {
-                int err = 0;
-                socklen_t slen = sizeof(err);
-                if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &slen) == 0 && err == 0) {
-                    int flags = fcntl(sock, F_GETFL, 0);
-                    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
-                    break;
+int net_race_step(net_race_t *r, long long now_ms, int *wait_ms) {
+    /* Attempts that finished: the first success wins, a failure lets the
+     * next address start at once */
+    if (r->nfd > 0) {
+        struct pollfd p[NET_RACE_ADDRS];
+        int n = r->nfd;
+        for (int i = 0; i < n; i++) {
+            p[i].fd = r->fd[i];
+            p[i].events = POLLOUT;
+            p[i].revents = 0;
+        }
+        if (poll(p, (nfds_t)n, 0) > 0) {
+            /* Backwards, so race_drop only moves attempts already seen */
+            for (int i = n - 1; i >= 0; i--) {
+                if (!p[i].revents) continue;
+                int err = net_connect_finish(r->fd[i]);
+                if (err == 0) {
+                    int fd = r->fd[i];
+                    r->nfd--;
+                    r->fd[i] = r->fd[r->nfd];
+                    r->deadline[i] = r->deadline[r->nfd];
+                    net_race_abort(r);
+                    return fd;
                 }
-                errno = err;
-            } else if (ret == 0) {
-                errno = ETIMEDOUT;
+                r->err = err;
+                race_drop(r, i);
+                r->next_ms = now_ms;
             }
         }
+    }
 
-        close(sock);
-        sock = -1;
+    for (int i = r->nfd - 1; i >= 0; i--) {
+        if (r->timeout_ms > 0 && r->deadline[i] <= now_ms) {
+            r->err = ETIMEDOUT;
+            race_drop(r, i);
+            r->next_ms = now_ms;
+        }
     }
 
-    freeaddrinfo(res);
-    return sock;
+    /* Next address once the delay is up, or right away if none is left
+     * in flight */
+    while (r->next < r->naddr && (r->nfd == 0 || now_ms >= r->next_ms)) {
+        int fd = net_connect_start(r->addr[r->next++]);
+        if (fd < 0) {
+            r->err = errno;
+            continue;
+        }
+        if (r->watch && r->watch(r->ctx, fd) < 0) {
+            close(fd);
+            continue;
+        }
+        r->fd[r->nfd] = fd;
+        r->deadline[r->nfd] = now_ms + r->timeout_ms;
+        r->nfd++;
+        r->next_ms = now_ms + NET_RACE_DELAY_MS;
+    }
+    if (r->nfd == 0) return -2;
+
+    long long due = r->next < r->naddr ? r->next_ms : -1;
+    for (int i = 0; i < r->nfd; i++)
+        if (r->timeout_ms > 0 && (due < 0 || r->deadline[i] < due))
+            due = r->deadline[i];
+    *wait_ms = due < 0 ? -1 : (int)(due > now_ms ? due - now_ms : 0);
+    return -1;
 }
 
-int net_listen(const char *port) {
+int net_connect_addrs(const struct addrinfo *res, int timeout_sec) {
+    net_race_t r;
+    net_race_init(&r, res, timeout_sec > 0 ? timeout_sec * 1000 : 0);
+    for (;;) {
+        int wait;
+        int fd = net_race_step(&r, mono_ms(), &wait);
+        if (fd >= 0) {
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+            return fd;
+        }
+        if (fd == -2) {
+            errno = r.err;
+            return -1;
+        }
+
+        /* poll, not select: relays with many streams pass fd 1024 */
+        struct pollfd p[NET_RACE_ADDRS];
+        for (int i = 0; i < r.nfd; i++) {
+            p[i].fd = r.fd[i];
+            p[i].events = POLLOUT;
+            p[i].revents = 0;
+        }
+        if (poll(p, (nfds_t)r.nfd, wait) < 0 && errno != EINTR) {
+            net_race_abort(&r);
+            return -1;
+        }
+    }
+}
+
+static int listen_on(const char *port, int reuseport) {
     struct addrinfo hints, *res = NULL, *rp;
     int listen_fd = -1, ret;
 
@@ -160,6 +220,12 @@ int net_listen(const char *port) {
 
         int yes = 1;
         setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+        if (reuseport)
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#else
+        (void)reuseport;
+#endif
 
         if (rp->ai_family == AF_INET6 && g_af_family == AF_UNSPEC) {
             int no = 0;
@@ -186,6 +252,14 @@ int net_listen(const char *port) {
     return listen_fd;
 }
 
+int net_listen(const char *port) {
+    return listen_on(port, 0);
+}
+
+int net_listen_reuseport(const char *port) {
+    return listen_on(port, 1);
+}
+
 int net_accept(int listen_fd) {
     struct sockaddr_storage ss;
     socklen_t slen = sizeof(ss);
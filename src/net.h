@@ -1,12 +1,17 @@
 #ifndef CLAWSEC_NET_H
 #define CLAWSEC_NET_H
 
-/* Connect to host:port with optional timeout. Returns socket fd or exits on error. */
+/* Connect to host:port (Happy Eyeballs, below) with optional timeout per
+ * address. Returns socket fd or exits on error. */
 int net_connect(const char *host, const char *port, int timeout_sec);
 
 /* Bind and listen (TCP) or bind (UDP) on port. Returns fd or exits on error. */
 int net_listen(const char *port);
 
+/* net_listen with SO_REUSEPORT: sockets of one group may bind the same port
+ * and Linux spreads new connections over them */
+int net_listen_reuseport(const char *port);
+
 /* Accept one TCP connection. Returns fd or exits on error. */
 int net_accept(int listen_fd);
 
@@ -16,6 +21,63 @@ int net_udp_accept(int udp_fd);
 /* Like net_connect but returns -1 on failure instead of exiting */
 int net_try_connect(const char *host, const char *port, int timeout_sec);
 
+/*
+ * Non-blocking connects: start one address, finish it when the socket
+ * turns writable. The race below is built from these.
+ */
+struct addrinfo;
+
+/* Start connecting to one address. Returns a non-blocking socket whose
+ * connect is done or in progress, or -1. */
+int net_connect_start(const struct addrinfo *ai);
+
+/* Writable socket from net_connect_start: 0 once connected, else the errno */
+int net_connect_finish(int fd);
+
+/*
+ * Happy Eyeballs (RFC 8305): addresses are tried with the families
+ * interleaved, a new attempt starting every NET_RACE_DELAY_MS (or as soon
+ * as one fails) while the earlier ones keep going. The first to connect
+ * wins and the rest are closed, so a dead IPv6 path costs 250 ms, not a
+ * whole connect timeout.
+ */
+#define NET_RACE_DELAY_MS 250   /* Connection Attempt Delay */
+#define NET_RACE_ADDRS    16    /* addresses tried; the rest are ignored */
+
+typedef struct net_race {
+    const struct addrinfo *addr[NET_RACE_ADDRS];  /* in the order tried */
+    int naddr, next;
+    int fd[NET_RACE_ADDRS];          /* attempts in flight */
+    long long deadline[NET_RACE_ADDRS];
+    int nfd;
+    long long next_ms;               /* next attempt may start */
+    int timeout_ms;                  /* per attempt, 0: none */
+    int err;                         /* errno of the last failure */
+    /* Optional, set after net_race_init (event loops): watch a new attempt
+     * (-1 skips it), stop watching one before it is closed */
+    int (*watch)(void *ctx, int fd);
+    void (*unwatch)(void *ctx, int fd);
+    void *ctx;
+} net_race_t;
+
+/* Race over res, which must outlive it */
+void net_race_init(net_race_t *r, const struct addrinfo *res, int timeout_ms);
+
+/*
+ * Reap finished attempts and start due ones, at now_ms (monotonic).
+ * Returns the connected socket (non-blocking, the race is over), -1 while
+ * racing with *wait_ms until the next step is due (-1: only when an
+ * attempt turns writable), or -2 when every address failed (err says why).
+ */
+int net_race_step(net_race_t *r, long long now_ms, int *wait_ms);
+
+/* Close every attempt in flight */
+void net_race_abort(net_race_t *r);
+
+/* Blocking race over res, timeout_sec per attempt (0: none). Returns a
+ * blocking socket, or -1 with errno set. */
+int net_connect_addrs(const struct addrinfo *res, int timeout_sec);
+
 /* Global network config (set before calling net_* functions) */
 extern int g_udp_mode;
 extern int g_af_family;
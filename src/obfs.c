@@ -1,14 +1,18 @@
 /*
  * obfs.c — Traffic obfuscation layer
  *
- * Three anti-DPI modes:
+ * Anti-DPI modes:
  *
  * OBFS_HTTP: wraps each encrypted packet as an HTTP POST/response.
+ * OBFS_HTTP_STREAM: one long-lived chunked POST per direction, one chunk
+ *            per packet, rotated to a new request every 64-191 chunks.
  * OBFS_TLS:  wraps the entire connection in a real TLS 1.3 session.
  *            From the outside, traffic is indistinguishable from HTTPS.
+ * OBFS_H2:   TLS with ALPN h2; each packet is one HTTP/2 DATA frame on a
+ *            long-lived POST stream, rotated like OBFS_HTTP_STREAM.
  *
  * Additional anti-fingerprint features:
- * - Packet padding (obfs_pad/obfs_unpad): all packets become uniform size
+ * - Packet padding (obfs_pad/obfs_unpad): packets snap to a few fixed sizes
  * - Timing jitter (obfs_jitter): random delays defeat timing correlation
  */
 
@@ -20,8 +24,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <stdint.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -29,23 +39,80 @@
 #include <openssl/rand.h>
 #include <openssl/x509.h>
 #include <openssl/pem.h>
+#include <openssl/core_names.h>
+#include <netdb.h>
 
 #include "obfs.h"
 #include "fingerprint.h"
+#include "farm9crypt.h"
+#include "util.h"
 
 static int g_obfs_mode = OBFS_NONE;
 static int g_ech       = 0;
-static SSL_CTX *g_ssl_ctx = NULL;
+static SSL_CTX *g_srv_ctx = NULL;   /* built once, inherited by -K children */
+static SSL_CTX *g_cli_ctx = NULL;   /* reused across --persistent reconnects */
+static int      g_srv_ctx_key = -1; /* settings each context was built with */
+static int      g_cli_ctx_key = -1;
 static SSL     *g_ssl     = NULL;
+static int      g_ktls    = 1;
+
+/*
+ * Streaming state (OBFS_HTTP_STREAM). The sender keeps one chunked POST
+ * open and closes it after a random 64..191 chunks so request lengths vary.
+ * The receiver tracks whether it is inside a chunked body.
+ */
+static int tx_chunks_left = 0;   /* 0 = no request open */
+static int rx_chunked     = 0;
+
+static void h2_reset(void);
+static int  h2_send(const void *data, size_t len);
+static int  h2_recv(void *buf, size_t buflen);
 
 void obfs_set_mode(int mode) {
     g_obfs_mode = mode;
+    tx_chunks_left = 0;
+    rx_chunked = 0;
+    h2_reset();
 }
 
 int obfs_get_mode(void) {
     return g_obfs_mode;
 }
 
+int obfs_uses_tls(void) {
+    return g_obfs_mode == OBFS_TLS || g_obfs_mode == OBFS_H2;
+}
+
+void obfs_ktls_set(int enabled) { g_ktls = enabled; }
+
+int obfs_ktls_send_active(void) {
+    return g_ssl ? BIO_get_ktls_send(SSL_get_wbio(g_ssl)) : 0;
+}
+
+int obfs_ktls_recv_active(void) {
+    return g_ssl ? BIO_get_ktls_recv(SSL_get_rbio(g_ssl)) : 0;
+}
+
+int obfs_tls_pending(void) {
+    return g_ssl ? SSL_pending(g_ssl) : 0;
+}
+
+int obfs_tls_exporter(const char *label, unsigned char *out, size_t len) {
+    if (!g_ssl || !label || !out) return -1;
+    return SSL_export_keying_material(g_ssl, out, len, label, strlen(label),
+                                      NULL, 0, 0) == 1 ? 0 : -1;
+}
+
+/* Ask OpenSSL to move record crypto into the kernel after the handshake */
+static void tls_ktls_ctx(SSL_CTX *ctx) {
+#ifdef SSL_OP_ENABLE_KTLS
+    if (g_ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+    (void)ctx;
+#endif
+}
+
 void obfs_ech_enable(void)  { g_ech = 1; }
 void obfs_ech_disable(void) { g_ech = 0; }
 int obfs_ech_enabled(void)  { return g_ech; }
@@ -81,23 +148,89 @@ static int obfs_write_exact(int fd, const void *buf, size_t len) {
     return (int)total;
 }
 
-/* Read one byte at a time until \r\n\r\n found. Returns header length or -1. */
-static int obfs_read_http_header(int fd, char *hdr, size_t hdr_size) {
+/* Write a whole iovec list with sendmsg(); one syscall in the common case */
+static int obfs_sendv_exact(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        total += (size_t)n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++; iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return (int)total;
+}
+
+/* Fill a whole iovec list with recvmsg(). Returns 1, 0 on EOF, -1 on error. */
+static int obfs_recvv_exact(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0 && iov->iov_len == 0) { iov++; iovcnt--; }
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = recvmsg(fd, &msg, MSG_WAITALL);
+        if (n <= 0) {
+            if (n == 0) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++; iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Peek until term appears. On success buf[0..len) holds the line/header
+ * including term and the return value is len; *consumed says how many of
+ * those bytes were already taken off the socket (only when the sender split
+ * a header across segments). Bytes beyond term are never consumed, so
+ * select() readiness stays accurate for the next frame. Returns 0 on EOF,
+ * -1 on error or oversize.
+ */
+static int obfs_peek_until(int fd, char *buf, size_t size, const char *term,
+                           size_t *consumed) {
+    size_t tlen = strlen(term);
     size_t pos = 0;
-    while (pos < hdr_size - 1) {
-        ssize_t n = recv(fd, hdr + pos, 1, 0);
+    while (pos < size - 1) {
+        ssize_t n = recv(fd, buf + pos, size - 1 - pos, MSG_PEEK);
         if (n <= 0) {
             if (n == 0) return 0;
             if (errno == EINTR) continue;
             return -1;
         }
-        pos++;
-        hdr[pos] = '\0';
-        if (pos >= 4 &&
-            hdr[pos-4] == '\r' && hdr[pos-3] == '\n' &&
-            hdr[pos-2] == '\r' && hdr[pos-1] == '\n') {
-            return (int)pos;
+        size_t avail = pos + (size_t)n;
+        size_t from = pos >= tlen ? pos - tlen + 1 : 0;
+        for (size_t i = from; i + tlen <= avail; i++) {
+            if (memcmp(buf + i, term, tlen) == 0) {
+                buf[i + tlen] = '\0';
+                *consumed = pos;
+                return (int)(i + tlen);
+            }
         }
+        /* Everything peeked so far belongs to this header: take it */
+        if (obfs_read_exact(fd, buf + pos, (size_t)n) <= 0) return -1;
+        pos = avail;
     }
     return -1; /* header too large */
 }
@@ -120,6 +253,21 @@ static int obfs_parse_content_length(const char *hdr) {
     return -1;
 }
 
+/* True if the header announces Transfer-Encoding: chunked */
+static int obfs_is_chunked(const char *hdr) {
+    const char *p = hdr;
+    while (*p) {
+        if ((p[0] == 'T' || p[0] == 't') &&
+            strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+            p += 18;
+            while (*p == ' ') p++;
+            return strncasecmp(p, "chunked", 7) == 0;
+        }
+        p++;
+    }
+    return 0;
+}
+
 /*
  * HTTP request paths — rotated to look like real traffic
  */
@@ -133,6 +281,106 @@ static const char *http_paths[] = {
 #define NUM_PATHS 5
 static int path_idx = 0;
 
+static const char http_crlf[2] = { '\r', '\n' };
+
+static int http_stream_send(int fd, const void *data, size_t len) {
+    char prefix[512];
+    int plen = 0;
+
+    if (tx_chunks_left == 0) {
+        unsigned char rnd;
+        RAND_bytes(&rnd, 1);
+        tx_chunks_left = OBFS_HTTP_ROTATE + (rnd & 0x7F);
+        plen = snprintf(prefix, sizeof(prefix),
+            "POST %s HTTP/1.1\r\n"
+            "Host: cdn.cloudflare-dns.com\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Connection: keep-alive\r\n"
+            "\r\n",
+            http_paths[path_idx % NUM_PATHS]);
+        path_idx++;
+    }
+    plen += snprintf(prefix + plen, sizeof(prefix) - (size_t)plen, "%zx\r\n", len);
+
+    /* Last chunk of this request: append the terminator to the same write */
+    static const char last_chunk[] = "\r\n0\r\n\r\n";
+    int closing = (--tx_chunks_left == 0);
+
+    struct iovec iov[3];
+    iov[0].iov_base = prefix;
+    iov[0].iov_len  = (size_t)plen;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = len;
+    iov[2].iov_base = closing ? (void *)last_chunk : (void *)http_crlf;
+    iov[2].iov_len  = closing ? sizeof(last_chunk) - 1 : sizeof(http_crlf);
+    if (obfs_sendv_exact(fd, iov, 3) < 0) return -1;
+    return (int)len;
+}
+
+/*
+ * Read one framed payload. Handles both Content-Length messages and chunked
+ * bodies, so either sender mode is understood. Typically two syscalls per
+ * frame: a MSG_PEEK to find the header and one recvmsg for header + body.
+ */
+static int http_recv(int fd, void *buf, size_t buflen) {
+    char hdr[2048];
+    size_t consumed;
+    char crlf[2];
+
+    for (;;) {
+        if (!rx_chunked) {
+            int hlen = obfs_peek_until(fd, hdr, sizeof(hdr), "\r\n\r\n", &consumed);
+            if (hlen <= 0) return hlen;
+
+            if (obfs_is_chunked(hdr)) {
+                struct iovec iov[1] = {
+                    { hdr + consumed, (size_t)hlen - consumed },
+                };
+                int rc = obfs_recvv_exact(fd, iov, 1);
+                if (rc <= 0) return rc < 0 ? -1 : 0;
+                rx_chunked = 1;
+                continue;
+            }
+
+            int content_len = obfs_parse_content_length(hdr);
+            if (content_len < 0) return -1;
+            if ((size_t)content_len > buflen) return -1;
+
+            struct iovec iov[2] = {
+                { hdr + consumed, (size_t)hlen - consumed },
+                { buf, (size_t)content_len },
+            };
+            int rc = obfs_recvv_exact(fd, iov, 2);
+            if (rc <= 0) return rc < 0 ? -1 : 0;
+            return content_len;
+        }
+
+        /* Inside a chunked body: "<hex>\r\n" <data> "\r\n" */
+        int llen = obfs_peek_until(fd, hdr, 32, "\r\n", &consumed);
+        if (llen <= 0) return llen;
+        char *end;
+        unsigned long clen = strtoul(hdr, &end, 16);
+        if (end == hdr) return -1;
+        if (clen > buflen) return -1;
+
+        struct iovec iov[3] = {
+            { hdr + consumed, (size_t)llen - consumed },
+            { buf, (size_t)clen },
+            { crlf, sizeof(crlf) },
+        };
+        int rc = obfs_recvv_exact(fd, iov, 3);
+        if (rc <= 0) return rc < 0 ? -1 : 0;
+        if (memcmp(crlf, http_crlf, 2) != 0) return -1;
+
+        if (clen == 0) {
+            rx_chunked = 0;   /* request finished; next one follows */
+            continue;
+        }
+        return (int)clen;
+    }
+}
+
 int obfs_send(int fd, const void *data, size_t len) {
     if (g_obfs_mode == OBFS_NONE) {
         return obfs_write_exact(fd, data, len);
@@ -145,7 +393,13 @@ int obfs_send(int fd, const void *data, size_t len) {
         return (ret > 0) ? ret : -1;
     }
 
-    /* HTTP mode: wrap as POST request */
+    if (g_obfs_mode == OBFS_H2)
+        return h2_send(data, len);
+
+    if (g_obfs_mode == OBFS_HTTP_STREAM)
+        return http_stream_send(fd, data, len);
+
+    /* HTTP mode: wrap as POST request, header and body in one write */
     char header[512];
     int hlen = snprintf(header, sizeof(header),
         "POST %s HTTP/1.1\r\n"
@@ -157,8 +411,12 @@ int obfs_send(int fd, const void *data, size_t len) {
         http_paths[path_idx % NUM_PATHS], len);
     path_idx++;
 
-    if (obfs_write_exact(fd, header, (size_t)hlen) < 0) return -1;
-    if (obfs_write_exact(fd, data, len) < 0) return -1;
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len  = (size_t)hlen;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = len;
+    if (obfs_sendv_exact(fd, iov, 2) < 0) return -1;
     return (int)len;
 }
 
@@ -180,16 +438,345 @@ int obfs_recv(int fd, void *buf, size_t buflen) {
         return ret;
     }
 
-    /* HTTP mode: read header, extract Content-Length, read payload */
-    char hdr[2048];
-    int hlen = obfs_read_http_header(fd, hdr, sizeof(hdr));
-    if (hlen <= 0) return hlen;
+    if (g_obfs_mode == OBFS_H2)
+        return h2_recv(buf, buflen);
+
+    /* HTTP modes: Content-Length or chunked body */
+    return http_recv(fd, buf, buflen);
+}
 
-    int content_len = obfs_parse_content_length(hdr);
-    if (content_len < 0) return -1;
-    if ((size_t)content_len > buflen) return -1;
+/* ──────────── HTTP/2 Camouflage ──────────── */
 
-    return obfs_read_exact(fd, buf, (size_t)content_len);
+/*
+ * Minimal HTTP/2 (RFC 9113) framing over the TLS session. The client opens
+ * POST streams 1, 3, 5, ... and the server answers on the newest one, so
+ * both directions carry tunnel packets as DATA frames (9-byte header).
+ * Streams rotate every 64-191 frames; request/response HEADERS use HPACK
+ * static-table references and literals only, so no dynamic table state.
+ *
+ * Control frames (SETTINGS ACK, PING ACK, WINDOW_UPDATE) are queued and
+ * prepended to the next outgoing DATA frame. Every TLS record we write thus
+ * ends in a DATA frame, and a reader that stops after a DATA frame leaves
+ * nothing buffered inside OpenSSL that select() cannot see.
+ */
+
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+
+#define H2_HDR_SIZE    9
+#define H2_MAX_FRAME   16384          /* SETTINGS_MAX_FRAME_SIZE default */
+#define H2_WINDOW_MAX  0x7fffffffU    /* advertised stream + connection window */
+#define H2_CTRL_MAX    512
+
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static unsigned char h2_ctrl[H2_CTRL_MAX];  /* queued control frames */
+static size_t   h2_ctrl_len  = 0;
+static uint32_t h2_tx_stream = 0;   /* stream our DATA goes out on */
+static uint32_t h2_rx_stream = 0;   /* newest stream opened by the client */
+static int      h2_server    = 0;
+static int      h2_tx_left   = 0;   /* frames before the client rotates */
+static uint32_t h2_rx_conn_used   = 0;   /* DATA bytes not yet credited back */
+static uint32_t h2_rx_stream_used = 0;
+static uint32_t h2_rx_data_stream = 0;   /* stream h2_rx_stream_used counts */
+
+static void h2_reset(void) {
+    h2_ctrl_len = 0;
+    h2_tx_stream = h2_rx_stream = 0;
+    h2_server = 0;
+    h2_tx_left = 0;
+    h2_rx_conn_used = h2_rx_stream_used = 0;
+    h2_rx_data_stream = 0;
+}
+
+static size_t h2_frame_hdr(unsigned char *p, size_t len, int type, int flags,
+                           uint32_t stream) {
+    p[0] = (len >> 16) & 0xFF;
+    p[1] = (len >> 8) & 0xFF;
+    p[2] = len & 0xFF;
+    p[3] = (unsigned char)type;
+    p[4] = (unsigned char)flags;
+    p[5] = (stream >> 24) & 0x7F;
+    p[6] = (stream >> 16) & 0xFF;
+    p[7] = (stream >> 8) & 0xFF;
+    p[8] = stream & 0xFF;
+    return H2_HDR_SIZE;
+}
+
+static void h2_put32(unsigned char *p, uint32_t v) {
+    p[0] = (v >> 24) & 0xFF; p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;  p[3] = v & 0xFF;
+}
+
+static uint32_t h2_get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Queue a control frame for the next write; drops it if the queue is full */
+static void h2_queue(int type, int flags, uint32_t stream,
+                     const unsigned char *payload, size_t len) {
+    if (h2_ctrl_len + H2_HDR_SIZE + len > sizeof(h2_ctrl)) return;
+    h2_ctrl_len += h2_frame_hdr(h2_ctrl + h2_ctrl_len, len, type, flags, stream);
+    if (len > 0) memcpy(h2_ctrl + h2_ctrl_len, payload, len);
+    h2_ctrl_len += len;
+}
+
+static size_t h2_settings(unsigned char *p, int server) {
+    /* id(2) value(4) pairs, in the order Chrome sends them */
+    static const struct { unsigned short id; uint32_t val; } cli[] = {
+        { 0x1, 65536 }, { 0x2, 0 }, { 0x4, H2_WINDOW_MAX }, { 0x6, 262144 },
+    }, srv[] = {
+        { 0x3, 100 }, { 0x4, H2_WINDOW_MAX }, { 0x5, H2_MAX_FRAME },
+    };
+    size_t n = server ? 3 : 4, off = H2_HDR_SIZE;
+    for (size_t i = 0; i < n; i++) {
+        unsigned short id = server ? srv[i].id : cli[i].id;
+        p[off++] = (id >> 8) & 0xFF;
+        p[off++] = id & 0xFF;
+        h2_put32(p + off, server ? srv[i].val : cli[i].val);
+        off += 4;
+    }
+    h2_frame_hdr(p, off - H2_HDR_SIZE, H2_SETTINGS, 0, 0);
+    return off;
+}
+
+/* Raise the connection window from 65535 to the advertised maximum */
+static size_t h2_conn_window(unsigned char *p) {
+    h2_frame_hdr(p, 4, H2_WINDOW_UPDATE, 0, 0);
+    h2_put32(p + H2_HDR_SIZE, H2_WINDOW_MAX - 65535);
+    return H2_HDR_SIZE + 4;
+}
+
+/* HPACK string literal, no Huffman; all our values are < 127 bytes */
+static size_t hpack_str(unsigned char *p, const char *s) {
+    size_t n = strlen(s);
+    p[0] = (unsigned char)n;
+    memcpy(p + 1, s, n);
+    return n + 1;
+}
+
+/* HEADERS frame opening a request (client) or response (server) */
+static size_t h2_headers(unsigned char *p, uint32_t stream, int server) {
+    size_t off = H2_HDR_SIZE;
+    if (server) {
+        p[off++] = 0x88;                            /* :status 200 */
+    } else {
+        p[off++] = 0x83;                            /* :method POST */
+        p[off++] = 0x87;                            /* :scheme https */
+        p[off++] = 0x01;                            /* :authority (literal) */
+        off += hpack_str(p + off, "cdn.cloudflare-dns.com");
+        p[off++] = 0x04;                            /* :path (literal) */
+        off += hpack_str(p + off, http_paths[path_idx++ % NUM_PATHS]);
+    }
+    p[off++] = 0x0F; p[off++] = 0x10;               /* content-type (idx 31) */
+    off += hpack_str(p + off, "application/octet-stream");
+    h2_frame_hdr(p, off - H2_HDR_SIZE, H2_HEADERS, H2_FLAG_END_HEADERS, stream);
+    return off;
+}
+
+static int h2_ssl_write(const void *buf, size_t len) {
+    if (!g_ssl) return -1;
+    int ret = SSL_write(g_ssl, buf, (int)len);
+    return (ret > 0 && (size_t)ret == len) ? 0 : -1;
+}
+
+static int h2_ssl_read_exact(void *buf, size_t len) {
+    unsigned char *p = (unsigned char *)buf;
+    size_t total = 0;
+    while (total < len) {
+        int ret = SSL_read(g_ssl, p + total, (int)(len - total));
+        if (ret <= 0) {
+            int err = SSL_get_error(g_ssl, ret);
+            return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+        }
+        total += (size_t)ret;
+    }
+    return 1;
+}
+
+static int h2_send(const void *data, size_t len) {
+    if (!g_ssl || len > H2_MAX_FRAME) return -1;
+
+    unsigned char out[H2_CTRL_MAX + 3 * 128 + H2_HDR_SIZE + H2_MAX_FRAME];
+    size_t off = 0;
+
+    memcpy(out, h2_ctrl, h2_ctrl_len);
+    off = h2_ctrl_len;
+    h2_ctrl_len = 0;
+
+    if (h2_server) {
+        /* Follow the client onto its newest stream */
+        if (h2_tx_stream != h2_rx_stream) {
+            if (h2_tx_stream != 0)
+                off += h2_frame_hdr(out + off, 0, H2_DATA, H2_FLAG_END_STREAM,
+                                    h2_tx_stream);
+            h2_tx_stream = h2_rx_stream;
+            off += h2_headers(out + off, h2_tx_stream, 1);
+        }
+    } else if (h2_tx_left-- <= 0) {
+        /* Rotate: finish this request, open the next client stream */
+        off += h2_frame_hdr(out + off, 0, H2_DATA, H2_FLAG_END_STREAM, h2_tx_stream);
+        h2_tx_stream += 2;
+        off += h2_headers(out + off, h2_tx_stream, 0);
+        unsigned char rnd;
+        RAND_bytes(&rnd, 1);
+        h2_tx_left = OBFS_HTTP_ROTATE + (rnd & 0x7F) - 1;
+    }
+
+    off += h2_frame_hdr(out + off, len, H2_DATA, 0, h2_tx_stream);
+    memcpy(out + off, data, len);
+    off += len;
+
+    return h2_ssl_write(out, off) == 0 ? (int)len : -1;
+}
+
+/* Credit consumed DATA back to the sender once half a window is used */
+static void h2_credit(uint32_t stream, uint32_t n) {
+    unsigned char inc[4];
+    if (stream != h2_rx_data_stream) {
+        h2_rx_data_stream = stream;
+        h2_rx_stream_used = 0;
+    }
+    h2_rx_conn_used += n;
+    h2_rx_stream_used += n;
+    if (h2_rx_conn_used >= H2_WINDOW_MAX / 2) {
+        h2_put32(inc, h2_rx_conn_used);
+        h2_queue(H2_WINDOW_UPDATE, 0, 0, inc, 4);
+        h2_rx_conn_used = 0;
+    }
+    if (h2_rx_stream_used >= H2_WINDOW_MAX / 2) {
+        h2_put32(inc, h2_rx_stream_used);
+        h2_queue(H2_WINDOW_UPDATE, 0, stream, inc, 4);
+        h2_rx_stream_used = 0;
+    }
+}
+
+/* Read frames until a non-empty DATA frame; control frames are handled inline */
+static int h2_recv(void *buf, size_t buflen) {
+    unsigned char hdr[H2_HDR_SIZE];
+    unsigned char scratch[H2_MAX_FRAME];
+
+    if (!g_ssl) return -1;
+    for (;;) {
+        int rc = h2_ssl_read_exact(hdr, sizeof(hdr));
+        if (rc <= 0) return rc;
+
+        size_t len = ((size_t)hdr[0] << 16) | ((size_t)hdr[1] << 8) | hdr[2];
+        int type = hdr[3], flags = hdr[4];
+        uint32_t stream = h2_get32(hdr + 5) & 0x7fffffffU;
+        if (len > H2_MAX_FRAME) return -1;
+
+        if (type == H2_DATA && len > 0) {
+            size_t pad = 0;
+            if (flags & H2_FLAG_PADDED) {
+                unsigned char pl;
+                if ((rc = h2_ssl_read_exact(&pl, 1)) <= 0) return rc;
+                pad = pl;
+                if (pad + 1 > len) return -1;
+            }
+            size_t dlen = len - pad - ((flags & H2_FLAG_PADDED) ? 1 : 0);
+            if (dlen > buflen) return -1;
+            if (dlen > 0 && (rc = h2_ssl_read_exact(buf, dlen)) <= 0) return rc;
+            if (pad > 0 && (rc = h2_ssl_read_exact(scratch, pad)) <= 0) return rc;
+            h2_credit(stream, (uint32_t)len);
+            if (dlen == 0) continue;
+            return (int)dlen;
+        }
+
+        if (len > 0 && (rc = h2_ssl_read_exact(scratch, len)) <= 0) return rc;
+
+        switch (type) {
+        case H2_HEADERS:
+            /* Header block content is camouflage; only the stream matters */
+            if (h2_server && stream > h2_rx_stream)
+                h2_rx_stream = stream;
+            break;
+        case H2_SETTINGS:
+            if (!(flags & H2_FLAG_ACK))
+                h2_queue(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            break;
+        case H2_PING:
+            if (!(flags & H2_FLAG_ACK) && len == 8)
+                h2_queue(H2_PING, H2_FLAG_ACK, 0, scratch, 8);
+            break;
+        case H2_GOAWAY:
+            return 0;
+        default:
+            /* DATA(empty)/PRIORITY/RST_STREAM/WINDOW_UPDATE/unknown: ignore */
+            break;
+        }
+    }
+}
+
+/* Client: preface + SETTINGS + WINDOW_UPDATE + HEADERS for stream 1 */
+static int h2_client_start(void) {
+    unsigned char out[256];
+    size_t off = sizeof(h2_preface) - 1;
+    memcpy(out, h2_preface, off);
+    off += h2_settings(out + off, 0);
+    off += h2_conn_window(out + off);
+    h2_tx_stream = 1;
+    off += h2_headers(out + off, h2_tx_stream, 0);
+    unsigned char rnd;
+    RAND_bytes(&rnd, 1);
+    h2_tx_left = OBFS_HTTP_ROTATE + (rnd & 0x7F);
+    return h2_ssl_write(out, off);
+}
+
+/*
+ * Server: check the preface and read the client's opening record (through
+ * its first HEADERS). Our SETTINGS go out ahead of the first DATA frame.
+ */
+static int h2_server_start(void) {
+    char pre[sizeof(h2_preface) - 1];
+    h2_server = 1;
+    if (h2_ssl_read_exact(pre, sizeof(pre)) <= 0) return -1;
+    if (memcmp(pre, h2_preface, sizeof(pre)) != 0) return -1;
+
+    h2_ctrl_len = h2_settings(h2_ctrl, 1);
+    h2_ctrl_len += h2_conn_window(h2_ctrl + h2_ctrl_len);
+
+    unsigned char hdr[H2_HDR_SIZE], scratch[H2_MAX_FRAME];
+    while (h2_rx_stream == 0) {
+        if (h2_ssl_read_exact(hdr, sizeof(hdr)) <= 0) return -1;
+        size_t len = ((size_t)hdr[0] << 16) | ((size_t)hdr[1] << 8) | hdr[2];
+        if (len > H2_MAX_FRAME) return -1;
+        if (len > 0 && h2_ssl_read_exact(scratch, len) <= 0) return -1;
+        if (hdr[3] == H2_SETTINGS && !(hdr[4] & H2_FLAG_ACK))
+            h2_queue(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        else if (hdr[3] == H2_HEADERS)
+            h2_rx_stream = h2_get32(hdr + 5) & 0x7fffffffU;
+        else if (hdr[3] == H2_DATA)
+            return -1;   /* data before a request */
+    }
+    return 0;
+}
+
+static int h2_alpn_select_cb(SSL *s, const unsigned char **out,
+                             unsigned char *outlen, const unsigned char *in,
+                             unsigned int inlen, void *arg) {
+    (void)s; (void)arg;
+    static const unsigned char h2[] = { 2, 'h', '2' };
+    unsigned char *sel;
+    /* The server context is shared across modes: plain TLS selects nothing */
+    if (g_obfs_mode != OBFS_H2)
+        return SSL_TLSEXT_ERR_NOACK;
+    if (SSL_select_next_proto(&sel, outlen, h2, sizeof(h2), in, inlen)
+            != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    *out = sel;
+    return SSL_TLSEXT_ERR_OK;
 }
 
 /* ──────────── TLS Camouflage ──────────── */
@@ -204,7 +791,13 @@ static const char *fake_cns[] = {
 };
 #define NUM_CNS 6
 
-static int tls_generate_self_signed(SSL_CTX *ctx) {
+static X509     *g_cert       = NULL;
+static EVP_PKEY *g_cert_key   = NULL;
+static int       g_cert_cache = 0;
+
+void obfs_tls_cert_cache(int enabled) { g_cert_cache = enabled; }
+
+static int tls_generate_self_signed(void) {
     EVP_PKEY *pkey = EVP_EC_gen("P-256");
     if (!pkey) return -1;
 
@@ -235,37 +828,217 @@ static int tls_generate_self_signed(SSL_CTX *ctx) {
     /* Sign */
     X509_sign(x509, pkey, EVP_sha256());
 
-    SSL_CTX_use_certificate(ctx, x509);
-    SSL_CTX_use_PrivateKey(ctx, pkey);
+    X509_free(g_cert);
+    EVP_PKEY_free(g_cert_key);
+    g_cert = x509;
+    g_cert_key = pkey;
+    return 0;
+}
+
+/* True while the certificate is younger than OBFS_CERT_ROTATE_DAYS */
+static int tls_cert_fresh(X509 *x) {
+    int days, secs;
+    if (!x || !ASN1_TIME_diff(&days, &secs, X509_get0_notBefore(x), NULL))
+        return 0;
+    return days >= 0 && days < OBFS_CERT_ROTATE_DAYS;
+}
+
+static int tls_cert_path(char *buf, size_t buflen) {
+    char dir[512];
+    if (clawsec_dir(dir, sizeof(dir), 1) < 0) return -1;
+    int n = snprintf(buf, buflen, "%s/tls_cert.pem", dir);
+    return (n > 0 && (size_t)n < buflen) ? 0 : -1;
+}
+
+/* Load ~/.clawsec/tls_cert.pem if it holds a matching, fresh cert + key */
+static int tls_cert_load(void) {
+    char path[576];
+    if (tls_cert_path(path, sizeof(path)) < 0) return -1;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    X509 *x509 = PEM_read_X509(fp, NULL, NULL, NULL);
+    EVP_PKEY *pkey = x509 ? PEM_read_PrivateKey(fp, NULL, NULL, NULL) : NULL;
+    fclose(fp);
 
-    X509_free(x509);
-    EVP_PKEY_free(pkey);
+    if (!pkey || !tls_cert_fresh(x509) || X509_check_private_key(x509, pkey) != 1) {
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+    X509_free(g_cert);
+    EVP_PKEY_free(g_cert_key);
+    g_cert = x509;
+    g_cert_key = pkey;
     return 0;
 }
 
-int obfs_tls_accept(int fd) {
-    /* Server side: wrap fd in TLS with auto-generated cert */
-    g_ssl_ctx = SSL_CTX_new(TLS_server_method());
-    if (!g_ssl_ctx) return -1;
+/* Write cert + key (0600) via rename so concurrent servers never see half a file */
+static void tls_cert_save(void) {
+    char path[576], tmp[600];
+    if (tls_cert_path(path, sizeof(path)) < 0) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
 
-    /* Force TLS 1.3 only — most modern, hardest to fingerprint */
-    SSL_CTX_set_min_proto_version(g_ssl_ctx, TLS1_3_VERSION);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return;
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) { close(fd); unlink(tmp); return; }
+    int ok = PEM_write_X509(fp, g_cert) &&
+             PEM_write_PrivateKey(fp, g_cert_key, NULL, NULL, 0, NULL, NULL);
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        fprintf(stderr, "Warning: could not save TLS certificate to %s\n", path);
+    }
+}
+
+/*
+ * Stateless session tickets. Every ticket is sealed with the current key;
+ * the previous key still opens tickets (and has them re-issued) for one
+ * more period, so a ticket lives at most 2 * OBFS_TICKET_ROTATE_SECS.
+ * Keys are rotated in the listener, so -K children share them.
+ */
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+static struct ticket_key g_tk[2];   /* [0] current, [1] previous */
+static time_t g_tk_born = 0;
 
-    if (tls_generate_self_signed(g_ssl_ctx) < 0) {
-        SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL;
+static int tls_ticket_rotate(void) {
+    time_t now = time(NULL);
+    if (g_tk_born && now - g_tk_born < OBFS_TICKET_ROTATE_SECS)
+        return 0;
+    struct ticket_key next;
+    if (RAND_bytes((unsigned char *)&next, sizeof(next)) != 1)
         return -1;
+    g_tk[1] = g_tk_born ? g_tk[0] : next;
+    g_tk[0] = next;
+    g_tk_born = now;
+    return 0;
+}
+
+static int tls_ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                             EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+    (void)s;
+    const struct ticket_key *k = &g_tk[0];
+    if (enc) {
+        memcpy(key_name, k->name, 16);
+        if (RAND_bytes(iv, 16) != 1 ||
+            !EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aes, iv))
+            return -1;
+    } else {
+        if (memcmp(key_name, g_tk[0].name, 16) != 0) {
+            k = &g_tk[1];
+            if (memcmp(key_name, k->name, 16) != 0)
+                return 0;   /* unknown or expired key: full handshake */
+        }
+        if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aes, iv))
+            return -1;
     }
 
-    g_ssl = SSL_new(g_ssl_ctx);
-    if (!g_ssl) {
-        SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL;
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  (void *)k->hmac, sizeof(k->hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (!EVP_MAC_CTX_set_params(hctx, params))
         return -1;
+
+    /* 2 = accept, but issue a ticket under the current key */
+    return (!enc && k != &g_tk[0]) ? 2 : 1;
+}
+
+int obfs_tls_server_init(void) {
+    if (tls_ticket_rotate() < 0) return -1;
+
+    int fresh = tls_cert_fresh(g_cert);
+    if (fresh && g_srv_ctx && g_srv_ctx_key == g_ktls)
+        return 0;
+
+    if (!fresh && !(g_cert_cache && tls_cert_load() == 0)) {
+        if (tls_generate_self_signed() < 0) return -1;
+        if (g_cert_cache) tls_cert_save();
     }
 
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return -1;
+
+    /* Force TLS 1.3 only — most modern, hardest to fingerprint */
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    tls_ktls_ctx(ctx);
+
+    if (SSL_CTX_use_certificate(ctx, g_cert) != 1 ||
+        SSL_CTX_use_PrivateKey(ctx, g_cert_key) != 1) {
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    SSL_CTX_set_alpn_select_cb(ctx, h2_alpn_select_cb, NULL);
+    /* Tickets are stateless: nothing to keep in a server-side cache */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb);
+    SSL_CTX_set_timeout(ctx, 2 * OBFS_TICKET_ROTATE_SECS);
+
+    /* Sessions already running hold their own reference to the old context */
+    SSL_CTX_free(g_srv_ctx);
+    g_srv_ctx = ctx;
+    g_srv_ctx_key = g_ktls;
+    return 0;
+}
+
+/* Drop the previous connection's session (e.g. before a reconnect) */
+static void tls_session_free(void) {
+    if (g_ssl) {
+        SSL_free(g_ssl);
+        g_ssl = NULL;
+    }
+}
+
+static SSL_SESSION *g_resume = NULL;   /* newest ticket from the server */
+static char g_resume_peer[80];         /* "addr:port" it was issued by */
+static int  g_session_cache = 0;
+
+void obfs_tls_session_cache(int enabled) { g_session_cache = enabled; }
+
+int obfs_tls_resumed(void) {
+    return g_ssl ? SSL_session_reused(g_ssl) : 0;
+}
+
+static void tls_resume_drop(void) {
+    SSL_SESSION_free(g_resume);
+    g_resume = NULL;
+    g_resume_peer[0] = '\0';
+}
+
+void obfs_tls_cleanup(void) {
+    tls_resume_drop();
+    tls_session_free();
+    SSL_CTX_free(g_srv_ctx);
+    SSL_CTX_free(g_cli_ctx);
+    g_srv_ctx = g_cli_ctx = NULL;
+    g_srv_ctx_key = g_cli_ctx_key = -1;
+    X509_free(g_cert);
+    EVP_PKEY_free(g_cert_key);
+    g_cert = NULL;
+    g_cert_key = NULL;
+}
+
+int obfs_tls_accept(int fd) {
+    /* Server side: wrap fd in TLS with the shared context */
+    tls_session_free();
+    if (obfs_tls_server_init() < 0) return -1;
+
+    g_ssl = SSL_new(g_srv_ctx);
+    if (!g_ssl) return -1;
+
     SSL_set_fd(g_ssl, fd);
     if (SSL_accept(g_ssl) <= 0) {
-        SSL_free(g_ssl); g_ssl = NULL;
-        SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL;
+        tls_session_free();
+        return -1;
+    }
+
+    h2_reset();
+    if (g_obfs_mode == OBFS_H2 && h2_server_start() < 0) {
+        tls_session_free();
         return -1;
     }
     return 0;
@@ -324,23 +1097,117 @@ static void ech_grease_free_cb(SSL *s, unsigned int ext_type,
     OPENSSL_free((void *)out);
 }
 
-int obfs_tls_connect(int fd) {
-    /* Client side: connect to TLS server, skip cert verification
-       (we have our own crypto layer inside — cert is just camouflage) */
-    g_ssl_ctx = SSL_CTX_new(TLS_client_method());
-    if (!g_ssl_ctx) return -1;
+/* Numeric "addr:port" of the socket's peer — tickets are only offered back to it */
+static int tls_peer_key(int fd, char *buf, size_t buflen) {
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    char host[64], serv[16];
+    if (getpeername(fd, (struct sockaddr *)&ss, &slen) < 0) return -1;
+    if (ss.ss_family != AF_INET && ss.ss_family != AF_INET6) {
+        snprintf(buf, buflen, "local");
+        return 0;
+    }
+    if (getnameinfo((struct sockaddr *)&ss, slen, host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        return -1;
+    snprintf(buf, buflen, "%s:%s", host, serv);
+    return 0;
+}
+
+static int tls_session_path(char *buf, size_t buflen) {
+    char dir[512];
+    if (clawsec_dir(dir, sizeof(dir), 1) < 0) return -1;
+    int n = snprintf(buf, buflen, "%s/tls_session.pem", dir);
+    return (n > 0 && (size_t)n < buflen) ? 0 : -1;
+}
+
+/* File format: "peer <addr:port>\n" followed by the PEM session */
+static void tls_resume_save(void) {
+    char path[576], tmp[600];
+    if (tls_session_path(path, sizeof(path)) < 0) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return;
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) { close(fd); unlink(tmp); return; }
+    int ok = fprintf(fp, "peer %s\n", g_resume_peer) > 0 &&
+             PEM_write_SSL_SESSION(fp, g_resume);
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+static void tls_resume_load(const char *peer) {
+    char path[576], line[128];
+    if (tls_session_path(path, sizeof(path)) < 0) return;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+    SSL_SESSION *sess = NULL;
+    if (fgets(line, sizeof(line), fp) && strncmp(line, "peer ", 5) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line + 5, peer) == 0)
+            sess = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+    }
+    fclose(fp);
+    if (!sess) return;
+    tls_resume_drop();
+    g_resume = sess;
+    snprintf(g_resume_peer, sizeof(g_resume_peer), "%s", peer);
+}
+
+/* TLS 1.3 tickets arrive after the handshake, during the first reads */
+static int tls_new_session_cb(SSL *ssl, SSL_SESSION *sess) {
+    char peer[sizeof(g_resume_peer)];
+    if (tls_peer_key(SSL_get_fd(ssl), peer, sizeof(peer)) < 0)
+        return 0;
+    /* Keep a copy: OpenSSL marks the live session unusable if the
+     * connection is freed without a close_notify, as ours usually are */
+    SSL_SESSION *copy = SSL_SESSION_dup(sess);
+    if (!copy) return 0;
+    tls_resume_drop();
+    g_resume = copy;
+    memcpy(g_resume_peer, peer, sizeof(peer));
+    if (g_session_cache)
+        tls_resume_save();
+    return 0;
+}
+
+/*
+ * Client context, rebuilt only when a setting it bakes in changes
+ * (fingerprint profile, h2 ALPN, ECH, kTLS).
+ */
+static int tls_client_ctx(void) {
+    int key = fp_get_profile() | (g_obfs_mode == OBFS_H2) << 8 |
+              g_ech << 9 | g_ktls << 10;
+    if (g_cli_ctx && g_cli_ctx_key == key)
+        return 0;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) return -1;
 
-    SSL_CTX_set_min_proto_version(g_ssl_ctx, TLS1_3_VERSION);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
     /* No cert verification — the inner ECDHE+PBKDF2 layer provides authentication */
-    SSL_CTX_set_verify(g_ssl_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    tls_ktls_ctx(ctx);
+
+    /* Resumption: keep tickets ourselves, keyed by peer address */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session_cb);
 
     /* Browser fingerprint: reshape ClientHello to match a real browser */
     if (fp_get_profile() != FP_NONE)
-        fp_apply_ctx(g_ssl_ctx);
+        fp_apply_ctx(ctx);
+
+    /* h2 camouflage: browser profiles already offer "h2, http/1.1" */
+    if (g_obfs_mode == OBFS_H2 && fp_get_profile() == FP_NONE) {
+        static const unsigned char alpn_h2[] = { 2, 'h', '2' };
+        SSL_CTX_set_alpn_protos(ctx, alpn_h2, sizeof(alpn_h2));
+    }
 
     /* Encrypted Client Hello: add GREASE ECH extension to ClientHello */
     if (g_ech) {
-        if (!SSL_CTX_add_custom_ext(g_ssl_ctx, 0xfe0d,
+        if (!SSL_CTX_add_custom_ext(ctx, 0xfe0d,
                                     SSL_EXT_CLIENT_HELLO,
                                     ech_grease_add_cb, ech_grease_free_cb, NULL,
                                     NULL, NULL)) {
@@ -348,10 +1215,32 @@ int obfs_tls_connect(int fd) {
         }
     }
 
-    g_ssl = SSL_new(g_ssl_ctx);
-    if (!g_ssl) {
-        SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL;
-        return -1;
+    /* A ticket from another profile would resume with the wrong ClientHello */
+    if (g_cli_ctx)
+        tls_resume_drop();
+    SSL_CTX_free(g_cli_ctx);
+    g_cli_ctx = ctx;
+    g_cli_ctx_key = key;
+    return 0;
+}
+
+int obfs_tls_connect(int fd) {
+    /* Client side: connect to TLS server, skip cert verification
+       (we have our own crypto layer inside — cert is just camouflage) */
+    tls_session_free();
+    if (tls_client_ctx() < 0) return -1;
+
+    g_ssl = SSL_new(g_cli_ctx);
+    if (!g_ssl) return -1;
+
+    /* Offer the last ticket from this peer (PSK + ECDHE resumption) */
+    char peer[sizeof(g_resume_peer)];
+    if (tls_peer_key(fd, peer, sizeof(peer)) == 0) {
+        if (!g_resume && g_session_cache)
+            tls_resume_load(peer);
+        if (g_resume && strcmp(peer, g_resume_peer) == 0 &&
+            SSL_SESSION_is_resumable(g_resume))
+            SSL_set_session(g_ssl, g_resume);
     }
 
     /* Set a realistic SNI hostname */
@@ -361,17 +1250,82 @@ int obfs_tls_connect(int fd) {
 
     SSL_set_fd(g_ssl, fd);
     if (SSL_connect(g_ssl) <= 0) {
-        SSL_free(g_ssl); g_ssl = NULL;
-        SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL;
+        tls_session_free();
         return -1;
     }
+
+    h2_reset();
+    if (g_obfs_mode == OBFS_H2) {
+        const unsigned char *proto = NULL;
+        unsigned int plen = 0;
+        SSL_get0_alpn_selected(g_ssl, &proto, &plen);
+        if (plen != 2 || memcmp(proto, "h2", 2) != 0 || h2_client_start() < 0) {
+            tls_session_free();
+            return -1;
+        }
+    }
     return 0;
 }
 
 /* ──────────── Packet Padding ──────────── */
 
+/*
+ * Size buckets: small frames (keystrokes, ACKs, control messages) land in
+ * 128/512, full-MTU frames in 1400, and bulk reads in MTU multiples.
+ */
+static const int pad_buckets[] = { 128, 512, 1400, 2800, 4200, 5600, 7000, OBFS_PAD_MAX };
+#define NUM_BUCKETS 8
+#define FIXED_FIRST 2   /* index of OBFS_PAD_SIZE in pad_buckets */
+
+static int g_pad_policy = OBFS_PAD_FIXED;
+
+void obfs_pad_set_policy(int policy) { g_pad_policy = policy; }
+int obfs_pad_get_policy(void)        { return g_pad_policy; }
+
+/*
+ * Padding keystream: AES-128-CTR over zeros under a random per-process key.
+ * The padded frame is encrypted by farm9crypt right after, so the filler
+ * only needs to be cheap — one DRBG call per session instead of per frame.
+ */
+static EVP_CIPHER_CTX *pad_ks = NULL;
+
+static int pad_fill(unsigned char *p, size_t n) {
+    if (!pad_ks) {
+        unsigned char key[16], iv[16];
+        if (RAND_bytes(key, sizeof(key)) != 1 || RAND_bytes(iv, sizeof(iv)) != 1)
+            return -1;
+        pad_ks = EVP_CIPHER_CTX_new();
+        if (!pad_ks) return -1;
+        if (EVP_EncryptInit_ex(pad_ks, EVP_aes_128_ctr(), NULL, key, iv) != 1) {
+            EVP_CIPHER_CTX_free(pad_ks); pad_ks = NULL;
+            return -1;
+        }
+        OPENSSL_cleanse(key, sizeof(key));
+    }
+    int outl = 0;
+    memset(p, 0, n);
+    return EVP_EncryptUpdate(pad_ks, p, &outl, p, (int)n) == 1 ? 0 : -1;
+}
+
+int obfs_pad_target(size_t len) {
+    size_t need = len + 2;
+    int first = (g_pad_policy == OBFS_PAD_FIXED) ? FIXED_FIRST : 0;
+    int i = first;
+    while (i < NUM_BUCKETS && (size_t)pad_buckets[i] < need) i++;
+    if (i == NUM_BUCKETS) return -1;
+
+    if (g_pad_policy == OBFS_PAD_RANDOM) {
+        unsigned char rnd = 0;
+        int span = NUM_BUCKETS - i < 3 ? NUM_BUCKETS - i : 3;
+        pad_fill(&rnd, 1);
+        i += rnd % span;
+    }
+    return pad_buckets[i];
+}
+
 int obfs_pad(const void *data, size_t len, void *out, size_t out_max) {
-    if (len > OBFS_PAD_SIZE - 2 || out_max < OBFS_PAD_SIZE) return -1;
+    int target = obfs_pad_target(len);
+    if (target < 0 || out_max < (size_t)target) return -1;
 
     unsigned char *p = (unsigned char *)out;
     /* 2-byte big-endian real length */
@@ -379,12 +1333,11 @@ int obfs_pad(const void *data, size_t len, void *out, size_t out_max) {
     p[1] = (unsigned char)(len & 0xFF);
     memcpy(p + 2, data, len);
 
-    /* Fill remainder with random bytes (not zeros — defeats entropy analysis) */
-    size_t pad_len = OBFS_PAD_SIZE - 2 - len;
-    if (pad_len > 0)
-        RAND_bytes(p + 2 + len, (int)pad_len);
+    size_t pad_len = (size_t)target - 2 - len;
+    if (pad_len > 0 && pad_fill(p + 2 + len, pad_len) < 0)
+        return -1;
 
-    return OBFS_PAD_SIZE;
+    return target;
 }
 
 int obfs_unpad(const void *data, size_t len, void *out, size_t out_max) {
@@ -398,13 +1351,138 @@ int obfs_unpad(const void *data, size_t len, void *out, size_t out_max) {
 
 /* ──────────── Timing Jitter ──────────── */
 
-void obfs_jitter(int max_ms) {
-    if (max_ms <= 0) return;
+static int jitter_delay_ms(int max_ms) {
     unsigned int rnd;
     RAND_bytes((unsigned char *)&rnd, sizeof(rnd));
-    int delay_ms = (int)(rnd % (unsigned int)max_ms);
+    return (int)(rnd % (unsigned int)max_ms);
+}
+
+void obfs_jitter(int max_ms) {
+    if (max_ms <= 0) return;
+    int delay_ms = jitter_delay_ms(max_ms);
     struct timespec ts;
     ts.tv_sec  = delay_ms / 1000;
     ts.tv_nsec = (delay_ms % 1000) * 1000000L;
     nanosleep(&ts, NULL);
 }
+
+/* ──────────── Jitter Send Queue ──────────── */
+
+typedef struct {
+    long long release_us;   /* monotonic release time */
+    int fd;
+    int len;
+    char *data;
+} jq_frame_t;
+
+/* Ring of jq_cap frames: OBFS_JQ_MAX is where callers stop feeding it, but
+ * a push past it (a reply to a record just read) grows it, never blocks */
+static jq_frame_t *jq = NULL;
+static int jq_cap = 0, jq_head = 0, jq_count = 0;
+static long long jq_last_us = 0;
+static int jq_wait_fd = -1;     /* head due, but its socket has no room */
+
+static int jq_grow(void) {
+    int cap = jq_cap ? jq_cap * 2 : OBFS_JQ_MAX;
+    jq_frame_t *n = malloc((size_t)cap * sizeof(*n));
+    if (!n) return -1;
+    for (int i = 0; i < jq_count; i++)
+        n[i] = jq[(jq_head + i) % jq_cap];
+    free(jq);
+    jq = n;
+    jq_cap = cap;
+    jq_head = 0;
+    return 0;
+}
+
+/* Pop and send the head frame regardless of its release time */
+static int jq_send_head(void) {
+    jq_frame_t *f = &jq[jq_head];
+    int rc = farm9crypt_write(f->fd, f->data, f->len) == f->len ? 0 : -1;
+    free(f->data);
+    f->data = NULL;
+    jq_head = (jq_head + 1) % jq_cap;
+    jq_count--;
+    return rc;
+}
+
+/* Sleep until the head frame is due, then send it */
+static int jq_wait_head(void) {
+    long long wait = jq[jq_head].release_us - mono_us();
+    if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec  = (time_t)(wait / 1000000LL);
+        ts.tv_nsec = (long)(wait % 1000000LL) * 1000L;
+        nanosleep(&ts, NULL);
+    }
+    return jq_send_head();
+}
+
+int obfs_jq_push(int fd, const void *data, size_t len, int max_ms) {
+    if (jq_count == jq_cap && jq_grow() < 0)
+        return -1;
+
+    char *copy = malloc(len);
+    if (!copy) return -1;
+    memcpy(copy, data, len);
+
+    long long release = mono_us();
+    if (max_ms > 0)
+        release += (long long)jitter_delay_ms(max_ms) * 1000LL;
+    if (jq_count > 0 && release < jq_last_us)
+        release = jq_last_us;   /* keep frames in order */
+    jq_last_us = release;
+
+    jq_frame_t *f = &jq[(jq_head + jq_count) % jq_cap];
+    f->release_us = release;
+    f->fd = fd;
+    f->len = (int)len;
+    f->data = copy;
+    jq_count++;
+    return (int)len;
+}
+
+int obfs_jq_flush(void) {
+    long long now = mono_us();
+    jq_wait_fd = -1;
+    while (jq_count > 0 && jq[jq_head].release_us <= now) {
+        /* Never block here: a relay stuck in a write stops reading, and
+         * two of them facing each other wedge the tunnel */
+        struct pollfd p = { jq[jq_head].fd, POLLOUT, 0 };
+        if (poll(&p, 1, 0) != 1 || !(p.revents & (POLLOUT | POLLERR | POLLHUP))) {
+            jq_wait_fd = p.fd;
+            break;
+        }
+        if (jq_send_head() < 0) return -1;
+    }
+    return 0;
+}
+
+int obfs_jq_drain(void) {
+    int rc = 0;
+    while (jq_count > 0) {
+        if (jq_wait_head() < 0) rc = -1;
+    }
+    return rc;
+}
+
+int obfs_jq_pending(void) {
+    return jq_count;
+}
+
+int obfs_jq_full(void) {
+    return jq_count >= OBFS_JQ_MAX;
+}
+
+int obfs_jq_wait_fd(void) {
+    return jq_count > 0 ? jq_wait_fd : -1;
+}
+
+struct timeval *obfs_jq_timeout(struct timeval *tv) {
+    if (jq_count == 0 || obfs_jq_wait_fd() >= 0) return NULL;
+    long long wait = jq[jq_head].release_us - mono_us();
+    if (wait < 0) wait = 0;
+    tv->tv_sec  = (time_t)(wait / 1000000LL);
+    tv->tv_usec = (suseconds_t)(wait % 1000000LL);
+    return tv;
+}
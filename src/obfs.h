@@ -7,19 +7,91 @@
 #define OBFS_NONE 0
 #define OBFS_HTTP 1
 #define OBFS_TLS  2
+#define OBFS_HTTP_STREAM 3   /* chunked POST per direction */
+#define OBFS_H2   4          /* HTTP/2 DATA frames inside TLS (ALPN h2) */
+
+/* Minimum chunks per streamed request before rotating (plus 0..127) */
+#define OBFS_HTTP_ROTATE 64
 
 /* Anti-fingerprint: pad all packets to this size */
 #define OBFS_PAD_SIZE 1400
 
+/* Largest padded frame — must fit one farm9crypt record (FARM9_MAX_MSG) */
+#define OBFS_PAD_MAX  8192
+
+/* Padding policies (--pad-policy) */
+#define OBFS_PAD_FIXED  0   /* OBFS_PAD_SIZE, then multiples of it (default) */
+#define OBFS_PAD_BUCKET 1   /* smallest of 128/512/1400/2800/... that fits */
+#define OBFS_PAD_RANDOM 2   /* random pick among the 3 smallest fitting buckets */
+
 /* Set obfuscation mode globally */
 void obfs_set_mode(int mode);
 
 /* Get current obfuscation mode */
 int obfs_get_mode(void);
 
+/* True if the mode runs inside a TLS session (tls, h2) */
+int obfs_uses_tls(void);
+
+/*
+ * Kernel TLS offload. On by default: OpenSSL installs the "tls" ULP after
+ * the handshake when the kernel and cipher allow it, and silently stays in
+ * userspace otherwise. The probes report what the current session got.
+ */
+void obfs_ktls_set(int enabled);
+int  obfs_ktls_send_active(void);
+int  obfs_ktls_recv_active(void);
+
+/*
+ * Plaintext bytes OpenSSL has already decrypted but not handed out. A
+ * poll() on the socket cannot see them, so drain these with obfs_recv()
+ * before waiting on the fd or handing it to the kernel.
+ */
+int obfs_tls_pending(void);
+
+/*
+ * RFC 8446 exporter secret of the current TLS session (no context value).
+ * Both ends get the same bytes only if they share one TLS session, so a
+ * proxy that terminates TLS on each side cannot make them match.
+ * Returns 0 on success, -1 if no session is up.
+ */
+int obfs_tls_exporter(const char *label, unsigned char *out, size_t len);
+
+/*
+ * Server TLS context and self-signed camouflage certificate. Built once —
+ * call before the accept loop so forked children inherit it; calling again
+ * is cheap and only rebuilds after kTLS setting changes or once the
+ * certificate is OBFS_CERT_ROTATE_DAYS old. obfs_tls_accept() calls it
+ * on demand. Returns 0 on success, -1 on error.
+ */
+#define OBFS_CERT_ROTATE_DAYS 30
+int obfs_tls_server_init(void);
+
+/* Keep the certificate in ~/.clawsec/tls_cert.pem across restarts */
+void obfs_tls_cert_cache(int enabled);
+
+/* Server ticket keys rotate this often; tickets stay valid for two periods */
+#define OBFS_TICKET_ROTATE_SECS 3600
+
+/*
+ * Client resumption: the newest session ticket is kept in memory and
+ * offered on the next connect to the same peer address. With
+ * obfs_tls_session_cache(1) it is also kept in ~/.clawsec/tls_session.pem
+ * so separate client processes resume too.
+ */
+void obfs_tls_session_cache(int enabled);
+
+/* True if the current TLS session was resumed from a ticket */
+int obfs_tls_resumed(void);
+
+/* Free the session, both cached contexts, the certificate and the ticket */
+void obfs_tls_cleanup(void);
+
 /*
  * TLS camouflage layer — wraps the socket in a real TLS 1.3 session.
  * Must be called AFTER accept/connect, BEFORE any crypto handshake.
+ * In OBFS_H2 mode this also negotiates ALPN h2 and exchanges the
+ * connection preface and SETTINGS.
  * Returns 0 on success, -1 on error.
  */
 int obfs_tls_accept(int fd);
@@ -37,9 +109,16 @@ int obfs_send(int fd, const void *data, size_t len);
  */
 int obfs_recv(int fd, void *buf, size_t buflen);
 
+/* Select the padding policy (sender side only — unpad is policy-agnostic) */
+void obfs_pad_set_policy(int policy);
+int obfs_pad_get_policy(void);
+
+/* Padded size the current policy picks for a len-byte payload, -1 if too large */
+int obfs_pad_target(size_t len);
+
 /*
- * Pad buffer to OBFS_PAD_SIZE bytes. Returns padded length.
- * Format: [2-byte real_len big-endian][payload][random padding]
+ * Pad buffer to the size chosen by the current policy. Returns padded length.
+ * Format: [2-byte real_len big-endian][payload][keystream padding]
  */
 int obfs_pad(const void *data, size_t len, void *out, size_t out_max);
 
@@ -53,6 +132,44 @@ int obfs_unpad(const void *data, size_t len, void *out, size_t out_max);
  */
 void obfs_jitter(int max_ms);
 
+/*
+ * Scheduled jitter queue (--jitter). Instead of sleeping inline, each frame
+ * gets a release time of now + random 0..max_ms (never earlier than the
+ * previous frame's, so order is preserved) and is farm9crypt_write()n by
+ * obfs_jq_flush() once due. Event loops keep servicing reads meanwhile,
+ * and stop reading what they would push while obfs_jq_full().
+ */
+#define OBFS_JQ_MAX 256   /* queued frames before obfs_jq_full() */
+
+/* Queue a frame for fd. Returns len on success, -1 on error. */
+int obfs_jq_push(int fd, const void *data, size_t len, int max_ms);
+
+/* Send every frame whose release time has passed and whose socket has
+ * room; never blocks. Returns 0 or -1. */
+int obfs_jq_flush(void);
+
+/* Block until the queue is empty. Returns 0 or -1. */
+int obfs_jq_drain(void);
+
+/* Number of queued frames */
+int obfs_jq_pending(void);
+
+/* Nonzero with OBFS_JQ_MAX frames queued: the sender is outrunning the
+ * jitter window, so stop reading its input until a flush. Push never
+ * blocks; past this it only grows the queue. */
+int obfs_jq_full(void);
+
+/* The fd a due frame waits to be written to, or -1: event loops wait for
+ * it to be writable, and flush again */
+int obfs_jq_wait_fd(void);
+
+/*
+ * select() timeout until the next release: fills tv and returns it,
+ * or returns NULL (wait forever) when the queue is empty or waits on
+ * obfs_jq_wait_fd().
+ */
+struct timeval *obfs_jq_timeout(struct timeval *tv);
+
 /* Encrypted Client Hello (GREASE ECH) — hides SNI from DPI */
 void obfs_ech_enable(void);
 void obfs_ech_disable(void);
@@ -0,0 +1,249 @@
+/*
+ * prefork.c — Pre-forked accept workers for -K servers (--prefork)
+ *
+ * Workers report on a pipe when they take a connection; the parent answers
+ * by forking the next worker for that listener once none is left waiting
+ * on it. It never accepts itself. With ops->reuse a worker reports again
+ * when its session is done, and the parent lets it wait for another one
+ * unless PREFORK_SPARE workers are already waiting on its listener.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+
+#include "prefork.h"
+#include "net.h"
+#include "util.h"
+
+typedef struct {
+    pid_t pid;
+    int slot;
+    int back;       /* 0: took a connection; 1: done with it, may it wait again? */
+} prefork_msg_t;
+
+/* Parent: every worker that is waiting, or busy and may come back */
+typedef struct {
+    pid_t pid;
+    int slot;
+    int ctl;        /* answers to back: 'y' wait again, else exit */
+    int idle;
+} prefork_worker_t;
+
+static prefork_worker_t *s_workers = NULL;
+static int s_nworkers = 0, s_cap = 0;
+
+int prefork_default_workers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n > PREFORK_MAX ? PREFORK_MAX : (int)n;
+}
+
+void prefork_listen(const char *port, int backlog, int *fds, int n) {
+#ifdef __linux__
+    for (int i = 0; i < n; i++) {
+        fds[i] = net_listen_reuseport(port);
+        listen(fds[i], backlog);
+    }
+#else
+    /* No balancing group: the workers take turns on one listener */
+    fds[0] = net_listen(port);
+    listen(fds[0], backlog);
+    for (int i = 1; i < n; i++)
+        fds[i] = fds[0];
+#endif
+}
+
+static void worker(const int *fds, int n, int slot, int notify_fd, int ctl_fd,
+                   const prefork_ops_t *ops) {
+    for (int i = 0; i < n; i++)
+        if (fds[i] != fds[slot]) close(fds[i]);
+    if (ops->warm) ops->warm(ops->ctx);
+
+    struct pollfd p = { fds[slot], POLLIN, 0 };
+    long long retire = mono_ms() + PREFORK_MAX_IDLE_S * 1000LL;
+    for (;;) {
+        long long wait = retire - mono_ms();
+        if (wait <= 0) _exit(0);
+        if (poll(&p, 1, (int)wait) <= 0) continue;
+        int fd = accept(fds[slot], NULL, NULL);
+        if (fd < 0) continue;    /* a sibling on the shared listener got it */
+        /* BSD accept() hands the shared listener's O_NONBLOCK on; the
+         * handshake reads block */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        log_peer(fd);
+
+        prefork_msg_t msg = { getpid(), slot, 0 };
+        if (write(notify_fd, &msg, sizeof(msg)) < 0)
+            log_msg(2, "prefork: parent gone");
+        if (!ops->reuse) {
+            close(notify_fd);
+            close(ctl_fd);
+            close(fds[slot]);
+            ops->serve(fd, ops->ctx);
+            _exit(0);
+        }
+        ops->serve(fd, ops->ctx);
+
+        /* Wait again if the parent still wants this worker; EOF on ctl_fd
+         * means the parent is gone */
+        char go = 0;
+        msg.back = 1;
+        if (write(notify_fd, &msg, sizeof(msg)) != (ssize_t)sizeof(msg) ||
+            read(ctl_fd, &go, 1) != 1 || go != 'y')
+            _exit(0);
+        retire = mono_ms() + PREFORK_MAX_IDLE_S * 1000LL;
+    }
+}
+
+static prefork_worker_t *find_worker(pid_t pid) {
+    for (int i = 0; i < s_nworkers; i++)
+        if (s_workers[i].pid == pid) return &s_workers[i];
+    return NULL;
+}
+
+static void drop_worker(prefork_worker_t *w) {
+    close(w->ctl);
+    *w = s_workers[--s_nworkers];
+}
+
+static int idle_on(int slot) {
+    int k = 0;
+    for (int i = 0; i < s_nworkers; i++)
+        if (s_workers[i].slot == slot && s_workers[i].idle) k++;
+    return k;
+}
+
+/* Parent: what respawn_loop's callbacks share */
+typedef struct {
+    const int *fds;
+    int n;
+    const prefork_ops_t *ops;
+    int notes[2];
+    int ctl[2];     /* the next worker's, made in worker_prepare */
+} prefork_conf_t;
+
+static int worker_want(int slot, void *arg) {
+    (void)arg;
+    return idle_on(slot) == 0;
+}
+
+static int worker_prepare(int slot, void *arg) {
+    prefork_conf_t *c = arg;
+    (void)slot;
+    if (s_nworkers == s_cap) {
+        int cap = s_cap ? s_cap * 2 : 2 * PREFORK_MAX;
+        prefork_worker_t *nw = realloc(s_workers, (size_t)cap * sizeof(*nw));
+        if (!nw) fatal("prefork: out of memory");
+        s_workers = nw;
+        s_cap = cap;
+    }
+    if (c->ops->prepare) c->ops->prepare(c->ops->ctx);
+    if (pipe(c->ctl) < 0) {
+        perror("pipe");
+        c->ctl[0] = c->ctl[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void worker_child(int slot, void *arg) {
+    prefork_conf_t *c = arg;
+    close(c->notes[0]);
+    /* Only the parent may hold the write ends: its exit is then an EOF
+     * for every worker */
+    for (int w = 0; w < s_nworkers; w++)
+        close(s_workers[w].ctl);
+    close(c->ctl[1]);
+    worker(c->fds, c->n, slot, c->notes[1], c->ctl[0], c->ops);
+}
+
+static void worker_forked(int slot, pid_t pid, void *arg) {
+    prefork_conf_t *c = arg;
+    if (pid < 0) {
+        if (c->ctl[0] >= 0) {
+            close(c->ctl[0]);
+            close(c->ctl[1]);
+        }
+        return;
+    }
+    close(c->ctl[0]);
+    s_workers[s_nworkers++] = (prefork_worker_t){ pid, slot, c->ctl[1], 1 };
+    log_msg(2, "prefork: worker pid=%d on listener %d", (int)pid, slot);
+}
+
+static void read_notes(void *arg) {
+    prefork_conf_t *c = arg;
+    prefork_msg_t msg;
+    while (read(c->notes[0], &msg, sizeof(msg)) == (ssize_t)sizeof(msg)) {
+        prefork_worker_t *w = find_worker(msg.pid);
+        if (!w) continue;
+        if (!msg.back) {
+            /* Taken: the next worker for this listener is forked if none
+             * is left waiting */
+            w->idle = 0;
+            if (!c->ops->reuse) drop_worker(w);
+            continue;
+        }
+        /* Done: wait again, or exit if enough already wait */
+        int stay = idle_on(w->slot) < PREFORK_SPARE;
+        if (write(w->ctl, stay ? "y" : "n", 1) != 1 || !stay)
+            drop_worker(w);
+        else
+            w->idle = 1;
+    }
+    /* Woken by a worker that just accepted: let it reach its first
+     * handshake flight before the fork takes the CPU */
+    sched_yield();
+}
+
+static int worker_reaped(pid_t pid, int status, void *arg) {
+    (void)arg;
+    prefork_worker_t *w = find_worker(pid);
+    if (!w) return -1;
+    /* Died waiting: retired, or something is wrong */
+    int slot = w->idle && (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ? w->slot : -1;
+    drop_worker(w);
+    return slot;
+}
+
+static void kill_idle(void *arg) {
+    (void)arg;
+    for (int i = 0; i < s_nworkers; i++)
+        if (s_workers[i].idle) kill(s_workers[i].pid, SIGTERM);
+}
+
+void prefork_run(const int *fds, int n, const prefork_ops_t *ops) {
+    static prefork_conf_t conf;
+    conf = (prefork_conf_t){ fds, n, ops, { -1, -1 }, { -1, -1 } };
+    if (pipe(conf.notes) < 0)
+        fatal("pipe: %s", strerror(errno));
+    fcntl(conf.notes[0], F_SETFL, O_NONBLOCK);
+    /* Shared listener (no SO_REUSEPORT): idle workers must not block in
+     * accept when another took the connection */
+    for (int i = 1; i < n; i++)
+        if (fds[i] == fds[0])
+            set_nonblock(fds[0]);
+
+    /* A worker's answer to a parent that just died must not kill it */
+    signal(SIGPIPE, SIG_IGN);
+
+    log_msg(1, "prefork: %d workers%s", n, ops->reuse ? ", reused" : "");
+    respawn_ops_t rops = {
+        .nslots = n, .retry_ms = PREFORK_RETRY_MS, .event_fd = conf.notes[0],
+        .want = worker_want, .prepare = worker_prepare, .child = worker_child,
+        .forked = worker_forked, .on_event = read_notes, .reaped = worker_reaped,
+        .stop = kill_idle, .ctx = &conf,
+    };
+    respawn_loop(&rops);
+}
@@ -0,0 +1,46 @@
+#ifndef CLAWSEC_PREFORK_H
+#define CLAWSEC_PREFORK_H
+
+/*
+ * Prefork (-K --prefork): instead of forking a handler after each accept,
+ * keep one worker per listener forked ahead of time and blocked in accept.
+ * Each listener is its own SO_REUSEPORT socket, so the kernel spreads
+ * connections over them and the workers accept in parallel.
+ *
+ * A worker serves the connection it accepts and, unless ops->reuse is set,
+ * exits: the TLS session and the h2 state live in process globals, and a
+ * fresh process is the only reset that is sure to be complete. Sessions
+ * that keep nothing outside farm9crypt (plain TCP) set reuse, and their
+ * workers go back to accept when done, up to PREFORK_SPARE per listener.
+ * The parent forks a new worker when none is left waiting on a listener,
+ * while the one that took the connection is already handshaking, so the
+ * fork is no longer in front of any client, and the worker does its
+ * one-time library setup while it waits. An idle
+ * worker retires after PREFORK_MAX_IDLE_S, which keeps the TLS certificate
+ * and ticket keys it inherited in step with the parent's.
+ */
+
+#define PREFORK_MAX         64
+#define PREFORK_MAX_IDLE_S  600   /* well inside OBFS_TICKET_ROTATE_SECS */
+#define PREFORK_RETRY_MS    1000  /* refill pause after a worker that failed idle */
+#define PREFORK_SPARE       2     /* reused workers kept waiting per listener */
+
+/* Worker count for --prefork without one: the CPUs online */
+int prefork_default_workers(void);
+
+/* n listeners on port, each with the given backlog: an SO_REUSEPORT group
+ * where there is one, else one listener shared by all */
+void prefork_listen(const char *port, int backlog, int *fds, int n);
+
+typedef struct {
+    void (*prepare)(void *ctx);        /* parent, before every fork */
+    void (*warm)(void *ctx);           /* worker, before it waits */
+    void (*serve)(int fd, void *ctx);  /* worker, with the connection it took */
+    void *ctx;
+    int reuse;                         /* serve leaves no state: accept again */
+} prefork_ops_t;
+
+/* Serve forever with a worker waiting on each of fds[0..n-1] */
+void prefork_run(const int *fds, int n, const prefork_ops_t *ops);
+
+#endif
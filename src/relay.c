@@ -27,6 +27,8 @@
 #define COLOR_BOLD    "\033[1m"
 
 #define BUFSIZE 8192
+/* Largest plaintext read that still fits a padded frame */
+#define PAD_READ (OBFS_PAD_MAX - 2)
 #define MAX_FILE_SIZE (4 * 1024 * 1024) /* 4MB inline file limit */
 
 /* Feature flags — set from clawsec.c */
@@ -142,24 +144,28 @@ static uint64_t now_ms(void) {
 
 /* ── Anti-fingerprint wrappers ── */
 
-/* Write with optional padding + jitter */
-static int relay_write(int sockfd, char *data, int len) {
+/* Send one frame now, or hand it to the jitter queue */
+static int relay_send(int sockfd, char *data, int len) {
     if (g_jitter > 0)
-        obfs_jitter(g_jitter);
+        return obfs_jq_push(sockfd, data, (size_t)len, g_jitter) == len ? 0 : -1;
+    return farm9crypt_write(sockfd, data, len) == len ? 0 : -1;
+}
 
+/* Write with optional padding + jitter */
+static int relay_write(int sockfd, char *data, int len) {
     if (g_pad) {
-        char padded[OBFS_PAD_SIZE];
+        char padded[OBFS_PAD_MAX];
         int plen = obfs_pad(data, (size_t)len, padded, sizeof(padded));
         if (plen < 0) return -1;
-        return farm9crypt_write(sockfd, padded, plen) == plen ? len : -1;
+        return relay_send(sockfd, padded, plen) == 0 ? len : -1;
     }
-    return farm9crypt_write(sockfd, data, len) == len ? len : -1;
+    return relay_send(sockfd, data, len) == 0 ? len : -1;
 }
 
 /* Read with optional unpadding */
 static int relay_read(int sockfd, char *buf, int bufsize) {
     if (g_pad) {
-        char padded[OBFS_PAD_SIZE];
+        char padded[OBFS_PAD_MAX];
         int got = farm9crypt_read(sockfd, padded, sizeof(padded));
         if (got <= 0) return got;
         return obfs_unpad(padded, (size_t)got, buf, (size_t)bufsize);
@@ -520,16 +526,25 @@ int relay_socket_stdio(int sockfd, int is_server, int chat_enabled) {
 
         FD_ZERO(&rfds);
         FD_SET(sockfd, &rfds);
-        if (!stdin_closed) {
+        /* Jitter queue full: leave stdin until it drains */
+        if (!stdin_closed && !obfs_jq_full()) {
             FD_SET(STDIN_FILENO, &rfds);
             if (STDIN_FILENO > nfds) nfds = STDIN_FILENO;
         }
 
-        int ret = select(nfds + 1, &rfds, NULL, NULL, NULL);
+        fd_set wfds;
+        FD_ZERO(&wfds);
+        if (obfs_jq_wait_fd() >= 0)
+            FD_SET(sockfd, &wfds);
+
+        struct timeval tv;
+        int ret = select(nfds + 1, &rfds, &wfds, NULL, obfs_jq_timeout(&tv));
         if (ret < 0) {
             if (errno == EINTR) continue;
             fatal("select failed");
         }
+        if (obfs_jq_flush() < 0) fatal("write to network failed");
+        if (ret == 0) continue;
 
         /* ── Network → stdout ── */
         if (FD_ISSET(sockfd, &rfds)) {
@@ -609,7 +624,7 @@ int relay_socket_stdio(int sockfd, int is_server, int chat_enabled) {
 
         /* ── stdin → Network ── */
         if (!stdin_closed && FD_ISSET(STDIN_FILENO, &rfds)) {
-            n = read(STDIN_FILENO, inbuf, sizeof(inbuf));
+            n = read(STDIN_FILENO, inbuf, g_pad ? PAD_READ : sizeof(inbuf));
             if (n < 0) fatal("read from stdin failed");
             if (n == 0) {
                 if (g_verify) {
@@ -629,6 +644,7 @@ int relay_socket_stdio(int sockfd, int is_server, int chat_enabled) {
                     }
                     relay_write(sockfd, sd, sl);
                 }
+                obfs_jq_drain();
                 shutdown(sockfd, SHUT_WR);
                 stdin_closed = 1;
             } else {
@@ -666,6 +682,8 @@ int relay_socket_stdio(int sockfd, int is_server, int chat_enabled) {
         }
     }
 
+    obfs_jq_drain();
+
     if (g_verify) {
         EVP_MD_CTX_free(sha_send);
         EVP_MD_CTX_free(sha_recv);
@@ -698,13 +716,22 @@ int relay_encrypted_plain(int enc_fd, int plain_fd) {
 
         FD_ZERO(&rfds);
         FD_SET(enc_fd, &rfds);
-        FD_SET(plain_fd, &rfds);
+        if (!obfs_jq_full())
+            FD_SET(plain_fd, &rfds);
 
-        int ret = select(nfds + 1, &rfds, NULL, NULL, NULL);
+        fd_set wfds;
+        FD_ZERO(&wfds);
+        if (obfs_jq_wait_fd() >= 0)
+            FD_SET(enc_fd, &wfds);
+
+        struct timeval tv;
+        int ret = select(nfds + 1, &rfds, &wfds, NULL, obfs_jq_timeout(&tv));
         if (ret < 0) {
             if (errno == EINTR) continue;
             return -1;
         }
+        if (obfs_jq_flush() < 0) break;
+        if (ret == 0) continue;
 
         if (FD_ISSET(enc_fd, &rfds)) {
             n = relay_read(enc_fd, buf, sizeof(buf));
@@ -714,13 +741,15 @@ int relay_encrypted_plain(int enc_fd, int plain_fd) {
         }
 
         if (FD_ISSET(plain_fd, &rfds)) {
-            n = read(plain_fd, buf, sizeof(buf));
+            n = read(plain_fd, buf, g_pad ? PAD_READ : sizeof(buf));
             if (n <= 0) break;
             sent += (size_t)n;
             if (relay_write(enc_fd, buf, (int)n) < 0) break;
         }
     }
 
+    obfs_jq_drain();
+
     if (g_verbose)
         log_msg(1, "[Forwarding done] sent=%zu recv=%zu", sent, received);
     return 0;
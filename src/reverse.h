@@ -6,16 +6,17 @@
  *   Server listens on rev_port, accepts connections, forwards through
  *   encrypted tunnel to client which connects to local target.
  *
- * Protocol over encrypted channel:
- *   Server → Client: "ROPEN\n"  (new incoming connection)
- *   Client connects to target, sends: "ROK\n"
- *   Then bidirectional relay through tunnel.
+ * Runs on the mux (mux.h) with the roles of -L swapped: the tunnel server
+ * opens a stream per accepted connection, the tunnel client connects each
+ * one to the target without blocking the others and answers OPEN_OK, or
+ * CLOSE when the target cannot be reached. Any number of connections share
+ * the tunnel at once.
  */
 
 /* Server side: listen on rev_port, relay through encrypted tunnel_fd */
 int reverse_server(int tunnel_fd, const char *rev_port);
 
-/* Client side: wait for ROPEN, connect to target, relay back */
+/* Client side: connect each stream the server opens to the target */
 int reverse_client(int tunnel_fd, const char *target_host, const char *target_port);
 
 #endif
@@ -2,309 +2,205 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <errno.h>
 #include <unistd.h>
-#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
-#include <sys/wait.h>
-#include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "socks5.h"
 #include "util.h"
-#include "net.h"
-#include "farm9crypt.h"
+#include "mux.h"
 
 /*
  * SOCKS5 protocol constants
  */
 #define SOCKS_VERSION   0x05
 #define SOCKS_AUTH_NONE 0x00
-#define SOCKS_CMD_CONNECT 0x01
 #define SOCKS_ATYP_IPV4   0x01
 #define SOCKS_ATYP_DOMAIN 0x03
 #define SOCKS_ATYP_IPV6   0x04
-#define SOCKS_REP_OK       0x00
-#define SOCKS_REP_FAIL     0x01
-#define SOCKS_REP_DENIED   0x02
-#define SOCKS_REP_NETUNREACH 0x03
-#define SOCKS_REP_HOSTUNREACH 0x04
-#define SOCKS_REP_CONNREFUSED 0x05
 
-#define RELAY_BUF 8192
+int socks5_parse_greeting(const unsigned char *buf, size_t len) {
+    if (len >= 1 && buf[0] != SOCKS_VERSION) return -1;
+    if (len < 2) return 0;
 
-/* Read exactly n bytes */
-static int read_exact(int fd, void *buf, size_t n) {
-    size_t done = 0;
-    while (done < n) {
-        ssize_t r = read(fd, (char *)buf + done, n - done);
-        if (r <= 0) return -1;
-        done += r;
-    }
-    return 0;
+    size_t nmethods = buf[1];
+    if (len < 2 + nmethods) return 0;
+    for (size_t i = 0; i < nmethods; i++)
+        if (buf[2 + i] == SOCKS_AUTH_NONE) return (int)(2 + nmethods);
+    return -1;
 }
 
 /*
- * Handle one SOCKS5 client connection.
- * Does SOCKS5 handshake, extracts target, sends through tunnel,
- * then relays bidirectionally.
+ * ATYP and address at the start of buf, into host. Returns the bytes they
+ * take, 0 while incomplete, -1 when malformed, or -2 for an unknown type.
  */
-static void handle_socks_client(int client_fd, int tunnel_fd) {
-    unsigned char buf[512];
-
-    /* 1. Version/auth negotiation */
-    if (read_exact(client_fd, buf, 2) < 0) goto fail;
-    if (buf[0] != SOCKS_VERSION) goto fail;
-
-    int nmethods = buf[1];
-    if (nmethods > 0 && nmethods < 256) {
-        if (read_exact(client_fd, buf, nmethods) < 0) goto fail;
+static int parse_addr(const unsigned char *buf, size_t len, char *host) {
+    if (len < 1) return 0;
+    switch (buf[0]) {
+    case SOCKS_ATYP_IPV4:
+        if (len < 1 + 4) return 0;
+        inet_ntop(AF_INET, buf + 1, host, 256);
+        return 1 + 4;
+    case SOCKS_ATYP_DOMAIN:
+        if (len < 2) return 0;
+        if (buf[1] == 0) return -1;
+        if (len < 2 + (size_t)buf[1]) return 0;
+        memcpy(host, buf + 2, buf[1]);
+        host[buf[1]] = '\0';
+        return 2 + buf[1];
+    case SOCKS_ATYP_IPV6:
+        if (len < 1 + 16) return 0;
+        inet_ntop(AF_INET6, buf + 1, host, 256);
+        return 1 + 16;
     }
+    return -2;
+}
 
-    /* Reply: no auth required */
-    buf[0] = SOCKS_VERSION;
-    buf[1] = SOCKS_AUTH_NONE;
-    if (write(client_fd, buf, 2) != 2) goto fail;
-
-    /* 2. CONNECT request */
-    if (read_exact(client_fd, buf, 4) < 0) goto fail;
-    if (buf[0] != SOCKS_VERSION || buf[1] != SOCKS_CMD_CONNECT) goto fail;
-
-    char host[256];
-    uint16_t port;
-    int host_len = 0;
-
-    switch (buf[3]) {
-    case SOCKS_ATYP_IPV4: {
-        unsigned char ipv4[4];
-        if (read_exact(client_fd, ipv4, 4) < 0) goto fail;
-        snprintf(host, sizeof(host), "%d.%d.%d.%d",
-                 ipv4[0], ipv4[1], ipv4[2], ipv4[3]);
-        host_len = strlen(host);
-        break;
-    }
-    case SOCKS_ATYP_DOMAIN: {
-        unsigned char dlen;
-        if (read_exact(client_fd, &dlen, 1) < 0) goto fail;
-        if (read_exact(client_fd, host, dlen) < 0) goto fail;
-        host[dlen] = '\0';
-        host_len = dlen;
-        break;
+/* Address as ATYP and address: literals as such, anything else a name */
+static size_t put_addr(unsigned char *out, const char *host) {
+    if (inet_pton(AF_INET, host, out + 1) == 1) {
+        out[0] = SOCKS_ATYP_IPV4;
+        return 1 + 4;
     }
-    case SOCKS_ATYP_IPV6: {
-        unsigned char ipv6[16];
-        if (read_exact(client_fd, ipv6, 16) < 0) goto fail;
-        inet_ntop(AF_INET6, ipv6, host, sizeof(host));
-        host_len = strlen(host);
-        break;
+    if (inet_pton(AF_INET6, host, out + 1) == 1) {
+        out[0] = SOCKS_ATYP_IPV6;
+        return 1 + 16;
     }
-    default:
-        goto fail;
-    }
-
-    /* Read port (2 bytes, network order) */
-    unsigned char port_buf[2];
-    if (read_exact(client_fd, port_buf, 2) < 0) goto fail;
-    port = (port_buf[0] << 8) | port_buf[1];
-
-    log_msg(1, "SOCKS5 CONNECT %s:%d", host, port);
+    size_t n = strlen(host);
+    if (n > 255) n = 255;
+    out[0] = SOCKS_ATYP_DOMAIN;
+    out[1] = (unsigned char)n;
+    memcpy(out + 2, host, n);
+    return 2 + n;
+}
 
-    /* 3. Send connect request through encrypted tunnel:
-     *    [1: host_len][N: host][2: port_be] */
-    char req[260];
-    req[0] = (char)host_len;
-    memcpy(req + 1, host, host_len);
-    req[1 + host_len] = port_buf[0];
-    req[2 + host_len] = port_buf[1];
+/* [1: host_len][N: host][2: port_be] */
+static size_t put_target(unsigned char *target, const char *host,
+                         const unsigned char *port_be) {
+    size_t host_len = strlen(host);
+    target[0] = (unsigned char)host_len;
+    memcpy(target + 1, host, host_len);
+    memcpy(target + 1 + host_len, port_be, 2);
+    return 3 + host_len;
+}
 
-    int req_len = 3 + host_len;
-    if (farm9crypt_write(tunnel_fd, req, req_len) < 0) goto fail;
+/* Socket address as text, IPv4-mapped IPv6 as plain IPv4 */
+static void sa_host(const struct sockaddr *sa, char *host, unsigned char *port_be) {
+    const unsigned char *p;
+    if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *s6 = (const struct sockaddr_in6 *)sa;
+        if (IN6_IS_ADDR_V4MAPPED(&s6->sin6_addr))
+            inet_ntop(AF_INET, s6->sin6_addr.s6_addr + 12, host, 256);
+        else
+            inet_ntop(AF_INET6, &s6->sin6_addr, host, 256);
+        p = (const unsigned char *)&s6->sin6_port;
+    } else {
+        const struct sockaddr_in *s4 = (const struct sockaddr_in *)sa;
+        inet_ntop(AF_INET, &s4->sin_addr, host, 256);
+        p = (const unsigned char *)&s4->sin_port;
+    }
+    port_be[0] = p[0];
+    port_be[1] = p[1];
+}
 
-    /* 4. Read server response: [1: status] */
-    char status_buf[1];
-    int rlen = farm9crypt_read(tunnel_fd, status_buf, sizeof(status_buf));
-    if (rlen < 1 || status_buf[0] != 0) {
-        /* Connection failed — send SOCKS5 error */
-        unsigned char reply[10] = {SOCKS_VERSION, SOCKS_REP_HOSTUNREACH,
-                                   0, SOCKS_ATYP_IPV4, 0,0,0,0, 0,0};
-        (void)write(client_fd, reply, 10);
-        goto fail;
+int socks5_parse_request(const unsigned char *buf, size_t len,
+                         unsigned char *cmd, unsigned char *target,
+                         size_t *target_len, unsigned char *rep) {
+    *rep = SOCKS5_REP_FAIL;
+    if (len >= 1 && buf[0] != SOCKS_VERSION) return -1;
+    if (len < 4) return 0;
+    if (buf[1] != SOCKS5_CMD_CONNECT && buf[1] != SOCKS5_CMD_UDP) {
+        *rep = SOCKS5_REP_CMD;
+        return -1;
     }
+    *cmd = buf[1];
 
-    /* 5. Send SOCKS5 success reply */
-    unsigned char reply[10] = {SOCKS_VERSION, SOCKS_REP_OK,
-                               0, SOCKS_ATYP_IPV4, 0,0,0,0, 0,0};
-    if (write(client_fd, reply, 10) != 10) goto fail;
+    char host[256];
+    int addr_len = parse_addr(buf + 3, len - 3, host);
+    if (addr_len == -2) *rep = SOCKS5_REP_ATYP;
+    if (addr_len <= 0) return addr_len < 0 ? -1 : 0;
+    if (len < 3 + (size_t)addr_len + 2) return 0;
 
-    /* 6. Relay: client_fd <-> tunnel_fd (encrypted) */
-    fd_set rfds;
-    int maxfd = (client_fd > tunnel_fd) ? client_fd : tunnel_fd;
-    char relay_buf[RELAY_BUF];
+    *target_len = put_target(target, host, buf + 3 + addr_len);
+    return 3 + addr_len + 2;
+}
 
-    for (;;) {
-        FD_ZERO(&rfds);
-        FD_SET(client_fd, &rfds);
-        FD_SET(tunnel_fd, &rfds);
+int socks5_parse_target(const unsigned char *buf, size_t len,
+                        char *host, char *port) {
+    if (len < 1) return -1;
+    size_t host_len = buf[0];
+    if (host_len == 0 || len < 3 + host_len) return -1;
+    memcpy(host, buf + 1, host_len);
+    host[host_len] = '\0';
+    snprintf(port, 6, "%u", (unsigned)(buf[1 + host_len] << 8 | buf[2 + host_len]));
+    return (int)(3 + host_len);
+}
+
+size_t socks5_target_addr(unsigned char *target, const struct sockaddr *sa) {
+    char host[256];
+    unsigned char port_be[2];
+    sa_host(sa, host, port_be);
+    return put_target(target, host, port_be);
+}
 
-        int ret = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-        if (ret <= 0) break;
+int socks5_parse_udp(const unsigned char *buf, size_t len,
+                     unsigned char *target, size_t *target_len) {
+    /* RSV(2) FRAG(1): reassembly is optional, and not done */
+    if (len < 3 || buf[2] != 0) return -1;
+    char host[256];
+    int addr_len = parse_addr(buf + 3, len - 3, host);
+    if (addr_len <= 0 || len < 3 + (size_t)addr_len + 2) return -1;
+    *target_len = put_target(target, host, buf + 3 + addr_len);
+    return 3 + addr_len + 2;
+}
 
-        if (FD_ISSET(client_fd, &rfds)) {
-            ssize_t n = read(client_fd, relay_buf, sizeof(relay_buf));
-            if (n <= 0) break;
-            if (farm9crypt_write(tunnel_fd, relay_buf, n) < 0) break;
-        }
+size_t socks5_udp_header(unsigned char *out, const char *host, const char *port) {
+    unsigned p = (unsigned)atoi(port);
+    out[0] = out[1] = out[2] = 0;
+    size_t n = 3 + put_addr(out + 3, host);
+    out[n++] = (p >> 8) & 0xFF;
+    out[n++] = p & 0xFF;
+    return n;
+}
 
-        if (FD_ISSET(tunnel_fd, &rfds)) {
-            int n = farm9crypt_read(tunnel_fd, relay_buf, sizeof(relay_buf));
-            if (n <= 0) break;
-            ssize_t w = write(client_fd, relay_buf, n);
-            if (w <= 0) break;
-        }
-    }
+void socks5_reply(unsigned char *out, unsigned char rep) {
+    static const unsigned char tmpl[SOCKS5_REPLY_LEN] = {
+        SOCKS_VERSION, 0, 0, SOCKS_ATYP_IPV4, 0,0,0,0, 0,0
+    };
+    memcpy(out, tmpl, sizeof(tmpl));
+    out[1] = rep;
+}
 
-fail:
-    close(client_fd);
+size_t socks5_reply_addr(unsigned char *out, unsigned char rep,
+                         const struct sockaddr *sa) {
+    char host[256];
+    unsigned char port_be[2];
+    sa_host(sa, host, port_be);
+    out[0] = SOCKS_VERSION;
+    out[1] = rep;
+    out[2] = 0;
+    size_t n = 3 + put_addr(out + 3, host);
+    out[n++] = port_be[0];
+    out[n++] = port_be[1];
+    return n;
 }
 
 /*
- * Client-side SOCKS5: listen on local_port, for each connection
- * do SOCKS5 handshake and forward through tunnel.
- *
- * Note: single-threaded sequential — one SOCKS connection at a time
- * through the tunnel. For concurrent, use --mux + --socks together.
+ * Client-side SOCKS5: listen on local_port; every connection is a mux
+ * stream, negotiated and relayed by the mux event loop.
  */
 void socks5_client(int tunnel_fd, const char *local_port) {
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    if (getaddrinfo(NULL, local_port, &hints, &res) != 0) {
-        fprintf(stderr, "ERROR: SOCKS5 cannot bind to port %s\n", local_port);
-        return;
-    }
-
-    int listen_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (listen_fd < 0) {
-        freeaddrinfo(res);
-        fprintf(stderr, "ERROR: SOCKS5 socket failed\n");
-        return;
-    }
-
-    int yes = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-
-    if (bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0) {
-        freeaddrinfo(res);
-        close(listen_fd);
-        fprintf(stderr, "ERROR: SOCKS5 bind to port %s failed: %s\n",
-                local_port, strerror(errno));
-        return;
-    }
-    freeaddrinfo(res);
-
-    if (listen(listen_fd, 5) < 0) {
-        close(listen_fd);
-        fprintf(stderr, "ERROR: SOCKS5 listen failed\n");
-        return;
-    }
-
-    log_msg(1, "SOCKS5 proxy listening on 127.0.0.1:%s", local_port);
-
-    for (;;) {
-        int client_fd = accept(listen_fd, NULL, NULL);
-        if (client_fd < 0) {
-            if (errno == EINTR) continue;
-            break;
-        }
-        handle_socks_client(client_fd, tunnel_fd);
-    }
-
+    int listen_fd = mux_listen(local_port);
+    log_msg(1, "SOCKS5 proxy listening on port %s", local_port);
+    mux_relay_socks_client(tunnel_fd, listen_fd);
     close(listen_fd);
 }
 
 /*
- * Server-side SOCKS5: receive connect requests from tunnel,
- * make outbound connections, relay data back.
+ * Server-side SOCKS5: each stream the client opens names its target.
  */
 void socks5_server(int tunnel_fd) {
-    for (;;) {
-        /* Read connect request: [1: host_len][N: host][2: port_be] */
-        char buf[512];
-        int rlen = farm9crypt_read(tunnel_fd, buf, sizeof(buf));
-        if (rlen <= 0) break;
-
-        if (rlen < 4) {
-            char fail = 1;
-            farm9crypt_write(tunnel_fd, &fail, 1);
-            continue;
-        }
-
-        int host_len = (unsigned char)buf[0];
-        if (host_len + 3 > rlen) {
-            char fail = 1;
-            farm9crypt_write(tunnel_fd, &fail, 1);
-            continue;
-        }
-
-        char host[256];
-        memcpy(host, buf + 1, host_len);
-        host[host_len] = '\0';
-
-        uint16_t port = ((unsigned char)buf[1 + host_len] << 8) | (unsigned char)buf[2 + host_len];
-        char port_str[8];
-        snprintf(port_str, sizeof(port_str), "%d", port);
-
-        log_msg(1, "SOCKS5 server: connecting to %s:%s", host, port_str);
-
-        /* Connect to target */
-        int target_fd = net_try_connect(host, port_str, 10);
-        if (target_fd < 0) {
-            log_msg(1, "SOCKS5 server: connect to %s:%s failed", host, port_str);
-            char fail = 1;
-            farm9crypt_write(tunnel_fd, &fail, 1);
-            continue;
-        }
-
-        /* Send success */
-        char ok = 0;
-        if (farm9crypt_write(tunnel_fd, &ok, 1) < 0) {
-            close(target_fd);
-            break;
-        }
-
-        /* Relay: target_fd <-> tunnel_fd (encrypted) */
-        fd_set rfds;
-        int maxfd = (target_fd > tunnel_fd) ? target_fd : tunnel_fd;
-        char relay_buf[RELAY_BUF];
-
-        for (;;) {
-            FD_ZERO(&rfds);
-            FD_SET(target_fd, &rfds);
-            FD_SET(tunnel_fd, &rfds);
-
-            int ret = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-            if (ret <= 0) break;
-
-            if (FD_ISSET(target_fd, &rfds)) {
-                ssize_t n = read(target_fd, relay_buf, sizeof(relay_buf));
-                if (n <= 0) break;
-                if (farm9crypt_write(tunnel_fd, relay_buf, n) < 0) break;
-            }
-
-            if (FD_ISSET(tunnel_fd, &rfds)) {
-                int n = farm9crypt_read(tunnel_fd, relay_buf, sizeof(relay_buf));
-                if (n <= 0) break;
-                ssize_t w = write(target_fd, relay_buf, n);
-                if (w <= 0) break;
-            }
-        }
-
-        close(target_fd);
-    }
+    mux_relay_socks_server(tunnel_fd);
 }
@@ -1,19 +1,96 @@
 #ifndef CLAWSEC_SOCKS5_H
 #define CLAWSEC_SOCKS5_H
 
+#include <stddef.h>
+
 /*
  * SOCKS5 proxy over encrypted ClawSec tunnel.
  *
- * Client side: listens on local_port, accepts SOCKS5 connections,
- *              forwards connect requests through encrypted tunnel.
- * Server side: receives connect requests, makes outbound connections,
- *              relays data back through tunnel.
+ * Client side: listens on local_port, answers each application's SOCKS5
+ *              greeting and CONNECT itself, and opens a mux stream per
+ *              CONNECT — so any number of them share the tunnel at once.
+ * Server side: connects each stream to the target named in its OPEN,
+ *              without blocking the others.
+ *
+ * Target in the mux OPEN payload (after the class byte):
+ *   [1: host_len][N: host][2: port_be], then the stream's first bytes.
+ * The server answers OPEN_OK once connected, or CLOSE; the client turns
+ * that into the SOCKS5 reply.
  *
- * Protocol over tunnel:
- *   Client → Server: [1: addr_len][N: host][2: port_be]
- *   Server → Client: [1: status (0=ok, 1=fail)]
- *   Then bidirectional relay.
+ * UDP ASSOCIATE opens a stream with an empty target (host_len 0). Its
+ * datagrams travel as MUX_DGRAM frames, [target][data] both ways: the
+ * client strips the SOCKS5 UDP header and names the destination, the
+ * server sends from its own sockets for the association and names the
+ * source of each answer. Neither side retransmits or reorders them.
+ */
+
+#define SOCKS5_HELLO_MAX   257   /* ver, nmethods, 255 methods */
+#define SOCKS5_REQUEST_MAX 262   /* ver, cmd, rsv, atyp, len, 255 host, port */
+#define SOCKS5_TARGET_MAX  258   /* tunnel format of the longest target */
+#define SOCKS5_REPLY_LEN   10
+#define SOCKS5_REPLY_MAX   22    /* with an IPv6 bound address */
+#define SOCKS5_UDP_HDR_MAX 262   /* rsv, frag, atyp, len, 255 host, port */
+
+/* SOCKS5 commands */
+#define SOCKS5_CMD_CONNECT 0x01
+#define SOCKS5_CMD_UDP     0x03   /* UDP ASSOCIATE */
+
+/* SOCKS5 reply codes */
+#define SOCKS5_REP_OK          0x00
+#define SOCKS5_REP_FAIL        0x01
+#define SOCKS5_REP_HOSTUNREACH 0x04
+#define SOCKS5_REP_CMD         0x07
+#define SOCKS5_REP_ATYP        0x08
+
+/*
+ * Greeting at the start of buf. Returns its length, 0 while incomplete,
+ * or -1 when it is not SOCKS5 or does not offer "no authentication".
+ */
+int socks5_parse_greeting(const unsigned char *buf, size_t len);
+
+/*
+ * CONNECT or UDP ASSOCIATE request at the start of buf. Returns its length
+ * with the command in *cmd, the target in tunnel format in target
+ * (SOCKS5_TARGET_MAX bytes) and its size in *target_len, 0 while
+ * incomplete, or -1 with the SOCKS5 reply code to refuse it with in *rep.
+ * A UDP ASSOCIATE's target is where the application will send from,
+ * usually left unspecified.
  */
+int socks5_parse_request(const unsigned char *buf, size_t len,
+                         unsigned char *cmd, unsigned char *target,
+                         size_t *target_len, unsigned char *rep);
+
+/*
+ * Target in tunnel format at the start of buf, as host and port strings
+ * (host: 256 bytes, port: 6). Returns the bytes it took, or -1.
+ */
+int socks5_parse_target(const unsigned char *buf, size_t len,
+                        char *host, char *port);
+
+struct sockaddr;
+
+/* Socket address in tunnel format. Returns its size. */
+size_t socks5_target_addr(unsigned char *target, const struct sockaddr *sa);
+
+/*
+ * SOCKS5 UDP request header at the start of a datagram. Returns its length
+ * with the destination in tunnel format in target, or -1 when it is
+ * malformed or a fragment (those are dropped).
+ */
+int socks5_parse_udp(const unsigned char *buf, size_t len,
+                     unsigned char *target, size_t *target_len);
+
+/* UDP header for a datagram from host:port into out (SOCKS5_UDP_HDR_MAX).
+ * Returns its length. */
+size_t socks5_udp_header(unsigned char *out, const char *host, const char *port);
+
+/* SOCKS5_REPLY_LEN-byte reply with code rep and an unspecified address */
+void socks5_reply(unsigned char *out, unsigned char rep);
+
+/* Reply with code rep and sa as the bound address, into out
+ * (SOCKS5_REPLY_MAX). Returns its length. */
+size_t socks5_reply_addr(unsigned char *out, unsigned char rep,
+                         const struct sockaddr *sa);
 
 /* Client-side: local SOCKS5 listener + relay through encrypted fd.
  * Blocks until tunnel closes. */
@@ -13,13 +13,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <pwd.h>
 
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 
 #include "tofu.h"
+#include "util.h"
 
 int g_tofu = 0;
 
@@ -29,21 +29,12 @@ static unsigned char s_identity_pubkey[TOFU_ED25519_PUBKEY_LEN];
 /* ──────── Path helpers ──────── */
 
 static int tofu_get_dir(char *buf, size_t buflen) {
-    const char *home = getenv("HOME");
-    if (!home) {
-        struct passwd *pw = getpwuid(getuid());
-        if (!pw) return -1;
-        home = pw->pw_dir;
-    }
-    int n = snprintf(buf, buflen, "%s/.clawsec", home);
-    return (n > 0 && (size_t)n < buflen) ? 0 : -1;
+    return clawsec_dir(buf, buflen, 0);
 }
 
 static int tofu_ensure_dir(void) {
     char dir[512];
-    if (tofu_get_dir(dir, sizeof(dir)) < 0) return -1;
-    if (mkdir(dir, 0700) < 0 && errno != EEXIST) return -1;
-    return 0;
+    return clawsec_dir(dir, sizeof(dir), 1);
 }
 
 /* ──────── Server: identity key management ──────── */
@@ -0,0 +1,198 @@
+/*
+ * tpool.c — Pool of handshaken tunnels for non-mux forwarding (--tunnel-pool)
+ *
+ * The parent only counts: each child reports on a pipe when its tunnel is
+ * ready and when it has taken a connection, and the parent forks another
+ * for every one taken or lost. The children themselves wait on the shared
+ * listener, so an accepted connection is never handed between processes.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tpool.h"
+#include "util.h"
+
+enum { TPOOL_READY = 1, TPOOL_TAKEN = 2 };
+
+typedef struct {
+    pid_t pid;
+    int state;
+} tpool_msg_t;
+
+/* Parent: the children not yet taken, by slot (pid 0: empty) */
+typedef struct {
+    pid_t pid;
+    int ready;
+} tpool_slot_t;
+
+typedef struct {
+    int listen_fd;
+    int notes[2];
+    void (*session)(void *ctx);
+    void *ctx;
+} tpool_conf_t;
+
+static tpool_slot_t s_slots[TPOOL_MAX];
+static int s_nslots = 0;
+
+/* Child */
+static int s_listen_fd = -1;
+static int s_notify_fd = -1;
+
+static void notify(int state) {
+    tpool_msg_t msg = { getpid(), state };
+    /* Below PIPE_BUF: never interleaved with another child's */
+    if (write(s_notify_fd, &msg, sizeof(msg)) < 0)
+        log_msg(2, "tunnel pool: parent gone");
+}
+
+int tpool_active(void) {
+    return s_listen_fd >= 0;
+}
+
+/* Probes while idle; and no Nagle, which would hold back the second write
+ * of a record for an ACK, as the mux tunnel does */
+static void tunnel_opts(int fd) {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    int idle = TPOOL_KEEPIDLE_S, intvl = TPOOL_KEEPINTVL_S, cnt = TPOOL_KEEPCNT;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#endif
+}
+
+int tpool_take(int tunnel_fd) {
+    tunnel_opts(tunnel_fd);
+    notify(TPOOL_READY);
+
+    long long deadline = mono_ms() + TPOOL_MAX_AGE_MS;
+    struct pollfd p[2] = {
+        { s_listen_fd, POLLIN, 0 },
+        { tunnel_fd, POLLIN, 0 },
+    };
+    for (;;) {
+        long long wait = deadline - mono_ms();
+        if (wait <= 0) {
+            log_msg(2, "tunnel pool: idle tunnel aged out");
+            return -1;
+        }
+        int n = poll(p, 2, (int)wait);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (p[1].revents) {
+            /* Idle, so readable means closed or failed — unless the target
+             * speaks first, and then the relay gets it */
+            char c;
+            ssize_t r = recv(tunnel_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                           errno != EINTR)) {
+                log_msg(2, "tunnel pool: idle tunnel lost");
+                return -1;
+            }
+            if (r > 0) p[1].fd = -1;
+        }
+        if (p[0].revents & POLLIN) {
+            int fd = accept(s_listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                /* BSD accept() hands the listener's O_NONBLOCK on; the
+                 * relay writes with blocking write_all */
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+                notify(TPOOL_TAKEN);
+                return fd;
+            }
+            /* Another tunnel took it */
+        }
+    }
+}
+
+static int find_slot(pid_t pid) {
+    for (int i = 0; i < s_nslots; i++)
+        if (s_slots[i].pid == pid) return i;
+    return -1;
+}
+
+static int slot_want(int slot, void *arg) {
+    (void)arg;
+    return s_slots[slot].pid == 0;
+}
+
+static void slot_child(int slot, void *arg) {
+    tpool_conf_t *c = arg;
+    (void)slot;
+    close(c->notes[0]);
+    s_listen_fd = c->listen_fd;
+    s_notify_fd = c->notes[1];
+    c->session(c->ctx);
+}
+
+static void slot_forked(int slot, pid_t pid, void *arg) {
+    (void)arg;
+    if (pid > 0) s_slots[slot] = (tpool_slot_t){ pid, 0 };
+}
+
+static void read_notes(void *arg) {
+    tpool_conf_t *c = arg;
+    tpool_msg_t msg;
+    while (read(c->notes[0], &msg, sizeof(msg)) == (ssize_t)sizeof(msg)) {
+        int i = find_slot(msg.pid);
+        if (i < 0) continue;
+        if (msg.state == TPOOL_READY) {
+            s_slots[i].ready = 1;
+        } else {
+            s_slots[i].pid = 0;
+            log_msg(2, "tunnel pool: tunnel taken, refilling");
+        }
+    }
+}
+
+static int slot_reaped(pid_t pid, int status, void *arg) {
+    (void)status;
+    (void)arg;
+    int i = find_slot(pid);
+    if (i < 0) return -1;    /* a taken tunnel, done relaying */
+    s_slots[i].pid = 0;
+    /* Never got through the handshake: the server may be down */
+    return s_slots[i].ready ? -1 : i;
+}
+
+static void kill_idle(void *arg) {
+    (void)arg;
+    for (int i = 0; i < s_nslots; i++)
+        if (s_slots[i].pid > 0) kill(s_slots[i].pid, SIGTERM);
+}
+
+void tpool_run(int listen_fd, int n, void (*session)(void *ctx), void *ctx) {
+    static tpool_conf_t conf;
+    conf = (tpool_conf_t){ listen_fd, { -1, -1 }, session, ctx };
+    if (pipe(conf.notes) < 0)
+        fatal("pipe: %s", strerror(errno));
+    fcntl(conf.notes[0], F_SETFL, O_NONBLOCK);
+    /* Every idle tunnel wakes for a connection; one gets it */
+    set_nonblock(listen_fd);
+    s_nslots = n;
+
+    log_msg(1, "tunnel pool: keeping %d tunnels ready", n);
+    respawn_ops_t ops = {
+        .nslots = n, .retry_ms = TPOOL_RETRY_MS, .event_fd = conf.notes[0],
+        .want = slot_want, .child = slot_child, .forked = slot_forked,
+        .on_event = read_notes, .reaped = slot_reaped, .stop = kill_idle,
+        .ctx = &conf,
+    };
+    respawn_loop(&ops);
+}
@@ -0,0 +1,43 @@
+#ifndef CLAWSEC_TPOOL_H
+#define CLAWSEC_TPOOL_H
+
+/*
+ * Tunnel pool (--tunnel-pool N): without --mux every local connection gets
+ * its own tunnel, and setting one up — TCP connect, TLS camouflage, X25519,
+ * the password KDF — is paid before the first byte moves. The pool keeps N
+ * tunnels already through all of that, each in its own process (the session
+ * key is per process), idle and waiting on the local listener. A connection
+ * that comes in is accepted by one of them and spliced at once; the parent
+ * starts a replacement as soon as it hears a tunnel was taken.
+ *
+ * Idle tunnels are kept alive by TCP keepalive probes rather than records:
+ * the server relays every byte it decrypts to the target, so a heartbeat in
+ * the stream would reach it. A tunnel the server closes, one whose probes go
+ * unanswered, and one idle for TPOOL_MAX_AGE_MS are dropped and replaced.
+ */
+
+#define TPOOL_MAX          64
+#define TPOOL_MAX_AGE_MS   (60 * 1000)  /* idle tunnels are renewed after this */
+#define TPOOL_KEEPIDLE_S   15           /* first keepalive probe after this idle */
+#define TPOOL_KEEPINTVL_S  5
+#define TPOOL_KEEPCNT      3            /* unanswered probes before it is dead */
+#define TPOOL_RETRY_MS     1000         /* refill pause after a failed tunnel */
+
+/*
+ * Keep n idle tunnels on listen_fd until killed. session(ctx) runs in a
+ * fresh child for each one: it connects and handshakes, then calls
+ * tpool_take and relays what that returns.
+ */
+void tpool_run(int listen_fd, int n, void (*session)(void *ctx), void *ctx);
+
+/*
+ * In a pool child, with tunnel_fd handshaken: wait for a local connection
+ * and return it, after telling the parent to refill. Returns -1 when the
+ * tunnel died or aged out while idle.
+ */
+int tpool_take(int tunnel_fd);
+
+/* Nonzero in a pool child */
+int tpool_active(void);
+
+#endif
@@ -5,6 +5,15 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pwd.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #include "util.h"
 #include "farm9crypt.h"
@@ -46,3 +55,113 @@ int write_all(int fd, const void *buf, size_t len) {
     }
     return 0;
 }
+
+long long mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long mono_ms(void) {
+    return mono_us() / 1000;
+}
+
+void set_nonblock(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl >= 0) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+int clawsec_dir(char *buf, size_t buflen, int create) {
+    const char *home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        if (!pw) return -1;
+        home = pw->pw_dir;
+    }
+    int n = snprintf(buf, buflen, "%s/.clawsec", home);
+    if (n <= 0 || (size_t)n >= buflen) return -1;
+    if (create && mkdir(buf, 0700) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+void log_peer(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    char host[128], serv[32];
+    if (getpeername(fd, (struct sockaddr *)&ss, &slen) == 0 &&
+        getnameinfo((struct sockaddr *)&ss, slen, host, sizeof(host),
+                    serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        log_msg(1, "connect from %s:%s", host, serv);
+}
+
+/* ── Respawn loop ── */
+
+static const respawn_ops_t *s_respawn;
+
+static void respawn_stop(int sig) {
+    if (s_respawn->stop) s_respawn->stop(s_respawn->ctx);
+    _exit(128 + sig);
+}
+
+static void respawn_wake(int sig) {
+    (void)sig;
+}
+
+void respawn_loop(const respawn_ops_t *ops) {
+    long long *retry_at = calloc((size_t)ops->nslots, sizeof(*retry_at));
+    if (!retry_at) fatal("respawn: out of memory");
+    s_respawn = ops;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = respawn_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    /* No SA_RESTART: an exit interrupts the poll below */
+    sa.sa_handler = respawn_wake;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;) {
+        long long now = mono_ms();
+        int wait = 1000;
+        for (int i = 0; i < ops->nslots; i++) {
+            if (!ops->want(i, ops->ctx)) continue;
+            if (now < retry_at[i]) {
+                if (retry_at[i] - now < wait) wait = (int)(retry_at[i] - now);
+                continue;
+            }
+            pid_t pid = -1;
+            if (!ops->prepare || ops->prepare(i, ops->ctx) == 0) {
+                pid = fork();
+                if (pid < 0) perror("fork");
+            }
+            if (pid == 0) {
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                signal(SIGHUP, SIG_DFL);
+                signal(SIGCHLD, SIG_DFL);
+                ops->child(i, ops->ctx);
+                _exit(0);
+            }
+            if (ops->forked) ops->forked(i, pid, ops->ctx);
+            if (pid < 0) retry_at[i] = now + ops->retry_ms;
+        }
+
+        if (ops->event_fd >= 0) {
+            struct pollfd p = { ops->event_fd, POLLIN, 0 };
+            poll(&p, 1, wait);
+        } else {
+            poll(NULL, 0, wait);
+        }
+        if (ops->on_event) ops->on_event(ops->ctx);
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            int slot = ops->reaped(pid, status, ops->ctx);
+            if (slot >= 0) retry_at[slot] = mono_ms() + ops->retry_ms;
+        }
+    }
+}
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 /* Logging */
 void log_msg(int level, const char *fmt, ...);
@@ -10,6 +11,39 @@ void fatal(const char *fmt, ...);
 
 /* I/O helpers */
 int write_all(int fd, const void *buf, size_t len);
+void set_nonblock(int fd);
+
+/* CLOCK_MONOTONIC in microseconds / milliseconds */
+long long mono_us(void);
+long long mono_ms(void);
+
+/* "connect from host:port" at verbosity 1 */
+void log_peer(int fd);
+
+/*
+ * Supervisor for the tunnel pool, prefork workers and event loops: keep a
+ * child on each of nslots slots, forking whenever want() says a slot needs
+ * one. A slot backs off retry_ms after a failed fork or when reaped()
+ * names it. SIGTERM/SIGINT/SIGHUP run stop() and exit. Never returns.
+ */
+typedef struct {
+    int nslots;
+    int retry_ms;
+    int event_fd;                                     /* polled; -1: none */
+    int  (*want)(int slot, void *ctx);                /* slot needs a child now */
+    int  (*prepare)(int slot, void *ctx);             /* before the fork; <0 backs off */
+    void (*child)(int slot, void *ctx);               /* in the child, then _exit(0) */
+    void (*forked)(int slot, pid_t pid, void *ctx);   /* pid < 0: the fork failed */
+    void (*on_event)(void *ctx);                      /* after each poll */
+    int  (*reaped)(pid_t pid, int status, void *ctx); /* slot to back off, or -1 */
+    void (*stop)(void *ctx);                          /* in the signal handler */
+    void *ctx;
+} respawn_ops_t;
+
+void respawn_loop(const respawn_ops_t *ops);
+
+/* Per-user state directory (~/.clawsec), created 0700 if create is set */
+int clawsec_dir(char *buf, size_t buflen, int create);
 
 /* Globals */
 extern int g_verbose;
@@ -14,10 +14,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "farm9crypt.h"
+#include "util.h"
 
 /* Counters (defined in test_main.c) */
 extern int tests_run;
@@ -68,6 +73,98 @@ static inline int make_socketpair(int fds[2]) {
     return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
 }
 
+/* Helper: TCP listener on an ephemeral 127.0.0.1 port, stored in *port */
+static inline int listen_loopback(int *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t slen = sizeof(sa);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 256) < 0 ||
+        getsockname(fd, (struct sockaddr *)&sa, &slen) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+/* Helper: connect to 127.0.0.1:port, -1 if nothing listens */
+static inline int connect_loopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons((unsigned short)port);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Helper: connect_loopback, retried for up to 2 s while the listener
+ * (usually a freshly forked relay) comes up */
+static inline int connect_loopback_wait(int port) {
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = connect_loopback(port);
+        if (fd >= 0) return fd;
+        poll(NULL, 0, 20);
+    }
+    return -1;
+}
+
+/* Helper: echo every connection on lfd from this process, up to 1023
+ * at once; never returns */
+static inline void echo_serve(int lfd) {
+    static struct pollfd pfd[1024];
+    int n = 1;
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, (nfds_t)n, -1) < 0) continue;
+        if ((pfd[0].revents & POLLIN) && n < 1024) {
+            int c = accept(lfd, NULL, NULL);
+            if (c >= 0) {
+                pfd[n].fd = c;
+                pfd[n].events = POLLIN;
+                pfd[n++].revents = 0;
+            }
+        }
+        for (int i = 1; i < n; i++) {
+            if (!pfd[i].revents) continue;
+            char buf[4096];
+            ssize_t r = read(pfd[i].fd, buf, sizeof(buf));
+            if (r <= 0 || write_all(pfd[i].fd, buf, (size_t)r) < 0) {
+                close(pfd[i].fd);
+                pfd[i--] = pfd[--n];
+            }
+        }
+    }
+}
+
+/* Helper: echo with a process per connection, so a stream that is not
+ * read cannot hold up another's; never returns */
+static inline void echo_serve_forking(int lfd) {
+    signal(SIGCHLD, SIG_IGN);
+    for (;;) {
+        int c = accept(lfd, NULL, NULL);
+        if (c < 0) continue;
+        if (fork() == 0) {
+            close(lfd);
+            char buf[65536];
+            ssize_t r;
+            while ((r = read(c, buf, sizeof(buf))) > 0)
+                if (write_all(c, buf, (size_t)r) < 0) break;
+            _exit(0);
+        }
+        close(c);
+    }
+}
+
 /* Test function signature */
 typedef void (*test_fn)(void);
 
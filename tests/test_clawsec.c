@@ -37,6 +37,11 @@ extern void test_bad_magic(void);
 /* test_handshake.c */
 extern void test_full_handshake(void);
 extern void test_bidirectional(void);
+extern void test_tls_bind_roundtrip(void);
+extern void test_tls_bind_wrong_password(void);
+extern void test_tls_bind_relay_detected(void);
+extern void test_tls_bind_negotiated(void);
+extern void test_tls_bind_requires_tls(void);
 
 /* test_obfs.c */
 extern void test_obfs_mode_default(void);
@@ -44,6 +49,9 @@ extern void test_obfs_mode_set_http(void);
 extern void test_obfs_http_roundtrip(void);
 extern void test_obfs_http_multiple_messages(void);
 extern void test_obfs_http_large_payload(void);
+extern void test_obfs_http_stream_rotation(void);
+extern void test_obfs_http_stream_wire_format(void);
+extern void test_obfs_http_no_overread(void);
 
 /* test_parse.c */
 extern void test_parse_forward_spec_ipv4(void);
@@ -72,11 +80,21 @@ extern void test_write_all_basic(void);
 /* test_stealth.c */
 extern void test_obfs_mode_set_tls(void);
 extern void test_tls_roundtrip(void);
+extern void test_tls_ktls_probe_fallback(void);
+extern void test_tls_server_ctx_reused(void);
+extern void test_tls_cert_cache_persist(void);
+extern void test_tls_session_resumption(void);
+extern void test_tls_resumption_fingerprint(void);
 extern void test_pad_roundtrip(void);
 extern void test_pad_uniform_size(void);
 extern void test_pad_too_large(void);
+extern void test_pad_bucket_policy(void);
+extern void test_pad_fixed_large_payload(void);
+extern void test_pad_random_policy(void);
 extern void test_jitter_applies_delay(void);
 extern void test_jitter_zero_noop(void);
+extern void test_jitter_queue_nonblocking(void);
+extern void test_jitter_queue_full(void);
 
 /* test_ech.c */
 extern void test_ech_flag(void);
@@ -84,15 +102,36 @@ extern void test_ech_tls_connects(void);
 extern void test_ech_extension_present(void);
 extern void test_ech_auto_enables_tls(void);
 
+/* test_h2.c */
+extern void test_h2_mode_uses_tls(void);
+extern void test_h2_roundtrip_rotation(void);
+extern void test_h2_with_browser_fingerprint(void);
+extern void test_h2_requires_alpn(void);
+
 /* test_mux.c */
 extern void test_mux_encode_decode(void);
 extern void test_mux_frame_types(void);
 extern void test_mux_max_payload(void);
+extern void test_mux_version_checked(void);
+extern void test_mux_pack_records(void);
+extern void test_mux_prio_parse(void);
+extern void test_mux_table_many_streams(void);
+extern void test_mux_table_recycles_ids(void);
+extern void test_mux_tunnel_many_streams(void);
+extern void test_mux_flow_control_stalled_stream(void);
+extern void test_mux_interactive_latency_under_bulk(void);
+extern void test_mux_jitter_queue_backpressure(void);
+extern void test_mux_slow_target_connect(void);
+extern void test_mux_zero_rtt_open(void);
+extern void test_mux_striped_tunnels(void);
 
 /* test_fallback.c */
 extern void test_fallback_knock_roundtrip(void);
 extern void test_fallback_detects_probe(void);
 extern void test_fallback_knock_magic(void);
+extern void test_fwd_pair_half_close(void);
+extern void test_fwd_pair_idle_timeout(void);
+extern void test_fallback_proxy_relays_probe(void);
 
 /* test_fingerprint.c */
 extern void test_fp_flag(void);
@@ -139,6 +178,21 @@ extern void test_socks5_wire_format_ipv4(void);
 extern void test_socks5_wire_format_long_host(void);
 extern void test_socks5_server_clean_exit(void);
 extern void test_socks5_client_binds(void);
+extern void test_socks5_parse_requests(void);
+extern void test_socks5_concurrent_connects(void);
+extern void test_socks5_slow_name(void);
+extern void test_socks5_udp_headers(void);
+extern void test_socks5_udp_associate(void);
+
+/* test_dns.c */
+extern void test_dns_cache_hits(void);
+extern void test_dns_slow_name(void);
+extern void test_dns_cancel(void);
+
+/* test_net.c */
+extern void test_net_race_order(void);
+extern void test_net_happy_eyeballs_blackhole(void);
+extern void test_net_happy_eyeballs_mux(void);
 
 /* test_filetx.c */
 extern void test_filetx_header_format(void);
@@ -152,10 +206,25 @@ extern void test_persist_backoff_initial(void);
 extern void test_persist_backoff_exponential(void);
 extern void test_persist_backoff_max(void);
 extern void test_persist_heartbeat_detect(void);
-extern void test_reverse_signal_format(void);
 extern void test_persist_backoff_jitter(void);
 extern void test_persist_heartbeat_ignores_data(void);
-extern void test_reverse_signals_distinct(void);
+extern void test_reverse_concurrent_clients(void);
+extern void test_reverse_target_refused(void);
+extern void test_reverse_target_pool(void);
+
+/* test_tpool.c */
+extern void test_tpool_take_refills(void);
+extern void test_tpool_lost_tunnel(void);
+
+/* test_prefork.c */
+extern void test_prefork_one_process_per_session(void);
+extern void test_prefork_reuseport_group(void);
+extern void test_prefork_reuse(void);
+
+/* test_evsrv.c */
+extern void test_evsrv_concurrent_sessions(void);
+extern void test_evsrv_bad_password(void);
+extern void test_evsrv_hello_flood(void);
 
 /* test_tun.c */
 extern void test_tun_parse_cidr(void);
@@ -196,6 +265,11 @@ int main(void) {
     /* Handshake tests */
     test_full_handshake();
     test_bidirectional();
+    test_tls_bind_roundtrip();
+    test_tls_bind_wrong_password();
+    test_tls_bind_relay_detected();
+    test_tls_bind_negotiated();
+    test_tls_bind_requires_tls();
 
     /* Obfuscation tests */
     test_obfs_mode_default();
@@ -203,6 +277,9 @@ int main(void) {
     test_obfs_http_roundtrip();
     test_obfs_http_multiple_messages();
     test_obfs_http_large_payload();
+    test_obfs_http_stream_rotation();
+    test_obfs_http_stream_wire_format();
+    test_obfs_http_no_overread();
 
     /* Parse host:port tests */
     test_parse_forward_spec_ipv4();
@@ -231,11 +308,21 @@ int main(void) {
     /* Stealth / anti-fingerprint tests */
     test_obfs_mode_set_tls();
     test_tls_roundtrip();
+    test_tls_ktls_probe_fallback();
+    test_tls_server_ctx_reused();
+    test_tls_cert_cache_persist();
+    test_tls_session_resumption();
+    test_tls_resumption_fingerprint();
     test_pad_roundtrip();
     test_pad_uniform_size();
     test_pad_too_large();
+    test_pad_bucket_policy();
+    test_pad_fixed_large_payload();
+    test_pad_random_policy();
     test_jitter_applies_delay();
     test_jitter_zero_noop();
+    test_jitter_queue_nonblocking();
+    test_jitter_queue_full();
 
     /* ECH tests */
     test_ech_flag();
@@ -243,15 +330,36 @@ int main(void) {
     test_ech_extension_present();
     test_ech_auto_enables_tls();
 
+    /* HTTP/2 camouflage tests */
+    test_h2_mode_uses_tls();
+    test_h2_roundtrip_rotation();
+    test_h2_with_browser_fingerprint();
+    test_h2_requires_alpn();
+
     /* Mux tests */
     test_mux_encode_decode();
     test_mux_frame_types();
     test_mux_max_payload();
+    test_mux_version_checked();
+    test_mux_pack_records();
+    test_mux_prio_parse();
+    test_mux_table_many_streams();
+    test_mux_table_recycles_ids();
+    test_mux_tunnel_many_streams();
+    test_mux_flow_control_stalled_stream();
+    test_mux_interactive_latency_under_bulk();
+    test_mux_jitter_queue_backpressure();
+    test_mux_slow_target_connect();
+    test_mux_zero_rtt_open();
+    test_mux_striped_tunnels();
 
     /* Fallback tests */
     test_fallback_knock_roundtrip();
     test_fallback_detects_probe();
     test_fallback_knock_magic();
+    test_fwd_pair_half_close();
+    test_fwd_pair_idle_timeout();
+    test_fallback_proxy_relays_probe();
 
     /* Fingerprint tests */
     test_fp_flag();
@@ -298,6 +406,21 @@ int main(void) {
     test_socks5_wire_format_long_host();
     test_socks5_server_clean_exit();
     test_socks5_client_binds();
+    test_socks5_parse_requests();
+    test_socks5_concurrent_connects();
+    test_socks5_slow_name();
+    test_socks5_udp_headers();
+    test_socks5_udp_associate();
+
+    /* Resolver tests */
+    test_dns_cache_hits();
+    test_dns_slow_name();
+    test_dns_cancel();
+
+    /* Happy Eyeballs tests */
+    test_net_race_order();
+    test_net_happy_eyeballs_blackhole();
+    test_net_happy_eyeballs_mux();
 
     /* File transfer tests */
     test_filetx_header_format();
@@ -311,10 +434,25 @@ int main(void) {
     test_persist_backoff_exponential();
     test_persist_backoff_max();
     test_persist_heartbeat_detect();
-    test_reverse_signal_format();
     test_persist_backoff_jitter();
     test_persist_heartbeat_ignores_data();
-    test_reverse_signals_distinct();
+    test_reverse_concurrent_clients();
+    test_reverse_target_refused();
+    test_reverse_target_pool();
+
+    /* Tunnel pool tests */
+    test_tpool_take_refills();
+    test_tpool_lost_tunnel();
+
+    /* Prefork tests */
+    test_prefork_one_process_per_session();
+    test_prefork_reuseport_group();
+    test_prefork_reuse();
+
+    /* Event server tests */
+    test_evsrv_concurrent_sessions();
+    test_evsrv_bad_password();
+    test_evsrv_hello_flood();
 
     /* TUN VPN tests */
     test_tun_parse_cidr();
@@ -0,0 +1,159 @@
+/*
+ * test_dns.c — Asynchronous resolver and cache tests
+ *
+ * Lookups run on worker threads; a stand-in for getaddrinfo() makes one
+ * name slow and failing so ordering, joining and the negative cache show.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "test.h"
+#include "dns.h"
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Next finished lookup within timeout_ms: 1, or 0 if none came */
+static int wait_next(uint64_t *tag, struct addrinfo **res, int timeout_ms) {
+    long long end = now_us() + (long long)timeout_ms * 1000;
+    for (;;) {
+        if (dns_next(tag, res)) return 1;
+        int left = (int)((end - now_us()) / 1000);
+        if (left <= 0) return 0;
+        struct pollfd p = { dns_fd(), POLLIN, 0 };
+        poll(&p, 1, left);
+    }
+}
+
+static int ai_port(const struct addrinfo *ai) {
+    if (ai->ai_family == AF_INET)
+        return ntohs(((const struct sockaddr_in *)ai->ai_addr)->sin_port);
+    return ntohs(((const struct sockaddr_in6 *)ai->ai_addr)->sin6_port);
+}
+
+/* slow*.test: 300ms, then not found. fast*.test: loopback at once. */
+static int fake_getaddrinfo(const char *host, const char *port,
+                            const struct addrinfo *hints, struct addrinfo **res) {
+    if (strncmp(host, "slow", 4) == 0) {
+        struct timespec ts = { 0, 300 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+        return EAI_NONAME;
+    }
+    if (strncmp(host, "fast", 4) == 0)
+        return getaddrinfo("127.0.0.1", port, hints, res);
+    return getaddrinfo(host, port, hints, res);
+}
+
+void test_dns_cache_hits(void) {
+    TEST_BEGIN("dns: cached name answers at once, per port") {
+        dns_stats_t before, after;
+        dns_stats(&before);
+        struct addrinfo *res = NULL;
+        uint64_t tag = 0;
+        int rc = dns_lookup("localhost", "80", 1, &res);
+        ASSERT(rc >= 0, "lookup failed to start");
+        if (rc == 0) {
+            ASSERT(wait_next(&tag, &res, 5000), "no answer for localhost");
+            ASSERT(tag == 1, "answer under the wrong tag");
+        }
+        ASSERT(res != NULL, "localhost did not resolve");
+        ASSERT_EQ(ai_port(res), 80, "port 80 not set");
+        dns_free(res);
+
+        /* Case does not matter, and each caller gets its own port */
+        res = NULL;
+        ASSERT_EQ(dns_lookup("LocalHost", "443", 2, &res), 1, "second lookup missed the cache");
+        ASSERT(res != NULL, "cached answer empty");
+        ASSERT_EQ(ai_port(res), 443, "port 443 not set");
+        dns_free(res);
+
+        long long t0 = now_us();
+        for (int i = 0; i < 1000; i++) {
+            ASSERT_EQ(dns_lookup("localhost", "22", 3, &res), 1, "cache miss");
+            dns_free(res);
+        }
+        long long per = (now_us() - t0) / 1000;
+        ASSERT(per < 100, "cache hit slower than 100us");
+
+        /* Address literals skip the cache */
+        ASSERT_EQ(dns_lookup("127.0.0.1", "8080", 4, &res), 1, "literal not immediate");
+        ASSERT(res && ai_port(res) == 8080, "literal port not set");
+        dns_free(res);
+
+        dns_stats(&after);
+        ASSERT(after.hits - before.hits == 1001, "hits not counted");
+        ASSERT(after.lookups - before.lookups == 1002, "lookups not counted");
+    } TEST_END;
+}
+
+void test_dns_slow_name(void) {
+    TEST_BEGIN("dns: slow name blocks no one, failures cached") {
+        g_dns_getaddrinfo = fake_getaddrinfo;
+        dns_stats_t before, after;
+        dns_stats(&before);
+        struct addrinfo *res = NULL;
+        uint64_t tag = 0;
+
+        ASSERT_EQ(dns_lookup("slow.test", "80", 10, &res), 0, "slow name not pending");
+        ASSERT_EQ(dns_lookup("SLOW.test", "81", 11, &res), 0, "second caller not pending");
+        ASSERT_EQ(dns_lookup("fast.test", "82", 12, &res), 0, "fast name not pending");
+        ASSERT_EQ(dns_lookup("slow2.test", "83", 13, &res), 0, "cancelled name not pending");
+        dns_cancel(13);
+
+        long long t0 = now_us();
+        ASSERT(wait_next(&tag, &res, 1000), "no answer");
+        ASSERT(tag == 12, "fast name not answered first");
+        ASSERT(now_us() - t0 < 150 * 1000, "fast name waited for the slow one");
+        ASSERT(res && ai_port(res) == 82, "fast name answer wrong");
+        dns_free(res);
+
+        ASSERT(wait_next(&tag, &res, 2000) && tag == 10 && !res, "slow name failure missing");
+        ASSERT(wait_next(&tag, &res, 2000) && tag == 11 && !res, "joined caller not answered");
+        ASSERT(!wait_next(&tag, &res, 400), "cancelled lookup still answered");
+
+        res = NULL;
+        t0 = now_us();
+        ASSERT_EQ(dns_lookup("slow.test", "80", 14, &res), 1, "failure not cached");
+        ASSERT(res == NULL, "cached failure has addresses");
+        ASSERT(now_us() - t0 < 10 * 1000, "cached failure not immediate");
+
+        dns_stats(&after);
+        ASSERT(after.joined - before.joined == 1, "join not counted");
+        ASSERT(after.resolved - before.resolved == 3, "lookups not counted");
+        ASSERT(after.failed - before.failed == 2, "failures not counted");
+        ASSERT(after.max_ms >= 250, "lookup time not recorded");
+    } TEST_END;
+    g_dns_getaddrinfo = getaddrinfo;
+}
+
+void test_dns_cancel(void) {
+    TEST_BEGIN("dns: cancel drops waiting and answered lookups") {
+        g_dns_getaddrinfo = fake_getaddrinfo;
+        struct addrinfo *res = NULL;
+        uint64_t tag = 0;
+
+        /* Many callers joined on one name; all but the last go away */
+        for (uint64_t t = 100; t < 2100; t++)
+            ASSERT_EQ(dns_lookup("slow3.test", "80", t, &res), 0, "joined name not pending");
+        for (uint64_t t = 100; t < 2099; t++)
+            dns_cancel(t);
+        dns_cancel(99);
+        ASSERT(wait_next(&tag, &res, 2000) && tag == 2099 && !res, "kept caller not answered");
+        ASSERT(!wait_next(&tag, &res, 100), "cancelled caller answered");
+
+        /* Both answers collected at once: the second is cancelled unread */
+        ASSERT_EQ(dns_lookup("fast2.test", "90", 30, &res), 0, "fast name not pending");
+        ASSERT_EQ(dns_lookup("fast2.test", "91", 31, &res), 0, "joined fast name not pending");
+        ASSERT(wait_next(&tag, &res, 1000) && tag == 30, "first answer missing");
+        dns_free(res);
+        dns_cancel(31);
+        ASSERT(!wait_next(&tag, &res, 100), "cancelled answer still returned");
+    } TEST_END;
+    g_dns_getaddrinfo = getaddrinfo;
+}
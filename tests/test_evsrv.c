@@ -0,0 +1,194 @@
+/*
+ * test_evsrv.c — Event-driven -K server tests (--event)
+ *
+ * evsrv_loop runs in a child in front of an echo target; each client is a
+ * child of its own (the client side keeps its keys in farm9crypt's
+ * process-wide state) that handshakes and echoes frames through it.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "test.h"
+#include "evsrv.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static const char *ev_password = "EventPass123";
+
+/* Echo target: a process per connection, so it never holds the server up */
+static pid_t start_echo(int *port) {
+    int lfd = listen_loopback(port);
+    if (lfd < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) echo_serve_forking(lfd);
+    close(lfd);
+    return pid;
+}
+
+static char s_port_str[16];
+
+static pid_t start_server(int target_port, int *port) {
+    int lfd = listen_loopback(port);
+    if (lfd < 0) return -1;
+    snprintf(s_port_str, sizeof(s_port_str), "%d", target_port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        evsrv_conf_t conf = { ev_password, "127.0.0.1", s_port_str };
+        evsrv_loop(lfd, &conf);
+        _exit(1);
+    }
+    close(lfd);
+    return pid;
+}
+
+/* One frame out, the same back within 5 s */
+static int echo_once(int fd, const char *msg) {
+    char buf[64];
+    int len = (int)strlen(msg);
+    if (farm9crypt_write(fd, (char *)msg, len) != len) return -1;
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 5000) != 1) return -1;
+    int n = farm9crypt_read(fd, buf, sizeof(buf));
+    return n == len && memcmp(buf, msg, (size_t)len) == 0 ? 0 : -1;
+}
+
+/* Client: handshake and echo, hold the session until the gate pipe is
+ * closed (if given), echo again. Exit status 0 if both came back. */
+static pid_t start_client(int port, const char *password, const int *gate, int id) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        if (gate) close(gate[1]);
+        char msg[32];
+        snprintf(msg, sizeof(msg), "session %d", id);
+        int fd = connect_loopback(port);
+        if (fd < 0 || farm9crypt_init_ecdhe(fd, password, strlen(password), 0) != 0)
+            _exit(2);
+        if (echo_once(fd, msg) < 0) _exit(3);
+        char c;
+        if (gate) while (read(gate[0], &c, 1) > 0);
+        _exit(echo_once(fd, msg) < 0 ? 4 : 0);
+    }
+    return pid;
+}
+
+/* Processes whose parent is pid */
+static int count_children(pid_t pid) {
+    DIR *d = opendir("/proc");
+    if (!d) return -1;
+    int n = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char path[300], line[512];
+        snprintf(path, sizeof(path), "/proc/%s/stat", e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        if (fgets(line, sizeof(line), f)) {
+            /* pid (comm) state ppid — comm may hold spaces */
+            char *rp = strrchr(line, ')');
+            int ppid;
+            if (rp && sscanf(rp + 2, "%*c %d", &ppid) == 1 && ppid == pid) n++;
+        }
+        fclose(f);
+    }
+    closedir(d);
+    return n;
+}
+
+static int client_status(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+void test_evsrv_concurrent_sessions(void) {
+    pid_t echo = -1, srv = -1;
+    TEST_BEGIN("event server: concurrent sessions in one process") {
+        int tport, port, gate[2];
+        echo = start_echo(&tport);
+        srv = start_server(tport, &port);
+        ASSERT(echo > 0 && srv > 0 && pipe(gate) == 0, "setup failed");
+
+        pid_t cl[4];
+        for (int i = 0; i < 4; i++)
+            cl[i] = start_client(port, ev_password, gate, i);
+        close(gate[0]);
+
+        /* All four hold their sessions open at once ... */
+        usleep(1500000);
+        int forks = count_children(srv);
+        close(gate[1]);
+
+        /* ... and each still relays afterwards */
+        int ok = 0;
+        for (int i = 0; i < 4; i++)
+            if (client_status(cl[i]) == 0) ok++;
+        ASSERT_EQ(forks, 0, "server forked for a session");
+        ASSERT_EQ(ok, 4, "a session failed");
+    } TEST_END;
+    if (srv > 0) { kill(srv, SIGTERM); waitpid(srv, NULL, 0); }
+    if (echo > 0) { kill(echo, SIGTERM); waitpid(echo, NULL, 0); }
+}
+
+void test_evsrv_bad_password(void) {
+    pid_t echo = -1, srv = -1;
+    TEST_BEGIN("event server: wrong password dropped, others unaffected") {
+        int tport, port, gate[2];
+        echo = start_echo(&tport);
+        srv = start_server(tport, &port);
+        ASSERT(echo > 0 && srv > 0 && pipe(gate) == 0, "setup failed");
+
+        pid_t good = start_client(port, ev_password, gate, 1);
+        close(gate[0]);
+        pid_t bad = start_client(port, "NotThePassword", NULL, 2);
+
+        /* The bad client's first frame does not open: no echo */
+        int bad_rc = client_status(bad);
+        close(gate[1]);
+        int good_rc = client_status(good);
+        ASSERT_EQ(bad_rc, 3, "frame under the wrong key was relayed");
+        ASSERT_EQ(good_rc, 0, "good session disturbed");
+    } TEST_END;
+    if (srv > 0) { kill(srv, SIGTERM); waitpid(srv, NULL, 0); }
+    if (echo > 0) { kill(echo, SIGTERM); waitpid(echo, NULL, 0); }
+}
+
+/* Take the server's key, answer with it (a valid point) and leave */
+static void hello_and_leave(int port) {
+    unsigned char key[32];
+    int fd = connect_loopback(port);
+    if (fd < 0) return;
+    if (recv(fd, key, sizeof(key), MSG_WAITALL) == (ssize_t)sizeof(key))
+        write_all(fd, (char *)key, sizeof(key));
+    close(fd);
+}
+
+void test_evsrv_hello_flood(void) {
+    pid_t echo = -1, srv = -1;
+    TEST_BEGIN("event server: clients gone before their KDF cost none") {
+        int tport, port;
+        echo = start_echo(&tport);
+        srv = start_server(tport, &port);
+        ASSERT(echo > 0 && srv > 0, "setup failed");
+
+        /* 200 password KDFs would keep the workers busy for seconds */
+        for (int i = 0; i < 200; i++)
+            hello_and_leave(port);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int rc = client_status(start_client(port, ev_password, NULL, 1));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+        ASSERT_EQ(rc, 0, "session behind the flood failed");
+        ASSERT(ms < 2000, "session waited behind abandoned handshakes");
+    } TEST_END;
+    if (srv > 0) { kill(srv, SIGTERM); waitpid(srv, NULL, 0); }
+    if (echo > 0) { kill(echo, SIGTERM); waitpid(echo, NULL, 0); }
+}
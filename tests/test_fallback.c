@@ -5,9 +5,14 @@
 #include "test.h"
 #include "fallback.h"
 #include "obfs.h"
+#include "fwd.h"
+#include "util.h"
 
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 void test_fallback_knock_roundtrip(void) {
     TEST_BEGIN("fallback knock send/verify roundtrip") {
@@ -93,3 +98,145 @@ void test_fallback_knock_magic(void) {
         ASSERT(memcmp(FALLBACK_KNOCK_MAGIC, "CLAW", 4) == 0, "magic should be CLAW");
     } TEST_END;
 }
+
+/* Read until EOF; returns total bytes or -1 */
+static int read_to_eof(int fd, char *buf, size_t buflen) {
+    size_t got = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + got, buflen - got);
+        if (n < 0) return -1;
+        if (n == 0) return (int)got;
+        got += (size_t)n;
+        if (got == buflen) return (int)got;
+    }
+}
+
+void test_fwd_pair_half_close(void) {
+    TEST_BEGIN("fwd_pair relays both ways with half-close") {
+        int left[2], right[2];
+        ASSERT(make_socketpair(left) == 0, "socketpair failed");
+        ASSERT(make_socketpair(right) == 0, "socketpair failed");
+        signal(SIGPIPE, SIG_IGN);
+
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            close(left[0]);
+            close(right[1]);
+            _exit(fwd_pair(left[1], right[0], 5) == 0 ? 0 : 1);
+        }
+        close(left[1]);
+        close(right[0]);
+
+        /* Request larger than one splice chunk, then half-close */
+        static char req[FWD_CHUNK * 2 + 123], got[sizeof(req)];
+        for (size_t i = 0; i < sizeof(req); i++) req[i] = (char)(i * 7);
+        ASSERT(write_all(left[0], req, sizeof(req)) == 0, "request write failed");
+        shutdown(left[0], SHUT_WR);
+
+        ASSERT_EQ(read_to_eof(right[1], got, sizeof(got)), (int)sizeof(req),
+                  "request length wrong or EOF not passed on");
+        ASSERT(memcmp(got, req, sizeof(req)) == 0, "request mismatch");
+
+        /* The other direction is still open for the reply */
+        ASSERT(write_all(right[1], "reply", 5) == 0, "reply write failed");
+        close(right[1]);
+        char back[16];
+        ASSERT_EQ(read_to_eof(left[0], back, sizeof(back)), 5, "reply length wrong");
+        ASSERT(memcmp(back, "reply", 5) == 0, "reply mismatch");
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "fwd_pair failed");
+        close(left[0]);
+    } TEST_END;
+}
+
+void test_fwd_pair_idle_timeout(void) {
+    TEST_BEGIN("fwd_pair ends idle relay") {
+        int left[2], right[2];
+        ASSERT(make_socketpair(left) == 0, "socketpair failed");
+        ASSERT(make_socketpair(right) == 0, "socketpair failed");
+
+        time_t start = time(NULL);
+        int rc = fwd_pair(left[1], right[0], 1);
+        ASSERT_EQ(rc, 1, "should report idle timeout");
+        ASSERT(time(NULL) - start <= 3, "timeout took too long");
+
+        close(left[0]); close(left[1]);
+        close(right[0]); close(right[1]);
+    } TEST_END;
+}
+
+/*
+ * A probe whose first TLS record is longer than the knock: the rest of the
+ * record sits decrypted inside OpenSSL, where poll() cannot see it. The
+ * proxy must hand it to the site without waiting for more traffic.
+ */
+void test_fallback_proxy_relays_probe(void) {
+    TEST_BEGIN("fallback proxy relays probe to site") {
+        int lfd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT(lfd >= 0, "socket failed");
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT(bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == 0, "bind failed");
+        ASSERT(listen(lfd, 1) == 0, "listen failed");
+        socklen_t slen = sizeof(sa);
+        getsockname(lfd, (struct sockaddr *)&sa, &slen);
+        char port[16];
+        snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+        signal(SIGPIPE, SIG_IGN);
+
+        /* Fake website: answer whatever arrived, then close */
+        pid_t site = fork();
+        ASSERT(site >= 0, "fork failed");
+        if (site == 0) {
+            int c = accept(lfd, NULL, NULL);
+            if (c < 0) _exit(1);
+            char req[256], resp[300];
+            ssize_t n = read(c, req, sizeof(req) - 1);
+            if (n <= 0) _exit(2);
+            int rlen = snprintf(resp, sizeof(resp), "site saw [%.*s]", (int)n, req);
+            write_all(c, resp, (size_t)rlen);
+            close(c);
+            _exit(0);
+        }
+        close(lfd);
+
+        int fds[2];
+        ASSERT(make_socketpair(fds) == 0, "socketpair failed");
+        obfs_set_mode(OBFS_TLS);
+
+        pid_t probe = fork();
+        ASSERT(probe >= 0, "fork failed");
+        if (probe == 0) {
+            close(fds[0]);
+            if (obfs_tls_connect(fds[1]) < 0) _exit(1);
+            if (obfs_send(fds[1], "GET /index.html", 15) != 15) _exit(2);
+            char resp[300];
+            int n = obfs_recv(fds[1], resp, sizeof(resp) - 1);
+            if (n <= 0) _exit(3);
+            resp[n] = '\0';
+            _exit(strstr(resp, "/index.html") ? 0 : 4);
+        }
+
+        close(fds[1]);
+        ASSERT(obfs_tls_accept(fds[0]) == 0, "TLS accept failed");
+        ASSERT_EQ(fallback_check_knock(fds[0]), 0, "should detect probe");
+
+        time_t start = time(NULL);
+        fallback_proxy(fds[0], "127.0.0.1", port, NULL, 0);
+        ASSERT(time(NULL) - start < FALLBACK_IDLE_SECS, "proxy stalled until idle timeout");
+
+        int status;
+        waitpid(probe, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "probe did not get site reply");
+        waitpid(site, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "site child failed");
+
+        close(fds[0]);
+        obfs_set_mode(OBFS_NONE);
+    } TEST_END;
+}
@@ -0,0 +1,128 @@
+/*
+ * test_h2.c — HTTP/2 camouflage tests (--obfs h2)
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "test.h"
+#include "obfs.h"
+#include "fingerprint.h"
+
+void test_h2_mode_uses_tls(void) {
+    TEST_BEGIN("h2 mode runs inside TLS") {
+        obfs_set_mode(OBFS_NONE);
+        ASSERT_EQ(obfs_uses_tls(), 0, "NONE is not TLS");
+        obfs_set_mode(OBFS_HTTP);
+        ASSERT_EQ(obfs_uses_tls(), 0, "HTTP is not TLS");
+        obfs_set_mode(OBFS_TLS);
+        ASSERT_EQ(obfs_uses_tls(), 1, "TLS uses TLS");
+        obfs_set_mode(OBFS_H2);
+        ASSERT_EQ(obfs_uses_tls(), 1, "h2 uses TLS");
+        obfs_set_mode(OBFS_NONE);
+    } TEST_END;
+}
+
+/* Client sends n numbered frames, server echoes each one back */
+static int h2_echo_child(int fd, int n) {
+    if (obfs_tls_connect(fd) < 0) return 1;
+    for (int i = 0; i < n; i++) {
+        char msg[32], back[64];
+        int mlen = snprintf(msg, sizeof(msg), "h2-frame-%d", i);
+        if (obfs_send(fd, msg, (size_t)mlen) != mlen) return 2;
+        int got = obfs_recv(fd, back, sizeof(back));
+        if (got != mlen || memcmp(back, msg, (size_t)mlen) != 0) return 3;
+    }
+    return 0;
+}
+
+void test_h2_roundtrip_rotation(void) {
+    TEST_BEGIN("h2 echo across stream rotation") {
+        int fds[2];
+        ASSERT(make_socketpair(fds) == 0, "socketpair failed");
+        obfs_set_mode(OBFS_H2);
+
+        /* 400 frames > the largest rotation window (64 + 127) */
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            close(fds[0]);
+            _exit(h2_echo_child(fds[1], 400));
+        }
+
+        close(fds[1]);
+        ASSERT(obfs_tls_accept(fds[0]) == 0, "h2 accept failed");
+        for (int i = 0; i < 400; i++) {
+            char buf[64];
+            int n = obfs_recv(fds[0], buf, sizeof(buf));
+            ASSERT(n > 0, "server recv failed");
+            ASSERT(obfs_send(fds[0], buf, (size_t)n) == n, "server send failed");
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client child failed");
+
+        close(fds[0]);
+        obfs_set_mode(OBFS_NONE);
+    } TEST_END;
+}
+
+void test_h2_with_browser_fingerprint(void) {
+    TEST_BEGIN("h2 negotiates with chrome ALPN profile") {
+        int fds[2];
+        ASSERT(make_socketpair(fds) == 0, "socketpair failed");
+        obfs_set_mode(OBFS_H2);
+
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            close(fds[0]);
+            fp_set_profile(FP_CHROME);
+            _exit(h2_echo_child(fds[1], 3));
+        }
+
+        close(fds[1]);
+        ASSERT(obfs_tls_accept(fds[0]) == 0, "h2 accept failed");
+        for (int i = 0; i < 3; i++) {
+            char buf[64];
+            int n = obfs_recv(fds[0], buf, sizeof(buf));
+            ASSERT(n > 0, "server recv failed");
+            ASSERT(obfs_send(fds[0], buf, (size_t)n) == n, "server send failed");
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client child failed");
+
+        close(fds[0]);
+        obfs_set_mode(OBFS_NONE);
+    } TEST_END;
+}
+
+void test_h2_requires_alpn(void) {
+    TEST_BEGIN("h2 client rejects server without h2 ALPN") {
+        int fds[2];
+        ASSERT(make_socketpair(fds) == 0, "socketpair failed");
+
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            close(fds[0]);
+            obfs_set_mode(OBFS_H2);
+            int rc = obfs_tls_connect(fds[1]);
+            close(fds[1]);
+            _exit(rc < 0 ? 0 : 1);
+        }
+
+        /* Plain TLS camouflage server never selects an ALPN protocol */
+        close(fds[1]);
+        obfs_set_mode(OBFS_TLS);
+        ASSERT(obfs_tls_accept(fds[0]) == 0, "TLS accept failed");
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "h2 client should refuse a non-h2 server");
+
+        close(fds[0]);
+        obfs_set_mode(OBFS_NONE);
+    } TEST_END;
+}
@@ -2,7 +2,10 @@
  * test_handshake.c — ECDHE handshake and session tests
  */
 #define _POSIX_C_SOURCE 200809L
+#include <signal.h>
 #include "test.h"
+#include "obfs.h"
+#include "ecdhe.h"
 
 void test_full_handshake(void) {
     int fds[2];
@@ -67,3 +70,262 @@ void test_bidirectional(void) {
         farm9crypt_cleanup();
     } TEST_END;
 }
+
+/*
+ * --tls-bind guarantees exercised below:
+ *  - both ends on one TLS session with the same password: the session
+ *    rekeys from the exporter and frames drop the inner AEAD;
+ *  - a wrong password still fails — the bind confirm travels in an AEAD
+ *    frame under the password-derived ECDHE key;
+ *  - a TLS-terminating relay that forwards the ClawSec handshake verbatim
+ *    fails — each leg has its own exporter, so the confirms never match;
+ *  - binding is negotiated: if only one side offers it, both keep the
+ *    inner AEAD instead of failing;
+ *  - binding is refused outside TLS, where dropping the AEAD would leave
+ *    the data unprotected.
+ */
+static const char *bind_payload = "bound payload";
+
+/* Client: connect, handshake, bind, echo one frame */
+static int bind_client(int fd, const char *password) {
+    signal(SIGPIPE, SIG_IGN);
+    if (obfs_tls_connect(fd) < 0) return 10;
+    if (farm9crypt_init_ecdhe(fd, password, strlen(password), 0) != 0) return 11;
+    if (farm9crypt_tls_bind(fd, 0) != 0) return 12;
+    if (!farm9crypt_tls_bound()) return 13;
+    char buf[64];
+    int n = farm9crypt_read(fd, buf, sizeof(buf));
+    if (n <= 0 || farm9crypt_write(fd, buf, n) != n) return 14;
+    return 0;
+}
+
+void test_tls_bind_roundtrip(void) {
+    int fds[2];
+    TEST_BEGIN("tls-bind: shared TLS session, inner AEAD off") {
+        ASSERT(make_socketpair(fds) == 0, "socketpair");
+        obfs_set_mode(OBFS_TLS);
+
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork");
+        if (pid == 0) {
+            close(fds[0]);
+            _exit(bind_client(fds[1], "BindPass123"));
+        }
+
+        close(fds[1]);
+        ASSERT(obfs_tls_accept(fds[0]) == 0, "TLS accept");
+        ASSERT_EQ(farm9crypt_init_ecdhe(fds[0], "BindPass123", 11, 1), 0, "server ECDHE");
+        ASSERT_EQ(farm9crypt_tls_bind(fds[0], 1), 0, "server bind");
+        ASSERT(farm9crypt_tls_bound(), "server not bound");
+
+        ASSERT(farm9crypt_write(fds[0], (char *)bind_payload, strlen(bind_payload)) ==
+               (int)strlen(bind_payload), "bound write");
+        char buf[64];
+        int n = farm9crypt_read(fds[0], buf, sizeof(buf));
+        ASSERT_EQ(n, (int)strlen(bind_payload), "bound echo size");
+        ASSERT(memcmp(buf, bind_payload, (size_t)n) == 0, "bound echo content");
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client failed");
+    } TEST_END;
+    farm9crypt_cleanup();
+    close(fds[0]);
+    obfs_set_mode(OBFS_NONE);
+}
+
+void test_tls_bind_wrong_password(void) {
+    int fds[2];
+    TEST_BEGIN("tls-bind: wrong password still rejected") {
+        ASSERT(make_socketpair(fds) == 0, "socketpair");
+        obfs_set_mode(OBFS_TLS);
+
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork");
+        if (pid == 0) {
+            close(fds[0]);
+            int rc = bind_client(fds[1], "WrongPass999");
+            close(fds[1]);
+            _exit(rc == 12 ? 0 : 1);
+        }
+
+        close(fds[1]);
+        /* Suppress SIGPIPE — the client hangs up after rejecting the confirm */
+        signal(SIGPIPE, SIG_IGN);
+        ASSERT(obfs_tls_accept(fds[0]) == 0, "TLS accept");
+        ASSERT_EQ(farm9crypt_init_ecdhe(fds[0], "BindPass123", 11, 1), 0, "server ECDHE");
+        ASSERT(farm9crypt_tls_bind(fds[0], 1) != 0, "bind must fail");
+        ASSERT(!farm9crypt_tls_bound(), "must not be bound");
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client bind should fail");
+    } TEST_END;
+    farm9crypt_cleanup();
+    close(fds[0]);
+    obfs_set_mode(OBFS_NONE);
+}
+
+/* Length-prefixed hop between the two halves of the relay */
+static int hop_send(int fd, const unsigned char *buf, int len) {
+    unsigned char hdr[4] = { 0, 0, (unsigned char)(len >> 8), (unsigned char)len };
+    return (write(fd, hdr, 4) == 4 && write(fd, buf, (size_t)len) == len) ? 0 : -1;
+}
+
+static int hop_recv(int fd, unsigned char *buf) {
+    unsigned char hdr[4];
+    if (recv(fd, hdr, 4, MSG_WAITALL) != 4) return -1;
+    int len = (hdr[2] << 8) | hdr[3];
+    return recv(fd, buf, (size_t)len, MSG_WAITALL) == len ? len : -1;
+}
+
+/*
+ * One half of a TLS-terminating relay. Forwards the ECDHE pubkeys
+ * (server first) and the server's bind confirm, message by message.
+ */
+static int relay_half(int tls_fd, int hop_fd, int faces_server) {
+    static const int to_client[] = { 1, 0, 1 };
+    signal(SIGPIPE, SIG_IGN);
+    if ((faces_server ? obfs_tls_connect(tls_fd) : obfs_tls_accept(tls_fd)) < 0)
+        return 1;
+    for (int i = 0; i < 3; i++) {
+        unsigned char buf[FARM9_MAX_MSG + 64];
+        int n;
+        if (to_client[i] == faces_server) {
+            if ((n = obfs_recv(tls_fd, buf, sizeof(buf))) <= 0) return 2;
+            if (hop_send(hop_fd, buf, n) < 0) return 3;
+        } else {
+            if ((n = hop_recv(hop_fd, buf)) <= 0) return 4;
+            if (obfs_send(tls_fd, buf, (size_t)n) != n) return 5;
+        }
+    }
+    return 0;
+}
+
+void test_tls_bind_relay_detected(void) {
+    int sfd[2], cfd[2], hop[2];
+    pid_t pids[3] = { -1, -1, -1 };
+    TEST_BEGIN("tls-bind: TLS-terminating relay detected") {
+        ASSERT(make_socketpair(sfd) == 0 && make_socketpair(cfd) == 0 &&
+               make_socketpair(hop) == 0, "socketpair");
+        obfs_set_mode(OBFS_TLS);
+
+        /* server <-sfd-> relay B <-hop-> relay A <-cfd-> client */
+        for (int r = 0; r < 3; r++) {
+            pids[r] = fork();
+            ASSERT(pids[r] >= 0, "fork");
+            if (pids[r] == 0) {
+                int rc;
+                close(sfd[0]);
+                if (r == 0) {
+                    close(cfd[0]); close(cfd[1]); close(hop[0]);
+                    rc = relay_half(sfd[1], hop[1], 1);
+                } else if (r == 1) {
+                    close(sfd[1]); close(cfd[1]); close(hop[1]);
+                    rc = relay_half(cfd[0], hop[0], 0);
+                } else {
+                    close(sfd[1]); close(cfd[0]); close(hop[0]); close(hop[1]);
+                    rc = bind_client(cfd[1], "BindPass123");
+                    rc = (rc == 12) ? 0 : 1;
+                }
+                _exit(rc);
+            }
+        }
+        close(sfd[1]); close(cfd[0]); close(cfd[1]); close(hop[0]); close(hop[1]);
+        signal(SIGPIPE, SIG_IGN);
+
+        ASSERT(obfs_tls_accept(sfd[0]) == 0, "TLS accept");
+        /* Same password on both ends: the relayed ECDHE itself succeeds */
+        ASSERT_EQ(farm9crypt_init_ecdhe(sfd[0], "BindPass123", 11, 1), 0, "server ECDHE");
+        ASSERT(farm9crypt_tls_bind(sfd[0], 1) != 0, "bind must fail across relay");
+
+        int status;
+        waitpid(pids[2], &status, 0);
+        pids[2] = -1;
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "client must reject the relayed bind confirm");
+    } TEST_END;
+    farm9crypt_cleanup();
+    close(sfd[0]);
+    for (int r = 0; r < 3; r++)
+        if (pids[r] > 0) waitpid(pids[r], NULL, 0);
+    obfs_set_mode(OBFS_NONE);
+}
+
+/* Client for the negotiation test: exit status 0 if it saw the server's
+ * offer as expected and echoed one frame (bound if both offered) */
+static int offer_client(int fd, int offer, int expect_peer) {
+    signal(SIGPIPE, SIG_IGN);
+    ecdhe_offer_bind(offer);
+    if (obfs_tls_connect(fd) < 0) return 10;
+    if (farm9crypt_init_ecdhe(fd, "BindPass123", 11, 0) != 0) return 11;
+    if (ecdhe_peer_offers_bind() != expect_peer) return 12;
+    if (offer && expect_peer && farm9crypt_tls_bind(fd, 0) != 0) return 13;
+    char buf[64];
+    int n = farm9crypt_read(fd, buf, sizeof(buf));
+    if (n <= 0 || farm9crypt_write(fd, buf, n) != n) return 14;
+    return 0;
+}
+
+/* Server offering the bind to a client that does (or does not): returns
+ * whether the session ended up bound, -1 on failure */
+static int offer_session(int client_offers) {
+    int fds[2], bound = -1;
+    if (make_socketpair(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(offer_client(fds[1], client_offers, 1));
+    }
+    close(fds[1]);
+    ecdhe_offer_bind(1);
+    char buf[64];
+    if (pid > 0 && obfs_tls_accept(fds[0]) == 0 &&
+        farm9crypt_init_ecdhe(fds[0], "BindPass123", 11, 1) == 0 &&
+        ecdhe_peer_offers_bind() == client_offers &&
+        (!client_offers || farm9crypt_tls_bind(fds[0], 1) == 0) &&
+        farm9crypt_write(fds[0], (char *)bind_payload, strlen(bind_payload)) ==
+            (int)strlen(bind_payload) &&
+        farm9crypt_read(fds[0], buf, sizeof(buf)) == (int)strlen(bind_payload))
+        bound = farm9crypt_tls_bound();
+    int status = -1;
+    if (pid > 0) waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) bound = -1;
+    ecdhe_offer_bind(0);
+    farm9crypt_cleanup();
+    close(fds[0]);
+    return bound;
+}
+
+void test_tls_bind_negotiated(void) {
+    TEST_BEGIN("tls-bind: negotiated, one-sided offer keeps the inner AEAD") {
+        obfs_set_mode(OBFS_TLS);
+        int both = offer_session(1);
+        int one = offer_session(0);
+        obfs_set_mode(OBFS_NONE);
+        ASSERT_EQ(both, 1, "both offered: session must bind");
+        ASSERT_EQ(one, 0, "client did not offer: session must stay sealed");
+    } TEST_END;
+}
+
+void test_tls_bind_requires_tls(void) {
+    int fds[2];
+    TEST_BEGIN("tls-bind: refused outside TLS") {
+        ASSERT(make_socketpair(fds) == 0, "socketpair");
+        unsigned char salt[16];
+        farm9crypt_generate_salt(salt, sizeof(salt));
+        farm9crypt_init_password_with_salt("BindPass123", 11, salt, 16);
+
+        obfs_set_mode(OBFS_NONE);
+        ASSERT(farm9crypt_tls_bind(fds[0], 1) != 0, "bind without TLS must fail");
+        ASSERT(!farm9crypt_tls_bound(), "must not be bound");
+
+        /* Frames still carry the inner AEAD */
+        const char *msg = "still sealed";
+        ASSERT(farm9crypt_write(fds[0], (char *)msg, strlen(msg)) == (int)strlen(msg), "write");
+        char buf[64];
+        ASSERT_EQ(farm9crypt_read(fds[1], buf, sizeof(buf)), (int)strlen(msg), "read");
+    } TEST_END;
+    farm9crypt_cleanup();
+    close(fds[0]); close(fds[1]);
+}
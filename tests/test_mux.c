@@ -4,6 +4,14 @@
 #define _POSIX_C_SOURCE 200809L
 #include "test.h"
 #include "mux.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 void test_mux_encode_decode(void) {
     TEST_BEGIN("mux header encode/decode roundtrip") {
@@ -29,10 +37,10 @@ void test_mux_frame_types(void) {
         ASSERT_EQ(hdr.type, MUX_OPEN, "OPEN type wrong");
         ASSERT_EQ(hdr.length, 0, "OPEN length should be 0");
 
-        /* CLOSE with max stream_id */
-        mux_encode_header(buf, 63, MUX_CLOSE, 0);
+        /* CLOSE with a 32-bit stream_id */
+        mux_encode_header(buf, 0xFFFFFFF1u, MUX_CLOSE, 0);
         mux_decode_header(buf, &hdr);
-        ASSERT_EQ(hdr.stream_id, 63, "max stream_id wrong");
+        ASSERT(hdr.stream_id == 0xFFFFFFF1u, "32-bit stream_id wrong");
         ASSERT_EQ(hdr.type, MUX_CLOSE, "CLOSE type wrong");
     } TEST_END;
 }
@@ -43,11 +51,858 @@ void test_mux_max_payload(void) {
         mux_header_t hdr;
 
         /* Manually set length to 65535 (> MUX_MAX_PAYLOAD) */
-        buf[0] = 1;
-        buf[1] = MUX_DATA;
+        mux_encode_header(buf, 1, MUX_DATA, 0);
         buf[2] = 0xFF;
         buf[3] = 0xFF;
 
         ASSERT(mux_decode_header(buf, &hdr) == -1, "should reject >8192 payload");
     } TEST_END;
 }
+
+void test_mux_version_checked(void) {
+    TEST_BEGIN("mux rejects frames of another version") {
+        unsigned char buf[MUX_HDR_SIZE];
+        mux_header_t hdr;
+
+        mux_encode_header(buf, 5, MUX_DATA, 10);
+        ASSERT_EQ(buf[0], MUX_VERSION, "version byte first");
+        buf[0] = 1;   /* v1 frame: [stream_id(1)][type(1)][len(2)] */
+        ASSERT(mux_decode_header(buf, &hdr) == -1, "should reject v1 frame");
+    } TEST_END;
+}
+
+void test_mux_pack_records(void) {
+    TEST_BEGIN("mux packs small frames into shared records") {
+        int fds[2];
+        ASSERT(make_socketpair(fds) == 0, "socketpair");
+        farm9crypt_init_password("PackTestPass1", 13);
+
+        /* 100 keystroke-sized frames fit one record; a full-size frame
+         * after them does not and must start the next */
+        static mux_rec_t tx, rx;
+        memset(&tx, 0, sizeof(tx));
+        memset(&rx, 0, sizeof(rx));
+        char small[16], big[MUX_MAX_PAYLOAD];
+        memset(big, 'B', sizeof(big));
+        for (int i = 0; i < 100; i++) {
+            snprintf(small, sizeof(small), "key-%03d", i);
+            ASSERT(mux_pack_frame(fds[0], &tx, 2 * i + 1, MUX_DATA, small, 7) == 7,
+                   "pack small");
+        }
+        ASSERT(mux_pack_frame(fds[0], &tx, 1, MUX_CLOSE, NULL, 0) == 0, "pack close");
+        ASSERT(mux_pack_frame(fds[0], &tx, 3, MUX_DATA, big, sizeof(big)) ==
+               (int)sizeof(big), "pack big");
+        ASSERT(mux_pack_flush(fds[0], &tx) == 0, "flush");
+        ASSERT_EQ((int)tx.len, 0, "flush empties the record");
+
+        int records = 0;
+        char buf[MUX_MAX_PAYLOAD];
+        mux_header_t hdr;
+        for (int i = 0; i < 102; i++) {
+            if (rx.off >= rx.len) records++;
+            int n = mux_unpack_frame(fds[1], &rx, &hdr, buf, sizeof(buf));
+            if (i < 100) {
+                snprintf(small, sizeof(small), "key-%03d", i);
+                ASSERT(n == 7 && memcmp(buf, small, 7) == 0, "small frame");
+                ASSERT(hdr.stream_id == (uint32_t)(2 * i + 1), "stream id");
+            } else if (i == 100) {
+                ASSERT(n == 0 && hdr.type == MUX_CLOSE, "empty CLOSE frame");
+            } else {
+                ASSERT(n == (int)sizeof(big) && buf[0] == 'B', "big frame");
+            }
+        }
+        ASSERT_EQ(records, 2, "102 frames should take 2 records");
+        ASSERT(rx.off == rx.len, "nothing left over");
+
+        close(fds[0]);
+        close(fds[1]);
+        farm9crypt_cleanup();
+    } TEST_END;
+}
+
+void test_mux_prio_parse(void) {
+    TEST_BEGIN("mux --mux-prio port classes") {
+        ASSERT(mux_prio_for_port(22) == -1, "no class before parsing");
+        ASSERT(mux_prio_parse("22=interactive,873=bulk") == 0, "valid spec");
+        ASSERT_EQ(mux_prio_for_port(22), MUX_PRIO_INTERACTIVE, "22 interactive");
+        ASSERT_EQ(mux_prio_for_port(873), MUX_PRIO_BULK, "873 bulk");
+        ASSERT_EQ(mux_prio_for_port(80), -1, "unlisted port");
+        ASSERT(mux_prio_parse("22=fast") < 0, "unknown class");
+        ASSERT(mux_prio_parse("0=bulk") < 0, "port out of range");
+        ASSERT(mux_prio_parse("ssh=bulk") < 0, "port must be numeric");
+        ASSERT(mux_prio_parse("22") < 0, "class missing");
+    } TEST_END;
+}
+
+void test_mux_table_many_streams(void) {
+    TEST_BEGIN("mux stream table holds 50000 streams") {
+        mux_table_t t;
+        ASSERT(mux_table_init(&t, 1) == 0, "init failed");
+
+        enum { N = 50000 };
+        static uint32_t ids[N];
+        for (int i = 0; i < N; i++) {
+            mux_stream_t *s = mux_table_open(&t, i);
+            ASSERT(s != NULL, "open failed");
+            ASSERT(s->id & 1, "client ids must be odd");
+            ids[i] = s->id;
+        }
+        ASSERT_EQ((int)t.count, N, "count wrong");
+
+        for (int i = 0; i < N; i++) {
+            mux_stream_t *s = mux_table_find(&t, ids[i]);
+            ASSERT(s && s->fd == i, "lookup failed");
+        }
+
+        /* Remove every other stream, the rest must stay reachable */
+        for (int i = 0; i < N; i += 2)
+            mux_table_remove(&t, mux_table_find(&t, ids[i]));
+        for (int i = 0; i < N; i++) {
+            mux_stream_t *s = mux_table_find(&t, ids[i]);
+            ASSERT((i % 2 == 0) ? s == NULL : (s && s->fd == i), "lookup after remove");
+        }
+        ASSERT_EQ((int)t.count, N / 2, "count after remove");
+
+        mux_table_free(&t);
+    } TEST_END;
+}
+
+void test_mux_table_recycles_ids(void) {
+    TEST_BEGIN("mux recycles ids of closed streams") {
+        mux_table_t t;
+        ASSERT(mux_table_init(&t, 0) == 0, "init failed");
+
+        mux_stream_t *a = mux_table_open(&t, 10);
+        mux_stream_t *b = mux_table_open(&t, 11);
+        mux_stream_t *c = mux_table_open(&t, 12);
+        ASSERT(a && b && c, "open failed");
+        ASSERT(a->id == 2 && b->id == 4 && c->id == 6, "server ids are even");
+
+        uint32_t freed = b->id;
+        mux_table_remove(&t, b);
+        mux_stream_t *d = mux_table_open(&t, 13);
+        ASSERT(d && d->id == freed, "closed id should be reused");
+
+        /* Peer ids are tracked but never handed out by us */
+        ASSERT(mux_table_add(&t, 7, 14) != NULL, "peer odd id accepted");
+        ASSERT(mux_table_add(&t, 7, 15) == NULL, "duplicate id refused");
+        ASSERT(mux_table_add(&t, 8, 16) == NULL, "our parity refused from peer");
+        mux_table_remove(&t, mux_table_find(&t, 7));
+        mux_stream_t *e = mux_table_open(&t, 17);
+        ASSERT(e && e->id == 8, "peer id must not enter our pool");
+
+        mux_table_free(&t);
+    } TEST_END;
+}
+
+/* ── End-to-end: client relay <-> tunnel <-> server relay <-> echo ── */
+
+static int echo_check(int fd, int i) {
+    char msg[32], back[32];
+    int len = snprintf(msg, sizeof(msg), "stream-%d", i);
+    if (write_all(fd, msg, (size_t)len) < 0) return -1;
+    int got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, back + got, (size_t)(len - got));
+        if (r <= 0) return -1;
+        got += (int)r;
+    }
+    return memcmp(msg, back, (size_t)len) == 0 ? 0 : -1;
+}
+
+/*
+ * n tunnels whose client relays listen on one free local port (a
+ * listener group, as with --mux-conns); tunnel i's server relay forwards
+ * to targets[i]. Returns the local port.
+ */
+static int tunnels_start(const int *targets, int n, pid_t *srv, pid_t *cli) {
+    int local_port;
+    int tmp = listen_loopback(&local_port);   /* reserve a free port */
+    if (tmp < 0) return -1;
+    close(tmp);
+    char lport[16];
+    snprintf(lport, sizeof(lport), "%d", local_port);
+    int lfd[MUX_MAX_CONNS];
+    mux_listen_group(lport, lfd, n);
+
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        int enc[2];
+        if (make_socketpair(enc) < 0) return -1;
+        /* Each tunnel starts its own record sequence */
+        unsigned char salt[16];
+        farm9crypt_generate_salt(salt, sizeof(salt));
+        farm9crypt_init_password_with_salt("MuxTest12345", 12, salt, 16);
+
+        char tport[16];
+        snprintf(tport, sizeof(tport), "%d", targets[i]);
+        srv[i] = fork();
+        if (srv[i] == 0) {
+            for (int j = 0; j < n; j++) close(lfd[j]);
+            close(enc[1]);
+            mux_relay_server(enc[0], "127.0.0.1", tport);
+            _exit(0);
+        }
+        cli[i] = fork();
+        if (cli[i] == 0) {
+            close(enc[0]);
+            /* A relay that ends must take its listener out of the group */
+            for (int j = 0; j < n; j++)
+                if (lfd[j] != lfd[i]) close(lfd[j]);
+            mux_relay_client(enc[1], lfd[i]);
+            _exit(0);
+        }
+        close(enc[0]);
+        close(enc[1]);
+        farm9crypt_cleanup();
+        if (srv[i] <= 0 || cli[i] <= 0) ok = 0;
+    }
+    for (int i = 0; i < n; i++)
+        if (i == 0 || lfd[i] != lfd[0]) close(lfd[i]);
+    return ok ? local_port : -1;
+}
+
+/* Client relay on a free local port, server relay forwarding to target_port */
+static int tunnel_start(int target_port, pid_t *srv, pid_t *cli) {
+    return tunnels_start(&target_port, 1, srv, cli);
+}
+
+/* Closing the client ends the tunnel; returns the server relay's status */
+static int tunnel_stop(pid_t srv, pid_t cli) {
+    int status = -1;
+    kill(cli, SIGTERM);
+    waitpid(cli, NULL, 0);
+    waitpid(srv, &status, 0);
+    return status;
+}
+
+void test_mux_tunnel_many_streams(void) {
+    TEST_BEGIN("mux tunnel: 300 sequential + 200 concurrent streams") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port;
+        int efd = listen_loopback(&echo_port);
+        ASSERT(efd >= 0, "echo listen failed");
+
+        pid_t echo = fork();
+        ASSERT(echo >= 0, "fork failed");
+        if (echo == 0) echo_serve(efd);
+        close(efd);
+
+        pid_t srv, cli;
+        int local_port = tunnel_start(echo_port, &srv, &cli);
+        ASSERT(local_port > 0, "tunnel start failed");
+
+        /* More streams than the old 63-id limit, one after another */
+        int ok = 1;
+        for (int i = 0; i < 300 && ok; i++) {
+            int fd = connect_loopback_wait(local_port);
+            if (fd < 0 || echo_check(fd, i) < 0) ok = 0;
+            if (fd >= 0) close(fd);
+        }
+        ASSERT(ok, "sequential stream failed");
+
+        /* Many open at once */
+        static int fds[200];
+        for (int i = 0; i < 200; i++) {
+            fds[i] = connect_loopback_wait(local_port);
+            if (fds[i] < 0) ok = 0;
+        }
+        for (int i = 0; i < 200 && ok; i++)
+            if (echo_check(fds[i], 1000 + i) < 0) ok = 0;
+        for (int i = 0; i < 200; i++)
+            if (fds[i] >= 0) close(fds[i]);
+        ASSERT(ok, "concurrent stream failed");
+
+        int status = tunnel_stop(srv, cli);
+        ASSERT(WIFEXITED(status), "server relay should end with the tunnel");
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+    } TEST_END;
+}
+
+/*
+ * Sink target: a connection whose first byte is 'S' is never read again
+ * (a stalled consumer); any other is read until FLOW_BYTES arrived, then
+ * answered with "OK".
+ */
+#define FLOW_STREAMS 50
+#define FLOW_BYTES   (1024 * 1024)
+
+static void sink_server(int lfd) {
+    static struct pollfd pfd[256];
+    static long got[256];
+    int n = 1;
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, (nfds_t)n, -1) < 0) continue;
+        if ((pfd[0].revents & POLLIN) && n < 256) {
+            int c = accept(lfd, NULL, NULL);
+            if (c >= 0) {
+                pfd[n].fd = c;
+                pfd[n].events = POLLIN;
+                pfd[n].revents = 0;
+                got[n++] = -1;
+            }
+        }
+        for (int i = 1; i < n; i++) {
+            if (!(pfd[i].revents & POLLIN)) continue;
+            char buf[65536];
+            ssize_t r = read(pfd[i].fd, buf, sizeof(buf));
+            if (r <= 0) {
+                close(pfd[i].fd);
+                pfd[i] = pfd[--n];
+                got[i--] = got[n];
+                continue;
+            }
+            if (got[i] < 0) {
+                if (buf[0] == 'S') {
+                    pfd[i].events = 0;   /* stall: never read this one again */
+                    continue;
+                }
+                got[i] = 0;
+            }
+            got[i] += r;
+            if (got[i] == FLOW_BYTES)
+                write_all(pfd[i].fd, "OK", 2);
+        }
+    }
+}
+
+static double now_sec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Push 'R' + FLOW_BYTES-1 bytes down each of FLOW_STREAMS connections and
+ * wait for every "OK". With stall_fd >= 0, keep stuffing that connection
+ * the whole time. Returns seconds taken, or -1 after 30s.
+ */
+static double flow_run(int local_port, int stall_fd) {
+    static char chunk[16384];
+    memset(chunk, 'x', sizeof(chunk));
+    chunk[0] = 'R';
+
+    struct pollfd pfd[FLOW_STREAMS + 1];
+    long sent[FLOW_STREAMS];
+    int done = 0;
+    for (int i = 0; i < FLOW_STREAMS; i++) {
+        pfd[i].fd = connect_loopback_wait(local_port);
+        if (pfd[i].fd < 0) return -1;
+        fcntl(pfd[i].fd, F_SETFL, O_NONBLOCK);
+        pfd[i].events = POLLOUT;
+        sent[i] = 0;
+    }
+    pfd[FLOW_STREAMS].fd = stall_fd;
+    pfd[FLOW_STREAMS].events = POLLOUT;
+
+    double start = now_sec();
+    while (done < FLOW_STREAMS) {
+        if (now_sec() - start > 30) break;
+        if (poll(pfd, FLOW_STREAMS + 1, 1000) <= 0) continue;
+        if (pfd[FLOW_STREAMS].revents & POLLOUT)
+            (void)!write(stall_fd, chunk, sizeof(chunk));
+        for (int i = 0; i < FLOW_STREAMS; i++) {
+            if (pfd[i].revents & POLLOUT) {
+                long left = FLOW_BYTES - sent[i];
+                ssize_t w = write(pfd[i].fd, chunk + (sent[i] ? 1 : 0),
+                                  left < (long)sizeof(chunk) - 1 ? (size_t)left
+                                                                 : sizeof(chunk) - 1);
+                if (w > 0) sent[i] += w;
+                if (sent[i] == FLOW_BYTES) pfd[i].events = POLLIN;
+            } else if (pfd[i].revents & POLLIN) {
+                char ok[2];
+                if (read(pfd[i].fd, ok, 2) == 2 && ok[0] == 'O') done++;
+                pfd[i].events = 0;
+            }
+        }
+    }
+    double took = now_sec() - start;
+    for (int i = 0; i < FLOW_STREAMS; i++) close(pfd[i].fd);
+    return done == FLOW_STREAMS ? took : -1;
+}
+
+/* Write into fd until every buffer on its path is full (1s without room) */
+static void stuff(int fd) {
+    static char junk[65536];
+    double last = now_sec();
+    while (now_sec() - last < 1.0) {
+        struct pollfd p = { fd, POLLOUT, 0 };
+        if (poll(&p, 1, 100) == 1 && write(fd, junk, sizeof(junk)) > 0)
+            last = now_sec();
+    }
+}
+
+void test_mux_flow_control_stalled_stream(void) {
+    TEST_BEGIN("mux flow control: stalled stream + 50 active") {
+        signal(SIGPIPE, SIG_IGN);
+        int sink_port;
+        int sfd = listen_loopback(&sink_port);
+        ASSERT(sfd >= 0, "sink listen failed");
+        pid_t sink = fork();
+        ASSERT(sink >= 0, "fork failed");
+        if (sink == 0) sink_server(sfd);
+        close(sfd);
+
+        pid_t srv, cli;
+        int local_port = tunnel_start(sink_port, &srv, &cli);
+        ASSERT(local_port > 0, "tunnel start failed");
+
+        double base = flow_run(local_port, -1);
+        ASSERT(base >= 0, "50 streams did not finish");
+
+        /* Same load next to a stream whose target never reads */
+        int stall = connect_loopback_wait(local_port);
+        ASSERT(stall >= 0, "stall connect failed");
+        ASSERT(write_all(stall, "S", 1) == 0, "stall write failed");
+        fcntl(stall, F_SETFL, O_NONBLOCK);
+        stuff(stall);
+        double stalled = flow_run(local_port, stall);
+        close(stall);
+
+        ASSERT(stalled >= 0, "stalled stream blocked the others");
+        ASSERT(stalled < base * 3 + 1.0, "aggregate throughput collapsed");
+
+        tunnel_stop(srv, cli);
+        kill(sink, SIGTERM);
+        waitpid(sink, NULL, 0);
+    } TEST_END;
+}
+
+/* Saturate a stream both ways until killed */
+static pid_t bulk_stream(int local_port) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    int fd = connect_loopback_wait(local_port);
+    if (fd < 0) _exit(1);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    static char buf[65536];
+    memset(buf, 'b', sizeof(buf));
+    for (;;) {
+        struct pollfd p = { fd, POLLIN | POLLOUT, 0 };
+        if (poll(&p, 1, -1) <= 0) continue;
+        if (p.revents & POLLIN) {
+            if (read(fd, buf, sizeof(buf)) == 0) _exit(0);
+        }
+        if (p.revents & POLLOUT)
+            (void)!write(fd, buf, sizeof(buf));
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+#define PRIO_BULK_STREAMS 4
+#define PRIO_PINGS        300
+
+void test_mux_interactive_latency_under_bulk(void) {
+    TEST_BEGIN("mux interactive p99 next to 4 bulk streams") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port;
+        int efd = listen_loopback(&echo_port);
+        ASSERT(efd >= 0, "echo listen failed");
+        pid_t echo = fork();
+        ASSERT(echo >= 0, "fork failed");
+        if (echo == 0) echo_serve_forking(efd);
+        close(efd);
+
+        pid_t srv, cli;
+        int local_port = tunnel_start(echo_port, &srv, &cli);
+        ASSERT(local_port > 0, "tunnel start failed");
+
+        int ping = connect_loopback_wait(local_port);
+        ASSERT(ping >= 0, "ping connect failed");
+        ASSERT(echo_check(ping, 0) == 0, "ping echo failed");
+
+        pid_t bulk[PRIO_BULK_STREAMS];
+        for (int i = 0; i < PRIO_BULK_STREAMS; i++)
+            bulk[i] = bulk_stream(local_port);
+        usleep(500000);   /* let the bulk streams fill every buffer */
+
+        static double rtt[PRIO_PINGS];
+        int ok = 1;
+        for (int i = 0; i < PRIO_PINGS && ok; i++) {
+            double t0 = now_sec();
+            if (echo_check(ping, i) < 0) ok = 0;
+            rtt[i] = now_sec() - t0;
+            usleep(5000);
+        }
+        for (int i = 0; i < PRIO_BULK_STREAMS; i++) {
+            kill(bulk[i], SIGKILL);
+            waitpid(bulk[i], NULL, 0);
+        }
+        close(ping);
+        tunnel_stop(srv, cli);
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+        ASSERT(ok, "ping echo failed under load");
+
+        qsort(rtt, PRIO_PINGS, sizeof(rtt[0]), cmp_double);
+        ASSERT(rtt[PRIO_PINGS * 99 / 100] < 0.05, "interactive p99 above 50 ms");
+    } TEST_END;
+}
+
+extern int g_jitter;
+
+#define JITTER_BULK  24    /* their credit is more records than OBFS_JQ_MAX */
+#define JITTER_PINGS 30
+
+/* --jitter: a full send queue pauses the streams feeding it instead of
+ * sleeping in the relay, so the tunnel keeps being read and nothing wedges */
+void test_mux_jitter_queue_backpressure(void) {
+    TEST_BEGIN("mux with --jitter: bulk streams fill the queue, pings still echo") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port;
+        int efd = listen_loopback(&echo_port);
+        ASSERT(efd >= 0, "echo listen failed");
+        pid_t echo = fork();
+        ASSERT(echo >= 0, "fork failed");
+        if (echo == 0) echo_serve_forking(efd);
+        close(efd);
+
+        g_jitter = 100;
+        pid_t srv, cli;
+        int local_port = tunnel_start(echo_port, &srv, &cli);
+        g_jitter = 0;
+        ASSERT(local_port > 0, "tunnel start failed");
+
+        int ping = connect_loopback_wait(local_port);
+        ASSERT(ping >= 0, "ping connect failed");
+        ASSERT(echo_check(ping, 0) == 0, "ping echo failed");
+
+        pid_t bulk[JITTER_BULK];
+        for (int i = 0; i < JITTER_BULK; i++)
+            bulk[i] = bulk_stream(local_port);
+        usleep(300000);
+
+        static double rtt[JITTER_PINGS];
+        int ok = 1;
+        for (int i = 0; i < JITTER_PINGS && ok; i++) {
+            double t0 = now_sec();
+            if (echo_check(ping, i) < 0) ok = 0;
+            rtt[i] = now_sec() - t0;
+        }
+        for (int i = 0; i < JITTER_BULK; i++) {
+            kill(bulk[i], SIGKILL);
+            waitpid(bulk[i], NULL, 0);
+        }
+        close(ping);
+        tunnel_stop(srv, cli);
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+        ASSERT(ok, "ping echo failed with the jitter queue full");
+
+        qsort(rtt, JITTER_PINGS, sizeof(rtt[0]), cmp_double);
+        ASSERT(rtt[JITTER_PINGS - 1] < 1.0, "ping above 1 s with --jitter");
+    } TEST_END;
+}
+
+/*
+ * Target that takes one connection, then leaves its accept queue full for
+ * a while: further SYNs are dropped, as by a blackholed host, until it
+ * starts accepting again.
+ */
+static void stalling_target(int lfd) {
+    listen(lfd, 0);
+    signal(SIGCHLD, SIG_IGN);
+    int c = accept(lfd, NULL, NULL);
+    if (c >= 0 && fork() == 0) {
+        close(lfd);
+        char buf[4096];
+        ssize_t r;
+        while ((r = read(c, buf, sizeof(buf))) > 0)
+            if (write_all(c, buf, (size_t)r) < 0) break;
+        _exit(0);
+    }
+    usleep(1500000);
+    echo_serve_forking(lfd);
+}
+
+/* Read exactly len bytes within timeout_ms. Returns len, 0 on EOF, -1. */
+static int read_within(int fd, char *buf, int len, int timeout_ms) {
+    int got = 0;
+    while (got < len) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, timeout_ms) <= 0) return -1;
+        ssize_t r = read(fd, buf + got, (size_t)(len - got));
+        if (r <= 0) return r == 0 && got == 0 ? 0 : -1;
+        got += (int)r;
+    }
+    return got;
+}
+
+#define SLOW_OPENS 4
+
+void test_mux_slow_target_connect(void) {
+    TEST_BEGIN("mux: hanging target connects do not stall open streams") {
+        signal(SIGPIPE, SIG_IGN);
+        int target_port;
+        int tfd = listen_loopback(&target_port);
+        ASSERT(tfd >= 0, "target listen failed");
+        pid_t target = fork();
+        ASSERT(target >= 0, "fork failed");
+        if (target == 0) stalling_target(tfd);
+        close(tfd);
+
+        pid_t srv, cli;
+        int local_port = tunnel_start(target_port, &srv, &cli);
+        ASSERT(local_port > 0, "tunnel start failed");
+
+        int est = connect_loopback_wait(local_port);
+        ASSERT(est >= 0, "connect failed");
+        ASSERT(echo_check(est, 0) == 0, "established stream echo failed");
+
+        /* New streams whose target connects hang; their first bytes go out
+         * before the server has reached the target */
+        int slow[SLOW_OPENS];
+        char msg[SLOW_OPENS][16];
+        for (int i = 0; i < SLOW_OPENS; i++) {
+            slow[i] = connect_loopback_wait(local_port);
+            snprintf(msg[i], sizeof(msg[i]), "early-%08d", i);
+            if (slow[i] >= 0) write_all(slow[i], msg[i], 14);
+        }
+
+        double worst = 0;
+        int ok = 1;
+        for (int i = 0; i < 20 && ok; i++) {
+            double t0 = now_sec();
+            if (echo_check(est, i) < 0) ok = 0;
+            if (now_sec() - t0 > worst) worst = now_sec() - t0;
+            usleep(10000);
+        }
+        ASSERT(ok, "established stream echo failed");
+        ASSERT(worst < 0.3, "a pending connect delayed an open stream");
+
+        /* Once the target accepts again the buffered bytes arrive */
+        for (int i = 0; i < SLOW_OPENS && ok; i++) {
+            char back[16];
+            if (slow[i] < 0 || read_within(slow[i], back, 14, 8000) != 14 ||
+                memcmp(back, msg[i], 14) != 0)
+                ok = 0;
+        }
+        for (int i = 0; i < SLOW_OPENS; i++)
+            if (slow[i] >= 0) close(slow[i]);
+        close(est);
+        tunnel_stop(srv, cli);
+        kill(target, SIGKILL);
+        waitpid(target, NULL, 0);
+        ASSERT(ok, "data sent before the connect finished was lost");
+
+        /* Nothing listening: the stream is closed, not left hanging */
+        int dead_port;
+        int dfd = listen_loopback(&dead_port);
+        ASSERT(dfd >= 0, "listen failed");
+        close(dfd);
+        local_port = tunnel_start(dead_port, &srv, &cli);
+        ASSERT(local_port > 0, "tunnel start failed");
+        int fd = connect_loopback_wait(local_port);
+        ASSERT(fd >= 0, "connect failed");
+        char c;
+        ok = read_within(fd, &c, 1, 3000) == 0;
+        close(fd);
+        tunnel_stop(srv, cli);
+        ASSERT(ok, "refused target should close the stream");
+    } TEST_END;
+}
+
+/* Next frame from the tunnel, or -2 if none comes within 2 s */
+static int next_frame(int fd, mux_rec_t *rx, mux_header_t *hdr, char *buf) {
+    if (rx->off >= rx->len) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, 2000) <= 0) return -2;
+    }
+    return mux_unpack_frame(fd, rx, hdr, buf, MUX_MAX_PAYLOAD);
+}
+
+void test_mux_zero_rtt_open(void) {
+    TEST_BEGIN("mux: first bytes ride in OPEN and reach the target on connect") {
+        static const char req[] = "GET / HTTP/1.1\r\n\r\n";
+        const size_t req_len = sizeof(req) - 1;
+        static char buf[MUX_MAX_PAYLOAD];
+        mux_header_t hdr;
+        mux_rec_t rx;
+        signal(SIGPIPE, SIG_IGN);
+
+        int enc[2];
+        ASSERT(make_socketpair(enc) == 0, "socketpair failed");
+        unsigned char salt[16];
+        farm9crypt_generate_salt(salt, sizeof(salt));
+        farm9crypt_init_password_with_salt("MuxTest12345", 12, salt, 16);
+
+        /* Client relay, with the test as the server end of the tunnel */
+        int local_port;
+        int lfd = listen_loopback(&local_port);
+        ASSERT(lfd >= 0, "listen failed");
+        fcntl(lfd, F_SETFL, O_NONBLOCK);
+        pid_t cli = fork();
+        ASSERT(cli >= 0, "fork failed");
+        if (cli == 0) {
+            close(enc[0]);
+            mux_relay_client(enc[1], lfd);
+            _exit(0);
+        }
+        close(lfd);
+
+        int fd = connect_loopback_wait(local_port);
+        ASSERT(fd >= 0, "connect failed");
+        write_all(fd, req, req_len);
+        memset(&rx, 0, sizeof(rx));
+        int n = next_frame(enc[0], &rx, &hdr, buf);
+        ASSERT(n >= 0 && hdr.type == MUX_OPEN, "expected OPEN");
+        ASSERT(n == (int)req_len + 1 && (unsigned char)buf[0] == MUX_OPEN_NOPRIO &&
+               memcmp(buf + 1, req, req_len) == 0, "request should ride in OPEN");
+
+        /* A client waiting for the server to speak first still gets its OPEN */
+        int quiet = connect_loopback_wait(local_port);
+        ASSERT(quiet >= 0, "connect failed");
+        n = next_frame(enc[0], &rx, &hdr, buf);
+        ASSERT(n == 0 && hdr.type == MUX_OPEN, "silent stream should open bare");
+        close(quiet);
+        close(fd);
+        kill(cli, SIGTERM);
+        waitpid(cli, NULL, 0);
+        close(enc[0]);
+        close(enc[1]);
+
+        /* Server relay, with the test as the client end (fresh record
+         * sequence for the new tunnel) */
+        farm9crypt_cleanup();
+        farm9crypt_init_password_with_salt("MuxTest12345", 12, salt, 16);
+        int target_port;
+        int tfd = listen_loopback(&target_port);
+        ASSERT(tfd >= 0, "target listen failed");
+        ASSERT(make_socketpair(enc) == 0, "socketpair failed");
+        char tport[16];
+        snprintf(tport, sizeof(tport), "%d", target_port);
+        pid_t srv = fork();
+        ASSERT(srv >= 0, "fork failed");
+        if (srv == 0) {
+            close(enc[0]);
+            mux_relay_server(enc[1], "127.0.0.1", tport);
+            _exit(0);
+        }
+        close(enc[1]);
+
+        mux_rec_t tx;
+        memset(&tx, 0, sizeof(tx));
+        buf[0] = (char)MUX_OPEN_NOPRIO;
+        memcpy(buf + 1, req, req_len);
+        ASSERT(mux_pack_frame(enc[0], &tx, 1, MUX_OPEN, buf, req_len + 1) >= 0 &&
+               mux_pack_flush(enc[0], &tx) == 0, "OPEN send failed");
+
+        struct pollfd p = { tfd, POLLIN, 0 };
+        ASSERT(poll(&p, 1, 2000) == 1, "server did not connect");
+        int t = accept(tfd, NULL, NULL);
+        ASSERT(t >= 0, "accept failed");
+        char got[sizeof(req)];
+        ASSERT(read_within(t, got, (int)req_len, 2000) == (int)req_len &&
+               memcmp(got, req, req_len) == 0, "target should get the 0-RTT bytes");
+
+        memset(&rx, 0, sizeof(rx));
+        n = next_frame(enc[0], &rx, &hdr, buf);
+        ASSERT(n == 0 && hdr.type == MUX_OPEN_OK && hdr.stream_id == 1, "expected OPEN_OK");
+        write_all(t, "HTTP/1.1 200 OK\r\n", 17);
+        n = next_frame(enc[0], &rx, &hdr, buf);
+        ASSERT(n == 17 && hdr.type == MUX_DATA && hdr.stream_id == 1, "expected the reply");
+
+        close(t);
+        close(tfd);
+        close(enc[0]);
+        waitpid(srv, NULL, 0);
+        farm9crypt_cleanup();
+    } TEST_END;
+}
+
+/* Echo target that answers in upper case, to tell which tunnel a stream took */
+static void upper_echo_server(int lfd) {
+    signal(SIGCHLD, SIG_IGN);
+    for (;;) {
+        int c = accept(lfd, NULL, NULL);
+        if (c < 0) continue;
+        if (fork() == 0) {
+            close(lfd);
+            char buf[4096];
+            ssize_t r;
+            while ((r = read(c, buf, sizeof(buf))) > 0) {
+                for (ssize_t i = 0; i < r; i++)
+                    if (buf[i] >= 'a' && buf[i] <= 'z') buf[i] -= 32;
+                if (write_all(c, buf, (size_t)r) < 0) break;
+            }
+            _exit(0);
+        }
+        close(c);
+    }
+}
+
+/* Which tunnel answered: 0 plain echo, 1 upper case, -1 error */
+static int tunnel_of(int fd, int i) {
+    char msg[32], back[32];
+    int len = snprintf(msg, sizeof(msg), "stream-%d", i);
+    if (write_all(fd, msg, (size_t)len) < 0 ||
+        read_within(fd, back, len, 5000) != len)
+        return -1;
+    if (memcmp(msg, back, (size_t)len) == 0) return 0;
+    for (int k = 0; k < len; k++)
+        if (msg[k] >= 'a' && msg[k] <= 'z') msg[k] -= 32;
+    return memcmp(msg, back, (size_t)len) == 0 ? 1 : -1;
+}
+
+#define STRIPE_STREAMS 200
+
+void test_mux_striped_tunnels(void) {
+    TEST_BEGIN("mux: streams spread over two tunnels sharing a listener") {
+        signal(SIGPIPE, SIG_IGN);
+        int targets[2];
+        pid_t echo[2];
+        for (int t = 0; t < 2; t++) {
+            int lfd = listen_loopback(&targets[t]);
+            ASSERT(lfd >= 0, "target listen failed");
+            echo[t] = fork();
+            ASSERT(echo[t] >= 0, "fork failed");
+            if (echo[t] == 0) {
+                if (t == 0) echo_serve_forking(lfd);
+                else upper_echo_server(lfd);
+            }
+            close(lfd);
+        }
+
+        pid_t srv[2], cli[2];
+        int local_port = tunnels_start(targets, 2, srv, cli);
+        ASSERT(local_port > 0, "tunnel start failed");
+
+        static int fds[STRIPE_STREAMS];
+        int count[2] = { 0, 0 }, ok = 1;
+        for (int i = 0; i < STRIPE_STREAMS; i++)
+            fds[i] = connect_loopback_wait(local_port);
+        for (int i = 0; i < STRIPE_STREAMS; i++) {
+            int t = fds[i] < 0 ? -1 : tunnel_of(fds[i], i);
+            if (t < 0) ok = 0;
+            else count[t]++;
+        }
+        for (int i = 0; i < STRIPE_STREAMS; i++)
+            if (fds[i] >= 0) close(fds[i]);
+
+        /* One tunnel gone: new streams keep working on the other */
+        kill(cli[1], SIGTERM);
+        waitpid(cli[1], NULL, 0);
+        waitpid(srv[1], NULL, 0);
+        for (int i = 0; i < 20 && ok; i++) {
+            int fd = connect_loopback_wait(local_port);
+            if (fd < 0 || tunnel_of(fd, i) != 0) ok = 0;
+            if (fd >= 0) close(fd);
+        }
+
+        tunnel_stop(srv[0], cli[0]);
+        for (int t = 0; t < 2; t++) {
+            kill(echo[t], SIGTERM);
+            waitpid(echo[t], NULL, 0);
+        }
+        ASSERT(ok, "stream failed");
+        ASSERT(count[0] >= STRIPE_STREAMS / 5 && count[1] >= STRIPE_STREAMS / 5,
+               "streams should be spread over both tunnels");
+    } TEST_END;
+}
@@ -0,0 +1,189 @@
+/*
+ * test_net.c — Happy Eyeballs connect tests
+ *
+ * The blackhole tests run in a private network namespace where 2001:db8::/32
+ * routes into a tun device nobody reads: SYNs sent there vanish, as on a
+ * broken IPv6 path. They are skipped when namespaces are not available.
+ */
+#define _GNU_SOURCE   /* unshare */
+#include "test.h"
+#include "net.h"
+#include "mux.h"
+#include "dns.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SKIP_EXIT 77
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Numeric host:port lists, chained in order */
+static struct addrinfo *addrs(const char **hosts, int n, const char *port) {
+    struct addrinfo hints, *head = NULL, **tail = &head;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    for (int i = 0; i < n; i++) {
+        struct addrinfo *res;
+        if (getaddrinfo(hosts[i], port, &hints, &res) != 0) continue;
+        *tail = res;
+        while (*tail) tail = &(*tail)->ai_next;
+    }
+    return head;
+}
+
+/* This process into a fresh namespace with a silent route for 2001:db8::/32.
+ * Returns 0, or -1 if that is not possible here. */
+static int enter_blackhole_netns(void) {
+    if (unshare(CLONE_NEWNET) < 0) return -1;
+    return system("{ ip link set lo up && ip tuntap add mode tun name he0 && "
+                  "ip link set he0 up && ip -6 route add 2001:db8::/32 dev he0; }"
+                  " >/dev/null 2>&1") == 0 ? 0 : -1;
+}
+
+void test_net_race_order(void) {
+    TEST_BEGIN("happy eyeballs: address families interleaved") {
+        const char *hosts[] = { "2001:db8::1", "2001:db8::2", "2001:db8::3",
+                                "192.0.2.1", "192.0.2.2" };
+        struct addrinfo *res = addrs(hosts, 5, "80");
+        net_race_t r;
+        net_race_init(&r, res, 1000);
+        static const int want[] = { AF_INET6, AF_INET, AF_INET6, AF_INET, AF_INET6 };
+        int ok = r.naddr == 5;
+        for (int i = 0; ok && i < 5; i++)
+            if (r.addr[i]->ai_family != want[i]) ok = 0;
+        freeaddrinfo(res);
+        ASSERT(ok, "expected v6, v4, v6, v4, v6");
+    } TEST_END;
+}
+
+/* In the namespace: 0 on success, else the number of the check that failed */
+static int blackhole_connects(void) {
+    if (enter_blackhole_netns() < 0) return SKIP_EXIT;
+    int port;
+    int lfd = listen_loopback(&port);
+    if (lfd < 0) return 1;
+    char pstr[16];
+    snprintf(pstr, sizeof(pstr), "%d", port);
+
+    /* Two dead IPv6 addresses first: the IPv4 one still starts second */
+    const char *hosts[] = { "2001:db8::1", "2001:db8::2", "127.0.0.1" };
+    struct addrinfo *res = addrs(hosts, 3, pstr);
+    long long t0 = now_ms();
+    int fd = net_connect_addrs(res, 5);
+    long long took = now_ms() - t0;
+    freeaddrinfo(res);
+    if (fd < 0) return 2;
+    if (took < NET_RACE_DELAY_MS - 50 || took > 1000) return 3;
+    if (fcntl(fd, F_GETFL, 0) & O_NONBLOCK) return 4;
+    close(fd);
+
+    /* Nothing but the dead path: one timeout, not one per address */
+    const char *dead[] = { "2001:db8::1", "2001:db8::2" };
+    res = addrs(dead, 2, pstr);
+    t0 = now_ms();
+    fd = net_connect_addrs(res, 1);
+    took = now_ms() - t0;
+    freeaddrinfo(res);
+    if (fd >= 0 || errno != ETIMEDOUT) return 5;
+    if (took > 1000 + NET_RACE_DELAY_MS + 300) return 6;
+    return 0;
+}
+
+void test_net_happy_eyeballs_blackhole(void) {
+    TEST_BEGIN("happy eyeballs: dead IPv6 route costs 250 ms, not a timeout") {
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) _exit(blackhole_connects());
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status), "child died");
+        if (WEXITSTATUS(status) == SKIP_EXIT) TEST_SKIP("no network namespaces");
+        ASSERT(WEXITSTATUS(status) != 2, "IPv4 fallback did not connect");
+        ASSERT(WEXITSTATUS(status) != 3, "IPv4 did not start one attempt delay in");
+        ASSERT(WEXITSTATUS(status) != 4, "socket should be blocking again");
+        ASSERT(WEXITSTATUS(status) != 5, "dead path should time out");
+        ASSERT(WEXITSTATUS(status) != 6, "dead addresses should time out together");
+        ASSERT_EQ(WEXITSTATUS(status), 0, "setup failed");
+    } TEST_END;
+}
+
+/* dual.test: a dead IPv6 address ahead of loopback */
+static int dual_getaddrinfo(const char *host, const char *port,
+                            const struct addrinfo *hints, struct addrinfo **res) {
+    if (strcmp(host, "dual.test") != 0) return getaddrinfo(host, port, hints, res);
+    const char *hosts[] = { "2001:db8::1", "127.0.0.1" };
+    *res = addrs(hosts, 2, port);
+    return *res ? 0 : EAI_NONAME;
+}
+
+static int mux_blackhole_open(void) {
+    if (enter_blackhole_netns() < 0) return SKIP_EXIT;
+    int port;
+    int tfd = listen_loopback(&port);
+    if (tfd < 0) return 1;
+    char pstr[16];
+    snprintf(pstr, sizeof(pstr), "%d", port);
+
+    int enc[2];
+    if (make_socketpair(enc) < 0) return 1;
+    unsigned char salt[16];
+    farm9crypt_generate_salt(salt, sizeof(salt));
+    farm9crypt_init_password_with_salt("RaceTest1234", 12, salt, 16);
+    g_dns_getaddrinfo = dual_getaddrinfo;
+    pid_t srv = fork();
+    if (srv == 0) {
+        close(enc[0]);
+        mux_relay_server(enc[1], "dual.test", pstr);
+        _exit(0);
+    }
+    close(enc[1]);
+
+    static char buf[MUX_MAX_PAYLOAD];
+    mux_rec_t tx, rx;
+    mux_header_t hdr;
+    memset(&tx, 0, sizeof(tx));
+    memset(&rx, 0, sizeof(rx));
+    long long t0 = now_ms();
+    if (mux_pack_frame(enc[0], &tx, 1, MUX_OPEN, NULL, 0) < 0 ||
+        mux_pack_flush(enc[0], &tx) < 0)
+        return 1;
+    struct pollfd p = { enc[0], POLLIN, 0 };
+    int rc = 2;
+    if (poll(&p, 1, 3000) == 1 &&
+        mux_unpack_frame(enc[0], &rx, &hdr, buf, sizeof(buf)) == 0 &&
+        hdr.type == MUX_OPEN_OK)
+        rc = now_ms() - t0 < 1000 ? 0 : 3;
+    close(enc[0]);
+    waitpid(srv, NULL, 0);
+    close(tfd);
+    return rc;
+}
+
+void test_net_happy_eyeballs_mux(void) {
+    TEST_BEGIN("happy eyeballs: mux target behind a dead IPv6 route") {
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) _exit(mux_blackhole_open());
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status), "child died");
+        if (WEXITSTATUS(status) == SKIP_EXIT) TEST_SKIP("no network namespaces");
+        ASSERT(WEXITSTATUS(status) != 2, "no OPEN_OK");
+        ASSERT(WEXITSTATUS(status) != 3, "OPEN_OK waited for the IPv6 timeout");
+        ASSERT_EQ(WEXITSTATUS(status), 0, "setup failed");
+    } TEST_END;
+}
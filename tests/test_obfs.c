@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/select.h>
 
 #include "test.h"
 #include "obfs.h"
@@ -143,3 +144,109 @@ void test_obfs_http_large_payload(void) {
     obfs_set_mode(OBFS_NONE);
     TEST_END;
 }
+
+/* ---- HTTP streaming (chunked) ---- */
+
+void test_obfs_http_stream_rotation(void) {
+    TEST_BEGIN("obfs HTTP stream survives request rotation");
+
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+
+    /* More frames than the largest rotation window (64 + 127) */
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+
+    if (pid == 0) {
+        close(sv[0]);
+        obfs_set_mode(OBFS_HTTP_STREAM);
+        for (int i = 0; i < 400; i++) {
+            char msg[32];
+            int mlen = snprintf(msg, sizeof(msg), "chunk-%d", i);
+            if (obfs_send(sv[1], msg, (size_t)mlen) != mlen) _exit(1);
+        }
+        close(sv[1]);
+        _exit(0);
+    }
+
+    /* Receiver in plain HTTP mode: chunked bodies are auto-detected */
+    close(sv[1]);
+    obfs_set_mode(OBFS_HTTP);
+    for (int i = 0; i < 400; i++) {
+        char want[32], buf[64];
+        int wlen = snprintf(want, sizeof(want), "chunk-%d", i);
+        int got = obfs_recv(sv[0], buf, sizeof(buf));
+        ASSERT_EQ(got, wlen, "wrong chunk length");
+        ASSERT(memcmp(buf, want, (size_t)wlen) == 0, "chunk mismatch");
+    }
+    close(sv[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child failed");
+
+    obfs_set_mode(OBFS_NONE);
+    TEST_END;
+}
+
+void test_obfs_http_stream_wire_format(void) {
+    TEST_BEGIN("obfs HTTP stream sends one chunked POST");
+
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+
+    obfs_set_mode(OBFS_HTTP_STREAM);
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(obfs_send(sv[0], "0123456789abcdef", 16), 16, "send failed");
+    obfs_set_mode(OBFS_NONE);
+    shutdown(sv[0], SHUT_WR);
+
+    char wire[4096];
+    size_t wlen = 0;
+    ssize_t n;
+    while ((n = read(sv[1], wire + wlen, sizeof(wire) - 1 - wlen)) > 0)
+        wlen += (size_t)n;
+    wire[wlen] = '\0';
+
+    int posts = 0;
+    for (const char *p = wire; (p = strstr(p, "POST ")) != NULL; p++) posts++;
+    ASSERT_EQ(posts, 1, "expected a single request header");
+    ASSERT(strstr(wire, "Transfer-Encoding: chunked\r\n") != NULL, "not chunked");
+    ASSERT(strstr(wire, "\r\n10\r\n0123456789abcdef\r\n") != NULL, "chunk framing");
+    /* Per-frame overhead is the chunk line + CRLF, not a full header */
+    ASSERT(wlen < 200 + 10 * (16 + 6), "header bytes per frame too high");
+
+    close(sv[0]);
+    close(sv[1]);
+    TEST_END;
+}
+
+void test_obfs_http_no_overread(void) {
+    TEST_BEGIN("obfs HTTP reader leaves next frame on socket");
+
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+
+    /* Two frames land in the socket buffer back to back */
+    obfs_set_mode(OBFS_HTTP);
+    ASSERT_EQ(obfs_send(sv[0], "first", 5), 5, "send 1 failed");
+    ASSERT_EQ(obfs_send(sv[0], "second", 6), 6, "send 2 failed");
+
+    char buf[64];
+    ASSERT_EQ(obfs_recv(sv[1], buf, sizeof(buf)), 5, "recv 1 length");
+
+    /* A buffered reader that slurped frame 2 would leave select() asleep */
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(sv[1], &rfds);
+    struct timeval tv = { 0, 100000 };
+    ASSERT_EQ(select(sv[1] + 1, &rfds, NULL, NULL, &tv), 1, "frame 2 not readable");
+
+    ASSERT_EQ(obfs_recv(sv[1], buf, sizeof(buf)), 6, "recv 2 length");
+    ASSERT(memcmp(buf, "second", 6) == 0, "frame 2 mismatch");
+
+    obfs_set_mode(OBFS_NONE);
+    close(sv[0]);
+    close(sv[1]);
+    TEST_END;
+}
@@ -0,0 +1,147 @@
+/*
+ * test_prefork.c — Pre-forked -K worker tests (--prefork)
+ *
+ * prefork_run serves a loopback port from a child; each worker answers
+ * with its pid and whether it was warmed before the connection came.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "test.h"
+#include "prefork.h"
+#include "net.h"
+#include "util.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int s_warmed = 0;
+
+static void warm(void *ctx) {
+    (void)ctx;
+    s_warmed = 1;
+}
+
+/* "<w><pid>\n", then hold the connection until the client closes it */
+static void serve(int fd, void *ctx) {
+    (void)ctx;
+    char line[32];
+    int n = snprintf(line, sizeof(line), "%d%d\n", s_warmed, (int)getpid());
+    write_all(fd, line, (size_t)n);
+    char c;
+    while (read(fd, &c, 1) > 0);
+    close(fd);
+}
+
+static pid_t start_prefork(int n, int reuse, int *port) {
+    /* An ephemeral port, then the workers' group on it */
+    int probe = net_listen_reuseport("0");
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    getsockname(probe, (struct sockaddr *)&ss, &slen);
+    *port = ntohs(ss.ss_family == AF_INET6 ?
+                  ((struct sockaddr_in6 *)&ss)->sin6_port :
+                  ((struct sockaddr_in *)&ss)->sin_port);
+    char pstr[16];
+    snprintf(pstr, sizeof(pstr), "%d", *port);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fds[PREFORK_MAX];
+        prefork_listen(pstr, 16, fds, n);
+        close(probe);
+        prefork_ops_t ops = { NULL, warm, serve, NULL, reuse };
+        prefork_run(fds, n, &ops);
+        _exit(0);
+    }
+    close(probe);
+    usleep(200000);   /* workers up */
+    return pid;
+}
+
+/* The worker's answer: its pid, or -1 (or -2 if it was not warmed) */
+static int answer(int fd) {
+    char line[32];
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 2000) != 1) return -1;
+    ssize_t r = read(fd, line, sizeof(line) - 1);
+    if (r < 2) return -1;
+    line[r] = '\0';
+    if (line[0] != '1') return -2;
+    return atoi(line + 1);
+}
+
+void test_prefork_one_process_per_session(void) {
+    TEST_BEGIN("prefork: warmed worker per connection, busy ones hold no one up") {
+        int port;
+        pid_t pid = start_prefork(1, 0, &port);
+        ASSERT(pid > 0, "fork failed");
+
+        /* The only listener's worker stays busy with the first client ... */
+        int first = connect_loopback(port);
+        int p0 = answer(first);
+        ASSERT(p0 != -2, "worker served before it was warmed");
+        ASSERT(p0 > 0, "first connection not served");
+
+        /* ... and the next ones still get fresh workers at once */
+        int pids[8], ok = 1;
+        for (int i = 0; i < 8 && ok; i++) {
+            int c = connect_loopback(port);
+            pids[i] = answer(c);
+            close(c);
+            if (pids[i] <= 0 || pids[i] == p0) ok = 0;
+            for (int j = 0; j < i; j++)
+                if (pids[j] == pids[i]) ok = 0;
+        }
+        close(first);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        ASSERT(ok, "a connection waited or shared a worker");
+    } TEST_END;
+}
+
+void test_prefork_reuseport_group(void) {
+    TEST_BEGIN("prefork: 4 listeners on one port all serve") {
+        int port;
+        pid_t pid = start_prefork(4, 0, &port);
+        ASSERT(pid > 0, "fork failed");
+        int served = 0;
+        for (int i = 0; i < 32; i++) {
+            int c = connect_loopback(port);
+            if (answer(c) > 0) served++;
+            close(c);
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        ASSERT_EQ(served, 32, "connections lost");
+    } TEST_END;
+}
+
+void test_prefork_reuse(void) {
+    TEST_BEGIN("prefork: reused workers take one connection after another") {
+        int port;
+        pid_t pid = start_prefork(1, 1, &port);
+        ASSERT(pid > 0, "fork failed");
+
+        /* One client at a time: the first worker comes back and the
+         * spare forked while it was busy waits next to it, so the same
+         * few processes serve them all */
+        int pids[16], distinct = 0, ok = 1;
+        for (int i = 0; i < 16 && ok; i++) {
+            int c = connect_loopback(port);
+            pids[i] = answer(c);
+            close(c);
+            if (pids[i] <= 0) ok = 0;
+            int seen = 0;
+            for (int j = 0; j < i; j++)
+                if (pids[j] == pids[i]) seen = 1;
+            if (!seen) distinct++;
+            usleep(50000);   /* the worker reports back */
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        ASSERT(ok, "a connection was not served");
+        ASSERT(distinct <= PREFORK_SPARE, "a worker was not reused");
+    } TEST_END;
+}
@@ -1,5 +1,8 @@
 /*
  * test_reverse.c — Reverse tunnel and persistent connection tests
+ *
+ * The reverse tunnel tests run both ends over an encrypted socketpair:
+ * 200 connections open through it at once, and a warm target pool.
  */
 #ifdef __APPLE__
 #define _DARWIN_C_SOURCE
@@ -8,9 +11,17 @@
 #include "test.h"
 #include "reverse.h"
 #include "persistent.h"
+#include "farm9crypt.h"
+#include "mux.h"
+#include "util.h"
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 /*
  * Test: Persistent backoff starts at 1 second
@@ -66,24 +77,6 @@ void test_persist_heartbeat_detect(void) {
     } TEST_END;
 }
 
-/*
- * Test: Reverse tunnel signal format
- */
-void test_reverse_signal_format(void) {
-    TEST_BEGIN("reverse tunnel signal wire format") {
-        /* Verify signal strings are properly terminated with \n */
-        const char *open_sig = "ROPEN\n";
-        const char *ok_sig = "ROK\n";
-        const char *fail_sig = "RFAIL\n";
-
-        ASSERT_EQ((int)strlen(open_sig), 6, "ROPEN length");
-        ASSERT_EQ((int)strlen(ok_sig), 4, "ROK length");
-        ASSERT_EQ((int)strlen(fail_sig), 6, "RFAIL length");
-        ASSERT(open_sig[5] == '\n', "ROPEN ends with newline");
-        ASSERT(ok_sig[3] == '\n', "ROK ends with newline");
-    } TEST_END;
-}
-
 /*
  * Test: Persistent backoff jitter produces variation
  */
@@ -113,22 +106,204 @@ void test_persist_heartbeat_ignores_data(void) {
     } TEST_END;
 }
 
+/* ── Live reverse tunnel: reverse_server <-> encrypted socketpair <-> reverse_client ── */
+
+#define REVERSE_CLIENTS 200
+
+static int read_n(int fd, void *buf, size_t n, int timeout_ms) {
+    size_t got = 0;
+    while (got < n) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, timeout_ms) != 1) return -1;
+        ssize_t r = read(fd, (char *)buf + got, n - got);
+        if (r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+/* reverse_server and reverse_client in two children over an encrypted
+ * socketpair, the client forwarding to target_port. Returns the reverse
+ * listener's port, or -1. */
+static int reverse_tunnel(int target_port, pid_t *srv, pid_t *cli) {
+    int rev_port;
+    int tmp = listen_loopback(&rev_port);
+    if (tmp < 0) return -1;
+    close(tmp);
+    char rport[16], tport[16];
+    snprintf(rport, sizeof(rport), "%d", rev_port);
+    snprintf(tport, sizeof(tport), "%d", target_port);
+
+    int enc[2];
+    if (make_socketpair(enc) != 0) return -1;
+    unsigned char salt[16];
+    farm9crypt_generate_salt(salt, sizeof(salt));
+    farm9crypt_init_password_with_salt("ReverseTest1", 12, salt, 16);
+    *srv = fork();
+    if (*srv == 0) {
+        close(enc[1]);
+        reverse_server(enc[0], rport);
+        _exit(0);
+    }
+    *cli = fork();
+    if (*cli == 0) {
+        close(enc[0]);
+        reverse_client(enc[1], "127.0.0.1", tport);
+        _exit(0);
+    }
+    close(enc[0]);
+    close(enc[1]);
+    farm9crypt_cleanup();
+    return rev_port;
+}
+
 /*
- * Test: Reverse tunnel signals are distinct (no overlap)
+ * Test: 200 clients connected through -R at once, every one echoed while
+ * all the others stay open
  */
-void test_reverse_signals_distinct(void) {
-    TEST_BEGIN("reverse tunnel signals are distinct") {
-        const char *open_sig = "ROPEN\n";
-        const char *ok_sig = "ROK\n";
-        const char *fail_sig = "RFAIL\n";
-        const char *hb = "HB\n";
-
-        /* No signal is a prefix of another */
-        ASSERT(strncmp(open_sig, ok_sig, strlen(ok_sig)) != 0, "ROPEN != ROK prefix");
-        ASSERT(strncmp(open_sig, fail_sig, strlen(fail_sig)) != 0, "ROPEN != RFAIL prefix");
-        ASSERT(strncmp(ok_sig, fail_sig, strlen(fail_sig)) != 0, "ROK != RFAIL prefix");
-        /* Heartbeat is distinct from all reverse signals */
-        ASSERT(strncmp(hb, open_sig, strlen(hb)) != 0, "HB != ROPEN prefix");
-        ASSERT(strncmp(hb, ok_sig, strlen(hb)) != 0, "HB != ROK prefix");
+void test_reverse_concurrent_clients(void) {
+    TEST_BEGIN("reverse tunnel: 200 simultaneous clients") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port;
+        int efd = listen_loopback(&echo_port);
+        ASSERT(efd >= 0, "target listen failed");
+        pid_t echo = fork();
+        if (echo == 0) echo_serve(efd);
+        close(efd);
+
+        pid_t srv, cli;
+        int rev_port = reverse_tunnel(echo_port, &srv, &cli);
+        ASSERT(rev_port > 0, "tunnel setup failed");
+
+        static int fds[REVERSE_CLIENTS];
+        int ok = 1;
+        for (int i = 0; i < REVERSE_CLIENTS && ok; i++) {
+            char msg[32];
+            int len = snprintf(msg, sizeof(msg), "rev-%d", i);
+            fds[i] = connect_loopback_wait(rev_port);
+            if (fds[i] < 0 || write_all(fds[i], msg, (size_t)len) < 0) ok = 0;
+        }
+        ASSERT(ok, "reverse connects failed");
+
+        /* Answered in reverse order: none may wait for an earlier one */
+        for (int i = REVERSE_CLIENTS - 1; i >= 0 && ok; i--) {
+            char msg[32], back[32];
+            int len = snprintf(msg, sizeof(msg), "rev-%d", i);
+            if (read_n(fds[i], back, (size_t)len, 5000) < 0 ||
+                memcmp(msg, back, (size_t)len) != 0)
+                ok = 0;
+        }
+        ASSERT(ok, "echo through the reverse tunnel failed");
+
+        /* A second round on the same connections */
+        for (int i = 0; i < REVERSE_CLIENTS && ok; i++) {
+            char back[4];
+            if (write_all(fds[i], "more", 4) < 0 || read_n(fds[i], back, 4, 5000) < 0 ||
+                memcmp(back, "more", 4) != 0)
+                ok = 0;
+        }
+        ASSERT(ok, "second round failed");
+
+        for (int i = 0; i < REVERSE_CLIENTS; i++)
+            if (fds[i] >= 0) close(fds[i]);
+        kill(srv, SIGTERM);
+        waitpid(srv, NULL, 0);
+        int status;
+        waitpid(cli, &status, 0);
+        ASSERT(WIFEXITED(status), "reverse client should end with the tunnel");
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+    } TEST_END;
+}
+
+/*
+ * Test: a target that refuses closes only the connection that asked for it
+ */
+void test_reverse_target_refused(void) {
+    TEST_BEGIN("reverse tunnel: refused target closes that client only") {
+        signal(SIGPIPE, SIG_IGN);
+        int dead_port;
+        int dfd = listen_loopback(&dead_port);
+        ASSERT(dfd >= 0, "listen failed");
+        close(dfd);   /* nothing listens there any more */
+
+        pid_t srv, cli;
+        int rev_port = reverse_tunnel(dead_port, &srv, &cli);
+        ASSERT(rev_port > 0, "tunnel setup failed");
+
+        for (int i = 0; i < 3; i++) {
+            int fd = connect_loopback_wait(rev_port);
+            ASSERT(fd >= 0, "reverse connect failed");
+            char c;
+            struct pollfd p = { fd, POLLIN, 0 };
+            ASSERT(poll(&p, 1, 3000) == 1 && read(fd, &c, 1) <= 0,
+                   "refused target did not close the connection");
+            close(fd);
+        }
+
+        kill(srv, SIGTERM);
+        waitpid(srv, NULL, 0);
+        waitpid(cli, NULL, 0);
+    } TEST_END;
+}
+
+/* Accept one connection on lfd within timeout_ms, or -1 */
+static int accept_within(int lfd, int timeout_ms) {
+    struct pollfd p = { lfd, POLLIN, 0 };
+    if (poll(&p, 1, timeout_ms) != 1) return -1;
+    return accept(lfd, NULL, NULL);
+}
+
+/*
+ * Test: --target-pool connects ahead of any client, replaces what the
+ * target closes, and hands a client a live pooled connection
+ */
+void test_reverse_target_pool(void) {
+    TEST_BEGIN("reverse tunnel: warm target pool") {
+        signal(SIGPIPE, SIG_IGN);
+        int target_port;
+        int lfd = listen_loopback(&target_port);
+        ASSERT(lfd >= 0, "target listen failed");
+
+        g_mux_pool = 2;   /* the client child inherits it */
+        pid_t srv, cli;
+        int rev_port = reverse_tunnel(target_port, &srv, &cli);
+        g_mux_pool = 0;
+        ASSERT(rev_port > 0, "tunnel setup failed");
+
+        /* Two connections before anyone uses the tunnel */
+        int t[4];
+        t[0] = accept_within(lfd, 3000);
+        t[1] = accept_within(lfd, 3000);
+        ASSERT(t[0] >= 0 && t[1] >= 0, "pool not filled ahead of time");
+
+        /* The target drops one: it is replaced */
+        close(t[0]);
+        t[0] = accept_within(lfd, 3000);
+        ASSERT(t[0] >= 0, "closed pooled connection not replaced");
+        usleep(100 * 1000);
+
+        /* A client rides a pooled connection, and that one is replaced */
+        int c = connect_loopback_wait(rev_port);
+        ASSERT(c >= 0 && write_all(c, "ping", 4) == 0, "reverse connect failed");
+        struct pollfd p[2] = { { t[0], POLLIN, 0 }, { t[1], POLLIN, 0 } };
+        ASSERT(poll(p, 2, 3000) >= 1, "client data not on a pooled connection");
+        int used = (p[0].revents & POLLIN) ? t[0] : t[1];
+        char buf[4];
+        ASSERT(read_n(used, buf, 4, 1000) == 0 && memcmp(buf, "ping", 4) == 0,
+               "client data wrong");
+        ASSERT(write_all(used, "pong", 4) == 0 && read_n(c, buf, 4, 3000) == 0 &&
+               memcmp(buf, "pong", 4) == 0, "reply not relayed");
+        t[2] = accept_within(lfd, 3000);
+        ASSERT(t[2] >= 0, "used connection not replaced");
+        t[3] = accept_within(lfd, 300);
+        ASSERT(t[3] < 0, "pool grew past its size");
+
+        close(c);
+        for (int i = 0; i < 3; i++) close(t[i]);
+        kill(srv, SIGTERM);
+        waitpid(srv, NULL, 0);
+        waitpid(cli, NULL, 0);
+        close(lfd);
     } TEST_END;
 }
@@ -1,8 +1,9 @@
 /*
  * test_socks5.c — SOCKS5 proxy protocol tests
  *
- * Unit tests for the SOCKS5 tunnel wire format and protocol.
- * Integration tests (actual tunnel) are done manually.
+ * Unit tests for the SOCKS5 tunnel wire format and protocol, and
+ * concurrent CONNECTs (and a slow name lookup) and UDP ASSOCIATE through
+ * a live tunnel.
  */
 #ifdef __APPLE__
 #define _DARWIN_C_SOURCE
@@ -10,12 +11,19 @@
 #define _POSIX_C_SOURCE 200809L
 #include "test.h"
 #include "socks5.h"
+#include "farm9crypt.h"
+#include "util.h"
+#include "dns.h"
+#include "mux.h"
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <netdb.h>
+#include <time.h>
 
 /*
  * Test: SOCKS5 tunnel wire format encoding/decoding
@@ -158,7 +166,7 @@ void test_socks5_client_binds(void) {
         char port_str[8];
         snprintf(port_str, sizeof(port_str), "%d", port);
 
-        /* Fork: child runs socks5_client (will block on accept) */
+        /* Fork: child runs socks5_client (its relay loop) */
         pid_t pid = fork();
         if (pid == 0) {
             close(fds[1]);
@@ -176,7 +184,7 @@ void test_socks5_client_binds(void) {
         int rc = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
         ASSERT(rc == 0, "should connect to socks5 listener");
 
-        /* Send SOCKS5 greeting to unblock the child's handle_socks_client */
+        /* The client answers the greeting itself, before any tunnel traffic */
         unsigned char hello[] = {0x05, 0x01, 0x00};
         write(sock, hello, 3);
 
@@ -187,9 +195,480 @@ void test_socks5_client_binds(void) {
         ASSERT_EQ(resp[1], 0x00, "no-auth method");
 
         close(sock);
-        /* Close tunnel fd to make child's handle_socks_client fail and exit accept loop */
+        /* Closing the tunnel ends the client's relay loop */
         close(fds[1]);
         kill(pid, SIGTERM);
         waitpid(pid, NULL, 0);
     } TEST_END;
 }
+
+/*
+ * Test: greeting and CONNECT parsing, whole and in pieces
+ */
+void test_socks5_parse_requests(void) {
+    TEST_BEGIN("socks5 greeting and CONNECT parsing") {
+        const unsigned char hello[] = {0x05, 0x02, 0x02, 0x00};
+        ASSERT_EQ(socks5_parse_greeting(hello, 1), 0, "greeting incomplete");
+        ASSERT_EQ(socks5_parse_greeting(hello, 3), 0, "methods incomplete");
+        ASSERT_EQ(socks5_parse_greeting(hello, 4), 4, "greeting length");
+        const unsigned char auth_only[] = {0x05, 0x01, 0x02};
+        ASSERT_EQ(socks5_parse_greeting(auth_only, 3), -1, "no-auth not offered");
+        const unsigned char socks4[] = {0x04, 0x01};
+        ASSERT_EQ(socks5_parse_greeting(socks4, 2), -1, "not SOCKS5");
+
+        unsigned char target[SOCKS5_TARGET_MAX], rep;
+        size_t tlen;
+        unsigned char cmd = 0;
+        char host[256], port[6];
+        const unsigned char v4[] = {0x05, 0x01, 0x00, 0x01, 10, 0, 0, 7, 0x01, 0xBB, 'G'};
+        ASSERT_EQ(socks5_parse_request(v4, 9, &cmd, target, &tlen, &rep), 0, "v4 incomplete");
+        ASSERT_EQ(socks5_parse_request(v4, sizeof(v4), &cmd, target, &tlen, &rep), 10, "v4 length");
+        ASSERT_EQ(cmd, SOCKS5_CMD_CONNECT, "CONNECT command");
+        ASSERT_EQ(socks5_parse_target(target, tlen, host, port), (int)tlen, "v4 target");
+        ASSERT_STR_EQ(host, "10.0.0.7", "v4 host");
+        ASSERT_STR_EQ(port, "443", "v4 port");
+
+        const unsigned char name[] = {0x05, 0x01, 0x00, 0x03, 7, 'e','x','a','m','p','l','e', 0x00, 0x50};
+        ASSERT_EQ(socks5_parse_request(name, 5, &cmd, target, &tlen, &rep), 0, "name incomplete");
+        ASSERT_EQ(socks5_parse_request(name, sizeof(name), &cmd, target, &tlen, &rep), 14, "name length");
+        ASSERT_EQ(socks5_parse_target(target, tlen, host, port), 10, "name target");
+        ASSERT_STR_EQ(host, "example", "domain host");
+        ASSERT_STR_EQ(port, "80", "domain port");
+
+        unsigned char v6[22] = {0x05, 0x01, 0x00, 0x04};
+        v6[19] = 1;              /* ::1 */
+        v6[20] = 0x1F; v6[21] = 0x90;
+        ASSERT_EQ(socks5_parse_request(v6, sizeof(v6), &cmd, target, &tlen, &rep), 22, "v6 length");
+        socks5_parse_target(target, tlen, host, port);
+        ASSERT_STR_EQ(host, "::1", "v6 host");
+        ASSERT_STR_EQ(port, "8080", "v6 port");
+
+        const unsigned char udp_req[] = {0x05, 0x03, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+        ASSERT_EQ(socks5_parse_request(udp_req, sizeof(udp_req), &cmd, target, &tlen, &rep), 10,
+                  "UDP ASSOCIATE length");
+        ASSERT_EQ(cmd, SOCKS5_CMD_UDP, "UDP ASSOCIATE command");
+
+        const unsigned char bind_req[] = {0x05, 0x02, 0x00, 0x01, 1, 2, 3, 4, 0, 80};
+        ASSERT_EQ(socks5_parse_request(bind_req, sizeof(bind_req), &cmd, target, &tlen, &rep), -1,
+                  "BIND refused");
+        ASSERT_EQ(rep, SOCKS5_REP_CMD, "command not supported");
+        const unsigned char bad_atyp[] = {0x05, 0x01, 0x00, 0x09};
+        ASSERT_EQ(socks5_parse_request(bad_atyp, sizeof(bad_atyp), &cmd, target, &tlen, &rep), -1,
+                  "unknown address type");
+        ASSERT_EQ(rep, SOCKS5_REP_ATYP, "address type not supported");
+    } TEST_END;
+}
+
+/*
+ * Test: SOCKS5 UDP headers to tunnel targets and back, bound address replies
+ */
+void test_socks5_udp_headers(void) {
+    TEST_BEGIN("socks5 UDP header parsing and building") {
+        unsigned char target[SOCKS5_TARGET_MAX], hdr[SOCKS5_UDP_HDR_MAX];
+        size_t tlen;
+        char host[256], port[6];
+        const unsigned char dg[] = {0, 0, 0, 0x01, 192, 0, 2, 1, 0x00, 0x35, 'q'};
+        ASSERT_EQ(socks5_parse_udp(dg, sizeof(dg), target, &tlen), 10, "header length");
+        socks5_parse_target(target, tlen, host, port);
+        ASSERT_STR_EQ(host, "192.0.2.1", "destination host");
+        ASSERT_STR_EQ(port, "53", "destination port");
+        ASSERT_EQ(socks5_parse_udp(dg, 9, target, &tlen), -1, "short header");
+        const unsigned char frag[] = {0, 0, 1, 0x01, 192, 0, 2, 1, 0x00, 0x35};
+        ASSERT_EQ(socks5_parse_udp(frag, sizeof(frag), target, &tlen), -1, "fragment dropped");
+
+        /* Answers: literals keep their type, names go as names */
+        ASSERT_EQ(socks5_udp_header(hdr, "192.0.2.1", "53"), 10, "v4 header length");
+        ASSERT(memcmp(hdr, dg, 10) == 0, "v4 header bytes");
+        ASSERT_EQ(socks5_udp_header(hdr, "2001:db8::1", "443"), 22, "v6 header length");
+        ASSERT_EQ(hdr[3], 0x04, "v6 address type");
+        ASSERT_EQ(socks5_udp_header(hdr, "dns.test", "53"), 15, "name header length");
+        ASSERT_EQ(socks5_parse_udp(hdr, 15, target, &tlen), 15, "name header parses");
+        socks5_parse_target(target, tlen, host, port);
+        ASSERT_STR_EQ(host, "dns.test", "name roundtrip");
+
+        struct sockaddr_in6 sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin6_family = AF_INET6;
+        inet_pton(AF_INET6, "::ffff:127.0.0.1", &sa.sin6_addr);
+        sa.sin6_port = htons(1080);
+        unsigned char rep[SOCKS5_REPLY_MAX];
+        ASSERT_EQ(socks5_reply_addr(rep, SOCKS5_REP_OK, (struct sockaddr *)&sa), 10,
+                  "mapped address replied as IPv4");
+        ASSERT(rep[3] == 0x01 && rep[4] == 127 && rep[7] == 1 && rep[8] == 0x04 && rep[9] == 0x38,
+               "bound address bytes");
+        tlen = socks5_target_addr(target, (struct sockaddr *)&sa);
+        socks5_parse_target(target, tlen, host, port);
+        ASSERT(strcmp(host, "127.0.0.1") == 0 && strcmp(port, "1080") == 0, "source target");
+    } TEST_END;
+}
+
+/* ── Live tunnel: socks5_client <-> encrypted socketpair <-> socks5_server ── */
+
+#define SOCKS_STREAMS 200
+
+/* Read exactly n bytes or fail after timeout_ms without progress */
+static int read_n(int fd, void *buf, size_t n, int timeout_ms) {
+    size_t got = 0;
+    while (got < n) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, timeout_ms) != 1) return -1;
+        ssize_t r = read(fd, (char *)buf + got, n - got);
+        if (r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+/* CONNECT request for name (NULL: 127.0.0.1) : port */
+static size_t connect_request(unsigned char *req, int port, const char *name) {
+    size_t n = 0;
+    req[n++] = 0x05; req[n++] = 0x01; req[n++] = 0x00;
+    if (name) {
+        req[n++] = 0x03;
+        req[n++] = (unsigned char)strlen(name);
+        memcpy(req + n, name, strlen(name));
+        n += strlen(name);
+    } else {
+        req[n++] = 0x01;
+        req[n++] = 127; req[n++] = 0; req[n++] = 0; req[n++] = 1;
+    }
+    req[n++] = (unsigned char)(port >> 8);
+    req[n++] = (unsigned char)port;
+    return n;
+}
+
+/* socks5_client and socks5_server in two children over an encrypted
+ * socketpair. Returns the proxy port, or -1. */
+static int socks_tunnel(pid_t *srv, pid_t *cli) {
+    int proxy_port;
+    int tmp = listen_loopback(&proxy_port);
+    if (tmp < 0) return -1;
+    close(tmp);
+    char pport[16];
+    snprintf(pport, sizeof(pport), "%d", proxy_port);
+
+    int enc[2];
+    if (make_socketpair(enc) != 0) return -1;
+    unsigned char salt[16];
+    farm9crypt_generate_salt(salt, sizeof(salt));
+    farm9crypt_init_password_with_salt("SocksTest123", 12, salt, 16);
+    *srv = fork();
+    if (*srv == 0) {
+        close(enc[1]);
+        socks5_server(enc[0]);
+        _exit(0);
+    }
+    *cli = fork();
+    if (*cli == 0) {
+        close(enc[0]);
+        socks5_client(enc[1], pport);
+        _exit(0);
+    }
+    close(enc[0]);
+    close(enc[1]);
+    farm9crypt_cleanup();
+    return proxy_port;
+}
+
+void test_socks5_concurrent_connects(void) {
+    TEST_BEGIN("socks5 over mux: 200 concurrent CONNECTs and a refused one") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port, dead_port;
+        int efd = listen_loopback(&echo_port);
+        int dfd = listen_loopback(&dead_port);
+        ASSERT(efd >= 0 && dfd >= 0, "target listen failed");
+        close(dfd);   /* nothing listens there any more */
+        pid_t echo = fork();
+        if (echo == 0) echo_serve(efd);
+        close(efd);
+
+        pid_t srv, cli;
+        int proxy_port = socks_tunnel(&srv, &cli);
+        ASSERT(proxy_port > 0, "tunnel setup failed");
+
+        /* Connected, greeted, and silent from then on: it must not hold
+         * up anyone else */
+        int idle = connect_loopback_wait(proxy_port);
+        ASSERT(idle >= 0, "proxy connect failed");
+        const unsigned char hello[] = {0x05, 0x01, 0x00};
+        unsigned char rep[SOCKS5_REPLY_LEN];
+        ASSERT(write_all(idle, hello, 3) == 0 && read_n(idle, rep, 2, 3000) == 0,
+               "greeting not answered");
+        ASSERT(rep[0] == 0x05 && rep[1] == 0x00, "no-auth not chosen");
+
+        /* All CONNECTs go out before any reply is read. Even ones pipeline
+         * greeting and request, odd ones wait for the method reply; every
+         * tenth asks by name. */
+        static int fds[SOCKS_STREAMS];
+        unsigned char req[64];
+        int ok = 1;
+        for (int i = 0; i < SOCKS_STREAMS && ok; i++) {
+            fds[i] = connect_loopback_wait(proxy_port);
+            size_t n = connect_request(req, echo_port, i % 10 == 0 ? "localhost" : NULL);
+            if (fds[i] < 0 || write_all(fds[i], hello, 3) < 0) ok = 0;
+            else if (i % 2 == 0 && write_all(fds[i], req, n) < 0) ok = 0;
+        }
+        ASSERT(ok, "proxy connects failed");
+        for (int i = 0; i < SOCKS_STREAMS && ok; i++) {
+            if (read_n(fds[i], rep, 2, 5000) < 0) ok = 0;
+            else if (i % 2 == 1 &&
+                     write_all(fds[i], req, connect_request(req, echo_port,
+                                                      i % 10 == 0 ? "localhost" : NULL)) < 0)
+                ok = 0;
+        }
+        ASSERT(ok, "method replies missing");
+        for (int i = 0; i < SOCKS_STREAMS && ok; i++)
+            if (read_n(fds[i], rep, sizeof(rep), 5000) < 0 || rep[1] != SOCKS5_REP_OK)
+                ok = 0;
+        ASSERT(ok, "CONNECT replies missing or failed");
+
+        /* Refused target: an error reply, and the others carry on */
+        int bad = connect_loopback_wait(proxy_port);
+        size_t n = connect_request(req, dead_port, NULL);
+        ASSERT(bad >= 0 && write_all(bad, hello, 3) == 0 && write_all(bad, req, n) == 0,
+               "refused CONNECT not sent");
+        ASSERT(read_n(bad, rep, 2, 3000) == 0 && read_n(bad, rep, sizeof(rep), 5000) == 0,
+               "refused CONNECT not answered");
+        ASSERT_EQ(rep[1], SOCKS5_REP_HOSTUNREACH, "refused target reported");
+        close(bad);
+
+        for (int i = 0; i < SOCKS_STREAMS && ok; i++) {
+            char msg[32], back[32];
+            int len = snprintf(msg, sizeof(msg), "socks-%d", i);
+            if (write_all(fds[i], msg, (size_t)len) < 0 ||
+                read_n(fds[i], back, (size_t)len, 5000) < 0 ||
+                memcmp(msg, back, (size_t)len) != 0)
+                ok = 0;
+        }
+        ASSERT(ok, "echo through the proxy failed");
+
+        for (int i = 0; i < SOCKS_STREAMS; i++)
+            if (fds[i] >= 0) close(fds[i]);
+        close(idle);
+        kill(cli, SIGTERM);
+        waitpid(cli, NULL, 0);
+        int status;
+        waitpid(srv, &status, 0);
+        ASSERT(WIFEXITED(status), "server relay should end with the tunnel");
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+    } TEST_END;
+}
+
+/* slow.test takes a second to look up, then is loopback */
+static int slow_getaddrinfo(const char *host, const char *port,
+                            const struct addrinfo *hints, struct addrinfo **res) {
+    if (strcmp(host, "slow.test") == 0) {
+        sleep(1);
+        host = "127.0.0.1";
+    }
+    return getaddrinfo(host, port, hints, res);
+}
+
+#define SOCKS_FAST_STREAMS 20
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void test_socks5_slow_name(void) {
+    TEST_BEGIN("socks5 over mux: a slow lookup holds up no other CONNECT") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port;
+        int efd = listen_loopback(&echo_port);
+        ASSERT(efd >= 0, "target listen failed");
+        pid_t echo = fork();
+        if (echo == 0) echo_serve(efd);
+        close(efd);
+
+        /* The server child inherits the slow resolver */
+        g_dns_getaddrinfo = slow_getaddrinfo;
+        pid_t srv, cli;
+        int proxy_port = socks_tunnel(&srv, &cli);
+        g_dns_getaddrinfo = getaddrinfo;
+        ASSERT(proxy_port > 0, "tunnel setup failed");
+
+        const unsigned char hello[] = {0x05, 0x01, 0x00};
+        unsigned char req[64], rep[SOCKS5_REPLY_LEN];
+        int slow = connect_loopback_wait(proxy_port);
+        size_t n = connect_request(req, echo_port, "slow.test");
+        ASSERT(slow >= 0 && write_all(slow, hello, 3) == 0 && write_all(slow, req, n) == 0,
+               "slow CONNECT not sent");
+        ASSERT(read_n(slow, rep, 2, 3000) == 0, "slow greeting not answered");
+        usleep(100 * 1000);   /* its lookup is under way */
+
+        long long t0 = now_ms();
+        static int fds[SOCKS_FAST_STREAMS];
+        int ok = 1;
+        for (int i = 0; i < SOCKS_FAST_STREAMS && ok; i++) {
+            fds[i] = connect_loopback_wait(proxy_port);
+            n = connect_request(req, echo_port, NULL);
+            if (fds[i] < 0 || write_all(fds[i], hello, 3) < 0 || write_all(fds[i], req, n) < 0 ||
+                read_n(fds[i], rep, 2, 3000) < 0 || read_n(fds[i], rep, sizeof(rep), 3000) < 0 ||
+                rep[1] != SOCKS5_REP_OK)
+                ok = 0;
+        }
+        ASSERT(ok, "numeric CONNECTs failed");
+        ASSERT(now_ms() - t0 < 500, "numeric CONNECTs waited for the slow lookup");
+
+        ASSERT(read_n(slow, rep, sizeof(rep), 3000) == 0 && rep[1] == SOCKS5_REP_OK,
+               "slow CONNECT not answered");
+        char back[8];
+        ASSERT(write_all(slow, "late", 4) == 0 && read_n(slow, back, 4, 3000) == 0 &&
+               memcmp(back, "late", 4) == 0, "echo after the slow lookup failed");
+
+        for (int i = 0; i < SOCKS_FAST_STREAMS; i++)
+            if (fds[i] >= 0) close(fds[i]);
+        close(slow);
+        kill(cli, SIGTERM);
+        waitpid(cli, NULL, 0);
+        waitpid(srv, NULL, 0);
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+    } TEST_END;
+}
+
+/* ── UDP ASSOCIATE through the live tunnel ── */
+
+#define SOCKS_DGRAMS 100
+
+static int udp_loopback(int *port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t slen = sizeof(sa);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&sa, &slen) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+static void udp_echo_target(int fd) {
+    for (;;) {
+        char buf[2048];
+        struct sockaddr_storage from;
+        socklen_t flen = sizeof(from);
+        ssize_t r = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &flen);
+        if (r >= 0) sendto(fd, buf, (size_t)r, 0, (struct sockaddr *)&from, flen);
+    }
+}
+
+/* udp.test is loopback */
+static int udp_getaddrinfo(const char *host, const char *port,
+                           const struct addrinfo *hints, struct addrinfo **res) {
+    return getaddrinfo(strcmp(host, "udp.test") == 0 ? "127.0.0.1" : host, port, hints, res);
+}
+
+/* SOCKS5 UDP datagram to host (name, or NULL: 127.0.0.1) : port */
+static size_t udp_datagram(unsigned char *dg, const char *name, int port,
+                           const char *data, size_t len) {
+    size_t n = 0;
+    dg[n++] = 0; dg[n++] = 0; dg[n++] = 0;
+    if (name) {
+        dg[n++] = 0x03;
+        dg[n++] = (unsigned char)strlen(name);
+        memcpy(dg + n, name, strlen(name));
+        n += strlen(name);
+    } else {
+        dg[n++] = 0x01;
+        dg[n++] = 127; dg[n++] = 0; dg[n++] = 0; dg[n++] = 1;
+    }
+    dg[n++] = (unsigned char)(port >> 8);
+    dg[n++] = (unsigned char)port;
+    memcpy(dg + n, data, len);
+    return n + len;
+}
+
+void test_socks5_udp_associate(void) {
+    TEST_BEGIN("socks5 over mux: UDP ASSOCIATE relays datagrams, idle ones expire") {
+        signal(SIGPIPE, SIG_IGN);
+        int echo_port;
+        int efd = udp_loopback(&echo_port);
+        ASSERT(efd >= 0, "UDP target bind failed");
+        pid_t echo = fork();
+        if (echo == 0) udp_echo_target(efd);
+        close(efd);
+
+        /* The server child inherits both */
+        g_dns_getaddrinfo = udp_getaddrinfo;
+        g_mux_udp_idle_ms = 600;
+        pid_t srv, cli;
+        int proxy_port = socks_tunnel(&srv, &cli);
+        g_dns_getaddrinfo = getaddrinfo;
+        g_mux_udp_idle_ms = MUX_UDP_IDLE_MS;
+        ASSERT(proxy_port > 0, "tunnel setup failed");
+
+        int ctl = connect_loopback_wait(proxy_port);
+        const unsigned char req[] = {0x05, 0x01, 0x00,
+                                     0x05, 0x03, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+        unsigned char rep[SOCKS5_REPLY_MAX];
+        ASSERT(ctl >= 0 && write_all(ctl, req, sizeof(req)) == 0, "UDP ASSOCIATE not sent");
+        ASSERT(read_n(ctl, rep, 2, 3000) == 0 && read_n(ctl, rep, 10, 3000) == 0,
+               "UDP ASSOCIATE not answered");
+        ASSERT_EQ(rep[1], SOCKS5_REP_OK, "UDP ASSOCIATE refused");
+        ASSERT(rep[3] == 0x01 && rep[4] == 127 && rep[7] == 1, "relay not on loopback");
+        struct sockaddr_in relay;
+        memset(&relay, 0, sizeof(relay));
+        relay.sin_family = AF_INET;
+        relay.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        memcpy(&relay.sin_port, rep + 8, 2);
+
+        int port;
+        int ufd = udp_loopback(&port);
+        ASSERT(ufd >= 0 && connect(ufd, (struct sockaddr *)&relay, sizeof(relay)) == 0,
+               "UDP socket setup failed");
+
+        /* A burst out, then the echoes back with the target as source */
+        unsigned char dg[512], back[512];
+        for (int i = 0; i < SOCKS_DGRAMS; i++) {
+            char msg[32];
+            int len = snprintf(msg, sizeof(msg), "dgram-%d", i);
+            size_t n = udp_datagram(dg, NULL, echo_port, msg, (size_t)len);
+            ASSERT(send(ufd, dg, n, 0) == (ssize_t)n, "datagram send failed");
+        }
+        int got = 0, good = 1;
+        for (;;) {
+            struct pollfd p = { ufd, POLLIN, 0 };
+            if (poll(&p, 1, 2000) != 1) break;
+            ssize_t r = recv(ufd, back, sizeof(back), 0);
+            if (r < 10) break;
+            if (memcmp(back, dg, 10) != 0 || memcmp(back + 10, "dgram-", 6) != 0) good = 0;
+            if (++got == SOCKS_DGRAMS) break;
+        }
+        ASSERT(good, "echo has the wrong header or data");
+        ASSERT(got >= SOCKS_DGRAMS * 9 / 10, "too many datagrams lost on loopback");
+
+        /* By name: the first may go while the server looks it up */
+        size_t n = udp_datagram(dg, "udp.test", echo_port, "named", 5);
+        int named = 0;
+        for (int tries = 0; tries < 20 && !named; tries++) {
+            ASSERT(send(ufd, dg, n, 0) == (ssize_t)n, "named datagram send failed");
+            struct pollfd p = { ufd, POLLIN, 0 };
+            if (poll(&p, 1, 100) == 1 && recv(ufd, back, sizeof(back), 0) == 15 &&
+                back[3] == 0x01 && memcmp(back + 10, "named", 5) == 0)
+                named = 1;
+        }
+        ASSERT(named, "datagram to a name not relayed");
+
+        /* Idle: the server ends the association, the client the connection */
+        struct pollfd p = { ctl, POLLIN, 0 };
+        ASSERT(poll(&p, 1, 200) == 0, "association ended while in use");
+        char c;
+        ASSERT(poll(&p, 1, 3000) == 1 && read(ctl, &c, 1) == 0, "idle association not closed");
+
+        close(ufd);
+        close(ctl);
+        kill(cli, SIGTERM);
+        waitpid(cli, NULL, 0);
+        waitpid(srv, NULL, 0);
+        kill(echo, SIGTERM);
+        waitpid(echo, NULL, 0);
+    } TEST_END;
+}
@@ -8,10 +8,20 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 #include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
 
 #include "test.h"
 #include "obfs.h"
+#include "fingerprint.h"
+#include "farm9crypt.h"
 
 /* ── TLS mode registration ── */
 void test_obfs_mode_set_tls(void) {
@@ -72,6 +82,276 @@ void test_tls_roundtrip(void) {
     TEST_END;
 }
 
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* 1: the kernel has the tls ULP, 0: it does not, -1: cannot tell */
+static int kernel_tls_ulp(void) {
+    int port, rc = -1;
+    int lfd = listen_loopback(&port);
+    if (lfd < 0) return -1;
+    int c = connect_loopback(port);
+    int a = c >= 0 ? accept(lfd, NULL, NULL) : -1;
+    if (a >= 0) {
+        if (setsockopt(c, IPPROTO_TCP, TCP_ULP, "tls", 3) == 0) rc = 1;
+        else if (errno == ENOENT) rc = 0;
+        close(a);
+    }
+    if (c >= 0) close(c);
+    close(lfd);
+    return rc;
+}
+
+/* ── Kernel TLS probe: TCP loopback, kTLS with the tls ULP, else userspace ── */
+void test_tls_ktls_probe_fallback(void) {
+    TEST_BEGIN("TLS roundtrip with kTLS probe and fallback");
+
+    /* OpenSSL without kTLS never asks the kernel: nothing to tell apart */
+    int want = kernel_tls_ulp();
+#if !defined(SSL_OP_ENABLE_KTLS) || defined(OPENSSL_NO_KTLS)
+    if (want == 1) want = -1;
+#endif
+    if (want < 0) TEST_SKIP("cannot tell whether kTLS is available");
+    obfs_ktls_set(1);
+
+    int port;
+    int lfd = listen_loopback(&port);
+    ASSERT(lfd >= 0, "listen failed");
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+
+    if (pid == 0) {
+        close(lfd);
+        int fd = connect_loopback(port);
+        if (fd < 0) _exit(1);
+        obfs_set_mode(OBFS_TLS);
+        if (obfs_tls_connect(fd) < 0) _exit(2);
+        if (obfs_send(fd, "ktls-probe", 10) != 10) _exit(3);
+        char reply[16];
+        if (obfs_recv(fd, reply, sizeof(reply)) != 2) _exit(4);
+        close(fd);
+        _exit(0);
+    }
+
+    int fd = accept(lfd, NULL, NULL);
+    close(lfd);
+    ASSERT(fd >= 0, "accept failed");
+    obfs_set_mode(OBFS_TLS);
+    ASSERT_EQ(obfs_tls_accept(fd), 0, "TLS accept failed");
+
+    /* The kernel takes over exactly when it has the tls ULP; the data
+     * below then goes through kTLS, else through OpenSSL in userspace */
+    ASSERT_EQ(obfs_ktls_send_active(), want,
+              want ? "tls ULP present but kTLS not active"
+                   : "no tls ULP but kTLS reported active");
+
+    char buf[16];
+    ASSERT_EQ(obfs_recv(fd, buf, sizeof(buf)), 10, "recv length");
+    ASSERT(memcmp(buf, "ktls-probe", 10) == 0, "payload mismatch");
+    ASSERT_EQ(obfs_send(fd, "ok", 2), 2, "send failed");
+
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client failed");
+    close(fd);
+
+    /* AF_UNIX can never carry kTLS: the probe must say so */
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+    pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        close(sv[0]);
+        signal(SIGPIPE, SIG_IGN);
+        obfs_set_mode(OBFS_TLS);
+        if (obfs_tls_connect(sv[1]) < 0) _exit(1);
+        char c;
+        obfs_recv(sv[1], &c, 1);   /* wait for the server to finish */
+        _exit(0);
+    }
+    close(sv[1]);
+    ASSERT_EQ(obfs_tls_accept(sv[0]), 0, "unix TLS accept failed");
+    ASSERT_EQ(obfs_ktls_send_active(), 0, "kTLS cannot be active on AF_UNIX");
+    close(sv[0]);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "unix client failed");
+
+    obfs_set_mode(OBFS_NONE);
+    TEST_END;
+}
+
+/* Client child: plain OpenSSL handshake, send the server cert's SHA-256 up the pipe */
+static int cert_digest_child(int fd, int out) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL *ssl = ctx ? SSL_new(ctx) : NULL;
+    if (!ssl) return 1;
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) <= 0) return 2;
+    X509 *peer = SSL_get_peer_certificate(ssl);
+    unsigned char md[32];
+    unsigned int mdlen = 0;
+    if (!peer || !X509_digest(peer, EVP_sha256(), md, &mdlen) || mdlen != 32) return 3;
+    if (write(out, md, 32) != 32) return 4;
+    char c;
+    SSL_read(ssl, &c, 1);   /* wait for the server to finish */
+    return 0;
+}
+
+/* ── One certificate and SSL_CTX serve every accept ── */
+void test_tls_server_ctx_reused(void) {
+    TEST_BEGIN("TLS server reuses one certificate across accepts");
+
+    unsigned char seen[2][32];
+    obfs_set_mode(OBFS_TLS);
+    ASSERT_EQ(obfs_tls_server_init(), 0, "server init failed");
+
+    for (int round = 0; round < 2; round++) {
+        int sv[2], pp[2];
+        ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+        ASSERT(pipe(pp) == 0, "pipe failed");
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            close(sv[0]); close(pp[0]);
+            signal(SIGPIPE, SIG_IGN);
+            _exit(cert_digest_child(sv[1], pp[1]));
+        }
+        close(sv[1]); close(pp[1]);
+        signal(SIGPIPE, SIG_IGN);
+        ASSERT_EQ(obfs_tls_accept(sv[0]), 0, "TLS accept failed");
+        ASSERT(read(pp[0], seen[round], 32) == 32, "no digest from client");
+        close(sv[0]); close(pp[0]);
+
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "client failed");
+    }
+    ASSERT(memcmp(seen[0], seen[1], 32) == 0, "certificate changed between accepts");
+
+    obfs_set_mode(OBFS_NONE);
+    TEST_END;
+}
+
+/* Server child: accept, send one byte so the client reads the ticket, wait */
+static int resume_server_child(int fd) {
+    signal(SIGPIPE, SIG_IGN);
+    if (obfs_tls_accept(fd) < 0) return 1;
+    if (obfs_send(fd, "k", 1) != 1) return 2;
+    char c;
+    obfs_recv(fd, &c, 1);
+    return 0;
+}
+
+/* Connect twice as a client; report whether each connection resumed */
+static int resume_two_connects(int resumed[2]) {
+    for (int round = 0; round < 2; round++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+        pid_t pid = fork();
+        if (pid < 0) return -1;
+        if (pid == 0) {
+            close(sv[0]);
+            _exit(resume_server_child(sv[1]));
+        }
+        close(sv[1]);
+        int ok = obfs_tls_connect(sv[0]) == 0;
+        char c;
+        ok = ok && obfs_recv(sv[0], &c, 1) == 1;
+        resumed[round] = obfs_tls_resumed();
+        close(sv[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    }
+    return 0;
+}
+
+/* ── Session tickets: second connect resumes with PSK ── */
+void test_tls_session_resumption(void) {
+    TEST_BEGIN("TLS reconnect resumes from session ticket");
+
+    int resumed[2];
+    signal(SIGPIPE, SIG_IGN);
+    obfs_set_mode(OBFS_TLS);
+    obfs_tls_cleanup();
+    ASSERT_EQ(obfs_tls_server_init(), 0, "server init failed");
+    ASSERT_EQ(resume_two_connects(resumed), 0, "connections failed");
+    ASSERT_EQ(resumed[0], 0, "first connect must be a full handshake");
+    ASSERT_EQ(resumed[1], 1, "second connect should resume");
+
+    obfs_set_mode(OBFS_NONE);
+    TEST_END;
+}
+
+/* ── Browser profiles resume too (ticket dropped when the profile changes) ── */
+void test_tls_resumption_fingerprint(void) {
+    TEST_BEGIN("TLS resumption with chrome fingerprint profile");
+
+    int resumed[2];
+    signal(SIGPIPE, SIG_IGN);
+    obfs_set_mode(OBFS_TLS);
+    fp_set_profile(FP_CHROME);
+    ASSERT_EQ(resume_two_connects(resumed), 0, "connections failed");
+    ASSERT_EQ(resumed[0], 0, "new profile must not reuse the old ticket");
+    ASSERT_EQ(resumed[1], 1, "chrome profile should resume");
+
+    TEST_END;
+    fp_set_profile(FP_NONE);
+    obfs_set_mode(OBFS_NONE);
+}
+
+static int read_file(const char *path, char *buf, size_t max) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    size_t n = fread(buf, 1, max, fp);
+    fclose(fp);
+    return (int)n;
+}
+
+/* ── --cert-cache: persisted 0600, reloaded instead of regenerated ── */
+void test_tls_cert_cache_persist(void) {
+    char home[] = "/tmp/clawsec_certXXXXXX";
+    char path[128], dir[128];
+    const char *old_home = getenv("HOME");
+    char saved_home[512] = "";
+    if (old_home) snprintf(saved_home, sizeof(saved_home), "%s", old_home);
+
+    TEST_BEGIN("TLS cert cache persists and reloads");
+
+    ASSERT(mkdtemp(home) != NULL, "mkdtemp failed");
+    setenv("HOME", home, 1);
+    snprintf(dir, sizeof(dir), "%s/.clawsec", home);
+    snprintf(path, sizeof(path), "%s/tls_cert.pem", dir);
+
+    obfs_tls_cleanup();
+    obfs_tls_cert_cache(1);
+    ASSERT_EQ(obfs_tls_server_init(), 0, "first init failed");
+
+    struct stat st;
+    ASSERT(stat(path, &st) == 0, "cert file not written");
+    ASSERT_EQ((int)(st.st_mode & 0777), 0600, "cert file must be 0600");
+
+    static char first[8192], second[8192];
+    int n1 = read_file(path, first, sizeof(first));
+    ASSERT(n1 > 0, "cert file empty");
+
+    /* Fresh process state: the file must be loaded, not replaced */
+    obfs_tls_cleanup();
+    ASSERT_EQ(obfs_tls_server_init(), 0, "reload init failed");
+    int n2 = read_file(path, second, sizeof(second));
+    ASSERT(n1 == n2 && memcmp(first, second, (size_t)n1) == 0, "cert regenerated on reload");
+
+    TEST_END;
+    obfs_tls_cert_cache(0);
+    obfs_tls_cleanup();
+    unlink(path);
+    rmdir(dir);
+    rmdir(home);
+    if (saved_home[0]) setenv("HOME", saved_home, 1);
+}
+
 /* ── Packet padding ── */
 void test_pad_roundtrip(void) {
     TEST_BEGIN("pad/unpad roundtrip preserves data");
@@ -118,6 +398,64 @@ void test_pad_too_large(void) {
     TEST_END;
 }
 
+void test_pad_bucket_policy(void) {
+    TEST_BEGIN("bucket padding picks smallest fitting size");
+
+    obfs_pad_set_policy(OBFS_PAD_BUCKET);
+    ASSERT_EQ(obfs_pad_target(1), 128, "1 byte should land in 128");
+    ASSERT_EQ(obfs_pad_target(126), 128, "126 bytes should land in 128");
+    ASSERT_EQ(obfs_pad_target(127), 512, "127 bytes should land in 512");
+    ASSERT_EQ(obfs_pad_target(1000), 1400, "1000 bytes should land in 1400");
+    ASSERT_EQ(obfs_pad_target(3000), 4200, "3000 bytes should land in 4200");
+    ASSERT_EQ(obfs_pad_target(OBFS_PAD_MAX - 2), OBFS_PAD_MAX, "max payload fits");
+    ASSERT_EQ(obfs_pad_target(OBFS_PAD_MAX - 1), -1, "beyond max rejected");
+
+    char out[OBFS_PAD_MAX], back[OBFS_PAD_MAX];
+    int plen = obfs_pad("ping", 4, out, sizeof(out));
+    ASSERT_EQ(plen, 128, "small frame should pad to 128");
+    ASSERT_EQ(obfs_unpad(out, (size_t)plen, back, sizeof(back)), 4, "unpad length");
+    ASSERT(memcmp(back, "ping", 4) == 0, "unpad data");
+
+    obfs_pad_set_policy(OBFS_PAD_FIXED);
+    TEST_END;
+}
+
+void test_pad_fixed_large_payload(void) {
+    TEST_BEGIN("fixed padding uses MTU multiples above 1398 bytes");
+
+    obfs_pad_set_policy(OBFS_PAD_FIXED);
+    ASSERT_EQ(obfs_pad_target(10), OBFS_PAD_SIZE, "small frame stays at 1400");
+    ASSERT_EQ(obfs_pad_target(1398), OBFS_PAD_SIZE, "1398 fits in 1400");
+    ASSERT_EQ(obfs_pad_target(1399), 2 * OBFS_PAD_SIZE, "1399 needs 2800");
+
+    char big[4000], out[OBFS_PAD_MAX], back[OBFS_PAD_MAX];
+    memset(big, 'B', sizeof(big));
+    int plen = obfs_pad(big, sizeof(big), out, sizeof(out));
+    ASSERT_EQ(plen, 3 * OBFS_PAD_SIZE, "4000 bytes should pad to 4200");
+    ASSERT_EQ(obfs_unpad(out, (size_t)plen, back, sizeof(back)), 4000, "unpad length");
+    ASSERT(memcmp(back, big, sizeof(big)) == 0, "unpad data");
+    TEST_END;
+}
+
+void test_pad_random_policy(void) {
+    TEST_BEGIN("random padding samples fitting buckets");
+
+    obfs_pad_set_policy(OBFS_PAD_RANDOM);
+    int seen128 = 0, seen512 = 0, seen1400 = 0;
+    for (int i = 0; i < 200; i++) {
+        int t = obfs_pad_target(50);
+        ASSERT(t == 128 || t == 512 || t == 1400, "size outside first 3 buckets");
+        if (t == 128) seen128 = 1;
+        if (t == 512) seen512 = 1;
+        if (t == 1400) seen1400 = 1;
+    }
+    ASSERT(seen128 && seen512 && seen1400, "all 3 buckets should be sampled");
+    ASSERT_EQ(obfs_pad_target(OBFS_PAD_MAX - 2), OBFS_PAD_MAX, "last bucket has no spread");
+
+    obfs_pad_set_policy(OBFS_PAD_FIXED);
+    TEST_END;
+}
+
 /* ── Timing jitter ── */
 void test_jitter_applies_delay(void) {
     TEST_BEGIN("jitter adds measurable delay");
@@ -148,3 +486,105 @@ void test_jitter_zero_noop(void) {
     ASSERT(elapsed_us < 1000, "should return immediately");
     TEST_END;
 }
+
+void test_jitter_queue_nonblocking(void) {
+    TEST_BEGIN("jitter queue is non-blocking and ordered");
+
+    char key[32];
+    memset(key, 0x5a, sizeof(key));
+    farm9crypt_init(key);
+
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+    /* Read only at the end: flush sends only while the socket polls
+     * writable, so give it room for all 20 frames */
+    int sndbuf = 1 << 20;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    /* 20 frames at up to 50ms each would block ~500ms with inline sleeps */
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+    for (int i = 0; i < 20; i++) {
+        char msg[16];
+        int mlen = snprintf(msg, sizeof(msg), "frame-%02d", i);
+        ASSERT_EQ(obfs_jq_push(sv[0], msg, (size_t)mlen, 50), mlen, "push failed");
+    }
+    gettimeofday(&t2, NULL);
+    long push_us = (t2.tv_sec - t1.tv_sec) * 1000000L + (t2.tv_usec - t1.tv_usec);
+    ASSERT(push_us < 20000, "push should not sleep");
+    ASSERT_EQ(obfs_jq_pending(), 20, "all frames queued");
+
+    /* Event-loop style: wait for the next release, flush what is due */
+    while (obfs_jq_pending() > 0) {
+        struct timeval tv;
+        ASSERT(obfs_jq_timeout(&tv) != NULL, "non-empty queue needs a timeout");
+        ASSERT(tv.tv_sec == 0 && tv.tv_usec <= 50000, "timeout beyond jitter window");
+        select(0, NULL, NULL, NULL, &tv);
+        ASSERT_EQ(obfs_jq_flush(), 0, "flush failed");
+    }
+    struct timeval tv;
+    ASSERT(obfs_jq_timeout(&tv) == NULL, "empty queue should wait forever");
+
+    for (int i = 0; i < 20; i++) {
+        char want[16], got[64];
+        int wlen = snprintf(want, sizeof(want), "frame-%02d", i);
+        int n = farm9crypt_read(sv[1], got, sizeof(got));
+        ASSERT_EQ(n, wlen, "frame length");
+        ASSERT(memcmp(got, want, (size_t)wlen) == 0, "frames out of order");
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    farm9crypt_cleanup();
+    TEST_END;
+}
+
+void test_jitter_queue_full(void) {
+    TEST_BEGIN("full jitter queue reports backpressure, push never sleeps");
+
+    char key[32];
+    memset(key, 0x5a, sizeof(key));
+    farm9crypt_init(key);
+
+    int sv[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+
+    /* Past OBFS_JQ_MAX the old push slept until the head was due */
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+    for (int i = 0; i < OBFS_JQ_MAX + 10; i++) {
+        ASSERT(obfs_jq_full() == (i >= OBFS_JQ_MAX), "full only from OBFS_JQ_MAX frames");
+        char msg[16];
+        int mlen = snprintf(msg, sizeof(msg), "frame-%03d", i);
+        ASSERT_EQ(obfs_jq_push(sv[0], msg, (size_t)mlen, 200), mlen, "push failed");
+    }
+    gettimeofday(&t2, NULL);
+    long push_us = (t2.tv_sec - t1.tv_sec) * 1000000L + (t2.tv_usec - t1.tv_usec);
+    ASSERT(push_us < 50000, "push past OBFS_JQ_MAX should not sleep");
+    ASSERT_EQ(obfs_jq_pending(), OBFS_JQ_MAX + 10, "all frames queued");
+
+    /* More frames than a socketpair buffers: read them in a child */
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        close(sv[0]);
+        for (int i = 0; i < OBFS_JQ_MAX + 10; i++) {
+            char want[16], got[64];
+            int wlen = snprintf(want, sizeof(want), "frame-%03d", i);
+            if (farm9crypt_read(sv[1], got, sizeof(got)) != wlen ||
+                memcmp(got, want, (size_t)wlen) != 0)
+                _exit(1);
+        }
+        _exit(0);
+    }
+    close(sv[1]);
+    ASSERT_EQ(obfs_jq_drain(), 0, "drain failed");
+    ASSERT(!obfs_jq_full(), "drained queue still full");
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "frames lost or out of order");
+
+    close(sv[0]);
+    farm9crypt_cleanup();
+    TEST_END;
+}
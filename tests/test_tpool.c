@@ -0,0 +1,127 @@
+/*
+ * test_tpool.c — Tunnel pool tests (--tunnel-pool)
+ *
+ * The pool runs in a child with plain loopback connections for tunnels:
+ * the test plays the tunnel server, accepting them and seeing which one a
+ * local connection lands on.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "test.h"
+#include "tpool.h"
+#include "util.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* A pooled tunnel: connect, then copy between it and the local connection */
+static void plain_session(void *ctx) {
+    int tun = connect_loopback(*(int *)ctx);
+    if (tun < 0) return;
+    int local = tpool_take(tun);
+    if (local < 0) return;
+    struct pollfd p[2] = { { tun, POLLIN, 0 }, { local, POLLIN, 0 } };
+    char buf[512];
+    while (poll(p, 2, -1) > 0) {
+        for (int i = 0; i < 2; i++) {
+            if (!p[i].revents) continue;
+            ssize_t r = read(p[i].fd, buf, sizeof(buf));
+            if (r <= 0 || write_all(p[!i].fd, buf, (size_t)r) < 0) return;
+        }
+    }
+}
+
+/* Next tunnel from the pool within timeout_ms, or -1 */
+static int accept_tunnel(int lfd, int timeout_ms) {
+    struct pollfd p = { lfd, POLLIN, 0 };
+    if (poll(&p, 1, timeout_ms) != 1) return -1;
+    return accept(lfd, NULL, NULL);
+}
+
+static pid_t start_pool(int *srv_lfd, int *local_port, int n) {
+    static int srv_port;
+    *srv_lfd = listen_loopback(&srv_port);
+    int local = listen_loopback(local_port);
+    if (*srv_lfd < 0 || local < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(*srv_lfd);
+        tpool_run(local, n, plain_session, &srv_port);
+        _exit(0);
+    }
+    close(local);
+    return pid;
+}
+
+static void stop_pool(pid_t pid, int srv_lfd) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(srv_lfd);
+}
+
+void test_tpool_take_refills(void) {
+    TEST_BEGIN("tunnel pool: connection spliced on a ready tunnel, pool refilled") {
+        int lfd, local_port;
+        pid_t pid = start_pool(&lfd, &local_port, 2);
+        ASSERT(pid > 0, "setup failed");
+
+        /* Both tunnels are up before any local connection */
+        int tun[3];
+        tun[0] = accept_tunnel(lfd, 2000);
+        tun[1] = accept_tunnel(lfd, 2000);
+        ASSERT(tun[0] >= 0 && tun[1] >= 0, "pool did not open 2 tunnels");
+
+        int c = connect_loopback(local_port);
+        ASSERT(c >= 0, "local connect failed");
+        ASSERT_EQ(write(c, "ping", 4), 4, "local write");
+
+        /* It arrives on one of the tunnels already open */
+        struct pollfd p[2] = { { tun[0], POLLIN, 0 }, { tun[1], POLLIN, 0 } };
+        ASSERT(poll(p, 2, 2000) >= 1, "nothing on the pooled tunnels");
+        int used = (p[0].revents & POLLIN) ? tun[0] : tun[1];
+        char buf[8];
+        ASSERT_EQ(read(used, buf, sizeof(buf)), 4, "tunnel read");
+        ASSERT(memcmp(buf, "ping", 4) == 0, "wrong bytes");
+        ASSERT_EQ(write(used, "pong", 4), 4, "tunnel write");
+        struct pollfd pc = { c, POLLIN, 0 };
+        ASSERT(poll(&pc, 1, 2000) == 1 && read(c, buf, sizeof(buf)) == 4 &&
+               memcmp(buf, "pong", 4) == 0, "reply did not come back");
+
+        /* The taken tunnel is replaced */
+        tun[2] = accept_tunnel(lfd, 2000);
+        ASSERT(tun[2] >= 0, "pool not refilled");
+
+        close(c);
+        for (int i = 0; i < 3; i++) close(tun[i]);
+        stop_pool(pid, lfd);
+    } TEST_END;
+}
+
+void test_tpool_lost_tunnel(void) {
+    TEST_BEGIN("tunnel pool: idle tunnel closed by the server is replaced") {
+        int lfd, local_port;
+        pid_t pid = start_pool(&lfd, &local_port, 1);
+        ASSERT(pid > 0, "setup failed");
+        int tun = accept_tunnel(lfd, 2000);
+        ASSERT(tun >= 0, "pool did not open a tunnel");
+        close(tun);
+
+        /* Reconnected at once: a tunnel that was ready is not a failure */
+        tun = accept_tunnel(lfd, TPOOL_RETRY_MS / 2);
+        ASSERT(tun >= 0, "lost tunnel not replaced");
+
+        /* And the replacement carries a connection */
+        int c = connect_loopback(local_port);
+        ASSERT(c >= 0 && write(c, "x", 1) == 1, "local connect failed");
+        struct pollfd p = { tun, POLLIN, 0 };
+        char b;
+        ASSERT(poll(&p, 1, 2000) == 1 && read(tun, &b, 1) == 1 && b == 'x',
+               "replacement did not carry it");
+
+        close(c);
+        close(tun);
+        stop_pool(pid, lfd);
+    } TEST_END;
+}